@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bcm.h"
+
+/* A message head with room for the one frame every message here carries */
+union bcm_msg {
+	struct bcm_msg_head head;
+	uint8_t buf[sizeof(struct bcm_msg_head) + sizeof(struct can_frame)];
+};
+
+signed int bcm_open(struct bcm_port *bp, const char *iface)
+{
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+
+	memset(bp, '\0', sizeof(*bp));
+	strncpy(bp->iface, iface, IFNAMSIZ-1);
+
+	bp->sock = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK, CAN_BCM);
+	if (bp->sock < 0) {
+		perror("Error opening CAN BCM socket");
+		return -1;
+	}
+
+	memset(&ifr, '\0', sizeof(ifr));
+	memcpy(ifr.ifr_name, bp->iface, IFNAMSIZ);
+	if (ioctl(bp->sock, SIOCGIFINDEX, &ifr) < 0) {
+		fprintf(stderr, "Unable to open iface %s: ", iface);
+		perror("");
+		bcm_close(bp);
+		return -1;
+	}
+
+	/* A BCM socket is connected to its interface, rather than bound */
+	memset(&addr, '\0', sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+	if (connect(bp->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Unable to connect BCM to %s: ", iface);
+		perror("");
+		bcm_close(bp);
+		return -1;
+	}
+
+	bp->ev.fd = bp->sock;
+	bp->ev.handler = bcm_handler;
+	bp->ev.data = bp;
+
+	return 0;
+}
+
+static void set_ival(struct bcm_timeval *tv, unsigned long us)
+{
+	tv->tv_sec = us / 1000000;
+	tv->tv_usec = us % 1000000;
+}
+
+/* Have the kernel send tx->frame every tx->ival_ms from now on */
+signed int bcm_tx_setup(struct bcm_port *bp, const struct bcm_tx *tx)
+{
+	unsigned long offset_us;
+	union bcm_msg msg;
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.head.opcode = TX_SETUP;
+	msg.head.flags = SETTIMER | STARTTIMER;
+	msg.head.can_id = tx->frame.can_id;
+	msg.head.nframes = 1;
+	msg.head.frames[0] = tx->frame;
+	set_ival(&msg.head.ival2, tx->ival_ms * 1000UL);
+
+	/* The first frame goes out after ival1, then every ival2 */
+	offset_us = (bp->ntx * BCM_STAGGER_US) % (tx->ival_ms * 1000UL);
+	if (offset_us) {
+		msg.head.count = 1;
+		set_ival(&msg.head.ival1, offset_us);
+	}
+
+	if (write(bp->sock, &msg, sizeof(msg)) < 0) {
+		fprintf(stderr, "Unable to set up periodic 0x%x on %s: ",
+			tx->frame.can_id & CAN_EFF_MASK, bp->iface);
+		perror("");
+		return -1;
+	}
+	bp->ntx++;
+
+	return 0;
+}
+
+/* Have the kernel report only changes in the masked bits of rx->id, and
+ * the frame going missing for rx->timeout_ms.
+ */
+signed int bcm_rx_setup(struct bcm_port *bp, const struct bcm_rx *rx)
+{
+	union bcm_msg msg;
+
+	memset(&msg, '\0', sizeof(msg));
+	msg.head.opcode = RX_SETUP;
+	msg.head.flags = RX_CHECK_DLC;
+	msg.head.can_id = rx->id;
+	msg.head.nframes = 1;
+	memcpy(msg.head.frames[0].data, rx->mask, sizeof(rx->mask));
+	if (rx->timeout_ms) {
+		msg.head.flags |= SETTIMER | STARTTIMER;
+		set_ival(&msg.head.ival1, rx->timeout_ms * 1000UL);
+	}
+
+	if (write(bp->sock, &msg, sizeof(msg)) < 0) {
+		fprintf(stderr, "Unable to watch 0x%x on %s: ",
+			rx->id & CAN_EFF_MASK, bp->iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Print every notification pending from the kernel */
+signed int bcm_handler(struct ev_source *src, uint32_t events)
+{
+	struct bcm_port *bp = src->data;
+	const struct can_frame *frame;
+	union bcm_msg msg;
+	ssize_t len;
+	int i;
+
+	(void)events;
+
+	for (;;) {
+		len = read(bp->sock, &msg, sizeof(msg));
+		if (len < 0) {
+			if (errno == EAGAIN) {
+				fflush(stdout);
+				return 0;
+			}
+			fprintf(stderr, "Error reading BCM on %s: ", bp->iface);
+			perror("");
+			return -1;
+		}
+		if ((size_t)len < sizeof(msg.head))
+			continue;
+
+		frame = &msg.head.frames[0];
+		switch (msg.head.opcode) {
+		case RX_CHANGED:
+			if ((size_t)len < sizeof(msg))
+				break;
+			bp->changes++;
+			printf("%s: 0x%x changed [%d]", bp->iface,
+				frame->can_id & CAN_EFF_MASK, frame->can_dlc);
+			for (i = 0; i < frame->can_dlc && i < CAN_MAX_DLEN; i++)
+				printf(" %02x", frame->data[i]);
+			printf("\n");
+			break;
+		case RX_TIMEOUT:
+			bp->timeouts++;
+			printf("%s: 0x%x not seen in time\n", bp->iface,
+				msg.head.can_id & CAN_EFF_MASK);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+void bcm_print_stats(const struct bcm_port *bp)
+{
+	fprintf(stderr, "%s: %u periodic messages configured in the kernel, "
+		"%llu changes and %llu timeouts reported\n", bp->iface, bp->ntx,
+		bp->changes, bp->timeouts);
+}
+
+/* Closing the socket also ends every cyclic transmission it set up */
+void bcm_close(struct bcm_port *bp)
+{
+	if (bp->sock >= 0)
+		close(bp->sock);
+	bp->sock = -1;
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Periodic transmission and change detection with the CAN broadcast manager
+ *
+ * A CAN_BCM socket hands cyclic work to the kernel. TX_SETUP gives the
+ * kernel a frame and an interval, and its own hrtimers send the frame from
+ * then on, with no wakeup of the process at all. Dozens of frames at 10 ms
+ * cycles cost nothing in user space, and their timing does not depend on
+ * what the process is doing.
+ *
+ * RX_SETUP has the kernel watch a CAN ID instead. A notification is only
+ * passed up when the frame's content changes, compared under a mask so that
+ * only the bits of interest count, or when the frame has not been seen for
+ * a timeout. A signal that is sent every 10 ms but only changes now and then
+ * wakes the process only when it changes.
+ *
+ * Cyclic frames that share an interval would all go out on the same timer
+ * tick. Each is started BCM_STAGGER_US after the one before it, so they are
+ * spread out over the cycle instead of going out in a burst.
+ */
+
+#ifndef __BCM_H__
+#define __BCM_H__
+
+#include <linux/can.h>
+#include <linux/can/bcm.h>
+#include <net/if.h>
+#include <stdint.h>
+
+#include "evloop.h"
+
+#define BCM_MAX_MSGS		64
+#define BCM_STAGGER_US		500
+
+/* A frame sent every ival_ms */
+struct bcm_tx {
+	struct can_frame frame;
+	unsigned int ival_ms;
+};
+
+/* A CAN ID to report changes to, in the bits set in mask, or the frame not
+ * being seen for timeout_ms if that is not 0.
+ */
+struct bcm_rx {
+	canid_t id;
+	uint8_t mask[CAN_MAX_DLEN];
+	unsigned int timeout_ms;
+};
+
+struct bcm_port {
+	struct ev_source ev;
+	int sock;
+	char iface[IFNAMSIZ];
+	unsigned int ntx;
+
+	/* Statistics */
+	unsigned long long changes;
+	unsigned long long timeouts;
+};
+
+signed int bcm_open(struct bcm_port *bp, const char *iface);
+signed int bcm_tx_setup(struct bcm_port *bp, const struct bcm_tx *tx);
+signed int bcm_rx_setup(struct bcm_port *bp, const struct bcm_rx *rx);
+signed int bcm_handler(struct ev_source *src, uint32_t events);
+void bcm_print_stats(const struct bcm_port *bp);
+void bcm_close(struct bcm_port *bp);
+
+#endif /* __BCM_H__ */
@@ -0,0 +1,544 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "isotp.h"
+#include "obd.h"
+#include "txsched.h"
+
+enum {
+	SLOT_FREE = 0,
+	SLOT_SENT,
+	SLOT_ECHOED,
+};
+
+struct bench_slot {
+	int state;
+	struct timespec sent;
+	struct rx_stamp echo;
+};
+
+struct bench_state {
+	const struct bench_cfg *cfg;
+	struct bench_slot slots[BENCH_SLOTS];
+	unsigned int outstanding;
+	struct latency_hist rtt;
+	struct txsched sched;
+
+	/* Statistics */
+	unsigned long long echoed;
+	unsigned long long received;
+	unsigned long long hw_samples;
+	unsigned long long payload;
+	uint64_t bus_ns_min;
+	uint64_t bus_ns_max;
+};
+
+/* Query side of the benchmark, matching responses and our own queries coming
+ * back from the bus to their slot by sequence number.
+ */
+static signed int bench_query_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	struct bench_state *st = port->priv;
+	const struct bench_cfg *cfg = st->cfg;
+	struct can_frame *frame;
+	struct bench_slot *slot;
+	struct rx_stamp stamp;
+	uint16_t seq;
+	int nframes;
+	int i;
+
+	(void)events;
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		perror("Error receving on query");
+		return -1;
+	}
+
+	for (i = 0; i < nframes; i++) {
+		frame = rx_batch_frame(&port->rx, i);
+		if (rx_batch_is_fd(&port->rx, i) != cfg->fd ||
+		  frame->can_dlc != (cfg->fd ? BENCH_FD_LEN : 8))
+			continue;
+
+		st->payload += frame->can_dlc;
+		st->bus_ns_min += frame_time_ns(&port->rx.frames[i], cfg->fd, 0,
+						cfg->bitrate, cfg->dbitrate);
+		st->bus_ns_max += frame_time_ns(&port->rx.frames[i], cfg->fd, 1,
+						cfg->bitrate, cfg->dbitrate);
+		parse_cmsgs(&port->rx.msgs[i].msg_hdr, &stamp);
+		seq = (frame->data[6] << 8) | frame->data[7];
+		slot = &st->slots[seq % BENCH_SLOTS];
+
+		/* One of our own queries, now on the bus */
+		if (port->rx.msgs[i].msg_hdr.msg_flags & MSG_CONFIRM) {
+			st->echoed++;
+			if (slot->state == SLOT_SENT) {
+				slot->echo = stamp;
+				slot->state = SLOT_ECHOED;
+			}
+			continue;
+		}
+
+		if (frame->can_id != 0x7e8 ||
+		  frame->data[1] != OBD_SERVICE_CURRENT + OBD_RESPONSE_OFFSET)
+			continue;
+
+		st->received++;
+		if (slot->state == SLOT_FREE)
+			continue;
+
+		if (slot->state == SLOT_ECHOED)
+			st->hw_samples += record_latency(&st->rtt, &slot->echo,
+							 &stamp);
+		slot->state = SLOT_FREE;
+		st->outstanding--;
+	}
+
+	return 0;
+}
+
+/* Sustained loopback load between the query and ECU ports. Both ports are
+ * serviced from the same event loop, the ECU side responding to queries as
+ * they arrive while new queries are sent out as the window and rate allow.
+ */
+signed int run_bench(struct evloop *loop, struct can_port *query,
+		     struct can_port *ecu, const struct bench_cfg *cfg)
+{
+	static struct bench_state st;
+	struct canfd_frame classic_max = { .can_id = 0x7df, .len = 8 };
+	struct can_frame *frame;
+	struct bench_slot *slot;
+	uint64_t start_ns, now_ns, end_ns = 0, stop_ns = 0;
+	unsigned long long sent = 0, missed = 0, ecu_rx_count;
+	uint16_t seq_head = 0, seq_tail = 0, seq;
+	int sending = 1;
+	int timeout_ms;
+	int nframes;
+	int allowed;
+	int i;
+	double elapsed;
+
+	memset(&st, '\0', sizeof(st));
+	st.cfg = cfg;
+	latency_hist_init(&st.rtt);
+	txsched_init(&st.sched);
+	query->priv = &st;
+	query->ev.handler = bench_query_handler;
+
+	/* Only requests that reach the ECU during the run are counted */
+	ecu_rx_count = ecu->rx.frames_total;
+
+	start_ns = now_ns = monotonic_ns();
+	if (cfg->duration_s)
+		end_ns = start_ns + cfg->duration_s * 1000000000ULL;
+
+	while (keep_running) {
+		now_ns = monotonic_ns();
+
+		/* Stop sending at the end of the run, then give anything
+		 * still in flight a chance to come back.
+		 */
+		if (sending && ((end_ns && now_ns >= end_ns) ||
+		  (cfg->count && sent >= cfg->count))) {
+			sending = 0;
+			stop_ns = now_ns;
+		}
+		if (!sending && (st.outstanding == 0 ||
+		  now_ns - stop_ns > (uint64_t)BENCH_TIMEOUT_NS))
+			break;
+
+		/* Expire queries that have waited too long for a response */
+		while (seq_tail != seq_head) {
+			slot = &st.slots[seq_tail % BENCH_SLOTS];
+			if (slot->state != SLOT_FREE) {
+				if ((int64_t)now_ns - timespec_to_ns(&slot->sent) <
+				  BENCH_TIMEOUT_NS)
+					break;
+				slot->state = SLOT_FREE;
+				st.outstanding--;
+				missed++;
+			}
+			seq_tail++;
+		}
+
+		/* Queue as many new queries as the window and rate allow */
+		allowed = 0;
+		if (sending) {
+			allowed = cfg->window - st.outstanding;
+			if (cfg->rate) {
+				unsigned long long due = (now_ns - start_ns) *
+				  cfg->rate / 1000000000ULL + 1;
+
+				if (due <= sent)
+					allowed = 0;
+				else if (due - sent < (unsigned long long)allowed)
+					allowed = due - sent;
+			}
+			if (cfg->count && cfg->count - sent <
+			  (unsigned long long)allowed)
+				allowed = cfg->count - sent;
+		}
+
+		for (i = 0; i < allowed; i++) {
+			seq = seq_head;
+			slot = &st.slots[seq % BENCH_SLOTS];
+			if (slot->state != SLOT_FREE)
+				break;
+
+			frame = cfg->fd ?
+			  (struct can_frame *)tx_queue_next_fd(&query->tx) :
+			  tx_queue_next(&query->tx);
+			if (!frame)
+				break;
+
+			obd_build_request(frame, 0x7df, 0x0c);
+			frame->can_dlc = 8;
+			frame->data[6] = seq >> 8;
+			frame->data[7] = seq & 0xFF;
+			if (cfg->fd)
+				obd_pad_fd((struct canfd_frame *)frame,
+					   BENCH_FD_LEN);
+
+			slot->state = SLOT_SENT;
+			clock_gettime(CLOCK_MONOTONIC, &slot->sent);
+			seq_head++;
+
+			if (cfg->rate)
+				txsched_queued(&st.sched, &query->tx, start_ns +
+				  ((sent + i) * 1000000000ULL) / cfg->rate,
+				  timespec_to_ns(&slot->sent));
+		}
+
+		if (query->tx.count) {
+			unsigned int queued = query->tx.count;
+
+			nframes = tx_queue_flush(query->sock, &query->tx);
+			if (nframes < 0) {
+				perror("Error sending query");
+				return -1;
+			}
+
+			/* Frames dropped by the TX queue never went out */
+			for (; (unsigned int)nframes < queued; queued--) {
+				seq_head--;
+				st.slots[seq_head % BENCH_SLOTS].state = SLOT_FREE;
+			}
+			sent += nframes;
+			st.outstanding += nframes;
+		}
+
+		/* Sleep until the next query is due, or frames arrive. The
+		 * epoll_wait() timeout is only good to the ms, so it wakes up
+		 * early and the scheduler waits out the last part precisely.
+		 */
+		timeout_ms = 100;
+		if (sending && cfg->rate && st.outstanding < cfg->window) {
+			uint64_t next_ns = start_ns +
+			  (sent * 1000000000ULL) / cfg->rate;
+
+			now_ns = monotonic_ns();
+			if (next_ns >= now_ns + 1000000) {
+				timeout_ms = (next_ns - now_ns) / 1000000;
+			} else {
+				txsched_wait(&st.sched, next_ns);
+				timeout_ms = 0;
+			}
+		}
+
+		if (evloop_run_once(loop, timeout_ms) < 0)
+			return -1;
+	}
+	ecu_rx_count = ecu->rx.frames_total - ecu_rx_count;
+
+	/* Anything still outstanding at this point was never answered */
+	missed += st.outstanding;
+	now_ns = monotonic_ns();
+	elapsed = ((sending ? now_ns : stop_ns) - start_ns) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	printf("Benchmark ran for %.2f s\n", elapsed);
+	printf("  Queries sent: %llu (%.1f/s), seen on bus: %llu\n",
+		sent, sent / elapsed, st.echoed);
+	printf("  Requests received by ECU: %llu, responses received: %llu "
+		"(%.1f/s)\n", ecu_rx_count, st.received, st.received / elapsed);
+	printf("  Bus frames: %.1f/s, utilization %.1f%% to %.1f%% of %u bit/s",
+		(st.echoed + st.received) / elapsed,
+		100.0 * st.bus_ns_min / elapsed / 1e9,
+		100.0 * st.bus_ns_max / elapsed / 1e9, cfg->bitrate);
+	if (cfg->fd)
+		printf(", %u bit/s data phase", cfg->dbitrate);
+	printf(" (no to worst case bit stuffing)\n");
+
+	/* The most a classic bus at the same bit rate could move, flat out
+	 * with 8 byte frames and no stuff bits.
+	 */
+	printf("  Payload: %.1f bytes/s, classic CAN at %u bit/s carries at most "
+		"%.1f bytes/s\n", st.payload / elapsed, cfg->bitrate,
+		8 * 1e9 / frame_time_ns(&classic_max, 0, 0, cfg->bitrate, 0));
+	printf("  Dropped: %llu queries (TX queue full), %llu responses (TX "
+		"queue full), %llu requests lost before reaching ECU\n",
+		query->tx.dropped_total, ecu->tx.dropped_total,
+		sent > ecu_rx_count ? sent - ecu_rx_count : 0);
+	printf("  Missed: %llu queries never answered\n", missed);
+	latency_hist_print(stdout, "  Round trip latency", &st.rtt);
+	printf("    %llu of %llu samples from hardware timestamps\n",
+		st.hw_samples, (unsigned long long)st.rtt.count);
+	if (cfg->rate)
+		txsched_print(stdout, "  Query pacing", &st.sched);
+
+	return 0;
+}
+
+struct isotp_bench_state {
+	struct isotp_link tester;
+	struct isotp_link ecu;
+	uint8_t tx_data[ISOTP_MAX_LEN];
+	uint8_t rx_data[ISOTP_MAX_LEN];
+	int sending;
+
+	/* Statistics */
+	unsigned long long verified;
+	unsigned long long corrupt;
+	unsigned long long failed;
+};
+
+static void isotp_bench_tx_done(struct isotp_link *link, int err)
+{
+	struct isotp_bench_state *st = link->priv;
+
+	st->sending = 0;
+	if (err)
+		st->failed++;
+}
+
+static void isotp_bench_rx_done(struct isotp_link *link, int err)
+{
+	struct isotp_bench_state *st = link->priv;
+
+	if (err)
+		return;
+
+	if (link->rx_len == st->tester.tx_len &&
+	  memcmp(link->rx_buf, st->tx_data, link->rx_len) == 0)
+		st->verified++;
+	else
+		st->corrupt++;
+}
+
+/* Pass every frame received on a port to its link, then send any flow
+ * control that queued.
+ */
+static signed int isotp_port_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	struct isotp_link *link = port->priv;
+	uint64_t now_ns = monotonic_ns();
+	int nframes;
+	int i;
+
+	(void)events;
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		fprintf(stderr, "Error receiving ISO-TP on %s: ", port->iface);
+		perror("");
+		return -1;
+	}
+
+	for (i = 0; i < nframes; i++)
+		isotp_rx_frame(link, rx_batch_frame(&port->rx, i), now_ns);
+
+	if (can_port_flush(port) < 0) {
+		fprintf(stderr, "Error sending ISO-TP flow control on %s: ",
+			port->iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The timer only needs to wake the loop, the links are polled after */
+static signed int isotp_timer_handler(struct ev_source *src, uint32_t events)
+{
+	uint64_t expirations;
+
+	(void)events;
+
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0 &&
+	  errno != EAGAIN) {
+		perror("Error reading ISO-TP timer");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Flush what the link queued and let it know how much went out. Flow
+ * control the port handler left queued goes out first.
+ */
+static signed int isotp_flush(struct isotp_link *link, unsigned int queued)
+{
+	struct can_port *port = link->port;
+	unsigned int ahead;
+	int nframes;
+
+	if (!queued)
+		return 0;
+
+	ahead = port->tx.count - queued;
+	nframes = tx_queue_flush(port->sock, &port->tx);
+	if (nframes < 0) {
+		fprintf(stderr, "Error sending ISO-TP on %s: ", port->iface);
+		perror("");
+		return -1;
+	}
+	isotp_tx_sent(link, queued, (unsigned int)nframes > ahead ?
+		      nframes - ahead : 0);
+
+	return 0;
+}
+
+/* Repeated ISO-TP transfers from the tester to the ECU. STmin can be as
+ * short as 100 us, finer than an epoll_wait() timeout, so the wait for the
+ * next consecutive frame is a timerfd in the event loop.
+ */
+signed int run_isotp_bench(struct evloop *loop, struct can_port *tester,
+			   struct can_port *ecu,
+			   const struct isotp_bench_cfg *cfg)
+{
+	static struct isotp_bench_state st;
+	struct ev_source timer = { .handler = isotp_timer_handler };
+	struct itimerspec its;
+	uint64_t start_ns, now_ns, end_ns = 0, stop_ns = 0, next_ns, n;
+	unsigned long long started = 0;
+	int continuing = 1;
+	int queued;
+	int ret = -1;
+	size_t i;
+	double elapsed;
+
+	memset(&st, '\0', sizeof(st));
+	for (i = 0; i < cfg->size; i++)
+		st.tx_data[i] = (i * 7) ^ (i >> 8);
+
+	isotp_link_init(&st.tester, tester, 0x7e0, 0x7e8, NULL, 0);
+	isotp_link_init(&st.ecu, ecu, 0x7e8, 0x7e0, st.rx_data,
+			sizeof(st.rx_data));
+	st.ecu.bs = cfg->bs;
+	st.ecu.stmin = cfg->stmin;
+	st.tester.tx_done = isotp_bench_tx_done;
+	st.ecu.rx_done = isotp_bench_rx_done;
+	st.tester.priv = st.ecu.priv = &st;
+
+	tester->priv = &st.tester;
+	tester->ev.handler = isotp_port_handler;
+	ecu->priv = &st.ecu;
+	ecu->ev.handler = isotp_port_handler;
+
+	timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer.fd < 0) {
+		perror("Error creating ISO-TP timer");
+		return -1;
+	}
+	if (evloop_add(loop, &timer, EPOLLIN) < 0) {
+		close(timer.fd);
+		return -1;
+	}
+
+	start_ns = monotonic_ns();
+	if (cfg->duration_s)
+		end_ns = start_ns + cfg->duration_s * 1000000000ULL;
+
+	while (keep_running) {
+		now_ns = monotonic_ns();
+
+		/* Stop starting new transfers at the end of the run */
+		if (continuing && ((end_ns && now_ns >= end_ns) ||
+		  (cfg->count && started >= cfg->count))) {
+			continuing = 0;
+			stop_ns = now_ns;
+		}
+		if (!continuing && !st.sending && st.ecu.rx_state == ISOTP_IDLE)
+			break;
+
+		if (continuing && !st.sending) {
+			queued = isotp_send(&st.tester, st.tx_data, cfg->size,
+					    now_ns);
+			if (queued < 0) {
+				fprintf(stderr, "Unable to start ISO-TP transfer\n");
+				break;
+			}
+			st.sending = 1;
+			started++;
+			if (isotp_flush(&st.tester, queued) < 0)
+				break;
+		}
+
+		/* Send no more consecutive frames per pass than the ECU side
+		 * takes in per wakeup, so its receive queue can not overflow on
+		 * a block size of 0.
+		 */
+		if (isotp_flush(&st.tester, isotp_poll(&st.tester, now_ns,
+		  ecu->batch)) < 0 ||
+		  isotp_flush(&st.ecu, isotp_poll(&st.ecu, now_ns, 0)) < 0)
+			break;
+
+		/* Arm the timer for whichever link needs polling first */
+		next_ns = isotp_next_ns(&st.tester);
+		n = isotp_next_ns(&st.ecu);
+		if (n < next_ns)
+			next_ns = n;
+
+		memset(&its, '\0', sizeof(its));
+		if (next_ns != UINT64_MAX) {
+			if (next_ns <= now_ns)
+				next_ns = now_ns + 1;
+			its.it_value.tv_sec = next_ns / 1000000000ULL;
+			its.it_value.tv_nsec = next_ns % 1000000000ULL;
+		}
+		timerfd_settime(timer.fd, TFD_TIMER_ABSTIME, &its, NULL);
+
+		if (evloop_run_once(loop, 100) < 0)
+			break;
+	}
+	if (!keep_running || (!continuing && !st.sending))
+		ret = 0;
+
+	evloop_del(loop, &timer);
+	close(timer.fd);
+
+	elapsed = ((continuing ? monotonic_ns() : stop_ns) - start_ns) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	printf("ISO-TP benchmark ran for %.2f s, %zu byte messages, block size "
+		"%u, STmin 0x%02x (%.1f us)\n", elapsed, cfg->size, cfg->bs,
+		cfg->stmin, isotp_stmin_ns(cfg->stmin) / 1e3);
+	printf("  Messages started: %llu, sent: %llu, received intact: %llu, "
+		"corrupt: %llu, failed: %llu\n", started, st.tester.tx_msgs,
+		st.verified, st.corrupt, st.failed);
+	printf("  Throughput: %.2f KB/s, %.1f ms per message\n",
+		st.verified * cfg->size / elapsed / 1024,
+		st.verified ? elapsed * 1000 / st.verified : 0.0);
+	printf("  Frames: %llu consecutive sent, %llu received, %llu flow "
+		"control sent, %llu received\n", st.tester.cf_sent,
+		st.ecu.cf_received, st.ecu.fc_sent, st.tester.fc_received);
+	printf("  Timeouts: %llu sending, %llu receiving, errors: %llu sending, "
+		"%llu receiving\n", st.tester.timeouts, st.ecu.timeouts,
+		st.tester.errors, st.ecu.errors);
+
+	return ret;
+}
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Sustained loopback benchmark
+ *
+ * Runs a load of queries and responses between a query port and an ECU
+ * emulation port, either flat out or at a target rate, and reports
+ * throughput, bus utilization, losses, and round trip latency.
+ *
+ * Each query carries a sequence number in its last two data bytes, which the
+ * ECU emulation copies back in to its response. This lets responses be
+ * matched to queries even if frames are lost.
+ *
+ * With FD, queries and responses are BENCH_FD_LEN byte CAN FD frames with
+ * the bit rate switched, to compare payload throughput against classic CAN.
+ *
+ * At a target rate, each query has an absolute deadline and the error of
+ * each against it is reported, see txsched.h.
+ */
+
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#include <stddef.h>
+
+#include "canio.h"
+#include "evloop.h"
+
+#define BENCH_SLOTS		1024
+#define BENCH_TIMEOUT_NS	1000000000LL
+#define BENCH_DURATION_S	10
+#define BENCH_FD_LEN		CANFD_MAX_DLEN
+
+struct bench_cfg {
+	unsigned int duration_s;
+	unsigned long long count;
+	unsigned int rate;
+	unsigned int bitrate;
+	unsigned int dbitrate;
+	unsigned int window;
+	int fd;
+};
+
+/* ISO-TP throughput, the tester repeatedly sends a message of size bytes to
+ * the ECU, as a flash download would, with the ECU's flow control giving bs
+ * and stmin. Every message received is checked against what was sent.
+ */
+#define ISOTP_BENCH_SIZE	4095
+
+struct isotp_bench_cfg {
+	size_t size;
+	uint8_t bs;
+	uint8_t stmin;
+	unsigned int duration_s;
+	unsigned long long count;
+};
+
+signed int run_bench(struct evloop *loop, struct can_port *query,
+		     struct can_port *ecu, const struct bench_cfg *cfg);
+signed int run_isotp_bench(struct evloop *loop, struct can_port *tester,
+			   struct can_port *ecu,
+			   const struct isotp_bench_cfg *cfg);
+
+#endif /* __BENCH_H__ */
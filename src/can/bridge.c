@@ -0,0 +1,546 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bridge.h"
+
+static signed int find_iface(const struct bridge *br, const char *name,
+			     unsigned int *idx)
+{
+	unsigned int i;
+
+	if (!name)
+		return -1;
+
+	for (i = 0; i < br->nports; i++) {
+		if (!strcmp(br->ports[i].iface, name)) {
+			*idx = i;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/* forward <from> <to> <id>:<mask> [rewrite <id>] [rate <frames/s>] */
+static const char *parse_forward(struct bridge *br, char **save)
+{
+	struct bridge_rule *r;
+	unsigned long val;
+	const char *tok;
+	char *end;
+
+	if (br->nrules >= BRIDGE_MAX_RULES)
+		return "too many rules";
+
+	r = &br->rules[br->nrules];
+	memset(r, '\0', sizeof(*r));
+	if (find_iface(br, strtok_r(NULL, " \t", save), &r->from) < 0 ||
+	  find_iface(br, strtok_r(NULL, " \t", save), &r->to) < 0)
+		return "expected interfaces to forward from and to, each one "
+		  "of --iface";
+	if (r->from == r->to)
+		return "rule forwards to the interface it is from";
+
+	tok = strtok_r(NULL, " \t", save);
+	if (!tok || parse_filter(tok, &r->filter) < 0)
+		return "expected a filter, <id>:<mask> or <id>~<mask>";
+
+	while ((tok = strtok_r(NULL, " \t", save))) {
+		if (!strcmp(tok, "rewrite")) {
+			tok = strtok_r(NULL, " \t", save);
+			val = tok ? strtoul(tok, &end, 16) : 0;
+			if (!tok || *end != '\0' || val > CAN_EFF_MASK)
+				return "expected an ID to rewrite to, in hex";
+			if (r->filter.can_id & CAN_INV_FILTER)
+				return "rewrite needs a filter that is not "
+				  "inverted";
+			r->rewrite = 1;
+			r->rewrite_id = val;
+		} else if (!strcmp(tok, "rate")) {
+			tok = strtok_r(NULL, " \t", save);
+			val = tok ? strtoul(tok, &end, 10) : 0;
+			if (!tok || *end != '\0' || val < 1 || val > 1000000)
+				return "expected a rate of 1 to 1000000 frames "
+				  "a second";
+			r->rate = val;
+		} else {
+			return "expected rewrite or rate";
+		}
+	}
+
+	latency_hist_init(&r->lat);
+	br->nrules++;
+
+	return NULL;
+}
+
+/* Load the rules in path, forwarding between the interfaces in ifaces. See
+ * the top of bridge.h for the format.
+ */
+signed int bridge_load(struct bridge *br, const char *path,
+		       char ifaces[][IFNAMSIZ], unsigned int nifaces)
+{
+	char line[BRIDGE_LINE_MAX];
+	const char *err = NULL;
+	unsigned int lineno = 0;
+	char *save, *tok;
+	unsigned int i;
+	FILE *f;
+
+	memset(br, '\0', sizeof(*br));
+	if (nifaces > BRIDGE_MAX_PORTS) {
+		fprintf(stderr, "Too many interfaces to bridge, limit is %d\n",
+			BRIDGE_MAX_PORTS);
+		return -1;
+	}
+	for (i = 0; i < nifaces; i++)
+		strcpy(br->ports[i].iface, ifaces[i]);
+	br->nports = nifaces;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s: ", path);
+		perror("");
+		return -1;
+	}
+
+	while (!err && fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+
+		tok = strtok_r(line, " \t", &save);
+		if (!tok)
+			continue;
+
+		if (!strcmp(tok, "forward"))
+			err = parse_forward(br, &save);
+		else
+			err = "unknown keyword";
+	}
+	fclose(f);
+
+	if (err) {
+		fprintf(stderr, "%s:%u: %s\n", path, lineno, err);
+		return -1;
+	}
+
+	if (!br->nrules) {
+		fprintf(stderr, "%s: no rules\n", path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The ID a rule sends a frame out with */
+static canid_t rewrite_id(const struct bridge_rule *r, canid_t id)
+{
+	canid_t mask = r->filter.can_mask &
+	  ((id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+
+	return (id & ~mask) | (r->rewrite_id & mask);
+}
+
+/* Hand a rule to CAN_GW, the kernel has no way of limiting its rate */
+static signed int offload(struct bridge *br, struct bridge_rule *r)
+{
+	struct canlink_gw *gw = &r->gw;
+	canid_t mask = r->filter.can_mask & CAN_EFF_MASK;
+
+	strcpy(gw->src, br->ports[r->from].iface);
+	strcpy(gw->dst, br->ports[r->to].iface);
+	gw->filter = r->filter;
+	gw->rewrite = r->rewrite;
+	gw->id_and = ~mask;
+	gw->id_or = r->rewrite_id & mask;
+
+	if (canlink_gw_add(gw) < 0)
+		return -1;
+	r->offloaded = 1;
+
+	return 0;
+}
+
+static signed int bridge_handler(struct ev_source *src, uint32_t events);
+
+/* What port i receives: the frames the rules left in userspace forward from
+ * it, and with latency, the frames they forwarded to it coming back.
+ * Forwarded frames match the filter once rewritten too, the bits it does not
+ * mask are left alone.
+ */
+static signed int set_port_filters(const struct bridge *br, unsigned int i)
+{
+	struct can_filter in[BRIDGE_MAX_RULES], out[BRIDGE_MAX_RULES];
+	const struct bridge_rule *r;
+	int nin = 0, nout = 0;
+	unsigned int j;
+
+	for (j = 0; j < br->nrules; j++) {
+		r = &br->rules[j];
+		if (r->offloaded)
+			continue;
+		if (r->from == i)
+			in[nin++] = r->filter;
+		if (r->to == i && br->latency) {
+			out[nout] = r->filter;
+			if (r->rewrite)
+				out[nout].can_id = rewrite_id(r,
+							      r->filter.can_id);
+			nout++;
+		}
+	}
+
+	return set_filters(br->ports[i].port->sock, in, nin, out, nout,
+			   NULL, 0);
+}
+
+/* Open a port for each interface, with latency also receiving its own
+ * frames back, timestamped. Every rule is in userspace to begin with,
+ * run_bridge() hands what it can to CAN_GW.
+ */
+signed int bridge_open(struct bridge *br, struct can_port *ports,
+		       unsigned int batch, int latency, int fd)
+{
+	struct bridge_port *bp;
+	unsigned int i;
+
+	br->latency = latency;
+	br->fd = fd;
+
+	for (i = 0; i < br->nports; i++) {
+		bp = &br->ports[i];
+		if (can_port_open(&ports[i], bp->iface, batch, NULL, 0, NULL,
+		  0, NULL, 0) < 0) {
+			while (i--)
+				can_port_close(&ports[i]);
+			return -1;
+		}
+		bp->port = &ports[i];
+		ports[i].priv = br;
+		ports[i].ev.handler = bridge_handler;
+
+		if (ports[i].local)
+			continue;
+
+		if (set_port_filters(br, i) < 0 || (latency &&
+		  (enable_timestamps(ports[i].sock) < 0 ||
+		  enable_own_msgs(ports[i].sock) < 0))) {
+			do
+				can_port_close(&ports[i]);
+			while (i--);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Hand every rule without a rate limit to CAN_GW, unless measuring latency
+ * or forwarding FD frames, then stop receiving what they forward. Should
+ * one fail, most likely for the module missing or us lacking CAP_NET_ADMIN,
+ * the rest would too, so they all stay in userspace.
+ */
+static signed int bridge_offload(struct bridge *br)
+{
+	struct bridge_rule *r;
+	unsigned int i;
+
+	if (br->latency || br->fd)
+		return 0;
+
+	for (i = 0; i < br->nrules; i++) {
+		r = &br->rules[i];
+		if (r->rate || br->ports[r->from].port->local ||
+		  br->ports[r->to].port->local)
+			continue;
+		if (offload(br, r) < 0) {
+			fprintf(stderr, "Forwarding in userspace instead\n");
+			break;
+		}
+	}
+
+	for (i = 0; i < br->nports; i++) {
+		if (!br->ports[i].port->local && set_port_filters(br, i) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Generic cell rate algorithm, the frame is let through unless the one
+ * after it would be due more than the burst ahead of now.
+ */
+static int rate_admit(struct bridge_rule *r, uint64_t now_ns)
+{
+	uint64_t ival_ns = 1000000000ULL / r->rate;
+
+	if (r->tat_ns < now_ns)
+		r->tat_ns = now_ns;
+	if (r->tat_ns - now_ns > ival_ns * (BRIDGE_RATE_BURST - 1))
+		return 0;
+	r->tat_ns += ival_ns;
+
+	return 1;
+}
+
+static int rule_matches(const struct bridge_rule *r, canid_t id)
+{
+	int match = ((id ^ r->filter.can_id) & r->filter.can_mask &
+	  ~CAN_INV_FILTER) == 0;
+
+	return (r->filter.can_id & CAN_INV_FILTER) ? !match : match;
+}
+
+/* Send everything queued on one port, and count the frames against the
+ * rules that sent them. Frames the interface had no room for stay queued,
+ * at the front, for the loop to send later.
+ */
+static signed int flush_port(struct bridge *br, struct bridge_port *bp)
+{
+	struct bridge_pending *pend;
+	unsigned int queued, left, j;
+	int sent;
+
+	queued = bp->port->tx.count;
+	if (!queued)
+		return 0;
+
+	sent = can_port_flush(bp->port);
+	if (sent < 0) {
+		fprintf(stderr, "Error forwarding to %s: ", bp->iface);
+		perror("");
+		return -1;
+	}
+
+	for (j = 0; j < (unsigned int)sent; j++) {
+		br->rules[bp->queued[j]].forwarded++;
+		if (!br->latency)
+			continue;
+
+		/* Should echoes ever go missing, lose the oldest */
+		if (bp->head - bp->tail == BRIDGE_PENDING)
+			bp->tail++;
+		pend = &bp->pending[bp->head++ % BRIDGE_PENDING];
+		pend->stamp = bp->queued_stamps[j];
+		pend->rule = bp->queued[j];
+	}
+	left = bp->port->tx.count;
+	for (j += left; j < queued; j++)
+		br->rules[bp->queued[j]].dropped++;
+
+	memmove(bp->queued, &bp->queued[sent], left * sizeof(bp->queued[0]));
+	if (br->latency)
+		memmove(bp->queued_stamps, &bp->queued_stamps[sent],
+			left * sizeof(bp->queued_stamps[0]));
+
+	return 0;
+}
+
+/* Send everything queued on every port, one sendmmsg() each */
+static signed int flush_all(struct bridge *br)
+{
+	unsigned int i;
+
+	for (i = 0; i < br->nports; i++) {
+		if (flush_port(br, &br->ports[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Queue a frame to go out on the rule's destination. Several rules may
+ * send one batch's frames to the same port, so should its queue fill up,
+ * what is already in it is sent first. If the interface has no room for
+ * that either, the frame is dropped.
+ */
+static signed int forward(struct bridge *br, unsigned int idx,
+		    const struct canfd_frame *frame, int fd,
+		    const struct rx_stamp *stamp)
+{
+	struct bridge_rule *r = &br->rules[idx];
+	struct bridge_port *bp = &br->ports[r->to];
+	struct tx_queue *tx = &bp->port->tx;
+	struct canfd_frame *out;
+
+	/* An interface without FD frames enabled cannot send them */
+	if (fd && !bp->port->fd) {
+		r->dropped++;
+		return 0;
+	}
+
+	if (tx->count >= MAX_BATCH && flush_port(br, bp) < 0)
+		return -1;
+
+	out = fd ? tx_queue_next_fd(tx) : (struct canfd_frame *)
+	  tx_queue_next(tx);
+	if (!out) {
+		r->dropped++;
+		return 0;
+	}
+
+	memcpy(out, frame, fd ? sizeof(struct canfd_frame) :
+	       sizeof(struct can_frame));
+	if (r->rewrite)
+		out->can_id = rewrite_id(r, frame->can_id);
+
+	bp->queued[tx->count - 1] = idx;
+	if (stamp)
+		bp->queued_stamps[tx->count - 1] = *stamp;
+
+	return 0;
+}
+
+/* Forward everything received in one batch by every userspace rule it
+ * matches, then send it all.
+ */
+static signed int bridge_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	struct bridge *br = port->priv;
+	struct bridge_pending *pend;
+	struct canfd_frame *frame;
+	struct bridge_port *bp;
+	struct bridge_rule *r;
+	struct rx_stamp stamp;
+	struct msghdr *msg;
+	unsigned int from, j;
+	uint64_t now_ns = 0;
+	int nframes, i;
+
+	(void)events;
+
+	for (from = 0; br->ports[from].port != port; from++);
+	bp = &br->ports[from];
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		fprintf(stderr, "Error receiving on %s: ", port->iface);
+		perror("");
+		return -1;
+	}
+
+	for (i = 0; i < nframes; i++) {
+		msg = &port->rx.msgs[i].msg_hdr;
+		frame = &port->rx.frames[i];
+		if (port->rx.msgs[i].msg_len < sizeof(struct can_frame))
+			continue;
+		if (br->latency)
+			parse_cmsgs(msg, &stamp);
+
+		/* One of the frames we forwarded, now on the bus */
+		if (msg->msg_flags & MSG_CONFIRM) {
+			if (bp->tail == bp->head) {
+				br->unmatched++;
+				continue;
+			}
+			pend = &bp->pending[bp->tail++ % BRIDGE_PENDING];
+			r = &br->rules[pend->rule];
+			r->hw_samples += record_latency(&r->lat, &pend->stamp,
+							&stamp);
+			continue;
+		}
+
+		for (j = 0; j < br->nrules; j++) {
+			r = &br->rules[j];
+			if (r->from != from || r->offloaded ||
+			  !rule_matches(r, frame->can_id))
+				continue;
+
+			if (r->rate) {
+				if (!now_ns)
+					now_ns = monotonic_ns();
+				if (!rate_admit(r, now_ns)) {
+					r->limited++;
+					continue;
+				}
+			}
+
+			if (forward(br, j, frame, rx_batch_is_fd(&port->rx, i),
+			  br->latency ? &stamp : NULL) < 0)
+				return -1;
+		}
+	}
+
+	return flush_all(br);
+}
+
+/* Forward until interrupted, or for duration_s if it is not 0 */
+signed int run_bridge(struct evloop *loop, struct bridge *br,
+		      unsigned int duration_s)
+{
+	uint64_t end_ns = monotonic_ns() + duration_s * 1000000000ULL;
+	unsigned int i, n = 0;
+
+	if (bridge_offload(br) < 0)
+		return -1;
+
+	for (i = 0; i < br->nrules; i++)
+		n += br->rules[i].offloaded;
+	fprintf(stderr, "Bridging %u interfaces with %u rules, %u of them "
+		"in the kernel with CAN_GW\n", br->nports, br->nrules, n);
+
+	while (keep_running && (!duration_s || monotonic_ns() < end_ns)) {
+		if (evloop_run_once(loop, 100) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void bridge_print_stats(const struct bridge *br)
+{
+	const struct bridge_rule *r;
+	unsigned long long handled, dropped;
+	char label[2 * IFNAMSIZ + 64];
+	unsigned int i;
+
+	for (i = 0; i < br->nrules; i++) {
+		r = &br->rules[i];
+		snprintf(label, sizeof(label), "%s -> %s %x%c%x",
+			 br->ports[r->from].iface, br->ports[r->to].iface,
+			 r->filter.can_id & ~CAN_INV_FILTER,
+			 (r->filter.can_id & CAN_INV_FILTER) ? '~' : ':',
+			 r->filter.can_mask);
+
+		if (r->offloaded) {
+			if (canlink_gw_counters(&r->gw, &handled, &dropped) < 0)
+				continue;
+			printf("%s: %llu forwarded, %llu dropped, by CAN_GW\n",
+			       label, handled, dropped);
+			continue;
+		}
+
+		printf("%s: %llu forwarded, %llu rate limited, %llu dropped\n",
+		       label, r->forwarded, r->limited, r->dropped);
+		if (br->latency) {
+			latency_hist_print(stdout, "  Forwarding latency",
+					   &r->lat);
+			printf("  %llu of %llu samples from hardware "
+			       "timestamps\n", r->hw_samples,
+			       (unsigned long long)r->lat.count);
+		}
+	}
+
+	if (br->latency)
+		printf("%llu echoes not matched to a forwarded frame\n",
+		       br->unmatched);
+}
+
+/* Remove any CAN_GW jobs, the ports are closed by whoever owns them */
+void bridge_close(struct bridge *br)
+{
+	unsigned int i;
+
+	for (i = 0; i < br->nrules; i++) {
+		if (!br->rules[i].offloaded)
+			continue;
+		canlink_gw_del(&br->rules[i].gw);
+		br->rules[i].offloaded = 0;
+	}
+}
@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Bridge between CAN interfaces
+ *
+ * Frames are forwarded from one interface to another by rules loaded from a
+ * text file:
+ *
+ *	# Requests from the tester on can0 go through to the vehicle on can1
+ *	forward can0 can1 7df:7ff
+ *	forward can0 can1 7e0:7f8
+ *	# Responses come back moved down to 0x6e8, keeping the ECU number
+ *	forward can1 can0 7e8:7f8 rewrite 6e8
+ *	# Body frames, at most 100 a second of them
+ *	forward can1 can0 200:700 rate 100
+ *
+ * A rule gives the interface to receive on, the interface to send on, and a
+ * filter in hex as --filter takes it. A frame is forwarded by every rule it
+ * matches. With rewrite, the ID bits set in the filter's mask are replaced
+ * with those of the given ID, the rest are kept. With rate, frames past the
+ * given number a second, after a burst of BRIDGE_RATE_BURST, are dropped.
+ *
+ * Every frame one wakeup receives on an interface is forwarded with one
+ * sendmmsg() per destination. Rules with no rate limit are instead handed to
+ * the kernel's CAN gateway, CAN_GW, where it is available, so their frames
+ * never reach userspace at all. With --latency or --fd every rule stays in
+ * userspace, for the latency to be measured and for FD frames to have their
+ * IDs rewritten.
+ *
+ * With --latency, each forwarded frame's receive timestamp is kept in a FIFO
+ * for the interface it went out on, and matched to its echo the same way
+ * that the ECU emulation times its responses, see ecu.h.
+ *
+ * Rules sending frames back the way they came can loop, as can a CAN_GW
+ * rule whose output another rule matches. The kernel limits a frame to one
+ * hop through CAN_GW, but nothing limits userspace rules.
+ */
+
+#ifndef __BRIDGE_H__
+#define __BRIDGE_H__
+
+#include <stdint.h>
+
+#include "canio.h"
+#include "canlink.h"
+#include "evloop.h"
+#include "latency.h"
+
+#define BRIDGE_MAX_PORTS	8
+#define BRIDGE_MAX_RULES	32
+#define BRIDGE_LINE_MAX		256
+#define BRIDGE_PENDING		256
+#define BRIDGE_RATE_BURST	10
+
+struct bridge_rule {
+	unsigned int from;
+	unsigned int to;
+	struct can_filter filter;
+	int rewrite;
+	canid_t rewrite_id;
+
+	/* Frames a second, 0 for no limit. Frames are let through while
+	 * the theoretical arrival time of the next is no more than the burst
+	 * ahead of now.
+	 */
+	unsigned int rate;
+	uint64_t tat_ns;
+
+	int offloaded;
+	struct canlink_gw gw;
+
+	/* Statistics */
+	struct latency_hist lat;
+	unsigned long long forwarded;
+	unsigned long long limited;
+	unsigned long long dropped;
+	unsigned long long hw_samples;
+};
+
+/* A forwarded frame waiting for its echo, with the rule that sent it */
+struct bridge_pending {
+	struct rx_stamp stamp;
+	unsigned int rule;
+};
+
+struct bridge_port {
+	char iface[IFNAMSIZ];
+	struct can_port *port;
+	struct bridge_pending pending[BRIDGE_PENDING];
+	unsigned int head;
+	unsigned int tail;
+
+	/* Rules of the frames queued to send, in order */
+	unsigned int queued[MAX_BATCH];
+	struct rx_stamp queued_stamps[MAX_BATCH];
+};
+
+struct bridge {
+	struct bridge_rule rules[BRIDGE_MAX_RULES];
+	unsigned int nrules;
+	struct bridge_port ports[BRIDGE_MAX_PORTS];
+	unsigned int nports;
+	int latency;
+	int fd;
+
+	/* Statistics */
+	unsigned long long unmatched;
+};
+
+signed int bridge_load(struct bridge *br, const char *path,
+		       char ifaces[][IFNAMSIZ], unsigned int nifaces);
+signed int bridge_open(struct bridge *br, struct can_port *ports,
+		       unsigned int batch, int latency, int fd);
+signed int run_bridge(struct evloop *loop, struct bridge *br,
+		      unsigned int duration_s);
+void bridge_print_stats(const struct bridge *br);
+void bridge_close(struct bridge *br);
+
+#endif /* __BRIDGE_H__ */
@@ -0,0 +1,1045 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <linux/can/raw.h>
+#include <linux/net_tstamp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "canio.h"
+#include "trace.h"
+
+signed int test_and_bind(int sock, struct ifreq *ifr,
+			 struct sockaddr_can *addr, const char *iface)
+{
+	/* Write the interface name to the struct, this is used by ioctl to find
+	 * the interface index if it exists.
+	 */
+	memset(ifr->ifr_name, '\0', IFNAMSIZ);
+	strncpy(ifr->ifr_name, iface, IFNAMSIZ-1);
+
+	if (ioctl(sock, SIOCGIFINDEX, ifr) < 0) {
+		fprintf(stderr, "Unable to open iface %s: ", iface);
+		perror("");
+		return -1;
+	}
+	addr->can_family = AF_CAN;
+	addr->can_ifindex = ifr->ifr_ifindex;
+
+	/* Now, bind the interface to the socket for use */
+	if (bind(sock, (struct sockaddr *)addr, sizeof(struct sockaddr_can)) < 0) {
+		fprintf(stderr, "Unable to bind on iface %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Install the given filters on the socket, followed by any extra ones from
+ * the command line. Frames that match none of them never leave the kernel.
+ */
+signed int set_filters(int sock, const struct can_filter *base, int nbase,
+		       const struct can_filter *base2, int nbase2,
+		       const struct can_filter *extra, int nextra)
+{
+	struct can_filter filters[MAX_PORT_FILTERS];
+	int n = 0;
+	int i;
+
+	assert(nbase + nbase2 + nextra <= (int)ARRAY_SIZE(filters));
+
+	for (i = 0; i < nbase; i++)
+		filters[n++] = base[i];
+	for (i = 0; i < nbase2; i++)
+		filters[n++] = base2[i];
+	for (i = 0; i < nextra; i++)
+		filters[n++] = extra[i];
+
+	if (setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FILTER, filters,
+	  n * sizeof(struct can_filter)) < 0) {
+		perror("Unable to set CAN filters");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Parse <id>:<mask> or <id>~<mask>, in hex, the same as candump. IDs that
+ * do not fit in 11 bits are taken as extended IDs.
+ */
+signed int parse_filter(const char *str, struct can_filter *filter)
+{
+	char *end;
+
+	filter->can_id = strtoul(str, &end, 16);
+	if (end == str || (*end != ':' && *end != '~'))
+		return -1;
+
+	str = end + 1;
+	filter->can_mask = strtoul(str, &end, 16);
+	if (end == str || *end != '\0')
+		return -1;
+
+	if (filter->can_id > CAN_SFF_MASK) {
+		filter->can_id |= CAN_EFF_FLAG;
+		filter->can_mask |= CAN_EFF_FLAG;
+	}
+
+	if (str[-1] == '~')
+		filter->can_id |= CAN_INV_FILTER;
+
+	return 0;
+}
+
+/* One of the interface's statistics counters, 0 if it can not be read */
+unsigned long long iface_stat(const char *iface, const char *name)
+{
+	char path[64 + IFNAMSIZ];
+	unsigned long long count = 0;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+		 iface, name);
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+	if (fscanf(f, "%llu", &count) != 1)
+		count = 0;
+	fclose(f);
+
+	return count;
+}
+
+/* Frames the interface has received from the bus, from its statistics */
+unsigned long long iface_rx_packets(const char *iface)
+{
+	return iface_stat(iface, "rx_packets");
+}
+
+/* Frames lost before any socket saw them. The controller overrunning its
+ * receive FIFO counts as an over error, and the driver or network stack
+ * running out of room as a drop. Either way, not something a bigger socket
+ * buffer can help with.
+ */
+unsigned long long iface_rx_drops(const char *iface)
+{
+	return iface_stat(iface, "rx_dropped") +
+	  iface_stat(iface, "rx_over_errors") +
+	  iface_stat(iface, "rx_fifo_errors");
+}
+
+/* Turn on RX timestamps. SO_TIMESTAMPING provides both the software and raw
+ * hardware timestamps, if the kernel is too old for that on CAN sockets fall
+ * back to just software timestamps with SO_TIMESTAMPNS.
+ */
+signed int enable_timestamps(int sock)
+{
+	int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |
+	  SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+	int on = 1;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+	  sizeof(flags)) == 0)
+		return 0;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0) {
+		perror("Unable to enable timestamps");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Have the socket receive its own frames back once they are sent, marked
+ * with MSG_CONFIRM. With timestamps on, this is when each frame went out.
+ */
+signed int enable_own_msgs(int sock)
+{
+	int on = 1;
+
+	if (setsockopt(sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &on,
+	  sizeof(on)) < 0) {
+		perror("Unable to receive own messages");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Have the kernel busy poll the device queue for up to usecs when the
+ * socket has nothing to receive, rather than sleeping until an interrupt.
+ * Only drivers that do NAPI polling benefit. Raising this needs
+ * CAP_NET_ADMIN.
+ */
+signed int enable_busy_poll(int sock, int usecs)
+{
+	if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &usecs,
+	  sizeof(usecs)) < 0) {
+		perror("Unable to set busy poll");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Set a socket buffer size, with force_opt to go past the sysctl limit if
+ * this has CAP_NET_ADMIN, or opt, capped at the limit, if not. Returns the
+ * size now in effect, or -1 on error.
+ */
+signed int set_sock_buf(int sock, int force_opt, int opt, int bytes)
+{
+	socklen_t len = sizeof(bytes);
+
+	if (setsockopt(sock, SOL_SOCKET, force_opt, &bytes,
+	  sizeof(bytes)) < 0) {
+		if (errno != EPERM ||
+		  setsockopt(sock, SOL_SOCKET, opt, &bytes, sizeof(bytes)) < 0)
+			return -1;
+	}
+
+	if (getsockopt(sock, SOL_SOCKET, opt, &bytes, &len) < 0)
+		return -1;
+
+	return bytes;
+}
+
+/* Walk the control messages of a received frame and pull out timestamps */
+void parse_cmsgs(struct msghdr *msg, struct rx_stamp *stamp)
+{
+	struct cmsghdr *cmsg;
+	struct scm_timestamping *tss;
+
+	memset(stamp, '\0', sizeof(*stamp));
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		switch (cmsg->cmsg_type) {
+		case SCM_TIMESTAMPING:
+			tss = (struct scm_timestamping *)CMSG_DATA(cmsg);
+			stamp->sw = tss->ts[0];
+			stamp->hw = tss->ts[2];
+			break;
+		case SCM_TIMESTAMPNS:
+			memcpy(&stamp->sw, CMSG_DATA(cmsg), sizeof(stamp->sw));
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Record the time between two timestamps, using the hardware timestamps if
+ * both frames have one. Returns 1 if hardware timestamps were used.
+ */
+int record_latency(struct latency_hist *hist, const struct rx_stamp *start,
+		   const struct rx_stamp *end)
+{
+	int64_t ns;
+	int hw = (start->hw.tv_sec || start->hw.tv_nsec) &&
+	  (end->hw.tv_sec || end->hw.tv_nsec);
+
+	if (hw)
+		ns = timespec_diff_ns(&end->hw, &start->hw);
+	else
+		ns = timespec_diff_ns(&end->sw, &start->sw);
+
+	/* Frames without any timestamp, or a clock step, are not counted */
+	if ((!hw && start->sw.tv_sec == 0) || ns < 0)
+		return 0;
+
+	latency_hist_add(hist, ns);
+
+	return hw;
+}
+
+static void parse_rxq_ovfl(struct msghdr *msg, uint32_t *drops)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		  cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(drops, CMSG_DATA(cmsg), sizeof(*drops));
+			return;
+		}
+	}
+}
+
+/* The socket dropped frames, double its receive buffer up to rcvbuf_max.
+ * The kernel doubles whatever is asked for, asking for the current size
+ * doubles that. Once the buffer stops growing, a limit has been hit.
+ */
+static void rx_batch_grow(int sock, struct rx_batch *rx)
+{
+	int bytes;
+
+	bytes = set_sock_buf(sock, SO_RCVBUFFORCE, SO_RCVBUF,
+			     rx->rcvbuf < rx->rcvbuf_max / 2 ?
+			     rx->rcvbuf : rx->rcvbuf_max / 2);
+	if (bytes <= rx->rcvbuf) {
+		rx->rcvbuf_max = rx->rcvbuf;
+		return;
+	}
+
+	rx->rcvbuf = bytes;
+	rx->rcvbuf_grows++;
+}
+
+void rx_batch_init(struct rx_batch *rx)
+{
+	int i;
+
+	memset(rx, '\0', sizeof(*rx));
+	for (i = 0; i < MAX_BATCH; i++) {
+		rx->iov[i].iov_base = &rx->frames[i];
+		rx->iov[i].iov_len = CAN_MTU;
+		rx->msgs[i].msg_hdr.msg_iov = &rx->iov[i];
+		rx->msgs[i].msg_hdr.msg_iovlen = 1;
+		rx->msgs[i].msg_hdr.msg_name = &rx->addr[i];
+		rx->msgs[i].msg_hdr.msg_control = rx->ctrlmsg[i];
+	}
+}
+
+/* Pull in up to vlen frames that are already pending on the socket. This is
+ * only called after epoll has reported the socket readable, so it does not
+ * block. Returns the number of frames received, 0 if nothing was pending, or
+ * -1 on error.
+ */
+signed int rx_batch_recv(int sock, struct rx_batch *rx, unsigned int vlen)
+{
+	unsigned int i;
+	int nframes;
+
+	TRACE_BEGIN(t);
+
+	/* The kernel updates these on each receive, reset them to the full
+	 * size of the buffers before every call.
+	 */
+	for (i = 0; i < vlen; i++) {
+		rx->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_can);
+		rx->msgs[i].msg_hdr.msg_controllen = CTRLMSG_LEN;
+		rx->msgs[i].msg_hdr.msg_flags = 0;
+	}
+
+	nframes = recvmmsg(sock, rx->msgs, vlen, MSG_DONTWAIT, NULL);
+	TRACE_END(t, TRACE_RECV, nframes);
+	if (nframes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+
+	rx->calls_total++;
+	rx->frames_total += nframes;
+	for (i = 0; i < (unsigned int)nframes; i++) {
+		if (rx->msgs[i].msg_hdr.msg_flags & MSG_CONFIRM)
+			rx->echo_total++;
+	}
+
+	/* The drop count only ever goes up, the last frame has the latest */
+	if (nframes)
+		parse_rxq_ovfl(&rx->msgs[nframes - 1].msg_hdr, &rx->rxq_drops);
+
+	if (rx->rxq_drops != rx->rxq_seen) {
+		rx->rxq_seen = rx->rxq_drops;
+		if (rx->rcvbuf < rx->rcvbuf_max)
+			rx_batch_grow(sock, rx);
+	}
+
+	return nframes;
+}
+
+void tx_queue_init(struct tx_queue *tx)
+{
+	int i;
+
+	memset(tx, '\0', sizeof(*tx));
+	for (i = 0; i < MAX_BATCH; i++) {
+		tx->iov[i].iov_base = &tx->frames[i];
+		tx->iov[i].iov_len = CAN_MTU;
+		tx->msgs[i].msg_hdr.msg_iov = &tx->iov[i];
+		tx->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+/* Returns the next free frame in the queue, cleared, or NULL if the queue is
+ * full and needs to be flushed first.
+ */
+struct can_frame *tx_queue_next(struct tx_queue *tx)
+{
+	struct can_frame *frame;
+
+	if (tx->count >= MAX_BATCH)
+		return NULL;
+
+	tx->iov[tx->count].iov_len = CAN_MTU;
+	tx->msgs[tx->count].msg_hdr.msg_control = NULL;
+	tx->msgs[tx->count].msg_hdr.msg_controllen = 0;
+	frame = (struct can_frame *)&tx->frames[tx->count++];
+	memset(frame, '\0', sizeof(*frame));
+
+	return frame;
+}
+
+/* Same as tx_queue_next(), for a CAN FD frame. The port must have FD frames
+ * enabled for it to be sent.
+ */
+struct canfd_frame *tx_queue_next_fd(struct tx_queue *tx)
+{
+	struct canfd_frame *frame;
+
+	if (tx->count >= MAX_BATCH)
+		return NULL;
+
+	tx->iov[tx->count].iov_len = CANFD_MTU;
+	tx->msgs[tx->count].msg_hdr.msg_control = NULL;
+	tx->msgs[tx->count].msg_hdr.msg_controllen = 0;
+	frame = &tx->frames[tx->count++];
+	memset(frame, '\0', sizeof(*frame));
+
+	return frame;
+}
+
+/* Give the frame last queued a launch time, for a socket with SO_TXTIME set.
+ * The time is on the clock given to SO_TXTIME.
+ */
+void tx_queue_set_txtime(struct tx_queue *tx, uint64_t txtime_ns)
+{
+	struct msghdr *msg;
+	struct cmsghdr *cmsg;
+
+	if (!tx->count)
+		return;
+
+	msg = &tx->msgs[tx->count - 1].msg_hdr;
+	msg->msg_control = tx->ctrlmsg[tx->count - 1];
+	msg->msg_controllen = TX_CTRLMSG_LEN;
+	cmsg = CMSG_FIRSTHDR(msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_TXTIME;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(txtime_ns));
+	memcpy(CMSG_DATA(cmsg), &txtime_ns, sizeof(txtime_ns));
+}
+
+/* Move the frames from first on to the front of the queue */
+static void tx_queue_shift(struct tx_queue *tx, unsigned int first)
+{
+	struct msghdr *to, *from;
+	unsigned int i;
+
+	for (i = 0; first && first + i < tx->count; i++) {
+		tx->frames[i] = tx->frames[first + i];
+		tx->iov[i].iov_len = tx->iov[first + i].iov_len;
+
+		to = &tx->msgs[i].msg_hdr;
+		from = &tx->msgs[first + i].msg_hdr;
+		to->msg_control = NULL;
+		to->msg_controllen = from->msg_controllen;
+		if (from->msg_control) {
+			memcpy(tx->ctrlmsg[i], tx->ctrlmsg[first + i],
+			       TX_CTRLMSG_LEN);
+			to->msg_control = tx->ctrlmsg[i];
+		}
+	}
+	tx->count -= first;
+}
+
+/* How long to back off for before the next send, doubling with each send in
+ * a row that stopped short.
+ */
+static unsigned int tx_queue_backoff_us(const struct tx_queue *tx)
+{
+	unsigned int backoff_us = TX_BACKOFF_MIN_US;
+	unsigned int i;
+
+	for (i = 1; i < tx->stalls && backoff_us < TX_BACKOFF_MAX_US; i++)
+		backoff_us *= 2;
+
+	return backoff_us < TX_BACKOFF_MAX_US ? backoff_us : TX_BACKOFF_MAX_US;
+}
+
+/* Send as many queued frames as the kernel will take, without waiting. The
+ * kernel may accept only part of the queue in one call, in which case the
+ * rest is sent with further calls. If the interface is out of buffer space,
+ * the frames not sent stay queued, moved to the front, ahead of any queued
+ * after, to be sent again later. Once TX_RETRY_MAX sends in a row have sent
+ * none of them, they are dropped.
+ *
+ * Returns the number of frames sent, or -1 on any other error, which empties
+ * the queue.
+ */
+signed int tx_queue_send(int sock, struct tx_queue *tx)
+{
+	unsigned int sent = 0;
+	int nframes;
+
+	TRACE_BEGIN(t);
+	while (sent < tx->count) {
+		nframes = sendmmsg(sock, &tx->msgs[sent], tx->count - sent, 0);
+		if (nframes < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != ENOBUFS && errno != EAGAIN) {
+				tx->count = 0;
+				tx->stalls = 0;
+				return -1;
+			}
+			break;
+		}
+
+		tx->calls_total++;
+		tx->frames_total += nframes;
+		sent += nframes;
+	}
+	TRACE_END(t, TRACE_SEND, sent);
+
+	if (sent == tx->count) {
+		tx->count = 0;
+		tx->stalls = 0;
+		return sent;
+	}
+
+	tx->stalls = sent ? 1 : tx->stalls + 1;
+	if (tx->stalls > TX_RETRY_MAX) {
+		tx->dropped_total += tx->count - sent;
+		tx->count = 0;
+		tx->stalls = 0;
+		return sent;
+	}
+	tx->retries_total++;
+	tx_queue_shift(tx, sent);
+
+	return sent;
+}
+
+/* Send every queued frame, backing off and sending again while the interface
+ * is out of buffer space, until each is either sent or dropped. Either way,
+ * the queue is empty on return. This waits, so it is only for senders with
+ * nothing else to service meanwhile. Event handlers use can_port_flush().
+ *
+ * Returns the number of frames sent, or -1 on any other error.
+ */
+signed int tx_queue_flush(int sock, struct tx_queue *tx)
+{
+	struct timespec ts = { 0, 0 };
+	unsigned int sent = 0;
+	int nframes;
+
+	while (tx->count) {
+		nframes = tx_queue_send(sock, tx);
+		if (nframes < 0)
+			return -1;
+		sent += nframes;
+		if (!tx->count)
+			break;
+
+		ts.tv_nsec = tx_queue_backoff_us(tx) * 1000L;
+		nanosleep(&ts, NULL);
+	}
+
+	return sent;
+}
+
+/* Send what is queued on the port from its event handler, without waiting.
+ * Frames left queued for want of buffer space are sent again, first, from
+ * the handler being run by the loop once backed off, see evloop_retry().
+ * Until then, what is queued is left alone, so frames may still be queued
+ * on return.
+ *
+ * Returns the number of frames sent, or -1 on error.
+ */
+signed int can_port_flush(struct can_port *port)
+{
+	int sent;
+
+	if (!port->tx.count || evloop_retry_pending(&port->ev))
+		return 0;
+
+	sent = tx_queue_send(port->sock, &port->tx);
+	if (sent >= 0 && port->tx.count)
+		evloop_retry(&port->ev, tx_queue_backoff_us(&port->tx));
+
+	return sent;
+}
+
+/* Sockets waiting for a port to be opened on their name, the ends of
+ * socketpairs, or CAN sockets that were handed to us already bound.
+ */
+static struct {
+	char name[IFNAMSIZ];
+	int sock;
+	int bound;
+} local_socks[2 + MAX_INHERITED];
+static unsigned int nlocal;
+
+/* Have the next ports opened on name_a and name_b get the two ends of a
+ * socketpair rather than CAN sockets, connected to each other as if over a
+ * bus of their own, with no bit rate. Frames still go through the kernel,
+ * one datagram each, so the batching is the same as it is on a bus.
+ */
+signed int can_local_pair(const char *name_a, const char *name_b)
+{
+	int socks[2];
+
+	if (nlocal + 2 > ARRAY_SIZE(local_socks)) {
+		fprintf(stderr, "Too many local ports\n");
+		return -1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, socks) < 0) {
+		perror("Unable to create socketpair");
+		return -1;
+	}
+
+	strncpy(local_socks[nlocal].name, name_a, IFNAMSIZ-1);
+	local_socks[nlocal++].sock = socks[0];
+	strncpy(local_socks[nlocal].name, name_b, IFNAMSIZ-1);
+	local_socks[nlocal++].sock = socks[1];
+
+	return 0;
+}
+
+/* Have the next port opened on the interface sock is bound to use sock,
+ * rather than a socket of its own, for sockets passed to us already open
+ * by whatever started us. The interface name is written to iface.
+ */
+signed int can_inherit_sock(int sock, char *iface)
+{
+	struct sockaddr_can addr;
+	socklen_t len = sizeof(addr);
+	int type = 0, proto = 0;
+	socklen_t tlen = sizeof(type), plen = sizeof(proto);
+
+	if (nlocal >= ARRAY_SIZE(local_socks)) {
+		fprintf(stderr, "Too many inherited sockets\n");
+		return -1;
+	}
+
+	if (getsockname(sock, (struct sockaddr *)&addr, &len) < 0 ||
+	  getsockopt(sock, SOL_SOCKET, SO_TYPE, &type, &tlen) < 0 ||
+	  getsockopt(sock, SOL_SOCKET, SO_PROTOCOL, &proto, &plen) < 0 ||
+	  addr.can_family != AF_CAN || type != SOCK_RAW || proto != CAN_RAW) {
+		fprintf(stderr, "Inherited fd %d is not a raw CAN socket\n",
+			sock);
+		return -1;
+	}
+
+	if (!addr.can_ifindex || !if_indextoname(addr.can_ifindex, iface)) {
+		fprintf(stderr, "Inherited fd %d is not bound to an "
+			"interface\n", sock);
+		return -1;
+	}
+
+	strcpy(local_socks[nlocal].name, iface);
+	local_socks[nlocal].bound = 1;
+	local_socks[nlocal++].sock = sock;
+
+	return 0;
+}
+
+/* Hand over the socket waiting for a port on iface, if there is one, and
+ * whether it is a CAN socket that is already bound.
+ */
+static int take_local_sock(const char *iface, int *bound)
+{
+	unsigned int i;
+	int sock;
+
+	for (i = 0; i < nlocal; i++) {
+		if (local_socks[i].sock >= 0 &&
+		  !strncmp(local_socks[i].name, iface, IFNAMSIZ)) {
+			sock = local_socks[i].sock;
+			*bound = local_socks[i].bound;
+			local_socks[i].sock = -1;
+			return sock;
+		}
+	}
+
+	return -1;
+}
+
+/* Open a raw CAN socket on iface with the given filters. Filters are set
+ * before binding, so that no unwanted frames are queued in the short time
+ * between the two. The caller sets the event handler before adding the
+ * port to an event loop.
+ */
+signed int can_port_open(struct can_port *port, const char *iface,
+			 unsigned int batch,
+			 const struct can_filter *base, int nbase,
+			 const struct can_filter *base2, int nbase2,
+			 const struct can_filter *extra, int nextra)
+{
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+	int bound = 0;
+	int on = 1;
+
+	memset(port, '\0', sizeof(*port));
+	strncpy(port->iface, iface, IFNAMSIZ-1);
+	port->batch = batch;
+	rx_batch_init(&port->rx);
+	tx_queue_init(&port->tx);
+
+	port->sock = take_local_sock(iface, &bound);
+	if (port->sock >= 0 && !bound) {
+		port->local = 1;
+		port->ev.fd = port->sock;
+		port->ev.data = port;
+		return 0;
+	}
+
+	/* An inherited socket only needs its filters replaced */
+	if (port->sock < 0)
+		port->sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (port->sock < 0) {
+		perror("Error opening CAN socket");
+		return -1;
+	}
+
+	if (set_filters(port->sock, base, nbase, base2, nbase2, extra,
+	  nextra) < 0) {
+		can_port_close(port);
+		return -1;
+	}
+
+	/* Costs nothing unless frames are dropped */
+	if (setsockopt(port->sock, SOL_SOCKET, SO_RXQ_OVFL, &on,
+	  sizeof(on)) < 0) {
+		perror("Unable to enable SO_RXQ_OVFL");
+		can_port_close(port);
+		return -1;
+	}
+
+	port->bus_start = iface_rx_packets(iface);
+	port->iface_drops_start = iface_rx_drops(iface);
+	if (!bound && test_and_bind(port->sock, &ifr, &addr, iface) < 0) {
+		can_port_close(port);
+		return -1;
+	}
+
+	port->ev.fd = port->sock;
+	port->ev.data = port;
+
+	return 0;
+}
+
+/* Set the socket receive and transmit buffer sizes in bytes, either may be 0
+ * to leave it at the default. With rcvbuf_max, the receive buffer grows, up
+ * to that, whenever the socket drops frames.
+ */
+signed int can_port_set_buffers(struct can_port *port, int rcvbuf, int sndbuf,
+				int rcvbuf_max)
+{
+	socklen_t len = sizeof(port->rx.rcvbuf);
+
+	if (rcvbuf && set_sock_buf(port->sock, SO_RCVBUFFORCE, SO_RCVBUF,
+	  rcvbuf) < 0) {
+		fprintf(stderr, "Unable to set receive buffer on %s: ",
+			port->iface);
+		perror("");
+		return -1;
+	}
+
+	if (sndbuf && set_sock_buf(port->sock, SO_SNDBUFFORCE, SO_SNDBUF,
+	  sndbuf) < 0) {
+		fprintf(stderr, "Unable to set transmit buffer on %s: ",
+			port->iface);
+		perror("");
+		return -1;
+	}
+
+	if (getsockopt(port->sock, SOL_SOCKET, SO_RCVBUF, &port->rx.rcvbuf,
+	  &len) < 0) {
+		perror("Unable to get receive buffer size");
+		return -1;
+	}
+	port->rx.rcvbuf_max = rcvbuf_max;
+
+	return 0;
+}
+
+/* Send and receive CAN FD frames as well as classic ones. Fails if the
+ * interface is not FD capable, which shows as an MTU of CAN_MTU.
+ */
+static signed int enable_fd_frames(int sock, const char *iface)
+{
+	struct ifreq ifr;
+	int on = 1;
+
+	memset(&ifr, '\0', sizeof(ifr));
+	memcpy(ifr.ifr_name, iface, IFNAMSIZ);
+	if (ioctl(sock, SIOCGIFMTU, &ifr) < 0) {
+		fprintf(stderr, "Unable to get MTU of %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	if (ifr.ifr_mtu != CANFD_MTU) {
+		fprintf(stderr, "%s is not CAN FD capable\n", iface);
+		return -1;
+	}
+
+	if (setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on,
+	  sizeof(on)) < 0) {
+		fprintf(stderr, "Unable to enable CAN FD frames on %s: ",
+			iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* A local port passes a datagram of whatever length as a frame, FD or not */
+signed int can_port_enable_fd(struct can_port *port)
+{
+	int i;
+
+	if (!port->local && enable_fd_frames(port->sock, port->iface) < 0)
+		return -1;
+
+	for (i = 0; i < MAX_BATCH; i++)
+		port->rx.iov[i].iov_len = CANFD_MTU;
+	port->fd = 1;
+
+	return 0;
+}
+
+void can_port_close(struct can_port *port)
+{
+	if (port->sock >= 0)
+		close(port->sock);
+	port->sock = -1;
+}
+
+/* Errors that go away by themselves, the interface being down or, with
+ * restart-ms set, bus off until it restarts, and its queue being full.
+ */
+int can_port_transient_error(int err)
+{
+	return err == ENETDOWN || err == ENOBUFS;
+}
+
+/* Report errno for what was being done on the port. A transient error may
+ * well happen on every frame until it clears, so those are only reported
+ * every PORT_ERR_INTERVAL_NS, with a count of the ones in between. errno is
+ * left as it was, for the caller to decide whether to carry on.
+ */
+void can_port_error(struct can_port *port, const char *what)
+{
+	int err = errno;
+	uint64_t now_ns;
+
+	if (can_port_transient_error(err)) {
+		now_ns = monotonic_ns();
+		if (port->err_ns &&
+		  now_ns - port->err_ns < PORT_ERR_INTERVAL_NS) {
+			port->err_quiet++;
+			return;
+		}
+		port->err_ns = now_ns;
+	}
+
+	fprintf(stderr, "Error %s on %s: %s", what, port->iface,
+		strerror(err));
+	if (port->err_quiet)
+		fprintf(stderr, ", %llu more since last reported",
+			port->err_quiet);
+	fprintf(stderr, "\n");
+	port->err_quiet = 0;
+	errno = err;
+}
+
+/* Frames received and sent per syscall, and what reached the socket compared
+ * with everything the interface received since the port was opened. The
+ * rest was filtered out in the kernel. Our own frames looped back for
+ * timestamping are not from the bus, so are not counted.
+ */
+void can_port_print_stats(const struct can_port *port)
+{
+	const struct rx_batch *rx = &port->rx;
+	const struct tx_queue *tx = &port->tx;
+	unsigned long long bus = iface_rx_packets(port->iface) - port->bus_start;
+	unsigned long long user = rx->frames_total - rx->echo_total;
+	unsigned long long drops = iface_rx_drops(port->iface) -
+	  port->iface_drops_start;
+
+	/* Frames moved with io_uring are not counted as calls, see uring.h */
+	if (rx->calls_total || tx->calls_total || !rx->frames_total) {
+		fprintf(stderr, "%s: received %llu frames in %llu recvmmsg() "
+			"calls (%.2f frames per call)\n", port->iface,
+			rx->frames_total, rx->calls_total, rx->calls_total ?
+			(double)rx->frames_total / rx->calls_total : 0.0);
+		fprintf(stderr, "%s: sent %llu frames in %llu sendmmsg() calls "
+			"(%.2f frames per call), %llu retries, %llu dropped\n",
+			port->iface, tx->frames_total, tx->calls_total,
+			tx->calls_total ?
+			(double)tx->frames_total / tx->calls_total : 0.0,
+			tx->retries_total, tx->dropped_total);
+	} else {
+		fprintf(stderr, "%s: received %llu frames, sent %llu, %llu "
+			"retries, %llu dropped\n", port->iface,
+			rx->frames_total, tx->frames_total, tx->retries_total,
+			tx->dropped_total);
+	}
+
+	/* There is no interface behind a local port to compare with */
+	if (port->local)
+		return;
+
+	fprintf(stderr, "%s: %llu frames received by interface, %llu passed to "
+		"user space, %llu filtered in kernel\n", port->iface, bus, user,
+		bus > user ? bus - user : 0);
+	fprintf(stderr, "%s: %u frames dropped by the socket, not read in "
+		"time, %llu lost by the interface or controller\n",
+		port->iface, rx->rxq_drops, drops);
+	if (rx->rcvbuf_grows)
+		fprintf(stderr, "%s: receive buffer grown %u times, to %d "
+			"bytes\n", port->iface, rx->rcvbuf_grows, rx->rcvbuf);
+}
+
+/* Number of bits a classic CAN data frame occupies on the bus, including the
+ * interframe space. If worst_case is set, include the most stuff bits that
+ * could be needed, otherwise assume none are.
+ */
+unsigned int frame_bits(const struct can_frame *frame, int worst_case)
+{
+	unsigned int dlc = frame->can_dlc > CAN_MAX_DLEN ?
+	  CAN_MAX_DLEN : frame->can_dlc;
+	unsigned int stuffed;
+
+	/* SOF through CRC is subject to bit stuffing */
+	stuffed = (frame->can_id & CAN_EFF_FLAG) ? 54 : 34;
+	if (!(frame->can_id & CAN_RTR_FLAG))
+		stuffed += 8 * dlc;
+
+	/* CRC delimiter, ACK, EOF, and interframe space are not */
+	return stuffed + 13 + (worst_case ? (stuffed - 1) / 4 : 0);
+}
+
+/* Append the low n bits of val to the bit stream, most significant first */
+static unsigned int put_bits(uint8_t *bits, unsigned int pos, uint32_t val,
+			     unsigned int n)
+{
+	while (n--)
+		bits[pos++] = (val >> n) & 1;
+
+	return pos;
+}
+
+/* The exact number of stuff bits a classic data frame gets on the bus, with
+ * its own ID, data, and CRC, rather than the worst case. Frames padded with
+ * zeros, as OBD requests are, come close to the worst case, others need
+ * few.
+ */
+unsigned int frame_stuff_bits(const struct can_frame *frame)
+{
+	unsigned int dlc = frame->can_dlc > CAN_MAX_DLEN ?
+	  CAN_MAX_DLEN : frame->can_dlc;
+	int rtr = !!(frame->can_id & CAN_RTR_FLAG);
+	unsigned int n = 0, run = 0, stuff = 0;
+	uint8_t bits[160];
+	uint16_t crc = 0;
+	unsigned int i;
+	uint8_t last;
+
+	/* SOF, then the arbitration and control fields */
+	n = put_bits(bits, n, 0, 1);
+	if (frame->can_id & CAN_EFF_FLAG) {
+		n = put_bits(bits, n, (frame->can_id & CAN_EFF_MASK) >> 18, 11);
+		n = put_bits(bits, n, 3, 2);
+		n = put_bits(bits, n, frame->can_id & 0x3ffff, 18);
+		n = put_bits(bits, n, rtr << 2, 3);
+	} else {
+		n = put_bits(bits, n, frame->can_id & CAN_SFF_MASK, 11);
+		n = put_bits(bits, n, rtr << 2, 3);
+	}
+	n = put_bits(bits, n, frame->can_dlc & 0xf, 4);
+	if (!rtr) {
+		for (i = 0; i < dlc; i++)
+			n = put_bits(bits, n, frame->data[i], 8);
+	}
+
+	/* CRC-15 over all of the above */
+	for (i = 0; i < n; i++) {
+		if (bits[i] ^ (crc >> 14))
+			crc = ((crc << 1) ^ 0x4599) & 0x7fff;
+		else
+			crc = (crc << 1) & 0x7fff;
+	}
+	n = put_bits(bits, n, crc, 15);
+
+	/* After five bits the same, the complement is inserted, which then
+	 * counts towards the next run.
+	 */
+	last = bits[0];
+	for (i = 0; i < n; i++) {
+		if (bits[i] == last) {
+			run++;
+		} else {
+			last = bits[i];
+			run = 1;
+		}
+
+		if (run == 5) {
+			stuff++;
+			last = !last;
+			run = 1;
+		}
+	}
+
+	return stuff;
+}
+
+/* Time a frame occupies the bus, in ns. For an FD frame with BRS set, the
+ * data phase, from the BRS bit through the CRC delimiter, runs at dbitrate.
+ * Stuff bits are counted as in frame_bits(), with the fixed stuff bits of
+ * the FD stuff count and CRC always included.
+ */
+uint64_t frame_time_ns(const struct canfd_frame *frame, int fd, int worst_case,
+		       unsigned int bitrate, unsigned int dbitrate)
+{
+	unsigned int arb, data, len;
+
+	if (!fd)
+		return frame_bits((const struct can_frame *)frame, worst_case) *
+		  1000000000ULL / bitrate;
+
+	len = frame->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : frame->len;
+
+	/* SOF through BRS, then ACK, EOF, and interframe space */
+	arb = (frame->can_id & CAN_EFF_FLAG) ? 36 : 17;
+	if (worst_case)
+		arb += (arb - 1) / 4;
+	arb += 12;
+
+	/* ESI and DLC through data, then stuff count, CRC, and delimiter */
+	data = 5 + 8 * len;
+	if (worst_case)
+		data += data / 4;
+	data += len > 16 ? 4 + 21 + 7 + 1 : 4 + 17 + 6 + 1;
+
+	if (!(frame->flags & CANFD_BRS))
+		return (arb + data) * 1000000000ULL / bitrate;
+
+	return arb * 1000000000ULL / bitrate + data * 1000000000ULL / dbitrate;
+}
+
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return timespec_to_ns(&ts);
+}
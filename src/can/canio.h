@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* CAN socket plumbing shared by every mode of ets_can_test
+ *
+ * Built in to libetscan along with the event loop, etscan.h is the part of
+ * it meant for use outside of ets_can_test.
+ *
+ * Frames are received in batches with recvmmsg() and sent in batches with
+ * sendmmsg(). Each batch is a fixed set of slots, one msghdr, iovec, and
+ * frame per slot, set up once and reused for every call so that nothing is
+ * allocated while running.
+ */
+
+#ifndef __CANIO_H__
+#define __CANIO_H__
+
+#include <linux/can.h>
+#include <net/if.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/* Relies on struct timespec from time.h */
+#include <linux/errqueue.h>
+
+#include "evloop.h"
+#include "latency.h"
+
+struct stats;
+
+#define ARRAY_SIZE(x)	(sizeof(x) / sizeof((x)[0]))
+
+/* Timestamps pulled from the control messages of a received frame, either
+ * may be zero if not provided by the kernel or controller.
+ */
+struct rx_stamp {
+	struct timespec sw;
+	struct timespec hw;
+};
+
+/* Upper limit of frames that can be pulled in with a single recvmmsg() */
+#define MAX_BATCH	64
+
+#define CACHE_LINE	64
+
+/* Filters that may be added on the command line */
+#define MAX_FILTERS	16
+
+/* Transient errors on a port are reported at most this often */
+#define PORT_ERR_INTERVAL_NS	1000000000ULL
+
+/* Bound CAN sockets that can be passed to us ready to use, see
+ * can_inherit_sock()
+ */
+#define MAX_INHERITED	8
+
+/* Filters a port can be opened with, those for the mode plus --filter */
+#define MAX_PORT_FILTERS	(80 + MAX_FILTERS)
+
+/* Control message space for each received frame, large enough for either
+ * SO_TIMESTAMPING or SO_TIMESTAMPNS, plus the SO_RXQ_OVFL drop counter.
+ */
+#define CTRLMSG_LEN	(CMSG_SPACE(sizeof(struct scm_timestamping)) + \
+			 CMSG_SPACE(sizeof(__u32)))
+
+/* When the interface transmit queue is full, the kernel returns ENOBUFS
+ * rather than blocking. Back off and retry, doubling the wait each time,
+ * before giving up on the frames still queued. Event handlers have the loop
+ * retry for them, see can_port_flush(), rather than wait.
+ */
+#define TX_BACKOFF_MIN_US	100
+#define TX_BACKOFF_MAX_US	10000
+#define TX_RETRY_MAX		10
+
+/* Set of receive slots used for batched receive with recvmmsg(). Each frame
+ * gets its own msghdr, iovec, address, and control message space so that
+ * the kernel can fill all of them in one call.
+ *
+ * Frame slots, here and in the transmit queue, are sized for CAN FD. A
+ * classic frame uses the start of a slot, struct can_frame and struct
+ * canfd_frame share the same layout up to the first 8 data bytes.
+ */
+struct rx_batch {
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+	struct canfd_frame frames[MAX_BATCH];
+	struct sockaddr_can addr[MAX_BATCH];
+	char ctrlmsg[MAX_BATCH][CTRLMSG_LEN];
+
+	/* Receive buffer size in effect, and with rcvbuf_max set, the most it
+	 * may be grown to when the socket drops frames.
+	 */
+	int rcvbuf;
+	int rcvbuf_max;
+
+	/* Statistics. rxq_drops is the socket's SO_RXQ_OVFL count, frames the
+	 * socket dropped for want of room in the receive buffer, because they
+	 * were not read quickly enough.
+	 */
+	uint32_t rxq_drops;
+	uint32_t rxq_seen;
+	unsigned int rcvbuf_grows;
+	unsigned long long frames_total;
+	unsigned long long calls_total;
+	unsigned long long echo_total;
+};
+
+/* Control message space for each sent frame, for an SCM_TXTIME launch time */
+#define TX_CTRLMSG_LEN	CMSG_SPACE(sizeof(uint64_t))
+
+/* Set of transmit slots that frames are queued in before being sent with a
+ * single sendmmsg() call.
+ */
+struct tx_queue {
+	struct mmsghdr msgs[MAX_BATCH];
+	struct iovec iov[MAX_BATCH];
+	struct canfd_frame frames[MAX_BATCH];
+	char ctrlmsg[MAX_BATCH][TX_CTRLMSG_LEN];
+	unsigned int count;
+
+	/* Sends in a row that stopped short, the last sending nothing */
+	unsigned int stalls;
+
+	/* Statistics */
+	unsigned long long frames_total;
+	unsigned long long calls_total;
+	unsigned long long retries_total;
+	unsigned long long dropped_total;
+};
+
+/* One bound CAN socket with its own receive batch and transmit queue. The
+ * mode the port is used for sets the event handler, and whatever state that
+ * handler needs in priv.
+ *
+ * A local port is one end of a socketpair standing in for a bus, see
+ * can_local_pair(). It has no filters, only ever receives what the other
+ * end sends, and none of the CAN socket options, so there are no echoes of
+ * its own frames and no error frames.
+ *
+ * A port can also take over a CAN socket that was opened and bound before
+ * we were started, see can_inherit_sock(), which is then set up as though
+ * it were opened here, other than the bind.
+ *
+ * A port is only ever touched by the thread servicing it, statistics
+ * included. Ports are cache line aligned so that threads servicing
+ * neighbouring ports never write to the same line.
+ */
+struct can_port {
+	struct ev_source ev;
+	int sock;
+	char iface[IFNAMSIZ];
+	unsigned int batch;
+	int fd;
+	int local;
+	unsigned long long bus_start;
+	unsigned long long iface_drops_start;
+	unsigned int seed;
+	void *priv;
+	struct stats *stats;
+
+	/* When an error was last reported, and how many have not been since */
+	uint64_t err_ns;
+	unsigned long long err_quiet;
+
+	struct rx_batch rx;
+	struct tx_queue tx;
+} __attribute__((aligned(CACHE_LINE)));
+
+signed int test_and_bind(int sock, struct ifreq *ifr,
+			 struct sockaddr_can *addr, const char *iface);
+signed int set_filters(int sock, const struct can_filter *base, int nbase,
+		       const struct can_filter *base2, int nbase2,
+		       const struct can_filter *extra, int nextra);
+signed int parse_filter(const char *str, struct can_filter *filter);
+unsigned long long iface_stat(const char *iface, const char *name);
+unsigned long long iface_rx_packets(const char *iface);
+unsigned long long iface_rx_drops(const char *iface);
+
+signed int enable_timestamps(int sock);
+signed int enable_own_msgs(int sock);
+signed int enable_busy_poll(int sock, int usecs);
+signed int set_sock_buf(int sock, int force_opt, int opt, int bytes);
+void parse_cmsgs(struct msghdr *msg, struct rx_stamp *stamp);
+int record_latency(struct latency_hist *hist, const struct rx_stamp *start,
+		   const struct rx_stamp *end);
+
+void rx_batch_init(struct rx_batch *rx);
+signed int rx_batch_recv(int sock, struct rx_batch *rx, unsigned int vlen);
+void tx_queue_init(struct tx_queue *tx);
+struct can_frame *tx_queue_next(struct tx_queue *tx);
+struct canfd_frame *tx_queue_next_fd(struct tx_queue *tx);
+void tx_queue_set_txtime(struct tx_queue *tx, uint64_t txtime_ns);
+signed int tx_queue_send(int sock, struct tx_queue *tx);
+signed int tx_queue_flush(int sock, struct tx_queue *tx);
+
+signed int can_port_open(struct can_port *port, const char *iface,
+			 unsigned int batch,
+			 const struct can_filter *base, int nbase,
+			 const struct can_filter *base2, int nbase2,
+			 const struct can_filter *extra, int nextra);
+signed int can_local_pair(const char *name_a, const char *name_b);
+signed int can_inherit_sock(int sock, char *iface);
+signed int can_port_flush(struct can_port *port);
+signed int can_port_enable_fd(struct can_port *port);
+signed int can_port_set_buffers(struct can_port *port, int rcvbuf, int sndbuf,
+				int rcvbuf_max);
+void can_port_close(struct can_port *port);
+int can_port_transient_error(int err);
+void can_port_error(struct can_port *port, const char *what);
+void can_port_print_stats(const struct can_port *port);
+
+unsigned int frame_bits(const struct can_frame *frame, int worst_case);
+unsigned int frame_stuff_bits(const struct can_frame *frame);
+uint64_t frame_time_ns(const struct canfd_frame *frame, int fd, int worst_case,
+		       unsigned int bitrate, unsigned int dbitrate);
+uint64_t monotonic_ns(void);
+
+/* Received frame i as a classic frame, valid for FD frames up to 8 bytes */
+static inline struct can_frame *rx_batch_frame(struct rx_batch *rx, int i)
+{
+	return (struct can_frame *)&rx->frames[i];
+}
+
+static inline int rx_batch_is_fd(const struct rx_batch *rx, int i)
+{
+	return rx->msgs[i].msg_len == CANFD_MTU;
+}
+
+#endif /* __CANIO_H__ */
@@ -0,0 +1,671 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/can/gw.h>
+#include <linux/can/netlink.h>
+#include <linux/can/vxcan.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canlink.h"
+
+#define CANLINK_BUF_LEN		1024
+
+/* Room for everything the kernel reports about a link */
+#define CANLINK_REPLY_LEN	16384
+
+/* How often to check whether a link has joined the bus */
+#define CANLINK_POLL_NS		1000000L
+
+/* One rtnetlink request, built up an attribute at a time. Links are
+ * described by an ifinfomsg, gateway jobs by an rtcanmsg.
+ */
+struct canlink_req {
+	struct nlmsghdr nh;
+	union {
+		struct ifinfomsg ifi;
+		struct rtcanmsg rtc;
+	};
+	char attrs[CANLINK_BUF_LEN];
+};
+
+/* Called for each message the kernel answers a request with */
+typedef void (*reply_fn)(struct nlmsghdr *nh, void *arg);
+
+static struct rtattr *add_attr(struct canlink_req *req, unsigned short type,
+			       const void *data, unsigned short len)
+{
+	unsigned int off = NLMSG_ALIGN(req->nh.nlmsg_len);
+	struct rtattr *rta;
+
+	if (off + RTA_SPACE(len) > sizeof(*req))
+		return NULL;
+
+	rta = (struct rtattr *)((char *)req + off);
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (len)
+		memcpy(RTA_DATA(rta), data, len);
+	req->nh.nlmsg_len = off + RTA_SPACE(len);
+
+	return rta;
+}
+
+/* Nested attributes are added after the nest, then nest_end() sets the
+ * length of the nest to cover them.
+ */
+static void nest_end(struct canlink_req *req, struct rtattr *nest)
+{
+	nest->rta_len = (char *)req + req->nh.nlmsg_len - (char *)nest;
+}
+
+static void req_init(struct canlink_req *req, unsigned short type,
+		     unsigned short flags)
+{
+	memset(req, '\0', sizeof(*req));
+	req->nh.nlmsg_len = NLMSG_LENGTH(sizeof(req->ifi));
+	req->nh.nlmsg_type = type;
+	req->nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	req->ifi.ifi_family = AF_UNSPEC;
+}
+
+/* Send the request and wait for the kernel to acknowledge it, or for the
+ * end of a dump. Returns 0, or -1 with errno set to the error the kernel
+ * gave. Any messages the kernel answers with before that are passed to fn,
+ * if given.
+ */
+static signed int req_send(struct canlink_req *req, reply_fn fn, void *arg)
+{
+	struct sockaddr_nl addr = { .nl_family = AF_NETLINK };
+	char buf[CANLINK_REPLY_LEN];
+	struct nlmsgerr *err;
+	struct nlmsghdr *nh;
+	int sock, len;
+
+	sock = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (sock < 0)
+		return -1;
+
+	if (sendto(sock, req, req->nh.nlmsg_len, 0, (struct sockaddr *)&addr,
+	  sizeof(addr)) < 0) {
+		close(sock);
+		return -1;
+	}
+
+	for (;;) {
+		len = recv(sock, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			close(sock);
+			return -1;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, (unsigned)len);
+		  nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == NLMSG_DONE) {
+				close(sock);
+				return 0;
+			}
+
+			if (nh->nlmsg_type != NLMSG_ERROR) {
+				if (fn)
+					fn(nh, arg);
+				continue;
+			}
+
+			err = NLMSG_DATA(nh);
+			close(sock);
+			if (err->error) {
+				errno = -err->error;
+				return -1;
+			}
+			return 0;
+		}
+	}
+}
+
+/* The peer of a vxcan interface is described by an ifinfomsg of its own,
+ * followed by its attributes.
+ */
+static signed int add_linkinfo(struct canlink_req *req, const char *kind,
+			       const char *peer)
+{
+	struct rtattr *linkinfo, *data, *peerinfo;
+	struct ifinfomsg peer_ifi;
+
+	linkinfo = add_attr(req, IFLA_LINKINFO, NULL, 0);
+	if (!linkinfo || !add_attr(req, IFLA_INFO_KIND, kind, strlen(kind)))
+		return -1;
+
+	if (peer) {
+		memset(&peer_ifi, '\0', sizeof(peer_ifi));
+		peer_ifi.ifi_family = AF_UNSPEC;
+
+		data = add_attr(req, IFLA_INFO_DATA, NULL, 0);
+		if (!data)
+			return -1;
+		peerinfo = add_attr(req, VXCAN_INFO_PEER, &peer_ifi,
+				    sizeof(peer_ifi));
+		if (!peerinfo ||
+		  !add_attr(req, IFLA_IFNAME, peer, strlen(peer) + 1))
+			return -1;
+		nest_end(req, peerinfo);
+		nest_end(req, data);
+	}
+	nest_end(req, linkinfo);
+
+	return 0;
+}
+
+/* Create iface as a kind interface, "vcan" or "vxcan". A vxcan interface is
+ * created along with its peer, the other end of the pair. An interface that
+ * already exists is used as it is.
+ */
+signed int canlink_create(const char *iface, const char *kind,
+			  const char *peer)
+{
+	struct canlink_req req;
+
+	req_init(&req, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL);
+	if (!add_attr(&req, IFLA_IFNAME, iface, strlen(iface) + 1) ||
+	  add_linkinfo(&req, kind, peer) < 0) {
+		fprintf(stderr, "Interface names too long for %s\n", iface);
+		return -1;
+	}
+
+	if (req_send(&req, NULL, NULL) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Unable to create %s interface %s: ", kind,
+			iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+static signed int set_flags(const char *iface, unsigned int flags)
+{
+	struct canlink_req req;
+
+	req_init(&req, RTM_NEWLINK, 0);
+	req.ifi.ifi_index = if_nametoindex(iface);
+	if (!req.ifi.ifi_index) {
+		fprintf(stderr, "Unable to find iface %s: ", iface);
+		perror("");
+		return -1;
+	}
+	req.ifi.ifi_flags = flags;
+	req.ifi.ifi_change = IFF_UP;
+
+	if (req_send(&req, NULL, NULL) < 0) {
+		fprintf(stderr, "Unable to bring %s %s: ", iface,
+			flags & IFF_UP ? "up" : "down");
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+signed int canlink_set_up(const char *iface)
+{
+	return set_flags(iface, IFF_UP);
+}
+
+/* The first attribute of type in the len bytes of attributes at rta */
+static struct rtattr *find_attr(struct rtattr *rta, int len,
+				unsigned short type)
+{
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == type)
+			return rta;
+	}
+
+	return NULL;
+}
+
+/* Copy out a fixed size attribute, if it is there and big enough */
+static int get_attr(struct rtattr *data, unsigned short type, void *val,
+		    size_t len)
+{
+	struct rtattr *rta;
+
+	rta = find_attr(RTA_DATA(data), RTA_PAYLOAD(data), type);
+	if (!rta || RTA_PAYLOAD(rta) < len)
+		return 0;
+	memcpy(val, RTA_DATA(rta), len);
+
+	return 1;
+}
+
+/* What the kernel has for a link */
+struct link_state {
+	unsigned int flags;
+	int can;
+	struct can_bittiming bt;
+	struct can_bittiming dbt;
+	struct can_ctrlmode ctrlmode;
+	uint32_t restart_ms;
+	uint32_t state;
+};
+
+/* Fill in a link_state from the kernel's description of a link */
+static void parse_link(struct nlmsghdr *nh, void *arg)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+	struct link_state *ls = arg;
+	struct rtattr *linkinfo, *data;
+	int len;
+
+	len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*ifi));
+	if (nh->nlmsg_type != RTM_NEWLINK || len <= 0)
+		return;
+	ls->flags = ifi->ifi_flags;
+
+	linkinfo = find_attr(IFLA_RTA(ifi), len, IFLA_LINKINFO);
+	if (!linkinfo)
+		return;
+	data = find_attr(RTA_DATA(linkinfo), RTA_PAYLOAD(linkinfo),
+			 IFLA_INFO_DATA);
+	if (!data)
+		return;
+
+	ls->can = get_attr(data, IFLA_CAN_BITTIMING, &ls->bt, sizeof(ls->bt));
+	get_attr(data, IFLA_CAN_DATA_BITTIMING, &ls->dbt, sizeof(ls->dbt));
+	get_attr(data, IFLA_CAN_CTRLMODE, &ls->ctrlmode,
+		 sizeof(ls->ctrlmode));
+	get_attr(data, IFLA_CAN_RESTART_MS, &ls->restart_ms,
+		 sizeof(ls->restart_ms));
+	get_attr(data, IFLA_CAN_STATE, &ls->state, sizeof(ls->state));
+}
+
+/* Fetch the flags and, for a CAN interface, the settings and state of
+ * iface. Anything the interface does not have is left zeroed, with can
+ * clear for an interface that has none of them, as with vcan.
+ */
+static signed int get_link(const char *iface, struct link_state *ls)
+{
+	struct canlink_req req;
+
+	memset(ls, '\0', sizeof(*ls));
+
+	req_init(&req, RTM_GETLINK, 0);
+	req.ifi.ifi_index = if_nametoindex(iface);
+	if (!req.ifi.ifi_index) {
+		fprintf(stderr, "Unable to find iface %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	if (req_send(&req, parse_link, ls) < 0) {
+		fprintf(stderr, "Unable to get link settings of %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Look up the nominal and FD data phase bit rates iface is configured for.
+ * Either is left at 0 when the interface has none, as with vcan, or when FD
+ * is not enabled. Needs no privileges.
+ */
+signed int canlink_get_bitrate(const char *iface, unsigned int *bitrate,
+			       unsigned int *dbitrate)
+{
+	struct link_state ls;
+
+	*bitrate = 0;
+	*dbitrate = 0;
+
+	if (get_link(iface, &ls) < 0)
+		return -1;
+
+	*bitrate = ls.bt.bitrate;
+	if (ls.ctrlmode.flags & CAN_CTRLMODE_FD)
+		*dbitrate = ls.dbt.bitrate;
+
+	return 0;
+}
+
+/* Whether the link is already set up as cfg asks, so need not be touched */
+static int link_matches(const struct link_state *ls,
+			const struct canlink_cfg *cfg)
+{
+	int fd = !!(ls->ctrlmode.flags & CAN_CTRLMODE_FD);
+
+	if (ls->bt.bitrate != cfg->bitrate || fd != cfg->fd ||
+	  ls->restart_ms != cfg->restart_ms)
+		return 0;
+	if (cfg->sample_point && ls->bt.sample_point != cfg->sample_point)
+		return 0;
+	if (cfg->fd && (ls->dbt.bitrate != cfg->dbitrate ||
+	  (cfg->dsample_point && ls->dbt.sample_point != cfg->dsample_point)))
+		return 0;
+
+	return 1;
+}
+
+static signed int set_bittiming(const char *iface,
+				const struct canlink_cfg *cfg)
+{
+	struct can_ctrlmode ctrlmode = {
+		.mask = CAN_CTRLMODE_FD,
+		.flags = cfg->fd ? CAN_CTRLMODE_FD : 0,
+	};
+	struct rtattr *linkinfo, *data;
+	struct can_bittiming bt;
+	struct canlink_req req;
+	uint32_t restart_ms = cfg->restart_ms;
+	int ok;
+
+	req_init(&req, RTM_NEWLINK, 0);
+	req.ifi.ifi_index = if_nametoindex(iface);
+	if (!req.ifi.ifi_index) {
+		fprintf(stderr, "Unable to find iface %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	/* With only the bit rate and sample point given, the driver works
+	 * out the rest of the timing itself.
+	 */
+	linkinfo = add_attr(&req, IFLA_LINKINFO, NULL, 0);
+	ok = linkinfo && add_attr(&req, IFLA_INFO_KIND, "can", 3);
+	data = ok ? add_attr(&req, IFLA_INFO_DATA, NULL, 0) : NULL;
+
+	memset(&bt, '\0', sizeof(bt));
+	bt.bitrate = cfg->bitrate;
+	bt.sample_point = cfg->sample_point;
+	ok = data && add_attr(&req, IFLA_CAN_BITTIMING, &bt, sizeof(bt));
+
+	if (ok && cfg->fd) {
+		memset(&bt, '\0', sizeof(bt));
+		bt.bitrate = cfg->dbitrate;
+		bt.sample_point = cfg->dsample_point;
+		ok = !!add_attr(&req, IFLA_CAN_DATA_BITTIMING, &bt, sizeof(bt));
+	}
+
+	ok = ok && add_attr(&req, IFLA_CAN_CTRLMODE, &ctrlmode,
+			    sizeof(ctrlmode)) &&
+	  add_attr(&req, IFLA_CAN_RESTART_MS, &restart_ms, sizeof(restart_ms));
+	if (!ok) {
+		fprintf(stderr, "Link settings too long for %s\n", iface);
+		return -1;
+	}
+	nest_end(&req, data);
+	nest_end(&req, linkinfo);
+
+	if (req_send(&req, NULL, NULL) < 0) {
+		fprintf(stderr, "Unable to set the bit timing of %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+static const char *state_name(uint32_t state)
+{
+	static const char *names[] = {
+		[CAN_STATE_ERROR_ACTIVE] = "ERROR-ACTIVE",
+		[CAN_STATE_ERROR_WARNING] = "ERROR-WARNING",
+		[CAN_STATE_ERROR_PASSIVE] = "ERROR-PASSIVE",
+		[CAN_STATE_BUS_OFF] = "BUS-OFF",
+		[CAN_STATE_STOPPED] = "STOPPED",
+		[CAN_STATE_SLEEPING] = "SLEEPING",
+	};
+
+	return state < CAN_STATE_MAX ? names[state] : "UNKNOWN";
+}
+
+static uint64_t mono_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/* Poll until the controller has joined the bus. The kernel sends no
+ * notification for a change of CAN state, so there is nothing to wait on.
+ */
+static signed int wait_active(const char *iface, unsigned int timeout_ms)
+{
+	struct timespec ts = { .tv_nsec = CANLINK_POLL_NS };
+	uint64_t deadline_ms = mono_ms() + timeout_ms;
+	struct link_state ls;
+
+	for (;;) {
+		if (get_link(iface, &ls) < 0)
+			return -1;
+		if ((ls.flags & IFF_UP) && ls.state == CAN_STATE_ERROR_ACTIVE)
+			return 0;
+
+		if (mono_ms() >= deadline_ms) {
+			fprintf(stderr, "%s did not become ERROR-ACTIVE within "
+				"%u ms, it is %s\n", iface, timeout_ms,
+				(ls.flags & IFF_UP) ? state_name(ls.state) :
+				"down");
+			return -1;
+		}
+		nanosleep(&ts, NULL);
+	}
+}
+
+/* Configure a CAN interface as cfg asks, bring it up, and wait for it to
+ * become ERROR-ACTIVE. The bit timing can only be changed with the link
+ * down, so a link that is up with other settings is first taken down, but
+ * one already set up as asked is left as it is, saving the restart of the
+ * controller.
+ */
+signed int canlink_setup(const char *iface, const struct canlink_cfg *cfg)
+{
+	struct link_state ls;
+
+	if (get_link(iface, &ls) < 0)
+		return -1;
+
+	if (!ls.can) {
+		fprintf(stderr, "%s has no bit timing to configure\n", iface);
+		return -1;
+	}
+
+	if (!link_matches(&ls, cfg)) {
+		if ((ls.flags & IFF_UP) && set_flags(iface, 0) < 0)
+			return -1;
+		ls.flags &= ~IFF_UP;
+		if (set_bittiming(iface, cfg) < 0)
+			return -1;
+	}
+
+	if (!(ls.flags & IFF_UP) && set_flags(iface, IFF_UP) < 0)
+		return -1;
+
+	return wait_active(iface, cfg->timeout_ms);
+}
+
+static void gw_req_init(struct canlink_req *req, unsigned short type,
+			unsigned short flags)
+{
+	req_init(req, type, flags);
+	req->nh.nlmsg_len = NLMSG_LENGTH(sizeof(req->rtc));
+	req->rtc.can_family = AF_CAN;
+	req->rtc.gwtype = CGW_TYPE_CAN_CAN;
+}
+
+/* The same request both adds and removes a job, the kernel finds the job
+ * to remove by everything it was added with.
+ */
+static signed int gw_build(struct canlink_req *req, unsigned short type,
+			   const struct canlink_gw *gw)
+{
+	struct cgw_frame_mod mod;
+	uint32_t src, dst;
+
+	src = if_nametoindex(gw->src);
+	dst = if_nametoindex(gw->dst);
+	if (!src || !dst) {
+		fprintf(stderr, "Unable to find iface %s: ", src ? gw->dst :
+			gw->src);
+		perror("");
+		return -1;
+	}
+
+	gw_req_init(req, type, type == RTM_NEWROUTE ? NLM_F_CREATE : 0);
+
+	/* Applied in this order, AND clears the bits to rewrite, then OR sets
+	 * them.
+	 */
+	if (gw->rewrite) {
+		memset(&mod, '\0', sizeof(mod));
+		mod.modtype = CGW_MOD_ID;
+		mod.cf.can_id = gw->id_and;
+		add_attr(req, CGW_MOD_AND, &mod, sizeof(mod));
+		mod.cf.can_id = gw->id_or;
+		add_attr(req, CGW_MOD_OR, &mod, sizeof(mod));
+	}
+
+	add_attr(req, CGW_SRC_IF, &src, sizeof(src));
+	add_attr(req, CGW_DST_IF, &dst, sizeof(dst));
+	add_attr(req, CGW_FILTER, &gw->filter, sizeof(gw->filter));
+
+	return 0;
+}
+
+/* Have the kernel forward frames as gw describes, without them ever
+ * reaching userspace. Needs the can-gw module and CAP_NET_ADMIN.
+ */
+signed int canlink_gw_add(const struct canlink_gw *gw)
+{
+	struct canlink_req req;
+
+	if (gw_build(&req, RTM_NEWROUTE, gw) < 0)
+		return -1;
+
+	if (req_send(&req, NULL, NULL) < 0) {
+		fprintf(stderr, "Unable to add CAN_GW job from %s to %s: ",
+			gw->src, gw->dst);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+signed int canlink_gw_del(const struct canlink_gw *gw)
+{
+	struct canlink_req req;
+
+	if (gw_build(&req, RTM_DELROUTE, gw) < 0)
+		return -1;
+
+	if (req_send(&req, NULL, NULL) < 0) {
+		fprintf(stderr, "Unable to remove CAN_GW job from %s to %s: ",
+			gw->src, gw->dst);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct gw_match {
+	const struct canlink_gw *gw;
+	uint32_t src, dst;
+	unsigned long long handled;
+	unsigned long long dropped;
+	int found;
+};
+
+/* Pick our job out of the dump of every job, by its interfaces, filter,
+ * and rewrite.
+ */
+static void parse_gw(struct nlmsghdr *nh, void *arg)
+{
+	struct rtcanmsg *rtc = NLMSG_DATA(nh);
+	struct gw_match *m = arg;
+	struct rtattr *rta = (struct rtattr *)((char *)rtc +
+	  NLMSG_ALIGN(sizeof(*rtc)));
+	struct can_filter filter;
+	struct cgw_frame_mod mod;
+	uint32_t src = 0, dst = 0, handled = 0, dropped = 0;
+	canid_t id_or = 0;
+	int len;
+
+	len = nh->nlmsg_len - NLMSG_LENGTH(sizeof(*rtc));
+	if (nh->nlmsg_type != RTM_NEWROUTE || len <= 0)
+		return;
+
+	memset(&filter, '\0', sizeof(filter));
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == CGW_SRC_IF &&
+		  RTA_PAYLOAD(rta) >= sizeof(src))
+			memcpy(&src, RTA_DATA(rta), sizeof(src));
+		else if (rta->rta_type == CGW_DST_IF &&
+		  RTA_PAYLOAD(rta) >= sizeof(dst))
+			memcpy(&dst, RTA_DATA(rta), sizeof(dst));
+		else if (rta->rta_type == CGW_FILTER &&
+		  RTA_PAYLOAD(rta) >= sizeof(filter))
+			memcpy(&filter, RTA_DATA(rta), sizeof(filter));
+		else if (rta->rta_type == CGW_MOD_OR &&
+		  RTA_PAYLOAD(rta) >= sizeof(mod)) {
+			memcpy(&mod, RTA_DATA(rta), sizeof(mod));
+			id_or = mod.cf.can_id;
+		} else if (rta->rta_type == CGW_HANDLED &&
+		  RTA_PAYLOAD(rta) >= sizeof(handled))
+			memcpy(&handled, RTA_DATA(rta), sizeof(handled));
+		else if (rta->rta_type == CGW_DROPPED &&
+		  RTA_PAYLOAD(rta) >= sizeof(dropped))
+			memcpy(&dropped, RTA_DATA(rta), sizeof(dropped));
+	}
+
+	if (src != m->src || dst != m->dst ||
+	  filter.can_id != m->gw->filter.can_id ||
+	  filter.can_mask != m->gw->filter.can_mask ||
+	  id_or != (m->gw->rewrite ? m->gw->id_or : 0))
+		return;
+
+	m->handled = handled;
+	m->dropped = dropped;
+	m->found = 1;
+}
+
+/* Frames the kernel has forwarded for a job, and dropped for want of room
+ * on the destination.
+ */
+signed int canlink_gw_counters(const struct canlink_gw *gw,
+			       unsigned long long *handled,
+			       unsigned long long *dropped)
+{
+	struct gw_match m = { .gw = gw };
+	struct canlink_req req;
+
+	m.src = if_nametoindex(gw->src);
+	m.dst = if_nametoindex(gw->dst);
+	gw_req_init(&req, RTM_GETROUTE, NLM_F_DUMP);
+	if (req_send(&req, parse_gw, &m) < 0) {
+		perror("Unable to list CAN_GW jobs");
+		return -1;
+	}
+
+	if (!m.found) {
+		fprintf(stderr, "CAN_GW job from %s to %s has gone\n", gw->src,
+			gw->dst);
+		return -1;
+	}
+	*handled = m.handled;
+	*dropped = m.dropped;
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* CAN interface management over rtnetlink
+ *
+ * Creates virtual CAN interfaces for testing without hardware, and brings
+ * interfaces up. A vcan interface is a bus of its own that every socket on
+ * it shares, a vxcan pair is two interfaces joined like the two ends of a
+ * cable, frames sent on one are received on the other.
+ *
+ * Also reads back the bit rates of a real CAN interface, for anything that
+ * needs to know how long a frame takes on the bus, and sets up a real CAN
+ * interface at startup, so the tool can be serving as soon as the
+ * controller joins the bus without an "ip link" script ahead of it.
+ *
+ * Jobs for the kernel's CAN gateway, CAN_GW, are added and removed here too,
+ * for the bridge to hand rules to the kernel where it can.
+ *
+ * Creating and changing interfaces needs CAP_NET_ADMIN.
+ */
+
+#ifndef __CANLINK_H__
+#define __CANLINK_H__
+
+#include <linux/can.h>
+#include <net/if.h>
+#include <stdint.h>
+
+/* Time allowed by default for a link to become ERROR-ACTIVE */
+#define CANLINK_TIMEOUT_MS	1000
+
+/* Sample points are in tenths of a percent, 875 for 87.5%, or 0 to let the
+ * driver choose. The data phase settings are only used with fd set.
+ */
+struct canlink_cfg {
+	unsigned int bitrate;
+	unsigned int sample_point;
+	unsigned int dbitrate;
+	unsigned int dsample_point;
+	int fd;
+	uint32_t restart_ms;
+	unsigned int timeout_ms;
+};
+
+signed int canlink_create(const char *iface, const char *kind,
+			  const char *peer);
+signed int canlink_set_up(const char *iface);
+signed int canlink_get_bitrate(const char *iface, unsigned int *bitrate,
+			       unsigned int *dbitrate);
+signed int canlink_setup(const char *iface, const struct canlink_cfg *cfg);
+
+/* A kernel CAN_GW job, forwarding frames from src that match filter to dst.
+ * With rewrite set, the ID bits set in id_and are kept and id_or is set in
+ * the rest.
+ */
+struct canlink_gw {
+	char src[IFNAMSIZ];
+	char dst[IFNAMSIZ];
+	struct can_filter filter;
+	int rewrite;
+	canid_t id_and;
+	canid_t id_or;
+};
+
+signed int canlink_gw_add(const struct canlink_gw *gw);
+signed int canlink_gw_del(const struct canlink_gw *gw);
+signed int canlink_gw_counters(const struct canlink_gw *gw,
+			       unsigned long long *handled,
+			       unsigned long long *dropped);
+
+#endif /* __CANLINK_H__ */
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "canlog.h"
+
+/* Count a record appended at offset, and add an index entry for it if it is
+ * the first one of a new CANLOG_INDEX_NS period. Returns -1 if the index
+ * could not grow, the record is still counted.
+ */
+signed int canlog_index_add(struct canlog_indexer *ix, uint64_t ts_ns,
+			    uint64_t offset)
+{
+	struct canlog_index *entries;
+	size_t size;
+
+	ix->nrecs++;
+	if (ix->n && ts_ns < ix->next_ns)
+		return 0;
+
+	if (ix->n == ix->size) {
+		size = ix->size ? ix->size * 2 : 1024;
+		entries = realloc(ix->entries, size * sizeof(*entries));
+		if (!entries)
+			return -1;
+		ix->entries = entries;
+		ix->size = size;
+	}
+
+	ix->entries[ix->n].ts_ns = htole64(ts_ns);
+	ix->entries[ix->n].offset = htole64(offset);
+	ix->n++;
+	ix->next_ns = ts_ns - (ts_ns % CANLOG_INDEX_NS) + CANLOG_INDEX_NS;
+
+	return 0;
+}
+
+static signed int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* Append the index and footer, index_off being where the records end */
+signed int canlog_write_index(int fd, const struct canlog_indexer *ix,
+			      uint64_t index_off)
+{
+	struct canlog_footer footer;
+
+	memset(&footer, '\0', sizeof(footer));
+	footer.index_off = htole64(index_off);
+	footer.nindex = htole64(ix->n);
+	footer.nrecs = htole64(ix->nrecs);
+	memcpy(footer.magic, CANLOG_INDEX_MAGIC, sizeof(footer.magic));
+
+	if (write_all(fd, ix->entries, ix->n * sizeof(*ix->entries)) < 0 ||
+	  write_all(fd, &footer, sizeof(footer)) < 0) {
+		perror("Unable to write log index");
+		return -1;
+	}
+
+	return 0;
+}
+
+void canlog_indexer_free(struct canlog_indexer *ix)
+{
+	free(ix->entries);
+	memset(ix, '\0', sizeof(*ix));
+}
+
+/* Use the index at the end of the log if there is a valid one */
+static int canlog_find_index(struct canlog *log)
+{
+	const struct canlog_footer *footer;
+	uint64_t off, n;
+
+	if (log->map_len < log->rec_start + sizeof(*footer))
+		return 0;
+
+	footer = (const void *)(log->map + log->map_len - sizeof(*footer));
+	if (memcmp(footer->magic, CANLOG_INDEX_MAGIC, sizeof(footer->magic)))
+		return 0;
+
+	off = le64toh(footer->index_off);
+	n = le64toh(footer->nindex);
+	if (off < log->rec_start || off > log->map_len ||
+	  n > (log->map_len - off) / sizeof(struct canlog_index) ||
+	  off + n * sizeof(struct canlog_index) + sizeof(*footer) !=
+	  log->map_len)
+		return 0;
+
+	log->index = (const void *)(log->map + off);
+	log->nindex = n;
+	log->nrecs = le64toh(footer->nrecs);
+	log->rec_end = off;
+
+	return 1;
+}
+
+/* No index, the capture was cut short. One pass over the records rebuilds
+ * it, and finds where the last complete record ends.
+ */
+static signed int canlog_build_index(struct canlog *log)
+{
+	const struct canlog_rec *rec;
+	size_t pos = log->rec_start;
+	size_t off;
+
+	log->rec_end = log->map_len;
+	for (;;) {
+		off = pos;
+		rec = canlog_next(log, &pos);
+		if (!rec)
+			break;
+		if (canlog_index_add(&log->built, le64toh(rec->ts_ns), off) < 0) {
+			perror("Unable to build log index");
+			return -1;
+		}
+	}
+	log->rec_end = off;
+
+	log->index = log->built.entries;
+	log->nindex = log->built.n;
+	log->nrecs = log->built.nrecs;
+
+	return 0;
+}
+
+signed int canlog_open(struct canlog *log, const char *path)
+{
+	struct stat st;
+
+	memset(log, '\0', sizeof(*log));
+	log->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (log->fd < 0 || fstat(log->fd, &st) < 0) {
+		fprintf(stderr, "Unable to open %s: ", path);
+		perror("");
+		return -1;
+	}
+
+	if ((size_t)st.st_size < sizeof(struct canlog_hdr)) {
+		fprintf(stderr, "%s is too short to be a CAN log\n", path);
+		return -1;
+	}
+
+	log->map_len = st.st_size;
+	log->map = mmap(NULL, log->map_len, PROT_READ, MAP_SHARED, log->fd, 0);
+	if (log->map == MAP_FAILED) {
+		log->map = NULL;
+		fprintf(stderr, "Unable to map %s: ", path);
+		perror("");
+		return -1;
+	}
+	madvise((void *)log->map, log->map_len, MADV_SEQUENTIAL);
+
+	log->hdr = (const void *)log->map;
+	log->rec_start = le32toh(log->hdr->hdr_len);
+	if (memcmp(log->hdr->magic, CANLOG_MAGIC, sizeof(log->hdr->magic)) ||
+	  le32toh(log->hdr->version) != CANLOG_VERSION ||
+	  log->rec_start < sizeof(struct canlog_hdr) ||
+	  log->rec_start > log->map_len) {
+		fprintf(stderr, "%s is not a version %d CAN log\n", path,
+			CANLOG_VERSION);
+		return -1;
+	}
+
+	if (!canlog_find_index(log)) {
+		fprintf(stderr, "%s has no index, scanning it\n", path);
+		if (canlog_build_index(log) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Offset of the first record at or after ts_ns. The index finds the period
+ * it falls in, and only the records within that are looked at.
+ */
+size_t canlog_seek(const struct canlog *log, uint64_t ts_ns)
+{
+	const struct canlog_rec *rec;
+	size_t lo = 0, hi = log->nindex, mid;
+	size_t pos = log->rec_start;
+	size_t off;
+
+	/* Last entry at or before ts_ns */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (le64toh(log->index[mid].ts_ns) <= ts_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo)
+		pos = le64toh(log->index[lo - 1].offset);
+
+	for (;;) {
+		off = pos;
+		rec = canlog_next(log, &pos);
+		if (!rec || le64toh(rec->ts_ns) >= ts_ns)
+			return off;
+	}
+}
+
+/* Record at *pos, advancing *pos past it, or NULL at the end of the log */
+const struct canlog_rec *canlog_next(const struct canlog *log, size_t *pos)
+{
+	const struct canlog_rec *rec;
+	size_t size;
+
+	if (*pos + sizeof(*rec) > log->rec_end)
+		return NULL;
+
+	rec = (const void *)(log->map + *pos);
+	size = canlog_rec_size(rec->len);
+	if (*pos + size > log->rec_end)
+		return NULL;
+	*pos += size;
+
+	return rec;
+}
+
+void canlog_close(struct canlog *log)
+{
+	if (log->map)
+		munmap((void *)log->map, log->map_len);
+	if (log->fd >= 0)
+		close(log->fd);
+	log->map = NULL;
+	log->fd = -1;
+	canlog_indexer_free(&log->built);
+}
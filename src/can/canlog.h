@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Binary CAN log format
+ *
+ * A log is a fixed size file header followed by packed, variable length
+ * records: a 16 byte record header, then only as many data bytes as the
+ * frame carried. A classic frame with 8 data bytes takes 24 bytes on disk,
+ * against around 40 for the same frame as a line of candump text, and needs
+ * no parsing to read back.
+ *
+ * All fields are little endian. Timestamps are CLOCK_REALTIME in ns, so a
+ * log can be lined up with logs from other machines.
+ *
+ * Once a capture is finished, a time index is appended after the records,
+ * an entry for every CANLOG_INDEX_NS of capture giving the timestamp and the
+ * file offset of the first record from then on, and then a fixed size
+ * footer pointing back to the index. A reader can mmap a log of any size
+ * and binary search the index to start at any time without reading what
+ * comes before it. A log cut short, without a footer, is still readable,
+ * the index is then rebuilt with one pass over the records.
+ */
+
+#ifndef __CANLOG_H__
+#define __CANLOG_H__
+
+#include <net/if.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CANLOG_MAGIC		"ETSCANLG"
+#define CANLOG_VERSION		1
+#define CANLOG_MAX_IFACES	8
+
+struct canlog_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t hdr_len;
+	uint64_t start_ns;
+	uint32_t nifaces;
+	uint32_t flags;
+	char ifaces[CANLOG_MAX_IFACES][IFNAMSIZ];
+} __attribute__((packed));
+
+/* Record flags */
+#define CANLOG_REC_FD		0x01	/* CAN FD frame */
+#define CANLOG_REC_BRS		0x02	/* FD bit rate switch */
+#define CANLOG_REC_ESI		0x04	/* FD error state indicator */
+#define CANLOG_REC_TX		0x08	/* Sent by this host */
+
+struct canlog_rec {
+	uint64_t ts_ns;
+	uint32_t can_id;	/* Including the EFF, RTR, and ERR flags */
+	uint8_t len;
+	uint8_t flags;
+	uint8_t iface;		/* Index in to the header's ifaces */
+	uint8_t rsvd;
+	uint8_t data[];
+} __attribute__((packed));
+
+static inline size_t canlog_rec_size(uint8_t len)
+{
+	return sizeof(struct canlog_rec) + len;
+}
+
+#define CANLOG_INDEX_MAGIC	"ETSCANIX"
+#define CANLOG_INDEX_NS		100000000ULL
+
+struct canlog_index {
+	uint64_t ts_ns;
+	uint64_t offset;
+} __attribute__((packed));
+
+struct canlog_footer {
+	uint64_t index_off;
+	uint64_t nindex;
+	uint64_t nrecs;
+	char magic[8];
+} __attribute__((packed));
+
+/* Builds the index as records are appended, offsets are from the start of
+ * the file.
+ */
+struct canlog_indexer {
+	struct canlog_index *entries;
+	size_t n;
+	size_t size;
+	uint64_t next_ns;
+	uint64_t nrecs;
+};
+
+/* A log open for reading, the whole file is mapped */
+struct canlog {
+	int fd;
+	const uint8_t *map;
+	size_t map_len;
+	const struct canlog_hdr *hdr;
+	size_t rec_start;
+	size_t rec_end;
+
+	/* Either points in to the map, or was rebuilt in to built */
+	const struct canlog_index *index;
+	size_t nindex;
+	uint64_t nrecs;
+	struct canlog_indexer built;
+};
+
+signed int canlog_index_add(struct canlog_indexer *ix, uint64_t ts_ns,
+			    uint64_t offset);
+signed int canlog_write_index(int fd, const struct canlog_indexer *ix,
+			      uint64_t index_off);
+void canlog_indexer_free(struct canlog_indexer *ix);
+
+signed int canlog_open(struct canlog *log, const char *path);
+size_t canlog_seek(const struct canlog *log, uint64_t ts_ns);
+const struct canlog_rec *canlog_next(const struct canlog *log, size_t *pos);
+void canlog_close(struct canlog *log);
+
+#endif /* __CANLOG_H__ */
@@ -0,0 +1,475 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/can.h>
+#include <net/ethernet.h>
+#include <net/if_arp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canio.h"
+#include "capture.h"
+
+#define CAPTURE_RING_MASK	(CAPTURE_RING_SIZE - 1)
+
+/* Copy in to the ring at pos, wrapping around the end */
+static void ring_copy(struct capture *cap, size_t pos, const void *src,
+		      size_t len)
+{
+	size_t off = pos & CAPTURE_RING_MASK;
+	size_t first = CAPTURE_RING_SIZE - off;
+
+	if (first > len)
+		first = len;
+	memcpy(cap->ring + off, src, first);
+	memcpy(cap->ring, (const uint8_t *)src + first, len - first);
+}
+
+/* Append a record to the ring, or drop it if the writer has fallen so far
+ * behind that there is no room.
+ */
+static void capture_put(struct capture *cap, const struct canlog_rec *rec,
+			const uint8_t *data, uint8_t len)
+{
+	size_t tail = __atomic_load_n(&cap->tail, __ATOMIC_ACQUIRE);
+	size_t size = canlog_rec_size(len);
+
+	if (CAPTURE_RING_SIZE - (cap->head - tail) < size) {
+		cap->ring_drops++;
+		return;
+	}
+
+	/* Records go to the file in ring order, right after the header */
+	if (canlog_index_add(&cap->index, le64toh(rec->ts_ns),
+	  sizeof(struct canlog_hdr) + cap->head) < 0)
+		cap->index_errors++;
+
+	ring_copy(cap, cap->head, rec, sizeof(*rec));
+	ring_copy(cap, cap->head + sizeof(*rec), data, len);
+	__atomic_store_n(&cap->head, cap->head + size, __ATOMIC_RELEASE);
+	cap->frames++;
+}
+
+/* Wake the writer once a full write worth of records is waiting. Otherwise
+ * it flushes on its own every CAPTURE_FLUSH_MS.
+ */
+static void capture_kick(struct capture *cap)
+{
+	if (cap->head - cap->signalled < CAPTURE_WRITE_SIZE)
+		return;
+
+	pthread_mutex_lock(&cap->lock);
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	cap->signalled = cap->head;
+}
+
+static void capture_frame(struct capture_iface *ci,
+			  const struct tpacket3_hdr *ppd)
+{
+	const struct sockaddr_ll *sll = (const void *)((const uint8_t *)ppd +
+	  TPACKET_ALIGN(sizeof(*ppd)));
+	const struct canfd_frame *frame = (const void *)((const uint8_t *)ppd +
+	  ppd->tp_mac);
+	struct canlog_rec rec;
+	uint8_t len;
+
+	memset(&rec, '\0', sizeof(rec));
+	if (ppd->tp_snaplen == CANFD_MTU) {
+		len = frame->len > CANFD_MAX_DLEN ? CANFD_MAX_DLEN : frame->len;
+		rec.flags = CANLOG_REC_FD;
+		if (frame->flags & CANFD_BRS)
+			rec.flags |= CANLOG_REC_BRS;
+		if (frame->flags & CANFD_ESI)
+			rec.flags |= CANLOG_REC_ESI;
+	} else if (ppd->tp_snaplen == CAN_MTU) {
+		len = frame->len > CAN_MAX_DLEN ? CAN_MAX_DLEN : frame->len;
+	} else {
+		return;
+	}
+
+	/* A frame sent from this host is only seen on its way out, as packet
+	 * sockets never get the loopback echo, so that one is kept, stamped
+	 * when it was queued rather than when it went out on the bus.
+	 */
+	if (sll->sll_pkttype == PACKET_OUTGOING)
+		rec.flags |= CANLOG_REC_TX;
+
+	rec.ts_ns = htole64(ppd->tp_sec * 1000000000ULL + ppd->tp_nsec);
+	rec.can_id = htole32(frame->can_id);
+	rec.len = len;
+	rec.iface = ci->index;
+
+	capture_put(ci->cap, &rec, frame->data, len);
+	ci->frames++;
+}
+
+/* Walk every block the kernel has handed over, then give them back */
+static signed int capture_handler(struct ev_source *src, uint32_t events)
+{
+	struct capture_iface *ci = src->data;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ppd;
+	unsigned int i;
+
+	(void)events;
+
+	for (;;) {
+		bd = (void *)(ci->map + (size_t)ci->block * ci->req.tp_block_size);
+		if (!(__atomic_load_n(&bd->hdr.bh1.block_status,
+		  __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+			break;
+
+		ppd = (void *)((uint8_t *)bd + bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			capture_frame(ci, ppd);
+			ppd = (void *)((uint8_t *)ppd + ppd->tp_next_offset);
+		}
+
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				 __ATOMIC_RELEASE);
+		ci->block = (ci->block + 1) % ci->req.tp_block_nr;
+		ci->blocks++;
+	}
+
+	capture_kick(ci->cap);
+
+	return 0;
+}
+
+/* Write out one contiguous span of the ring, at most CAPTURE_WRITE_SIZE */
+static signed int capture_write(struct capture *cap, size_t pending)
+{
+	size_t off = cap->tail & CAPTURE_RING_MASK;
+	size_t len = pending;
+	size_t done = 0;
+	ssize_t ret;
+
+	if (len > CAPTURE_WRITE_SIZE)
+		len = CAPTURE_WRITE_SIZE;
+	if (len > CAPTURE_RING_SIZE - off)
+		len = CAPTURE_RING_SIZE - off;
+
+	while (done < len) {
+		ret = write(cap->fd, cap->ring + off + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		done += ret;
+	}
+
+	cap->bytes_written += len;
+	cap->writes++;
+	__atomic_store_n(&cap->tail, cap->tail + len, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void *capture_writer(void *arg)
+{
+	struct capture *cap = arg;
+	struct timespec deadline;
+	size_t pending;
+	int timed_out = 0;
+
+	pthread_mutex_lock(&cap->lock);
+	for (;;) {
+		pending = __atomic_load_n(&cap->head, __ATOMIC_ACQUIRE) -
+		  cap->tail;
+		if (!pending && cap->stop)
+			break;
+
+		/* Wait for a full write, unless it has been a while */
+		if (pending < CAPTURE_WRITE_SIZE && !cap->stop && !timed_out) {
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += CAPTURE_FLUSH_MS * 1000000L;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			if (pthread_cond_timedwait(&cap->cond, &cap->lock,
+			  &deadline) == ETIMEDOUT)
+				timed_out = 1;
+			continue;
+		}
+		timed_out = 0;
+
+		if (!pending)
+			continue;
+
+		pthread_mutex_unlock(&cap->lock);
+		if (capture_write(cap, pending) < 0) {
+			cap->write_err = errno;
+			keep_running = 0;
+			return NULL;
+		}
+		pthread_mutex_lock(&cap->lock);
+	}
+	pthread_mutex_unlock(&cap->lock);
+
+	return NULL;
+}
+
+static signed int capture_iface_open(struct capture *cap,
+				     struct capture_iface *ci,
+				     const char *iface, uint8_t index)
+{
+	struct sockaddr_ll addr;
+	struct ifreq ifr;
+	int version = TPACKET_V3;
+
+	ci->cap = cap;
+	ci->index = index;
+	memset(ci->iface, '\0', IFNAMSIZ);
+	strncpy(ci->iface, iface, IFNAMSIZ-1);
+
+	/* No protocol until bound, so nothing is queued before the ring */
+	ci->ev.fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, 0);
+	if (ci->ev.fd < 0) {
+		perror("Unable to open packet socket, capture needs CAP_NET_RAW");
+		return -1;
+	}
+	ci->ev.handler = capture_handler;
+	ci->ev.data = ci;
+
+	memset(&ifr, '\0', sizeof(ifr));
+	memcpy(ifr.ifr_name, ci->iface, IFNAMSIZ);
+	if (ioctl(ci->ev.fd, SIOCGIFINDEX, &ifr) < 0) {
+		fprintf(stderr, "Unable to open iface %s: ", iface);
+		perror("");
+		return -1;
+	}
+	memset(&addr, '\0', sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL);
+	addr.sll_ifindex = ifr.ifr_ifindex;
+
+	if (ioctl(ci->ev.fd, SIOCGIFHWADDR, &ifr) < 0 ||
+	  ifr.ifr_hwaddr.sa_family != ARPHRD_CAN) {
+		fprintf(stderr, "%s is not a CAN interface\n", iface);
+		return -1;
+	}
+
+	if (setsockopt(ci->ev.fd, SOL_PACKET, PACKET_VERSION, &version,
+	  sizeof(version)) < 0) {
+		perror("Unable to set TPACKET_V3");
+		return -1;
+	}
+
+	memset(&ci->req, '\0', sizeof(ci->req));
+	ci->req.tp_block_size = CAPTURE_BLOCK_SIZE;
+	ci->req.tp_block_nr = CAPTURE_BLOCK_NR;
+	ci->req.tp_frame_size = CAPTURE_FRAME_SIZE;
+	ci->req.tp_frame_nr = (CAPTURE_BLOCK_SIZE / CAPTURE_FRAME_SIZE) *
+	  CAPTURE_BLOCK_NR;
+	ci->req.tp_retire_blk_tov = CAPTURE_BLOCK_TOV_MS;
+	if (setsockopt(ci->ev.fd, SOL_PACKET, PACKET_RX_RING, &ci->req,
+	  sizeof(ci->req)) < 0) {
+		fprintf(stderr, "Unable to set up capture ring on %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	ci->map_len = (size_t)CAPTURE_BLOCK_SIZE * CAPTURE_BLOCK_NR;
+	ci->map = mmap(NULL, ci->map_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ci->ev.fd, 0);
+	if (ci->map == MAP_FAILED) {
+		ci->map = NULL;
+		fprintf(stderr, "Unable to map capture ring on %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	if (bind(ci->ev.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Unable to bind on iface %s: ", iface);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Open a capture ring on each interface and the log at path, and write the
+ * log header. On failure, capture_close() cleans up whatever was opened.
+ */
+signed int capture_open(struct capture *cap, char ifaces[][IFNAMSIZ],
+			int nifaces, const char *path)
+{
+	struct canlog_hdr hdr;
+	struct timespec now;
+	int i;
+
+	memset(cap, '\0', sizeof(*cap));
+	cap->fd = -1;
+	for (i = 0; i < CANLOG_MAX_IFACES; i++)
+		cap->ifaces[i].ev.fd = -1;
+	pthread_mutex_init(&cap->lock, NULL);
+	pthread_cond_init(&cap->cond, NULL);
+
+	if (nifaces > CANLOG_MAX_IFACES)
+		return -1;
+
+	cap->ring = malloc(CAPTURE_RING_SIZE);
+	if (!cap->ring) {
+		perror("Unable to allocate capture ring");
+		return -1;
+	}
+
+	for (i = 0; i < nifaces; i++, cap->nifaces++) {
+		if (capture_iface_open(cap, &cap->ifaces[i], ifaces[i], i) < 0)
+			return -1;
+	}
+
+	cap->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (cap->fd < 0) {
+		fprintf(stderr, "Unable to open %s: ", path);
+		perror("");
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	memset(&hdr, '\0', sizeof(hdr));
+	memcpy(hdr.magic, CANLOG_MAGIC, sizeof(hdr.magic));
+	hdr.version = htole32(CANLOG_VERSION);
+	hdr.hdr_len = htole32(sizeof(hdr));
+	hdr.start_ns = htole64(now.tv_sec * 1000000000ULL + now.tv_nsec);
+	hdr.nifaces = htole32(nifaces);
+	for (i = 0; i < nifaces; i++)
+		memcpy(hdr.ifaces[i], cap->ifaces[i].iface, IFNAMSIZ);
+
+	if (write(cap->fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		fprintf(stderr, "Unable to write log header to %s: ", path);
+		perror("");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Capture until interrupted, or for duration_s if it is not zero. The
+ * capture sockets must already be in loop.
+ */
+signed int run_capture(struct evloop *loop, struct capture *cap,
+		       unsigned int duration_s)
+{
+	struct tpacket_stats_v3 stats;
+	socklen_t len;
+	sigset_t mask, oldmask;
+	uint64_t end_ns = 0;
+	int ret = 0;
+	int err;
+	unsigned int i;
+
+	/* As with the ECU workers, only the main thread handles signals */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+	err = pthread_create(&cap->writer, NULL, capture_writer, cap);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+	if (err) {
+		fprintf(stderr, "Unable to start capture writer: %s\n",
+			strerror(err));
+		return -1;
+	}
+	cap->started = 1;
+
+	if (duration_s)
+		end_ns = monotonic_ns() + duration_s * 1000000000ULL;
+
+	while (keep_running && (!end_ns || monotonic_ns() < end_ns)) {
+		if (evloop_run_once(loop, 100) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	/* Pick up anything the kernel handed over on the way out */
+	evloop_poll_all(loop);
+
+	pthread_mutex_lock(&cap->lock);
+	cap->stop = 1;
+	pthread_cond_signal(&cap->cond);
+	pthread_mutex_unlock(&cap->lock);
+	pthread_join(cap->writer, NULL);
+	cap->started = 0;
+
+	if (cap->write_err) {
+		fprintf(stderr, "Error writing capture log: %s\n",
+			strerror(cap->write_err));
+		ret = -1;
+	} else if (canlog_write_index(cap->fd, &cap->index,
+	  sizeof(struct canlog_hdr) + cap->head) < 0) {
+		ret = -1;
+	}
+
+	for (i = 0; i < cap->nifaces; i++) {
+		len = sizeof(stats);
+		if (getsockopt(cap->ifaces[i].ev.fd, SOL_PACKET,
+		  PACKET_STATISTICS, &stats, &len) == 0)
+			cap->ifaces[i].kernel_drops += stats.tp_drops;
+	}
+
+	return ret;
+}
+
+void capture_print_stats(struct capture *cap)
+{
+	struct capture_iface *ci;
+	unsigned int i;
+
+	for (i = 0; i < cap->nifaces; i++) {
+		ci = &cap->ifaces[i];
+		fprintf(stderr, "%s: captured %llu frames in %llu blocks, %llu "
+			"dropped by the kernel\n", ci->iface, ci->frames,
+			ci->blocks, ci->kernel_drops);
+	}
+
+	fprintf(stderr, "Logged %llu frames, %llu bytes in %llu writes, %llu "
+		"frames dropped with the ring full\n", cap->frames,
+		cap->bytes_written, cap->writes, cap->ring_drops);
+	fprintf(stderr, "Index of %zu entries", cap->index.n);
+	if (cap->index_errors)
+		fprintf(stderr, ", missing %llu from running out of memory",
+			cap->index_errors);
+	fprintf(stderr, "\n");
+}
+
+void capture_close(struct capture *cap)
+{
+	unsigned int i;
+
+	for (i = 0; i < CANLOG_MAX_IFACES; i++) {
+		if (cap->ifaces[i].map)
+			munmap(cap->ifaces[i].map, cap->ifaces[i].map_len);
+		if (cap->ifaces[i].ev.fd >= 0)
+			close(cap->ifaces[i].ev.fd);
+		cap->ifaces[i].map = NULL;
+		cap->ifaces[i].ev.fd = -1;
+	}
+
+	if (cap->fd >= 0)
+		close(cap->fd);
+	cap->fd = -1;
+
+	free(cap->ring);
+	cap->ring = NULL;
+	canlog_indexer_free(&cap->index);
+
+	pthread_mutex_destroy(&cap->lock);
+	pthread_cond_destroy(&cap->cond);
+}
@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Bus capture to a binary log
+ *
+ * Each interface is read through a TPACKET_V3 packet socket ring: the kernel
+ * fills whole blocks of frames in memory shared with the process, and hands
+ * over a block once it is full or CAPTURE_BLOCK_TOV_MS has passed. Reading a
+ * block of hundreds of frames costs no syscall at all, the event loop only
+ * wakes up once per block.
+ *
+ * Frames are packed in to log records in a large in-memory ring, and a
+ * writer thread flushes that to the log file in CAPTURE_WRITE_SIZE blocks
+ * of sequential writes. A slow disk then only has to keep up on average,
+ * a stall is soaked up by the ring rather than backing up in to the kernel
+ * and dropping frames. The log's time index is built up in memory as
+ * records go in to the ring, and appended once the capture ends.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <linux/if_packet.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canlog.h"
+#include "evloop.h"
+
+/* Kernel ring, per interface */
+#define CAPTURE_BLOCK_SIZE	(1 << 18)
+#define CAPTURE_BLOCK_NR	32
+#define CAPTURE_FRAME_SIZE	128
+#define CAPTURE_BLOCK_TOV_MS	10
+
+/* In-memory ring and writer */
+#define CAPTURE_RING_SIZE	(1 << 24)
+#define CAPTURE_WRITE_SIZE	(1 << 20)
+#define CAPTURE_FLUSH_MS	200
+
+struct capture;
+
+struct capture_iface {
+	struct ev_source ev;
+	char iface[IFNAMSIZ];
+	uint8_t index;
+	uint8_t *map;
+	size_t map_len;
+	struct tpacket_req3 req;
+	unsigned int block;
+	struct capture *cap;
+
+	/* Statistics */
+	unsigned long long frames;
+	unsigned long long blocks;
+	unsigned long long kernel_drops;
+};
+
+struct capture {
+	struct capture_iface ifaces[CANLOG_MAX_IFACES];
+	unsigned int nifaces;
+
+	/* head is only written by the event loop, tail only by the writer */
+	uint8_t *ring;
+	size_t head;
+	size_t tail;
+	size_t signalled;
+
+	struct canlog_indexer index;
+
+	int fd;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int started;
+	int stop;
+	int write_err;
+
+	/* Statistics */
+	unsigned long long frames;
+	unsigned long long ring_drops;
+	unsigned long long index_errors;
+	unsigned long long bytes_written;
+	unsigned long long writes;
+};
+
+signed int capture_open(struct capture *cap, char ifaces[][IFNAMSIZ],
+			int nifaces, const char *path);
+signed int run_capture(struct evloop *loop, struct capture *cap,
+		       unsigned int duration_s);
+void capture_print_stats(struct capture *cap);
+void capture_close(struct capture *cap);
+
+#endif /* __CAPTURE_H__ */
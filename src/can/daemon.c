@@ -0,0 +1,269 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "ecu.h"
+
+/* Posted on SIGHUP, for the reload thread */
+static sem_t reload_sem;
+
+/* The one vehicle reloads alternate with, beside the one loaded at startup */
+static struct vehicle spare_vehicle;
+
+/* Take over the sockets passed to us by the socket activation protocol,
+ * putting the interface each is bound to in ifaces. Returns how many there
+ * were, 0 if there were none for us.
+ */
+signed int daemon_listen_fds(char ifaces[][IFNAMSIZ], int max)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	int n, i;
+
+	if (!pid || !fds || strtoul(pid, NULL, 10) != (unsigned long)getpid())
+		return 0;
+
+	/* Not for any children we might have */
+	n = atoi(fds);
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if (n < 0 || n > max) {
+		fprintf(stderr, "Passed %d sockets, at most %d can be used\n",
+			n, max);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		fcntl(DAEMON_LISTEN_FDS_START + i, F_SETFD, FD_CLOEXEC);
+		if (can_inherit_sock(DAEMON_LISTEN_FDS_START + i,
+		  ifaces[i]) < 0)
+			return -1;
+		fprintf(stderr, "Using the socket passed for %s\n", ifaces[i]);
+	}
+
+	return n;
+}
+
+/* Tell the service manager our state, if there is one listening */
+void daemon_notify(const char *state)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	socklen_t len;
+	int sock;
+
+	if (!path || (path[0] != '/' && path[0] != '@') ||
+	  strlen(path) >= sizeof(addr.sun_path))
+		return;
+
+	/* A leading @ is an abstract socket */
+	strcpy(addr.sun_path, path);
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return;
+	if (sendto(sock, state, strlen(state), MSG_NOSIGNAL,
+	  (struct sockaddr *)&addr, len) < 0)
+		perror("Unable to notify the service manager");
+	close(sock);
+}
+
+/* sem_post() is one of the few things a signal handler may safely call */
+static void reload_handler(int signum)
+{
+	(void)signum;
+	sem_post(&reload_sem);
+}
+
+/* Load the vehicle again on each SIGHUP, in to the spare, and hand it to
+ * the event loop to switch to.
+ */
+static void *reload_main(void *arg)
+{
+	struct ecu_daemon *d = arg;
+	char state[64];
+
+	for (;;) {
+		if (sem_wait(&reload_sem) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (__atomic_load_n(&d->stop, __ATOMIC_ACQUIRE))
+			break;
+
+		/* The spare is still the one waiting to be switched to */
+		if (__atomic_load_n(&d->ready, __ATOMIC_ACQUIRE)) {
+			fprintf(stderr, "Reload already pending\n");
+			continue;
+		}
+
+		snprintf(state, sizeof(state),
+			 "RELOADING=1\nMONOTONIC_USEC=%llu",
+			 (unsigned long long)(monotonic_ns() / 1000));
+		daemon_notify(state);
+		fprintf(stderr, "Reloading %s\n", d->vehicle_path);
+
+		vehicle_close(d->spare);
+		if (vehicle_load(d->spare, d->vehicle_path) < 0) {
+			fprintf(stderr, "Carrying on with the vehicle already "
+				"loaded\n");
+			d->failed_reloads++;
+			daemon_notify("READY=1");
+			continue;
+		}
+
+		__atomic_store_n(&d->ready, d->spare, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/* Get ready to run the ECU emulation on every port as a service, reloading
+ * v from vehicle_path on SIGHUP if it is not NULL. Ports are refiltered on
+ * each reload with the extra filters from the command line.
+ */
+signed int ecu_daemon_start(struct ecu_daemon *d, struct can_port *ports,
+			    int nports, struct vehicle *v,
+			    const char *vehicle_path,
+			    const struct can_filter *extra, int nextra,
+			    int spin)
+{
+	struct sigaction sa = { .sa_handler = reload_handler };
+	int err;
+
+	memset(d, '\0', sizeof(*d));
+	d->ports = ports;
+	d->nports = nports;
+	d->extra = extra;
+	d->nextra = nextra;
+	d->spin = spin;
+
+	if (!vehicle_path) {
+		signal(SIGHUP, SIG_IGN);
+		return 0;
+	}
+
+	d->vehicle_path = vehicle_path;
+	d->cur = v;
+	d->spare = &spare_vehicle;
+
+	if (sem_init(&reload_sem, 0, 0) < 0) {
+		perror("Unable to create reload semaphore");
+		return -1;
+	}
+
+	err = pthread_create(&d->thread, NULL, reload_main, d);
+	if (err) {
+		fprintf(stderr, "Unable to start reload thread: %s\n",
+			strerror(err));
+		return -1;
+	}
+	d->started = 1;
+
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGHUP, &sa, NULL);
+
+	fprintf(stderr, "Send SIGHUP to %d to reload %s\n", getpid(),
+		vehicle_path);
+
+	return 0;
+}
+
+/* Answer from the vehicle the reload thread has loaded from now on, and
+ * give it back the one answered from until now.
+ */
+static signed int switch_vehicle(struct ecu_daemon *d, struct vehicle *v)
+{
+	int i;
+
+	ecu_swap_vehicle(v);
+	for (i = 0; i < d->nports; i++) {
+		if (ecu_port_refilter(&d->ports[i], d->extra, d->nextra) < 0)
+			return -1;
+	}
+
+	d->spare = d->cur;
+	d->cur = v;
+	__atomic_store_n(&d->ready, NULL, __ATOMIC_RELEASE);
+	d->reloads++;
+
+	vehicle_print(v);
+	daemon_notify("READY=1");
+
+	return 0;
+}
+
+/* Run until interrupted, carrying on past transient errors on the ports */
+signed int run_ecu_daemon(struct evloop *loop, struct ecu_daemon *d)
+{
+	struct timespec backoff = { 0, DAEMON_BACKOFF_NS };
+	struct vehicle *v;
+	int ret;
+
+	daemon_notify("READY=1");
+
+	while (keep_running) {
+		v = __atomic_load_n(&d->ready, __ATOMIC_ACQUIRE);
+		if (v && switch_vehicle(d, v) < 0)
+			return -1;
+
+		ret = d->spin ? evloop_poll_all(loop) :
+		  evloop_run_once(loop, 1000);
+		if (ret >= 0)
+			continue;
+		if (!can_port_transient_error(errno))
+			return -1;
+
+		/* The port has already said what went wrong */
+		d->recoveries++;
+		nanosleep(&backoff, NULL);
+	}
+
+	daemon_notify("STOPPING=1");
+
+	return 0;
+}
+
+void ecu_daemon_print_stats(const struct ecu_daemon *d)
+{
+	printf("Carried on past %llu transient errors", d->recoveries);
+	if (d->vehicle_path)
+		printf(", reloaded %llu times, %llu reloads failed",
+		       d->reloads, d->failed_reloads);
+	printf("\n");
+}
+
+void ecu_daemon_stop(struct ecu_daemon *d)
+{
+	if (!d->started)
+		return;
+
+	__atomic_store_n(&d->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&reload_sem);
+	pthread_join(d->thread, NULL);
+	d->started = 0;
+
+	/* Whichever of the two is not the caller's */
+	vehicle_close(&spare_vehicle);
+}
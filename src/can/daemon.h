@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* ECU emulation as a long running service
+ *
+ * With --daemon, --ecu can be started with its CAN sockets already open and
+ * bound, passed by systemd's socket activation protocol: LISTEN_PID naming
+ * us, and LISTEN_FDS sockets from fd 3 up. Nothing then has to look up or
+ * bind an interface, or have the privileges to, the sockets are only given
+ * their filters. systemd itself has no socket units for AF_CAN, so the
+ * sockets come from whatever starts us, a small launcher run as the
+ * service's ExecStart, say, that binds each interface and then execs this.
+ * Each socket's interface is found from its address, and stands in for an
+ * --iface, so none need be given. With NOTIFY_SOCKET set, systemd is told
+ * once we are ready, for a Type=notify, or notify-reload, service.
+ *
+ * The interface going down, or bus off until restart-ms brings it back, and
+ * its transmit queue filling up do not end the loop. The error is reported,
+ * at most once a second per port, and the loop carries on once it has
+ * backed off for DAEMON_BACKOFF_NS.
+ *
+ * SIGHUP reloads the --vehicle file. It is loaded in to a second vehicle by
+ * a thread of its own while every response keeps coming from the first.
+ * The event loop switches over between one batch and the next, and filters
+ * each port on the new vehicle's IDs, so no request goes unanswered for the
+ * time the file takes to load. A file that fails to load leaves the vehicle
+ * as it was. Periodic and watch entries are handed to the kernel at startup,
+ * see bcm.h, and are not reloaded.
+ */
+
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <net/if.h>
+#include <pthread.h>
+
+#include "canio.h"
+#include "evloop.h"
+#include "vehicle.h"
+
+#define DAEMON_LISTEN_FDS_START	3
+#define DAEMON_BACKOFF_NS	1000000ULL
+
+struct ecu_daemon {
+	struct can_port *ports;
+	int nports;
+	const struct can_filter *extra;
+	int nextra;
+	int spin;
+
+	/* The vehicle answered from, the one the next reload goes in to, and
+	 * one that has been reloaded, set by the reload thread and cleared
+	 * once switched to. NULL with no --vehicle.
+	 */
+	const char *vehicle_path;
+	struct vehicle *cur;
+	struct vehicle *spare;
+	struct vehicle *ready;
+	pthread_t thread;
+	int started;
+	int stop;
+
+	/* Statistics */
+	unsigned long long reloads;
+	unsigned long long failed_reloads;
+	unsigned long long recoveries;
+};
+
+signed int daemon_listen_fds(char ifaces[][IFNAMSIZ], int max);
+void daemon_notify(const char *state);
+signed int ecu_daemon_start(struct ecu_daemon *d, struct can_port *ports,
+			    int nports, struct vehicle *v,
+			    const char *vehicle_path,
+			    const struct can_filter *extra, int nextra,
+			    int spin);
+signed int run_ecu_daemon(struct evloop *loop, struct ecu_daemon *d);
+void ecu_daemon_print_stats(const struct ecu_daemon *d);
+void ecu_daemon_stop(struct ecu_daemon *d);
+
+#endif /* __DAEMON_H__ */
@@ -0,0 +1,528 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "dbc.h"
+#include "stats.h"
+
+/* Only bit 31 is defined, for extended IDs, anything else in the top bits
+ * is a pseudo message such as VECTOR__INDEPENDENT_SIG_MSG.
+ */
+#define DBC_ID_EFF		0x80000000UL
+#define DBC_ID_PSEUDO		0x60000000UL
+
+static inline unsigned int dbc_hash(canid_t id)
+{
+	return (id * 0x9e3779b97f4a7c15ULL) >> (64 - DBC_HASH_BITS);
+}
+
+/* Slot holding id, or the empty one it would go in */
+static struct dbc_slot *dbc_slot(struct dbc *dbc, canid_t id)
+{
+	unsigned int h = dbc_hash(id);
+	unsigned int probe = 0;
+
+	while (dbc->slots[h].used && dbc->slots[h].id != id) {
+		h = (h + 1) & (DBC_HASH_SIZE - 1);
+		probe++;
+	}
+	if (probe > dbc->max_probe)
+		dbc->max_probe = probe;
+
+	return &dbc->slots[h];
+}
+
+/* Index of the message with id, or -1 if there is none */
+static int dbc_lookup(const struct dbc *dbc, canid_t id)
+{
+	unsigned int h;
+
+	if (!(id & CAN_EFF_FLAG))
+		return (int)dbc->sff[id & CAN_SFF_MASK] - 1;
+
+	h = dbc_hash(id);
+	while (dbc->slots[h].used) {
+		if (dbc->slots[h].id == id)
+			return dbc->slots[h].msg;
+		h = (h + 1) & (DBC_HASH_SIZE - 1);
+	}
+
+	return -1;
+}
+
+/* The signal's bits, from data padded with 8 bytes past the frame's end */
+static inline uint64_t signal_raw(const struct dbc_signal *sig,
+				  const uint8_t *data)
+{
+	uint64_t word;
+
+	memcpy(&word, data + sig->byte, sizeof(word));
+	word = sig->be ? be64toh(word) : le64toh(word);
+
+	return (word >> sig->shift) & sig->mask;
+}
+
+/* Keep the name in name, or the part before a ':' straight after it */
+static const char *parse_name(const char *str, char *name, int colon)
+{
+	size_t len;
+
+	if (!str)
+		return "expected a name";
+
+	len = strlen(str);
+	if (colon && len && str[len - 1] == ':')
+		len--;
+	if (!len || len >= DBC_NAME_LEN)
+		return "missing or too long name";
+
+	memcpy(name, str, len);
+	name[len] = '\0';
+
+	return NULL;
+}
+
+/* BO_ <id> <name>: <length> <transmitter> */
+static const char *parse_msg(struct dbc *dbc, char **save, int *skip)
+{
+	struct dbc_slot *slot;
+	struct dbc_msg *msg;
+	unsigned long val;
+	const char *err;
+	const char *tok;
+	char *end;
+
+	tok = strtok_r(NULL, " \t", save);
+	val = tok ? strtoul(tok, &end, 10) : 0;
+	if (!tok || *end != '\0' || val > 0xffffffffUL)
+		return "expected a CAN ID";
+
+	/* Its signals go with it, and are skipped too */
+	*skip = (val & DBC_ID_PSEUDO) != 0;
+	if (*skip)
+		return NULL;
+
+	if (dbc->nmsgs >= DBC_MAX_MSGS)
+		return "too many messages";
+	msg = &dbc->msgs[dbc->nmsgs];
+	memset(msg, '\0', sizeof(*msg));
+
+	if (val & DBC_ID_EFF)
+		msg->id = (val & CAN_EFF_MASK) | CAN_EFF_FLAG;
+	else if (val > CAN_SFF_MASK)
+		return "standard ID does not fit in 11 bits";
+	else
+		msg->id = val;
+
+	err = parse_name(strtok_r(NULL, " \t", save), msg->name, 1);
+	if (err)
+		return err;
+
+	/* Before any name there may be a lone ':' */
+	tok = strtok_r(NULL, " \t", save);
+	if (tok && !strcmp(tok, ":"))
+		tok = strtok_r(NULL, " \t", save);
+	val = tok ? strtoul(tok, &end, 10) : 0;
+	if (!tok || *end != '\0' || val > CANFD_MAX_DLEN)
+		return "expected a length of 0 to 64 bytes";
+	msg->len = val;
+	msg->mux = -1;
+	msg->first = dbc->nsignals;
+
+	if (!(msg->id & CAN_EFF_FLAG)) {
+		if (dbc->sff[msg->id])
+			return "message ID already used";
+		dbc->sff[msg->id] = dbc->nmsgs + 1;
+	} else {
+		slot = dbc_slot(dbc, msg->id);
+		if (slot->used)
+			return "message ID already used";
+		slot->used = 1;
+		slot->id = msg->id;
+		slot->msg = dbc->nmsgs;
+	}
+
+	dbc->store->msgs[dbc->nmsgs].id = msg->id;
+	dbc->store->msgs[dbc->nmsgs].first = msg->first;
+	dbc->nmsgs++;
+
+	return NULL;
+}
+
+/* Turn <start>|<length>@<order><sign> in to what decoding needs */
+static const char *parse_layout(const char *str, const struct dbc_msg *msg,
+				struct dbc_signal *sig)
+{
+	unsigned int start, len, top;
+	char order, sign;
+
+	if (!str || sscanf(str, "%u|%u@%c%c", &start, &len, &order,
+	  &sign) != 4 || (order != '0' && order != '1') ||
+	  (sign != '+' && sign != '-'))
+		return "expected <start>|<length>@<order><sign>";
+	if (len < 1 || len > 64 || start >= CANFD_MAX_DLEN * 8)
+		return "start bit or length out of range";
+	if (len == 64 && sign == '+')
+		return "unsigned signals of 64 bits are not supported";
+
+	sig->byte = start / 8;
+	sig->be = order == '0';
+	if (sig->be) {
+		/* The start bit is the most significant one. Loaded big
+		 * endian, bit n of the first byte lands at bit 56 + n.
+		 */
+		top = 56 + start % 8;
+		if (len > top + 1)
+			return "signal does not fit in 8 bytes from its start";
+		sig->shift = top + 1 - len;
+		sig->need_len = sig->byte + (63 - sig->shift) / 8 + 1;
+	} else {
+		sig->shift = start % 8;
+		if (sig->shift + len > 64)
+			return "signal does not fit in 8 bytes from its start";
+		sig->need_len = sig->byte + (sig->shift + len + 7) / 8;
+	}
+	if (sig->need_len > msg->len)
+		return "signal does not fit in the message";
+
+	sig->mask = len == 64 ? ~0ULL : (1ULL << len) - 1;
+	sig->sign = sign == '-' ? 1ULL << (len - 1) : 0;
+
+	return NULL;
+}
+
+/* SG_ <name> [M|m<n>] : <layout> (<scale>,<offset>) [<min>|<max>] "<unit>"
+ * <receivers>
+ */
+static const char *parse_signal(struct dbc *dbc, char **save)
+{
+	struct dbc_shm_signal *out;
+	struct dbc_signal *sig;
+	struct dbc_msg *msg;
+	const char *tok, *unit;
+	unsigned long val;
+	const char *err;
+	size_t len;
+	char *end;
+
+	if (!dbc->nmsgs)
+		return "signal before any message";
+	if (dbc->nsignals >= DBC_MAX_SIGNALS)
+		return "too many signals";
+
+	msg = &dbc->msgs[dbc->nmsgs - 1];
+	sig = &dbc->signals[dbc->nsignals];
+	out = &dbc->store->signals[dbc->nsignals];
+	memset(sig, '\0', sizeof(*sig));
+	sig->mux = -1;
+
+	err = parse_name(strtok_r(NULL, " \t", save), out->name, 0);
+	if (err)
+		return err;
+
+	tok = strtok_r(NULL, " \t", save);
+	if (tok && !strcmp(tok, "M")) {
+		if (msg->mux >= 0)
+			return "message already has a multiplexor";
+		msg->mux = dbc->nsignals;
+		tok = strtok_r(NULL, " \t", save);
+	} else if (tok && tok[0] == 'm') {
+		val = strtoul(tok + 1, &end, 10);
+		if (end == tok + 1 || *end != '\0' || val > 0xffff)
+			return "only one level of multiplexing is supported";
+		sig->mux = val;
+		tok = strtok_r(NULL, " \t", save);
+	}
+	if (!tok || strcmp(tok, ":"))
+		return "expected ':' after the signal name";
+
+	err = parse_layout(strtok_r(NULL, " \t", save), msg, sig);
+	if (err)
+		return err;
+
+	tok = strtok_r(NULL, " \t", save);
+	if (!tok || sscanf(tok, "(%lf,%lf)", &sig->scale, &sig->offset) != 2)
+		return "expected (<scale>,<offset>)";
+
+	/* The range is not checked, but has to be there */
+	tok = strtok_r(NULL, " \t", save);
+	if (!tok || tok[0] != '[')
+		return "expected [<min>|<max>]";
+
+	/* The unit may have spaces in it, so is taken from the rest of the
+	 * line rather than a token.
+	 */
+	unit = *save ? strchr(*save, '"') : NULL;
+	if (!unit || !strchr(unit + 1, '"'))
+		return "expected a quoted unit";
+	unit++;
+	len = strchr(unit, '"') - unit;
+	if (len >= DBC_UNIT_LEN)
+		len = DBC_UNIT_LEN - 1;
+	memcpy(out->unit, unit, len);
+	out->unit[len] = '\0';
+
+	out->msg = dbc->nmsgs - 1;
+	dbc->store->msgs[dbc->nmsgs - 1].nsignals++;
+	msg->nsignals++;
+	dbc->nsignals++;
+
+	return NULL;
+}
+
+/* Shared memory segment shm_name, or if that is NULL, memory of our own */
+static signed int dbc_open_store(struct dbc *dbc, const char *shm_name)
+{
+	int fd;
+
+	if (!shm_name) {
+		dbc->store = mmap(NULL, sizeof(*dbc->store),
+				  PROT_READ | PROT_WRITE,
+				  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (dbc->store == MAP_FAILED) {
+			dbc->store = NULL;
+			perror("Unable to allocate signal store");
+			return -1;
+		}
+		return 0;
+	}
+
+	fd = shm_open(shm_name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open shared memory %s: ", shm_name);
+		perror("");
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(*dbc->store)) < 0) {
+		perror("Unable to size shared memory");
+		close(fd);
+		return -1;
+	}
+
+	dbc->store = mmap(NULL, sizeof(*dbc->store), PROT_READ | PROT_WRITE,
+			  MAP_SHARED, fd, 0);
+	close(fd);
+	if (dbc->store == MAP_FAILED) {
+		dbc->store = NULL;
+		perror("Unable to map shared memory");
+		return -1;
+	}
+
+	/* Readers wait for the magic before trusting anything else */
+	memset(dbc->store, '\0', sizeof(*dbc->store));
+	dbc->shm_name = shm_name;
+
+	return 0;
+}
+
+/* Compile the messages and signals in the DBC file at path, and set up the
+ * store for their values, the shared memory segment shm_name if it is not
+ * NULL.
+ */
+signed int dbc_load(struct dbc *dbc, const char *path, const char *shm_name)
+{
+	char line[DBC_LINE_MAX];
+	const char *err = NULL;
+	unsigned int lineno = 0;
+	int skip = 0;
+	int too_long, c;
+	char *save, *tok;
+	unsigned int i;
+	FILE *f;
+
+	memset(dbc, '\0', sizeof(*dbc));
+	if (dbc_open_store(dbc, shm_name) < 0)
+		return -1;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s: ", path);
+		perror("");
+		dbc_close(dbc);
+		return -1;
+	}
+
+	while (!err && fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		/* Comments and value tables can run long, the rest of the
+		 * line only matters if it is one we read.
+		 */
+		too_long = !strchr(line, '\n') && !feof(f);
+		while (too_long && (c = fgetc(f)) != EOF && c != '\n');
+		line[strcspn(line, "\r\n")] = '\0';
+
+		tok = strtok_r(line, " \t", &save);
+		if (!tok || (strcmp(tok, "BO_") && strcmp(tok, "SG_")))
+			continue;
+
+		if (too_long)
+			err = "line too long";
+		else if (!strcmp(tok, "BO_"))
+			err = parse_msg(dbc, &save, &skip);
+		else if (!skip)
+			err = parse_signal(dbc, &save);
+	}
+	fclose(f);
+
+	for (i = 0; !err && i < dbc->nsignals; i++) {
+		if (dbc->signals[i].mux >= 0 &&
+		  dbc->msgs[dbc->store->signals[i].msg].mux < 0)
+			err = "multiplexed signal in a message with no "
+			  "multiplexor";
+	}
+
+	if (err) {
+		fprintf(stderr, "%s:%u: %s\n", path, lineno, err);
+		dbc_close(dbc);
+		return -1;
+	}
+
+	if (!dbc->nsignals) {
+		fprintf(stderr, "%s: no signals\n", path);
+		dbc_close(dbc);
+		return -1;
+	}
+
+	dbc->store->nmsgs = dbc->nmsgs;
+	dbc->store->nsignals = dbc->nsignals;
+	__atomic_store_n(&dbc->store->magic, DBC_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	fprintf(stderr, "DBC: %u messages, %u signals, longest hash probe %u\n",
+		dbc->nmsgs, dbc->nsignals, dbc->max_probe);
+
+	return 0;
+}
+
+/* Decode every signal the frame carries in to the store */
+void dbc_decode(struct dbc *dbc, const struct canfd_frame *frame,
+		uint64_t now_ns)
+{
+	uint8_t data[CANFD_MAX_DLEN + sizeof(uint64_t)];
+	const struct dbc_signal *sig;
+	struct dbc_shm_signal *out;
+	struct dbc_shm_msg *smsg;
+	struct dbc_msg *msg;
+	long long mux = -1;
+	unsigned int i;
+	uint64_t raw;
+	uint32_t seq;
+	int idx;
+
+	if (frame->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG))
+		return;
+
+	idx = dbc_lookup(dbc, frame->can_id & (CAN_EFF_FLAG | CAN_EFF_MASK));
+	if (idx < 0) {
+		dbc->unknown++;
+		return;
+	}
+
+	msg = &dbc->msgs[idx];
+	msg->frames++;
+	if (frame->len < msg->len)
+		msg->short_frames++;
+
+	/* Every signal loads 8 bytes, the padding keeps that in bounds */
+	memcpy(data, frame->data, CANFD_MAX_DLEN);
+	memset(data + CANFD_MAX_DLEN, '\0', sizeof(uint64_t));
+	if (msg->mux >= 0 && dbc->signals[msg->mux].need_len <= frame->len)
+		mux = signal_raw(&dbc->signals[msg->mux], data);
+
+	smsg = &dbc->store->msgs[idx];
+	seq = smsg->seq;
+	__atomic_store_n(&smsg->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i = msg->first; i < msg->first + msg->nsignals; i++) {
+		sig = &dbc->signals[i];
+		if (sig->need_len > frame->len ||
+		  (sig->mux >= 0 && sig->mux != mux))
+			continue;
+
+		/* Sign extends when sign is set, does nothing otherwise */
+		raw = signal_raw(sig, data);
+		out = &dbc->store->signals[i];
+		out->value = (double)(int64_t)((raw ^ sig->sign) - sig->sign) *
+		  sig->scale + sig->offset;
+		out->time_ns = now_ns;
+	}
+	smsg->time_ns = now_ns;
+	smsg->frames = msg->frames;
+
+	__atomic_store_n(&smsg->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Decode everything in each batch received, counting it in the port's
+ * statistics too if it has any.
+ */
+signed int dbc_port_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	struct dbc *dbc = port->priv;
+	uint64_t now_ns;
+	int nframes, i;
+
+	(void)events;
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		fprintf(stderr, "Error receiving on %s: ", port->iface);
+		perror("");
+		return -1;
+	}
+
+	if (port->stats)
+		stats_add_batch(port->stats, port, nframes);
+
+	now_ns = monotonic_ns();
+	for (i = 0; i < nframes; i++)
+		dbc_decode(dbc, &port->rx.frames[i], now_ns);
+
+	return 0;
+}
+
+/* The last value of every signal decoded, by message */
+void dbc_print(const struct dbc *dbc)
+{
+	const struct dbc_shm_signal *out;
+	const struct dbc_msg *msg;
+	unsigned int i, j;
+
+	for (i = 0; i < dbc->nmsgs; i++) {
+		msg = &dbc->msgs[i];
+		if (!msg->frames)
+			continue;
+
+		printf("%s (0x%x): %llu frames, %llu short\n", msg->name,
+		       msg->id & CAN_EFF_MASK, msg->frames, msg->short_frames);
+		for (j = msg->first; j < msg->first + msg->nsignals; j++) {
+			out = &dbc->store->signals[j];
+			if (out->time_ns)
+				printf("  %s = %g%s%s\n", out->name,
+				       out->value, out->unit[0] ? " " : "",
+				       out->unit);
+		}
+	}
+	printf("%llu frames not in the DBC\n", dbc->unknown);
+}
+
+void dbc_close(struct dbc *dbc)
+{
+	if (!dbc->store)
+		return;
+
+	munmap(dbc->store, sizeof(*dbc->store));
+	if (dbc->shm_name)
+		shm_unlink(dbc->shm_name);
+	dbc->store = NULL;
+}
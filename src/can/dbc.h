@@ -0,0 +1,171 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Signal decoding from a DBC file
+ *
+ * The messages and signals of a DBC file are compiled when it is loaded:
+ *
+ *	BO_ 2364540158 EEC1: 8 Engine
+ *	 SG_ EngineSpeed : 24|16@1+ (0.125,0) [0|8031.875] "rpm" Vector__XXX
+ *	BO_ 1000 Gear: 2 Transmission
+ *	 SG_ Page M : 0|8@1+ (1,0) [0|255] "" Vector__XXX
+ *	 SG_ Gear m1 : 15|8@0- (1,0) [-1|8] "" Vector__XXX
+ *
+ * Only BO_ and SG_ lines are read, everything else in the file, comments,
+ * attributes, value tables, is skipped. Signals are little endian (@1) or
+ * big endian (@0), signed (-) or not (+), and may be multiplexed by one
+ * multiplexor signal (M) in the message, decoded only when it has the
+ * value given (mN).
+ *
+ * Each signal is turned in to the byte to load 8 bytes from, a shift, a
+ * mask, and a sign bit, so decoding one is a load, a shift, a mask, and a
+ * multiply and add for the scale and offset, with no branches on its
+ * layout. A message's signals are kept together, and the message is found
+ * from the CAN ID with a table indexed by the ID for standard IDs and an
+ * open addressed hash for extended ones.
+ *
+ * Decoded values go in to a store of every signal, which can be a shared
+ * memory segment for other processes to read rather than each open a raw
+ * socket of their own. In it, each message has a sequence count that is odd
+ * while its signals are being written, see dbc_shm_read(), so a reader never
+ * takes a lock and never sees half of a frame's values.
+ */
+
+#ifndef __DBC_H__
+#define __DBC_H__
+
+#include <linux/can.h>
+#include <stdint.h>
+
+#include "canio.h"
+#include "evloop.h"
+
+#define DBC_MAX_MSGS		1024
+#define DBC_MAX_SIGNALS		4096
+#define DBC_NAME_LEN		32
+#define DBC_UNIT_LEN		16
+#define DBC_LINE_MAX		1024
+
+/* Power of two, twice the most keys there can be so probes stay short */
+#define DBC_HASH_BITS		11
+#define DBC_HASH_SIZE		(1 << DBC_HASH_BITS)
+
+/* What decoding needs of a signal */
+struct dbc_signal {
+	uint64_t mask;
+	uint64_t sign;
+	double scale;
+	double offset;
+	uint8_t byte;
+	uint8_t shift;
+	uint8_t be;
+
+	/* Bytes of data the frame needs for the signal to be in it */
+	uint8_t need_len;
+
+	/* Value of the multiplexor the signal is sent with, or -1 */
+	int mux;
+};
+
+struct dbc_msg {
+	canid_t id;
+	char name[DBC_NAME_LEN];
+	uint8_t len;
+
+	/* Index of the multiplexor signal, or -1 */
+	int mux;
+	unsigned int first;
+	unsigned int nsignals;
+
+	/* Statistics */
+	unsigned long long frames;
+	unsigned long long short_frames;
+};
+
+struct dbc_slot {
+	canid_t id;
+	int used;
+	unsigned int msg;
+};
+
+/* Store layout, with every message and signal the file has. The names and
+ * IDs are filled in before magic is set, and never change after.
+ */
+#define DBC_SHM_MAGIC		0x45544442
+
+struct dbc_shm_msg {
+	uint32_t seq;
+
+	/* With CAN_EFF_FLAG set for extended IDs */
+	uint32_t id;
+	uint64_t time_ns;
+	uint64_t frames;
+	uint32_t first;
+	uint32_t nsignals;
+};
+
+struct dbc_shm_signal {
+	char name[DBC_NAME_LEN];
+	char unit[DBC_UNIT_LEN];
+	uint32_t msg;
+	uint32_t rsvd;
+	double value;
+
+	/* When the signal was last decoded on CLOCK_MONOTONIC, 0 if never */
+	uint64_t time_ns;
+};
+
+struct dbc_shm {
+	uint32_t magic;
+	uint32_t nmsgs;
+	uint32_t nsignals;
+	uint32_t rsvd;
+	struct dbc_shm_msg msgs[DBC_MAX_MSGS];
+	struct dbc_shm_signal signals[DBC_MAX_SIGNALS];
+};
+
+struct dbc {
+	struct dbc_msg msgs[DBC_MAX_MSGS];
+	unsigned int nmsgs;
+	struct dbc_signal signals[DBC_MAX_SIGNALS];
+	unsigned int nsignals;
+
+	/* Message index plus one for each standard ID, 0 for none */
+	uint16_t sff[CAN_SFF_MASK + 1];
+	struct dbc_slot slots[DBC_HASH_SIZE];
+	unsigned int max_probe;
+
+	struct dbc_shm *store;
+	const char *shm_name;
+
+	/* Statistics */
+	unsigned long long unknown;
+};
+
+signed int dbc_load(struct dbc *dbc, const char *path, const char *shm_name);
+void dbc_decode(struct dbc *dbc, const struct canfd_frame *frame,
+		uint64_t now_ns);
+signed int dbc_port_handler(struct ev_source *src, uint32_t events);
+void dbc_print(const struct dbc *dbc);
+void dbc_close(struct dbc *dbc);
+
+/* Copy out a signal's value and when it was decoded, for a reader of the
+ * shared memory. Returns 0 if the signal has never been decoded.
+ */
+static inline int dbc_shm_read(const struct dbc_shm *shm, unsigned int sig,
+			       double *value, uint64_t *time_ns)
+{
+	const struct dbc_shm_msg *msg = &shm->msgs[shm->signals[sig].msg];
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&msg->seq, __ATOMIC_ACQUIRE);
+		*value = shm->signals[sig].value;
+		*time_ns = shm->signals[sig].time_ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+	  seq != __atomic_load_n(&msg->seq, __ATOMIC_RELAXED));
+
+	return *time_ns != 0;
+}
+
+#endif /* __DBC_H__ */
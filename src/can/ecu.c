@@ -0,0 +1,363 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ecu.h"
+#include "obd.h"
+#include "stats.h"
+#include "trace.h"
+
+/* Read only once set, shared by every port and worker. Only replaced with
+ * ecu_swap_vehicle(), from the one thread servicing every port.
+ */
+static const struct vehicle *ecu_vehicle;
+static uint64_t ecu_start_ns;
+
+/* Generated values start from when this is called */
+void ecu_set_vehicle(const struct vehicle *v)
+{
+	ecu_vehicle = v;
+	ecu_start_ns = monotonic_ns();
+}
+
+/* Answer from v from now on, with generated values carrying on from where
+ * they were rather than starting over.
+ */
+void ecu_swap_vehicle(const struct vehicle *v)
+{
+	ecu_vehicle = v;
+}
+
+/* Send the responses queued on the port, any left queued are sent by the
+ * loop later. Those dropped will never come back for their latency.
+ */
+static signed int ecu_flush(struct can_port *port)
+{
+	unsigned int queued = port->tx.count;
+	int nframes;
+
+	if (!queued)
+		return 0;
+
+	nframes = can_port_flush(port);
+	if (nframes < 0) {
+		can_port_error(port, "sending ECU response");
+		ecu_responses_lost(port, queued);
+		return -1;
+	}
+	ecu_responses_lost(port, queued - nframes - port->tx.count);
+
+	return 0;
+}
+
+/* The next frame to queue a response in, sending what is already queued
+ * first when there is no room left. With the interface out of buffer space
+ * there may still be none, and frame is NULL. With latency measured, the
+ * response is timed from the request being answered.
+ */
+static signed int ecu_next_frame(struct can_port *port, int fd,
+				 struct can_frame **frame)
+{
+	struct ecu_state *st = port->priv;
+
+	*frame = fd ? (struct can_frame *)tx_queue_next_fd(&port->tx) :
+	  tx_queue_next(&port->tx);
+	if (!*frame) {
+		if (ecu_flush(port) < 0)
+			return -1;
+		*frame = fd ? (struct can_frame *)tx_queue_next_fd(&port->tx) :
+		  tx_queue_next(&port->tx);
+	}
+	if (*frame && st) {
+		/* Should echoes ever go missing, lose the oldest */
+		if (st->head - st->tail == ECU_PENDING)
+			st->tail++;
+		st->pending[st->head++ % ECU_PENDING] = st->req;
+	}
+
+	return 0;
+}
+
+/* Queue every response the vehicle has to a single frame request */
+static int vehicle_request(struct can_port *port, const struct can_frame *req,
+			   int fd)
+{
+	const struct vehicle *v = ecu_vehicle;
+	const struct vehicle_rsp *rsp;
+	struct can_frame *frame;
+	int functional = req->can_id == v->functional_id;
+	unsigned int pid_len, i;
+	uint64_t t_ns;
+	uint32_t val;
+	uint16_t pid;
+	int n = 0;
+
+	if (req->can_dlc < 3 || req->data[0] < 2 || req->data[0] > 7)
+		return 0;
+
+	pid_len = vehicle_pid_len(req->data[1]);
+	if (pid_len == 2) {
+		if (req->data[0] < 3 || req->can_dlc < 4)
+			return 0;
+		pid = (req->data[2] << 8) | req->data[3];
+	} else {
+		pid = req->data[2];
+	}
+
+	rsp = vehicle_lookup(v, req->can_id, req->data[1], pid);
+	if (!rsp)
+		return 0;
+
+	t_ns = monotonic_ns() - ecu_start_ns;
+	for (; rsp; rsp = functional ? vehicle_next(v, rsp) : NULL) {
+		if (ecu_next_frame(port, fd, &frame) < 0)
+			return -1;
+		if (!frame) {
+			/* This response and every one after it */
+			for (; rsp; rsp = functional ? vehicle_next(v, rsp) :
+			  NULL)
+				port->tx.dropped_total++;
+			break;
+		}
+
+		frame->can_id = rsp->id;
+		frame->can_dlc = rsp->dlc;
+		memcpy(frame->data, rsp->data, sizeof(frame->data));
+		if (rsp->val_len) {
+			val = siggen_value(&rsp->gen, t_ns, &port->seed);
+			for (i = rsp->val_len; i > 0; i--, val >>= 8)
+				frame->data[rsp->val_off + i - 1] = val;
+		}
+
+		if (fd)
+			obd_pad_fd((struct canfd_frame *)frame,
+				   req->can_dlc > rsp->dlc ?
+				   req->can_dlc : rsp->dlc);
+		n++;
+	}
+
+	return n;
+}
+
+/* Queue the response to an OBD request, if it is one this emulation answers.
+ * Returns the number of responses queued, only ever more than 1 for a
+ * functional request to a vehicle, or -1 if sending those already queued to
+ * make room failed.
+ */
+int ecu_handle_request(struct can_port *port, const struct can_frame *req,
+		       int fd)
+{
+	const struct obd_pid *info;
+	struct can_frame *rsp;
+
+	if (ecu_vehicle)
+		return vehicle_request(port, req, fd);
+
+	/* Single frame service 01 requests, either with just the service and
+	 * PID, or the longer form the mOByDic 1610 expects.
+	 */
+	if (req->can_dlc < 3 ||
+	  (req->data[0] != 0x02 && req->data[0] != 0x03) ||
+	  req->data[1] != OBD_SERVICE_CURRENT)
+		return 0;
+
+	/* Like a real ECU, say nothing about PIDs that are not supported */
+	info = obd_pid_info(req->data[2]);
+	if (!info)
+		return 0;
+
+	if (ecu_next_frame(port, fd, &rsp) < 0)
+		return -1;
+	if (!rsp) {
+		port->tx.dropped_total++;
+		return 0;
+	}
+
+	/* Physical requests are answered from the matching response address,
+	 * functional ones as the first ECU.
+	 */
+	obd_build_response(rsp, (req->can_id >= 0x7e0 && req->can_id <= 0x7e7) ?
+			   req->can_id + 8 : 0x7e8, req->data[2],
+			   rand_r(&port->seed) & obd_raw_max(info));
+
+	/* Carry the benchmark sequence number back, see bench.h */
+	if (req->can_dlc >= 8 && rsp->can_dlc <= 6) {
+		rsp->can_dlc = 8;
+		rsp->data[6] = req->data[6];
+		rsp->data[7] = req->data[7];
+	}
+
+	/* FD requests are answered with an FD frame of the same length */
+	if (fd)
+		obd_pad_fd((struct canfd_frame *)rsp, req->can_dlc);
+
+	return 1;
+}
+
+/* Open iface for ECU emulation, receiving only requests plus any extra
+ * filters. If st is given, also timestamp requests and receive our own
+ * responses back, for measuring response latency.
+ */
+signed int ecu_port_open(struct can_port *port, struct ecu_state *st,
+			 const char *iface, unsigned int batch,
+			 const struct can_filter *extra, int nextra)
+{
+	const struct vehicle *v = ecu_vehicle;
+
+	if ((v ? can_port_open(port, iface, batch, v->filters, v->nfilters,
+	  v->rsp_filters, st ? v->nrsp_filters : 0, extra, nextra) :
+	  can_port_open(port, iface, batch, obd_request_filters,
+	  ARRAY_SIZE(obd_request_filters), obd_response_filters,
+	  st ? ARRAY_SIZE(obd_response_filters) : 0, extra, nextra)) < 0)
+		return -1;
+
+	if (st) {
+		if (!port->local && (enable_timestamps(port->sock) < 0 ||
+		  enable_own_msgs(port->sock) < 0)) {
+			can_port_close(port);
+			return -1;
+		}
+
+		memset(st, '\0', sizeof(*st));
+		latency_hist_init(&st->rsp);
+		port->priv = st;
+	}
+
+	/* Each port makes up values from its own state, random() takes a lock
+	 * that every worker thread would contend on.
+	 */
+	port->ev.handler = ecu_port_handler;
+	port->seed = random();
+
+	return 0;
+}
+
+/* Receive the requests of the vehicle answered from now, after a swap */
+signed int ecu_port_refilter(struct can_port *port,
+			     const struct can_filter *extra, int nextra)
+{
+	const struct vehicle *v = ecu_vehicle;
+	int latency = port->priv != NULL;
+
+	if (port->local)
+		return 0;
+
+	return v ? set_filters(port->sock, v->filters, v->nfilters,
+	  v->rsp_filters, latency ? v->nrsp_filters : 0, extra, nextra) :
+	  set_filters(port->sock, obd_request_filters,
+	  ARRAY_SIZE(obd_request_filters), obd_response_filters,
+	  latency ? ARRAY_SIZE(obd_response_filters) : 0, extra, nextra);
+}
+
+/* Handle one received frame, with its control messages and flags in msg.
+ * Any responses are queued on the port, for the caller to send. Returns -1
+ * if the port failed to send.
+ */
+signed int ecu_handle_frame(struct can_port *port, struct msghdr *msg,
+			    const struct can_frame *frame, int fd)
+{
+	struct ecu_state *st = port->priv;
+	struct rx_stamp stamp;
+	int n;
+
+	/* Only received at all with statistics enabled */
+	if (frame->can_id & CAN_ERR_FLAG)
+		return 0;
+
+	if (!st) {
+		TRACE_BEGIN(t);
+		n = ecu_handle_request(port, frame, fd);
+		TRACE_END(t, TRACE_DECODE, frame->can_id);
+		return n < 0 ? -1 : 0;
+	}
+
+	parse_cmsgs(msg, &stamp);
+
+	/* One of our own responses, now on the bus */
+	if (msg->msg_flags & MSG_CONFIRM) {
+		if (st->tail == st->head) {
+			st->unmatched++;
+			return 0;
+		}
+		st->hw_samples += record_latency(&st->rsp,
+		  &st->pending[st->tail++ % ECU_PENDING], &stamp);
+		return 0;
+	}
+
+	/* Each response to the request is timed from it */
+	st->req = stamp;
+	TRACE_BEGIN(t);
+	n = ecu_handle_request(port, frame, fd);
+	TRACE_END(t, TRACE_DECODE, frame->can_id);
+
+	return n < 0 ? -1 : 0;
+}
+
+/* Responses that were queued but never sent will never come back */
+void ecu_responses_lost(struct can_port *port, unsigned int n)
+{
+	struct ecu_state *st = port->priv;
+
+	if (st)
+		st->head -= n;
+}
+
+/* Receive every pending request up to the batch size, and send all of the
+ * responses to them together.
+ */
+signed int ecu_port_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	int nframes;
+	int i;
+
+	(void)events;
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		can_port_error(port, "receiving on ECU emulation");
+		return -1;
+	}
+
+	if (port->stats)
+		stats_add_batch(port->stats, port, nframes);
+
+	for (i = 0; i < nframes; i++) {
+		if (port->rx.msgs[i].msg_len < sizeof(struct can_frame)) {
+			fprintf(stderr, "Incomplete CAN frame on ECU emulation\n");
+			continue;
+		}
+
+		if (ecu_handle_frame(port, &port->rx.msgs[i].msg_hdr,
+		  rx_batch_frame(&port->rx, i),
+		  rx_batch_is_fd(&port->rx, i)) < 0)
+			return -1;
+	}
+
+	return ecu_flush(port);
+}
+
+/* Request to response latency, against the time an ECU is given to respond */
+void ecu_print_latency(const struct can_port *port)
+{
+	const struct ecu_state *st = port->priv;
+	char label[IFNAMSIZ + 32];
+
+	if (!st)
+		return;
+
+	snprintf(label, sizeof(label), "%s response latency", port->iface);
+	latency_hist_print(stdout, label, &st->rsp);
+	printf("  %llu of %llu samples from hardware timestamps, %llu "
+		"unmatched\n", st->hw_samples, (unsigned long long)st->rsp.count,
+		st->unmatched);
+	if (st->rsp.count) {
+		printf("  Worst case %.3f ms, %s the %d ms P2 budget\n",
+			st->rsp.max_ns / 1e6, st->rsp.max_ns <=
+			OBD_P2_MS * 1000000ULL ? "within" : "OVER", OBD_P2_MS);
+	}
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* OBD ECU emulation
+ *
+ * Answers service 01 requests for any PID in the table in obd.c, with a
+ * random value. Functional requests to 0x7df are answered as the first ECU,
+ * from 0x7e8, and physical requests to 0x7e0+n are answered from 0x7e8+n.
+ * On a port with FD frames enabled, FD requests get FD responses.
+ *
+ * Given a vehicle with ecu_set_vehicle() before any port is opened, every
+ * port instead answers as all of the vehicle's ECUs, see vehicle.h. A
+ * functional request then gets a response from each ECU with the PID.
+ *
+ * When given an ecu_state, the port also measures response latency. Requests
+ * are timestamped as they are received, and the port gets its own responses
+ * back once they have gone out on the bus. Responses go out in the order
+ * they are queued, so the receive timestamps of the requests are kept in a
+ * FIFO and matched to each response as it comes back.
+ */
+
+#ifndef __ECU_H__
+#define __ECU_H__
+
+#include "canio.h"
+#include "latency.h"
+#include "vehicle.h"
+
+#define ECU_PENDING	256
+
+struct ecu_state {
+	struct rx_stamp pending[ECU_PENDING];
+	unsigned int head;
+	unsigned int tail;
+
+	/* When the request being answered was received */
+	struct rx_stamp req;
+	struct latency_hist rsp;
+
+	/* Statistics */
+	unsigned long long hw_samples;
+	unsigned long long unmatched;
+};
+
+void ecu_set_vehicle(const struct vehicle *v);
+void ecu_swap_vehicle(const struct vehicle *v);
+int ecu_handle_request(struct can_port *port, const struct can_frame *req,
+		       int fd);
+signed int ecu_port_open(struct can_port *port, struct ecu_state *st,
+			 const char *iface, unsigned int batch,
+			 const struct can_filter *extra, int nextra);
+signed int ecu_port_refilter(struct can_port *port,
+			     const struct can_filter *extra, int nextra);
+signed int ecu_handle_frame(struct can_port *port, struct msghdr *msg,
+			    const struct can_frame *frame, int fd);
+void ecu_responses_lost(struct can_port *port, unsigned int n);
+signed int ecu_port_handler(struct ev_source *src, uint32_t events);
+void ecu_print_latency(const struct can_port *port);
+
+#endif /* __ECU_H__ */
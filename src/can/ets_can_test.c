@@ -1,8 +1,7 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 
 /* A simple example that will attempt to communicate with an Ozen mOByDic1610
- * OBD ECU simulator, or, do a simple emulation of one aspect of it for a
- * loopback test.
+ * OBD ECU simulator, or, do a simple emulation of it for a loopback test.
  *
  * When doing a loopback between the two ports locally in a single command,
  * this is a one-shot loop. Similar if --query is specified. If running in
@@ -10,32 +9,166 @@
  *
  * On each loop, depending on the operation mode, it will send a query to
  * the mOByDic 1610 to read the RPM gauge. If emulating this ECU, it will
- * respond by returning a random RPM value, 0-255. Then it will wait for
- * a response from the ECU.
+ * respond by returning a random RPM value. Then it will wait for a response
+ * from the ECU. The emulation answers any of the PIDs in the table in obd.c,
+ * which is also used to decode responses.
  *
- * For simplicity, messages sent on the bus are just using a raw write()
- * since the packet format is quite simple. However, on the receive side
- * recvmsg() is used. This allows for more complex parsing, including
- * timestamping, flags, sizes, etc. For the messages used here, read()
- * would likely be fine, but we wanted to provide an example that can
- * be expanded for additional functionality.
+ * Messages sent on the bus are collected in a small transmit queue and
+ * then sent with sendmmsg(), the batched form of sendmsg(). For a single
+ * query this is no different than a write(), but it lets a burst of
+ * queries, or all of the responses to a batch of requests, go out with a
+ * single syscall. On the receive side recvmsg() is used. This allows for
+ * more complex parsing, including timestamping, flags, sizes, etc. For the
+ * messages used here, read() would likely be fine, but we wanted to provide
+ * an example that can be expanded for additional functionality.
+ *
+ * Specifically, recvmmsg() is used, which is the batched form of recvmsg().
+ * With --batch, each wakeup pulls in every frame that is pending on the
+ * socket, up to the batch size, with a single syscall.
+ * This matters on a busy bus where a number of testers are all sending
+ * requests at the same time.
+ *
+ * With --latency, kernel timestamps are enabled on the query socket, along
+ * with hardware timestamps if the CAN controller supports them. The query
+ * socket also receives its own frames back once they have actually gone out
+ * on the bus, and the difference between the timestamp of that echo and the
+ * timestamp of the ECU response is the round trip time. Both timestamps come
+ * from the same interface, so hardware timestamps can be compared directly.
+ *
+ * The --bench mode uses the same two loopback sockets to run a sustained
+ * load of queries and responses between can0 and can1, either flat out or
+ * at a target rate, and reports throughput, bus utilization, losses, and
+ * round trip latency.
+ *
+ * Giving --query any of the pipelining options switches it from a
+ * stop-and-wait query to a pipelined one. A list of PIDs, optionally sent
+ * to a number of ECUs, is queried with up to --window requests in flight at
+ * once. Responses are matched back to their request by the CAN ID of the
+ * ECU and the PID, and each request's timeout is tracked in a timer wheel.
+ *
+ * Each socket gets a CAN_RAW_FILTER so the kernel only hands it the frames
+ * it cares about, requests to 0x7df and 0x7e0-0x7e7 for the ECU emulation
+ * and responses from 0x7e8-0x7ef for queries. Everything else on the bus is
+ * dropped in the kernel without waking the process up. More filters can be
+ * added with --filter.
+ *
+ * Every mode runs from a single epoll event loop, each open interface being
+ * one source in it with its own handler. The --ecu mode may be given more
+ * than one --iface, and emulates an ECU on all of them at once from the one
+ * thread. The socket plumbing lives in canio.c, the loop in evloop.c, and the
+ * modes themselves in ecu.c, query.c, and bench.c.
+ *
+ * With --threads, --ecu instead services each interface from its own worker
+ * thread, with its own event loop, so that several saturated buses can be
+ * kept up with on a multi-core CPU. Workers, or the single thread, can be
+ * pinned to CPUs with --cpus and run under SCHED_FIFO with --fifo.
+ *
+ * For a deterministic ECU response time, --spin polls the sockets in a tight
+ * loop rather than waiting for a wakeup, --busy-poll has the kernel busy
+ * poll the device as well, and --mlock keeps every buffer resident. All of
+ * the response frames are built in place in the preallocated transmit
+ * queue. With --latency, the ECU emulation timestamps each request and gets
+ * its own response back once it is out on the bus, and reports a histogram
+ * of the difference against the OBD P2 response time budget.
+ *
+ * With --fd, every socket also sends and receives struct canfd_frame. The
+ * loopback test and benchmark then run on 64 byte FD frames with the bit
+ * rate switched for the data phase, and the benchmark reports the payload
+ * moved per second against the most classic CAN could carry at the same
+ * nominal bit rate. An ECU on an FD socket answers FD requests in kind.
+ *
+ * The --isotp mode benchmarks ISO-TP (ISO 15765-2) segmented transfers
+ * between can0 and can1, the transport that diagnostic services such as
+ * reading the VIN or DTCs, or downloading a flash image, run over. The ECU
+ * side's flow control sets the block size and STmin, see isotp.c.
+ *
+ * With --capture, every frame seen on each --iface, sent or received, is
+ * logged to a compact binary file. Frames are read in blocks from a memory
+ * mapped packet socket ring rather than one syscall per frame, and written
+ * out in large blocks from a separate thread, see capture.c.
+ *
+ * A log can be sent back out with --replay, with the original timing between
+ * frames or, with --fast, as quickly as the bus allows. The log is memory
+ * mapped and carries a time index, so --seek can start part way in to a
+ * capture of many GB straight away. Timed replay, and the benchmark at a
+ * --rate, send each frame at an absolute deadline, sleeping with
+ * clock_nanosleep() and spinning out the last few tens of us, and report
+ * the scheduling error. For replay, --txtime instead hands frames to the
+ * kernel early with an SO_TXTIME launch time for an ETF qdisc, see
+ * txsched.h.
+ *
+ * The --monitor mode receives everything on each --iface, and --stats
+ * reports on what it sees every interval: frames and rates per CAN ID, bus
+ * load, error frames by class, and frames the kernel dropped. The same can
+ * be had from --ecu alongside the emulation. Reports are a line of JSON on
+ * stdout, or with --stats-shm, kept in a shared memory segment for other
+ * processes to read, see stats.h.
+ *
+ * With --dbc, --monitor also decodes the signals described in a DBC file
+ * from every frame, in to a store that --dbc-shm puts in shared memory for
+ * other processes to read without opening a socket of their own, see dbc.h.
+ *
+ * With --vehicle, --ecu simulates a whole vehicle rather than the one ECU,
+ * any number of ECUs each with their own CAN IDs and PIDs as described in a
+ * file, with the response to each request found by hash, see vehicle.h.
+ * Each PID's value can come from a signal generator, a sine, ramp, recorded
+ * trace, and so on, so that whatever reads them can check what it gets.
+ * Periodic frames in the vehicle are sent by the kernel's broadcast manager,
+ * which can also watch frames and only wake this up when they change.
+ *
+ * The --bridge mode forwards frames between the --iface interfaces by the
+ * rules in a file, rewriting IDs and limiting rates as they say. Rules that
+ * need neither a rate limit nor timing are handed to the kernel's CAN_GW
+ * where it is available, see bridge.h.
+ *
+ * Every socket counts the frames it drops because its receive buffer was
+ * full, that is, because they were not read quickly enough, apart from
+ * frames the interface itself lost. The buffers can be sized with --rcvbuf
+ * and --sndbuf, and --rcvbuf-grow doubles the receive buffer each time the
+ * socket drops frames, up to the size given.
+ *
+ * With --daemon, --ecu runs as a service: it can be started with its
+ * sockets already open by the socket activation protocol, carries on past
+ * the interface going down or its queue filling, and reloads --vehicle on
+ * SIGHUP without stopping responses, see daemon.h.
  */
 
-#include <assert.h>
+#define _GNU_SOURCE
+
 #include <getopt.h>
-#include <linux/can.h>
-#include <net/if.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
-#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <time.h>
-#include <unistd.h>
 
-#ifndef RELEASE
-#define RELEASE "Unknown"
-#endif
+#include "bcm.h"
+#include "bench.h"
+#include "bridge.h"
+#include "canio.h"
+#include "canlink.h"
+#include "capture.h"
+#include "daemon.h"
+#include "dbc.h"
+#include "ecu.h"
+#include "evloop.h"
+#include "isotp.h"
+#include "obd.h"
+#include "query.h"
+#include "replay.h"
+#include "stats.h"
+#include "trace.h"
+#include "uring.h"
+#include "vehicle.h"
+#include "worker.h"
+
+/* Upper limit of interfaces --ecu can emulate on at once */
+#define MAX_IFACES	8
+
+/* Options with no short form, out of the range of any character */
+#define OPT_DAEMON	0x100
 
 static void usage(char **argv)
 {
@@ -43,14 +176,150 @@ static void usage(char **argv)
 		"Version %s - Built: " __DATE__ "\n\n"
 		"embeddedTS CAN example application\n"
 		"Usage:\n"
-		"  %s [(--ecu | --query) --iface <iface>]\n"
+		"  %s [(--ecu | --query) --iface <iface> ...]\n"
+		"  %s --capture <file> --iface <iface> ...\n"
+		"  %s --replay <file> --iface <iface> ...\n"
+		"  %s --monitor --iface <iface> ...\n"
+		"  %s --bridge <file> --iface <iface> ...\n"
 		"  %s --help\n"
 		"\n"
-		"  -i, --iface <iface>        Specify single interface to use\n"
+		"  -i, --iface <iface>        Specify interface to use, may be given\n"
+		"                             up to %d times with --ecu\n"
 		"  -e, --ecu                  Emulate ECU RPM on <iface>\n"
 		"  -q, --query                Query ECU RPM on <iface>\n"
+		"  -b, --batch <n>            Receive up to <n> frames per syscall\n"
+		"                             when emulating an ECU (1-%d, default 1)\n"
+		"  -n, --burst <n>            Send <n> queries at once when querying\n"
+		"                             (1-%d, default 1)\n"
+		"  -t, --latency              Report query to response round trip\n"
+		"                             latency from RX timestamps\n"
+		"  -B, --bench                Run a sustained loopback benchmark\n"
+		"  -d, --duration <s>         Length of benchmark (default %d s)\n"
+		"  -c, --count <n>            Stop benchmark or pipelined query\n"
+		"                             after <n> queries\n"
+		"  -r, --rate <n>             Target benchmark queries per second\n"
+		"                             (default 0, as fast as possible)\n"
+		"  -R, --bitrate <bps>        Bus bitrate, used for utilization\n"
+		"                             (default 500000)\n"
+		"  -w, --window <n>           Pipelined query, up to <n> queries in\n"
+		"                             flight at once (1-%d, default %d)\n"
+		"  -p, --pids <list>          Pipelined query, comma separated list\n"
+		"                             of hex PIDs to query (default 0c)\n"
+		"  -a, --target <list>        Pipelined query, comma separated list\n"
+		"                             of ECUs 0-7 to address directly\n"
+		"                             (default functional address 0x7df)\n"
+		"  -P, --period <ms>          Pipelined query, repeat each query\n"
+		"                             every <ms> (default 0, only once)\n"
+		"  -T, --timeout <ms>         Pipelined query, time to wait for each\n"
+		"                             response (default %d)\n"
+		"  -O, --bus-load <pct>       Pipelined query, keep our queries\n"
+		"                             under <pct> of the bus, backing off\n"
+		"                             on overflows and ENOBUFS. Bit rates\n"
+		"                             are read from the interface, or\n"
+		"                             --bitrate and --dbitrate if it has\n"
+		"                             none\n"
+		"  -L, --list-pids            List the PIDs that can be decoded and\n"
+		"                             emulated\n"
+		"  -f, --filter <id:mask>     Also receive frames matching <id:mask>,\n"
+		"                             or not matching with <id~mask>, hex.\n"
+		"                             May be given up to %d times\n",
+		RELEASE, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0],
+		MAX_IFACES,
+		MAX_BATCH, MAX_BATCH, BENCH_DURATION_S, PIPE_MAX_REQS,
+		PIPE_WINDOW, PIPE_TIMEOUT_MS, MAX_FILTERS
+	);
+
+	fprintf(stderr,
+		"  -j, --threads              With --ecu, service each interface\n"
+		"                             from its own worker thread\n"
+		"  -C, --cpus <list>          Comma separated list of CPUs to pin\n"
+		"                             each worker to in --iface order, or\n"
+		"                             the only thread to the first one\n"
+		"  -F, --fifo <prio>          Run under SCHED_FIFO at <prio> (1-99)\n"
+		"  -U, --uring                With --ecu, service every interface\n"
+		"                             with io_uring rather than epoll,\n"
+		"                             if built with liburing\n"
+		"  -s, --spin                 With --ecu, busy poll the sockets\n"
+		"                             rather than sleep in epoll_wait()\n"
+		"  -u, --busy-poll <us>       With --ecu, set SO_BUSY_POLL to <us>\n"
+		"  -m, --mlock                Lock all memory with mlockall()\n"
+		"  -x, --fd                   Use CAN FD frames with bit rate\n"
+		"                             switching, the FD loopback test and\n"
+		"                             benchmark send %d byte frames\n"
+		"  -D, --dbitrate <bps>       FD data phase bitrate, used for\n"
+		"                             utilization (default 2000000)\n"
+		"  -I, --isotp                Run an ISO-TP transfer benchmark\n"
+		"  -S, --size <n>             ISO-TP message size in bytes\n"
+		"                             (1-%d, default %d)\n"
+		"  -K, --block-size <n>       ISO-TP flow control block size\n"
+		"                             (0-255, default 0, no limit)\n"
+		"  -M, --stmin <n>            ISO-TP flow control STmin byte, 0-0x7f\n"
+		"                             ms or 0xf1-0xf9 for 100-900 us\n"
+		"                             (default 0)\n"
+		"  -o, --capture <file>       Log every frame on each <iface> to\n"
+		"                             <file>, needs CAP_NET_RAW\n"
+		"  -y, --replay <file>        Send the frames logged in <file> out\n"
+		"                             on each <iface>\n"
+		"  -k, --seek <s>             Start replay <s> in to the log\n"
+		"  -A, --fast                 Replay as fast as possible, rather\n"
+		"                             than with the logged timing\n"
+		"  -X, --txtime <us>          Replay with SO_TXTIME launch times,\n"
+		"                             queueing frames <us> ahead, needs an\n"
+		"                             ETF qdisc on each <iface>\n"
+		"  -N, --monitor              Receive every frame on each <iface>\n"
+		"                             and report statistics\n"
+		"  -z, --stats <ms>           Report statistics every <ms>, with\n"
+		"                             --monitor or --ecu (default %d)\n"
+		"  -W, --stats-shm <name>     Keep statistics in shared memory\n"
+		"                             <name> rather than print them\n"
+		"  -J, --dbc <file>           With --monitor, decode the signals\n"
+		"                             described in DBC <file>\n"
+		"  -Y, --dbc-shm <name>       Keep the decoded signals in shared\n"
+		"                             memory <name>\n"
+		"  -g, --rcvbuf <bytes>       Socket receive buffer size\n"
+		"  -l, --sndbuf <bytes>       Socket transmit buffer size\n"
+		"  -G, --rcvbuf-grow <bytes>  Double the receive buffer whenever\n"
+		"                             the socket drops frames, up to\n"
+		"                             <bytes>. Past the rmem_max sysctl\n"
+		"                             needs CAP_NET_ADMIN\n",
+		BENCH_FD_LEN, ISOTP_MAX_LEN, ISOTP_BENCH_SIZE, STATS_INTERVAL_MS
+	);
+
+	fprintf(stderr,
+		"  -v, --vehicle <file>       With --ecu, simulate the ECUs\n"
+		"                             described in <file>, along with\n"
+		"                             any periodic frames and watches\n"
+		"                             it lists, run by the kernel BCM\n"
+		"  -E, --backend <backend>    Run the loopback test, --bench,\n"
+		"                             and --isotp over can (can0 and\n"
+		"                             can1, the default), vcan (one\n"
+		"                             vcan0), vxcan (a vxcan0-vxcan1\n"
+		"                             pair), or socketpair (no kernel\n"
+		"                             CAN at all). vcan and vxcan are\n"
+		"                             created if they do not exist,\n"
+		"                             which needs CAP_NET_ADMIN\n"
+		"  -H, --link-setup           Set each <iface> to --bitrate, and\n"
+		"                             with --fd to --dbitrate, bring it\n"
+		"                             up, and wait for it to become\n"
+		"                             ERROR-ACTIVE before starting. Needs\n"
+		"                             CAP_NET_ADMIN\n"
+		"  -Q, --sample-point <pct>[,<pct>]\n"
+		"                             With --link-setup, the sample point\n"
+		"                             and FD data phase sample point, in\n"
+		"                             percent (default, driver's choice)\n"
+		"  -V, --restart-ms <ms>      With --link-setup, restart <ms> after\n"
+		"                             going bus off (default 0, never)\n"
+		"  -Z, --bridge <file>        Forward frames between each <iface>\n"
+		"                             by the rules in <file>\n"
+		"      --daemon               Run --ecu as a service, on any\n"
+		"                             sockets passed by socket activation,\n"
+		"                             through transient errors, and\n"
+		"                             reloading --vehicle on SIGHUP\n"
 		"  -h, --help                 This message\n"
 		"\n"
+	);
+
+	fprintf(stderr,
 		"  With no options specified, attempts to open both can0 and can1\n"
 		"  interfaces and do a simple one-shot loopback test between the\n"
 		"  two.\n"
@@ -58,122 +327,428 @@ static void usage(char **argv)
 		"  Only one of --ecu or --query can be specified, and if either are\n"
 		"  specified, then --iface must be as well. The --ecu instance\n"
 		"  will continue to run and await queries on the interface and\n"
-		"  respond to them.\n"
+		"  respond to them. On exit, a count of frames received and sent\n"
+		"  per syscall is printed. Given more than one --iface, --ecu\n"
+		"  emulates an ECU on each of them at once, either from one thread\n"
+		"  or, with --threads, from a thread per interface. With --latency,\n"
+		"  --ecu reports the time from receiving each request to its\n"
+		"  response going out on the bus.\n"
+		"\n"
+		"  The --bench mode runs between can0 and can1 like the loopback\n"
+		"  test, until --duration or --count is reached. The number of\n"
+		"  queries in flight at once is set by --burst, and frames\n"
+		"  received per syscall by --batch.\n"
+		"\n"
+		"  Any of the pipelined query options make --query send every\n"
+		"  PID to every target, keeping up to --window queries in flight\n"
+		"  and matching responses back by ECU and PID. A summary for each\n"
+		"  query is printed at the end, Ctrl-C ends a periodic query.\n"
+		"\n"
+		"  The --isotp mode sends --size byte ISO-TP messages from can0 to\n"
+		"  can1 until --duration or --count is reached, and reports the\n"
+		"  throughput for the --block-size and --stmin given.\n"
+		"\n"
+		"  The --capture mode may be given up to %d interfaces, and logs\n"
+		"  until --duration is reached or it is interrupted.\n"
+		"\n"
+		"  The --replay mode sends a log from --capture out on a single\n"
+		"  --iface, or given more than one, each interface in the log out\n"
+		"  on the matching --iface. --duration and --count limit how much\n"
+		"  is sent, and --batch how many frames go out per syscall.\n"
+		"\n"
+		"  The --monitor mode may be given up to %d interfaces, and runs\n"
+		"  until --duration is reached or it is interrupted. Statistics\n"
+		"  are counted over all of the interfaces together, rates and bus\n"
+		"  load over the last %d reports. --stats is not supported with\n"
+		"  --threads.\n"
+		"\n"
+		"  The --bridge mode may be given up to %d interfaces, can0 and\n"
+		"  can1 if none are, and runs until --duration is reached or it\n"
+		"  is interrupted. With --latency, the time from each frame\n"
+		"  being received to it going out again is reported per rule,\n"
+		"  and every rule is forwarded in userspace, as with --fd.\n"
+		"\n"
+		"  The virtual --backend choices have no bit rate, so the query\n"
+		"  and ECU code can be pushed as hard as the CPU allows. Over a\n"
+		"  socketpair, frames are never echoed back, so --bench can not\n"
+		"  measure round trip latency.\n"
 		"\n",
-		RELEASE, argv[0], argv[0]
+		MAX_IFACES, MAX_IFACES, MAX_IFACES, STATS_WINDOW
 	);
 }
 
-static signed int test_and_bind(int sock, struct ifreq *ifr,
-				struct sockaddr_can *addr, char *iface)
+static void list_pids(void)
 {
-	/* Write the interface name to the struct, this is used by ioctl to find
-	 * the interface index if it exists.
-	 */
-	memset(ifr->ifr_name, '\0', IFNAMSIZ);
-	strncpy(ifr->ifr_name, iface, IFNAMSIZ-1);
+	const struct obd_pid *info;
+	int pid;
 
-	if (ioctl(sock, SIOCGIFINDEX, ifr) < 0) {
-		fprintf(stderr, "Unable to open iface %s: ", iface);
-		perror("");
-		return -1;
+	for (pid = 0; pid < 256; pid++) {
+		info = obd_pid_info(pid);
+		if (!info)
+			continue;
+
+		printf("  0x%02x  %d byte%s  %s%s%s%s\n", pid, info->len,
+			info->len > 1 ? "s" : " ", info->name,
+			info->unit[0] ? " (" : "", info->unit,
+			info->unit[0] ? ")" : "");
 	}
-	addr->can_family = AF_CAN;
-	addr->can_ifindex = ifr->ifr_ifindex;
+}
 
-	/* Now, bind the interface to the socket for use */
-	if (bind(sock, (struct sockaddr *)addr, sizeof(struct sockaddr_can)) < 0) {
-		fprintf(stderr, "Unable to bind on iface %s: ", iface);
-		perror("");
-		return -1;
+/* Parse a comma separated list of numbers in to dest, returns the number of
+ * entries or -1 if any are not valid.
+ */
+static signed int parse_list(const char *str, int base, unsigned long max,
+			     int *dest, int size)
+{
+	char *end;
+	unsigned long val;
+	int n = 0;
+
+	while (*str) {
+		val = strtoul(str, &end, base);
+		if (end == str || val > max || n >= size ||
+		  (*end != ',' && *end != '\0'))
+			return -1;
+
+		dest[n++] = val;
+		str = *end ? end + 1 : end;
 	}
 
-	return 0;
+	return n;
 }
 
-static signed int poll_sock_fd(int fd_epoll, struct epoll_event *event,
-				int expected_fd, int err_on_timeout)
+/* Parse a sample point in percent, optionally followed by a comma and the
+ * data phase sample point, in to tenths of a percent.
+ */
+static signed int parse_sample_points(const char *str, struct canlink_cfg *cfg)
 {
-	int num_events;
+	double sp, dsp = 0;
+	char *end;
 
-	num_events = epoll_wait(fd_epoll, event, 1, 1000);
-	if (num_events < 0) {
-		fprintf(stderr, "epoll_wait error on %d: ", expected_fd);
-		perror("");
-		return -1;
+	sp = strtod(str, &end);
+	if (end != str && *end == ',') {
+		str = end + 1;
+		dsp = strtod(str, &end);
+		if (end == str)
+			return -1;
 	}
+	if (*end != '\0' || sp <= 0 || sp >= 100 || dsp < 0 || dsp >= 100)
+		return -1;
+
+	cfg->sample_point = sp * 10 + 0.5;
+	cfg->dsample_point = dsp * 10 + 0.5;
+
+	return 0;
+}
+
+static void close_ports(struct can_port *ports, int nports,
+			struct capture *cap)
+{
+	int i;
+
+	for (i = 0; i < nports; i++)
+		can_port_close(&ports[i]);
+
+	if (cap)
+		capture_close(cap);
+}
+
+static void close_bcm(struct bcm_port *bps, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		bcm_close(&bps[i]);
+}
+
+/* Have the kernel send the vehicle's periodic frames, and watch for changes,
+ * on the interface of each port.
+ */
+static signed int open_bcm(struct bcm_port *bps, const struct can_port *ports,
+			   int nports, const struct vehicle *v)
+{
+	unsigned int j;
+	int i;
 
-	if (num_events == 0) {
-		if (err_on_timeout) {
-			fprintf(stderr, "Timeout waiting for receive on %d!\n",
-				expected_fd);
+	for (i = 0; i < nports; i++) {
+		if (bcm_open(&bps[i], ports[i].iface) < 0) {
+			close_bcm(bps, i);
 			return -1;
-		} else {
-			return 0;
+		}
+
+		for (j = 0; j < v->nperiodic; j++) {
+			if (bcm_tx_setup(&bps[i], &v->periodic[j]) < 0) {
+				close_bcm(bps, i + 1);
+				return -1;
+			}
+		}
+
+		for (j = 0; j < v->nwatches; j++) {
+			if (bcm_rx_setup(&bps[i], &v->watches[j]) < 0) {
+				close_bcm(bps, i + 1);
+				return -1;
+			}
 		}
 	}
 
-	/* Check that the event was on the expected FD */
-	if (event[0].data.fd != expected_fd) {
-		fprintf(stderr, "Received event on unexpected socket! "
-			"Expected: %d, Got: %d\n",
-			expected_fd, event[0].data.fd);
+	return 0;
+}
+
+/* The bus load limit goes by the bit rates the interface is actually set
+ * to, where it has them to give.
+ */
+static void pipe_bitrates(struct pipe_cfg *pipe, const struct can_port *port,
+			  const struct bench_cfg *bench)
+{
+	pipe->bitrate = bench->bitrate;
+	pipe->dbitrate = bench->dbitrate;
+
+	if (port->local || canlink_get_bitrate(port->iface, &pipe->bitrate,
+	  &pipe->dbitrate) < 0 || !pipe->bitrate) {
+		pipe->bitrate = bench->bitrate;
+		pipe->dbitrate = bench->dbitrate;
+		fprintf(stderr, "No bit rate set on %s, limiting bus load at "
+			"%u bit/s\n", port->iface, pipe->bitrate);
+		return;
+	}
+
+	if (!pipe->dbitrate)
+		pipe->dbitrate = bench->dbitrate;
+}
+
+/* Set up what the local loopback runs over, and name the interfaces the
+ * query and ECU ports are to be opened on.
+ */
+static signed int setup_backend(const char *backend, const char **query_iface,
+				const char **ecu_iface)
+{
+	if (!strcmp(backend, "can")) {
+		*query_iface = "can0";
+		*ecu_iface = "can1";
+	} else if (!strcmp(backend, "vcan")) {
+		if (canlink_create("vcan0", "vcan", NULL) < 0 ||
+		  canlink_set_up("vcan0") < 0)
+			return -1;
+		*query_iface = "vcan0";
+		*ecu_iface = "vcan0";
+	} else if (!strcmp(backend, "vxcan")) {
+		if (canlink_create("vxcan0", "vxcan", "vxcan1") < 0 ||
+		  canlink_set_up("vxcan0") < 0 || canlink_set_up("vxcan1") < 0)
+			return -1;
+		*query_iface = "vxcan0";
+		*ecu_iface = "vxcan1";
+	} else if (!strcmp(backend, "socketpair")) {
+		if (can_local_pair("pair0", "pair1") < 0)
+			return -1;
+		*query_iface = "pair0";
+		*ecu_iface = "pair1";
+	} else {
+		fprintf(stderr, "Error! Unknown --backend %s!\n", backend);
 		return -1;
 	}
 
-	return num_events;
+	return 0;
 }
 
+/* Run the ECU emulation with one worker thread per port, until interrupted
+ * or any worker fails.
+ */
+static signed int run_ecu_workers(struct can_port *ports, int nports,
+				  const int *cpus, int ncpus, int prio,
+				  int spin)
+{
+	static struct worker workers[MAX_IFACES];
+	int ret = 0;
+	int i;
+
+	for (i = 0; i < nports; i++) {
+		worker_init(&workers[i], &ports[i], i < ncpus ? cpus[i] : -1,
+			    prio, spin);
+		if (worker_start(&workers[i]) < 0) {
+			keep_running = 0;
+			ret = -1;
+			break;
+		}
+	}
+
+	for (i = 0; i < nports; i++) {
+		if (worker_join(&workers[i]) < 0)
+			ret = -1;
+	}
+
+	for (i = 0; i < nports; i++) {
+		can_port_print_stats(&ports[i]);
+		ecu_print_latency(&ports[i]);
+	}
+	workers_print_stats(workers, nports);
+
+	return ret;
+}
 
 int main(int argc, char **argv)
 {
-	/* ECU emulation related */
-	int ecu_recv_sock = 0;
-	struct sockaddr_can ecu_recv_addr;
-	struct epoll_event ecu_recv_event = {
-		.events = EPOLLIN,
-	};
-
-	/* Query mode related */
-	int query_recv_sock = 0;
-	struct sockaddr_can query_recv_addr;
-	struct epoll_event query_recv_event = {
-		.events = EPOLLIN,
-	};
+	/* Port related, one per interface for --ecu, otherwise a query port
+	 * and, for the loopback test and benchmark, an ECU port.
+	 */
+	static struct can_port ports[MAX_IFACES];
+	static struct ecu_state ecu_states[MAX_IFACES];
+	struct can_port *query = NULL;
+	struct can_port *ecu = NULL;
+	char opt_ifaces[MAX_IFACES][IFNAMSIZ];
+	int nifaces = 0;
+	int nports = 0;
 
-	/* msghdr related */
-	struct can_frame frame;
-	struct ifreq ifr;
-	struct iovec iov;
-	struct msghdr msg;
-	char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) + CMSG_SPACE(sizeof(__u32))];
+	/* Filter related */
+	struct can_filter opt_filters[MAX_FILTERS];
+	int nfilters = 0;
 
-	/* epoll related */
-	int fd_epoll = 0;
-	int nbytes;
-	struct epoll_event events_pending[1];
-	int num_events = 0;
+	/* Event loop and thread related */
+	struct evloop loop;
+	int opt_threads = 0;
+	int opt_cpus[MAX_IFACES];
+	int ncpus = 0;
+	int opt_prio = 0;
+	int opt_spin = 0;
+	int opt_busy_poll = 0;
+	int opt_mlock = 0;
 
 	/* Program flow related */
 	int c;
+	int n, i;
 	int opt_ecu = 0;
 	int opt_query = 0;
 	int opt_loopback = 0;
-	char opt_iface[IFNAMSIZ] = {0};
-	int ret = 1;
+	int opt_batch = 1;
+	int opt_burst = 1;
+	int opt_latency = 0;
+	int opt_bench = 0;
+	struct bench_cfg bench = {
+		.bitrate = 500000,
+		.dbitrate = 2000000,
+	};
+	int opt_fd = 0;
+	int opt_isotp = 0;
+	static struct capture capture;
+	struct capture *cap = NULL;
+	const char *opt_capture = NULL;
+	static struct canlog log;
+	const char *opt_replay = NULL;
+	struct replay_cfg replay = { 0 };
+	double seek_s;
+	int opt_monitor = 0;
+	unsigned int opt_stats_ms = 0;
+	const char *opt_stats_shm = NULL;
+	static struct stats stats;
+	struct stats *st = NULL;
+	int opt_rcvbuf = 0;
+	int opt_sndbuf = 0;
+	int opt_rcvbuf_max = 0;
+	static struct vehicle vehicle;
+	const char *opt_vehicle = NULL;
+	static struct bcm_port bcm_ports[MAX_IFACES];
+	int nbcm = 0;
+	const char *opt_backend = NULL;
+	int opt_link_setup = 0;
+	struct canlink_cfg link = { .timeout_ms = CANLINK_TIMEOUT_MS };
+	int opt_uring = 0;
+	int opt_daemon = 0;
+	static struct ecu_daemon ecud;
+	char inherited[MAX_IFACES][IFNAMSIZ];
+	int ninherited = 0;
+	static struct bridge bridge;
+	const char *opt_bridge = NULL;
+	static struct dbc dbc;
+	const char *opt_dbc = NULL;
+	const char *opt_dbc_shm = NULL;
+#ifdef HAVE_LIBURING
+	static struct uring_loop uring;
+#endif
+	const char *query_iface = "can0";
+	const char *ecu_iface = "can1";
+	struct isotp_bench_cfg isotp = {
+		.size = ISOTP_BENCH_SIZE,
+	};
+	unsigned long val;
+	int opt_pipeline = 0;
+	int list[PIPE_MAX_REQS];
+	struct pipe_cfg pipe = {
+		.pids = { 0x0c },
+		.npids = 1,
+		.ecus = { -1 },
+		.necus = 1,
+		.window = PIPE_WINDOW,
+		.timeout_ms = PIPE_TIMEOUT_MS,
+	};
+	int ret = 0;
 
 	static struct option long_options[] = {
 		{ "iface",	required_argument, 	NULL, 'i' },
 		{ "ecu",	no_argument,		NULL, 'e' },
 		{ "query",	no_argument,		NULL, 'q' },
+		{ "batch",	required_argument,	NULL, 'b' },
+		{ "burst",	required_argument,	NULL, 'n' },
+		{ "latency",	no_argument,		NULL, 't' },
+		{ "bench",	no_argument,		NULL, 'B' },
+		{ "duration",	required_argument,	NULL, 'd' },
+		{ "count",	required_argument,	NULL, 'c' },
+		{ "rate",	required_argument,	NULL, 'r' },
+		{ "bitrate",	required_argument,	NULL, 'R' },
+		{ "window",	required_argument,	NULL, 'w' },
+		{ "pids",	required_argument,	NULL, 'p' },
+		{ "target",	required_argument,	NULL, 'a' },
+		{ "period",	required_argument,	NULL, 'P' },
+		{ "timeout",	required_argument,	NULL, 'T' },
+		{ "bus-load",	required_argument,	NULL, 'O' },
+		{ "list-pids",	no_argument,		NULL, 'L' },
+		{ "filter",	required_argument,	NULL, 'f' },
+		{ "threads",	no_argument,		NULL, 'j' },
+		{ "uring",	no_argument,		NULL, 'U' },
+		{ "cpus",	required_argument,	NULL, 'C' },
+		{ "fifo",	required_argument,	NULL, 'F' },
+		{ "spin",	no_argument,		NULL, 's' },
+		{ "busy-poll",	required_argument,	NULL, 'u' },
+		{ "mlock",	no_argument,		NULL, 'm' },
+		{ "fd",		no_argument,		NULL, 'x' },
+		{ "dbitrate",	required_argument,	NULL, 'D' },
+		{ "isotp",	no_argument,		NULL, 'I' },
+		{ "size",	required_argument,	NULL, 'S' },
+		{ "block-size",	required_argument,	NULL, 'K' },
+		{ "stmin",	required_argument,	NULL, 'M' },
+		{ "capture",	required_argument,	NULL, 'o' },
+		{ "replay",	required_argument,	NULL, 'y' },
+		{ "seek",	required_argument,	NULL, 'k' },
+		{ "fast",	no_argument,		NULL, 'A' },
+		{ "txtime",	required_argument,	NULL, 'X' },
+		{ "monitor",	no_argument,		NULL, 'N' },
+		{ "stats",	required_argument,	NULL, 'z' },
+		{ "stats-shm",	required_argument,	NULL, 'W' },
+		{ "dbc",	required_argument,	NULL, 'J' },
+		{ "dbc-shm",	required_argument,	NULL, 'Y' },
+		{ "rcvbuf",	required_argument,	NULL, 'g' },
+		{ "sndbuf",	required_argument,	NULL, 'l' },
+		{ "rcvbuf-grow", required_argument,	NULL, 'G' },
+		{ "vehicle",	required_argument,	NULL, 'v' },
+		{ "backend",	required_argument,	NULL, 'E' },
+		{ "link-setup",	no_argument,		NULL, 'H' },
+		{ "sample-point", required_argument,	NULL, 'Q' },
+		{ "restart-ms",	required_argument,	NULL, 'V' },
+		{ "bridge",	required_argument,	NULL, 'Z' },
+		{ "daemon",	no_argument,		NULL, OPT_DAEMON },
 		{ "help",	no_argument,		NULL, 'h' },
 		{NULL},
 	};
 
-	while((c = getopt_long(argc, argv, "i:eqh", long_options, NULL)) != -1) {
+	while((c = getopt_long(argc, argv, "i:eqb:n:tBd:c:r:R:w:p:a:P:T:O:Lf:jC:F:su:mxD:IS:K:M:o:y:k:AX:Nz:W:J:Y:g:l:G:v:E:HQ:V:Z:Uh", long_options, NULL)) != -1) {
 		switch(c) {
 		case 'i':
-			strncpy(opt_iface, optarg, sizeof(opt_iface)-1);
+			if (nifaces >= MAX_IFACES) {
+				fprintf(stderr, "Error! --iface may be given at "
+					"most %d times!\n", MAX_IFACES);
+				return 1;
+			}
+			memset(opt_ifaces[nifaces], '\0', IFNAMSIZ);
+			strncpy(opt_ifaces[nifaces], optarg, IFNAMSIZ-1);
+			nifaces++;
 			break;
 		case 'e':
 			opt_ecu = 1;
@@ -181,6 +756,249 @@ int main(int argc, char **argv)
 		case 'q':
 			opt_query = 1;
 			break;
+		case 'b':
+			opt_batch = atoi(optarg);
+			break;
+		case 'n':
+			opt_burst = atoi(optarg);
+			break;
+		case 't':
+			opt_latency = 1;
+			break;
+		case 'B':
+			opt_bench = 1;
+			break;
+		case 'd':
+			bench.duration_s = atoi(optarg);
+			break;
+		case 'c':
+			bench.count = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			bench.rate = atoi(optarg);
+			break;
+		case 'R':
+			bench.bitrate = atoi(optarg);
+			break;
+		case 'w':
+			pipe.window = atoi(optarg);
+			opt_pipeline = 1;
+			break;
+		case 'p':
+			n = parse_list(optarg, 16, 0xFF, list, PIPE_MAX_REQS);
+			if (n <= 0) {
+				fprintf(stderr, "Error! Invalid PID list '%s'!\n",
+					optarg);
+				return 1;
+			}
+			for (i = 0; i < n; i++)
+				pipe.pids[i] = list[i];
+			pipe.npids = n;
+			opt_pipeline = 1;
+			break;
+		case 'a':
+			n = parse_list(optarg, 0, PIPE_MAX_ECUS - 1, pipe.ecus,
+				       PIPE_MAX_ECUS);
+			if (n <= 0) {
+				fprintf(stderr, "Error! Invalid target list '%s'!\n",
+					optarg);
+				return 1;
+			}
+			pipe.necus = n;
+			opt_pipeline = 1;
+			break;
+		case 'P':
+			pipe.period_ms = atoi(optarg);
+			opt_pipeline = 1;
+			break;
+		case 'T':
+			pipe.timeout_ms = atoi(optarg);
+			opt_pipeline = 1;
+			break;
+		case 'O':
+			pipe.bus_load = atoi(optarg);
+			opt_pipeline = 1;
+			if (pipe.bus_load < 1 || pipe.bus_load > 100) {
+				fprintf(stderr, "Error! --bus-load must be "
+					"between 1 and 100!\n");
+				return 1;
+			}
+			break;
+		case 'L':
+			list_pids();
+			return 0;
+		case 'f':
+			if (nfilters >= MAX_FILTERS ||
+			  parse_filter(optarg, &opt_filters[nfilters]) < 0) {
+				fprintf(stderr, "Error! Invalid or too many "
+					"filters at '%s'!\n", optarg);
+				return 1;
+			}
+			nfilters++;
+			break;
+		case 'j':
+			opt_threads = 1;
+			break;
+		case 'U':
+			opt_uring = 1;
+			break;
+		case 'C':
+			ncpus = parse_list(optarg, 0, CPU_SETSIZE - 1, opt_cpus,
+					   MAX_IFACES);
+			if (ncpus <= 0) {
+				fprintf(stderr, "Error! Invalid CPU list '%s'!\n",
+					optarg);
+				return 1;
+			}
+			break;
+		case 'F':
+			opt_prio = atoi(optarg);
+			if (opt_prio < 1 || opt_prio > 99) {
+				fprintf(stderr, "Error! --fifo must be between 1 "
+					"and 99!\n");
+				return 1;
+			}
+			break;
+		case 's':
+			opt_spin = 1;
+			break;
+		case 'u':
+			opt_busy_poll = atoi(optarg);
+			if (opt_busy_poll < 1) {
+				fprintf(stderr, "Error! --busy-poll must be "
+					"non-zero!\n");
+				return 1;
+			}
+			break;
+		case 'm':
+			opt_mlock = 1;
+			break;
+		case 'x':
+			opt_fd = 1;
+			break;
+		case 'D':
+			bench.dbitrate = atoi(optarg);
+			break;
+		case 'I':
+			opt_isotp = 1;
+			break;
+		case 'S':
+			val = strtoul(optarg, NULL, 0);
+			if (val < 1 || val > ISOTP_MAX_LEN) {
+				fprintf(stderr, "Error! --size must be between 1 "
+					"and %d!\n", ISOTP_MAX_LEN);
+				return 1;
+			}
+			isotp.size = val;
+			break;
+		case 'K':
+			val = strtoul(optarg, NULL, 0);
+			if (val > 0xFF) {
+				fprintf(stderr, "Error! --block-size must be "
+					"between 0 and 255!\n");
+				return 1;
+			}
+			isotp.bs = val;
+			break;
+		case 'M':
+			val = strtoul(optarg, NULL, 0);
+			if ((val > 0x7f && val < 0xf1) || val > 0xf9) {
+				fprintf(stderr, "Error! --stmin must be 0-0x7f or "
+					"0xf1-0xf9!\n");
+				return 1;
+			}
+			isotp.stmin = val;
+			break;
+		case 'o':
+			opt_capture = optarg;
+			break;
+		case 'y':
+			opt_replay = optarg;
+			break;
+		case 'k':
+			seek_s = strtod(optarg, NULL);
+			if (seek_s < 0) {
+				fprintf(stderr, "Error! --seek may not be "
+					"negative!\n");
+				return 1;
+			}
+			replay.seek_ns = seek_s * 1e9;
+			break;
+		case 'A':
+			replay.fast = 1;
+			break;
+		case 'X':
+			replay.txtime_lead_ns = strtoull(optarg, NULL, 0) * 1000;
+			if (!replay.txtime_lead_ns) {
+				fprintf(stderr, "Error! --txtime must be "
+					"non-zero!\n");
+				return 1;
+			}
+			break;
+		case 'N':
+			opt_monitor = 1;
+			break;
+		case 'z':
+			opt_stats_ms = atoi(optarg);
+			if (opt_stats_ms < 1) {
+				fprintf(stderr, "Error! --stats must be "
+					"non-zero!\n");
+				return 1;
+			}
+			break;
+		case 'W':
+			opt_stats_shm = optarg;
+			break;
+		case 'J':
+			opt_dbc = optarg;
+			break;
+		case 'Y':
+			opt_dbc_shm = optarg;
+			break;
+		case 'g':
+		case 'l':
+		case 'G':
+			val = strtoul(optarg, NULL, 0);
+			if (val < 1 || val > INT_MAX) {
+				fprintf(stderr, "Error! --rcvbuf, --sndbuf, and "
+					"--rcvbuf-grow must be 1-%d bytes!\n",
+					INT_MAX);
+				return 1;
+			}
+			if (c == 'g')
+				opt_rcvbuf = val;
+			else if (c == 'l')
+				opt_sndbuf = val;
+			else
+				opt_rcvbuf_max = val;
+			break;
+		case 'v':
+			opt_vehicle = optarg;
+			break;
+		case 'E':
+			opt_backend = optarg;
+			break;
+		case 'H':
+			opt_link_setup = 1;
+			break;
+		case 'Q':
+			if (parse_sample_points(optarg, &link) < 0) {
+				fprintf(stderr, "Error! Invalid sample point "
+					"'%s'!\n", optarg);
+				return 1;
+			}
+			opt_link_setup = 1;
+			break;
+		case 'V':
+			link.restart_ms = atoi(optarg);
+			opt_link_setup = 1;
+			break;
+		case 'Z':
+			opt_bridge = optarg;
+			break;
+		case OPT_DAEMON:
+			opt_daemon = 1;
+			break;
 		case 'h':
 		default:
 			usage(argv);
@@ -195,165 +1013,597 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
-	if ((opt_ecu || opt_query) && opt_iface[0] == '\0') {
+	if (opt_bench && (opt_ecu || opt_query)) {
+		fprintf(stderr, "Error! --bench runs on can0 and can1, and may not "
+			"be used with --ecu or --query!\n");
+		return 1;
+	}
+
+	if (opt_isotp && (opt_ecu || opt_query || opt_bench)) {
+		fprintf(stderr, "Error! --isotp runs on can0 and can1, and may not "
+			"be used with --ecu, --query, or --bench!\n");
+		return 1;
+	}
+
+	if (opt_capture && (opt_ecu || opt_query || opt_bench || opt_isotp ||
+	  opt_pipeline)) {
+		fprintf(stderr, "Error! --capture may not be used with any other "
+			"mode!\n");
+		return 1;
+	}
+
+	if (opt_replay && (opt_ecu || opt_query || opt_bench || opt_isotp ||
+	  opt_pipeline || opt_capture)) {
+		fprintf(stderr, "Error! --replay may not be used with any other "
+			"mode!\n");
+		return 1;
+	}
+
+	if (opt_monitor && (opt_ecu || opt_query || opt_bench || opt_isotp ||
+	  opt_pipeline || opt_capture || opt_replay)) {
+		fprintf(stderr, "Error! --monitor may not be used with any other "
+			"mode!\n");
+		return 1;
+	}
+
+	if (opt_bridge && (opt_ecu || opt_query || opt_bench || opt_isotp ||
+	  opt_pipeline || opt_capture || opt_replay || opt_monitor)) {
+		fprintf(stderr, "Error! --bridge may not be used with any other "
+			"mode!\n");
+		return 1;
+	}
+
+	if (opt_bridge && nifaces == 1) {
+		fprintf(stderr, "Error! --bridge needs at least two "
+			"--iface!\n");
+		return 1;
+	}
+
+	if (opt_monitor && nifaces == 0) {
+		fprintf(stderr, "Error! --iface must be specified with "
+			"--monitor!\n");
+		return 1;
+	}
+
+	if ((opt_dbc || opt_dbc_shm) && (!opt_monitor || !opt_dbc)) {
+		fprintf(stderr, "Error! --dbc is only valid with --monitor, and "
+			"--dbc-shm with --dbc!\n");
+		return 1;
+	}
+
+	if (opt_stats_shm && !opt_stats_ms)
+		opt_stats_ms = STATS_INTERVAL_MS;
+	if (opt_monitor && !opt_stats_ms)
+		opt_stats_ms = STATS_INTERVAL_MS;
+
+	if (opt_stats_ms && !(opt_monitor || opt_ecu)) {
+		fprintf(stderr, "Error! --stats and --stats-shm are only valid "
+			"with --monitor or --ecu!\n");
+		return 1;
+	}
+
+	if (opt_stats_ms && opt_threads) {
+		fprintf(stderr, "Error! --stats is not supported with "
+			"--threads!\n");
+		return 1;
+	}
+
+	if (replay.txtime_lead_ns && (!opt_replay || replay.fast)) {
+		fprintf(stderr, "Error! --txtime is only valid for a timed "
+			"--replay!\n");
+		return 1;
+	}
+
+	if (opt_replay && nifaces == 0) {
+		fprintf(stderr, "Error! --iface must be specified with "
+			"--replay!\n");
+		return 1;
+	}
+
+	if (opt_capture && nifaces == 0) {
+		fprintf(stderr, "Error! --iface must be specified with "
+			"--capture!\n");
+		return 1;
+	}
+
+	if (opt_isotp && opt_fd) {
+		fprintf(stderr, "Error! --fd is not supported with --isotp!\n");
+		return 1;
+	}
+
+	if ((opt_bench || opt_stats_ms || pipe.bus_load) &&
+	  (bench.bitrate == 0 || bench.dbitrate == 0)) {
+		fprintf(stderr, "Error! --bitrate and --dbitrate must be "
+			"non-zero!\n");
+		return 1;
+	}
+
+	if (opt_fd && opt_pipeline) {
+		fprintf(stderr, "Error! --fd is not supported with pipelined "
+			"queries!\n");
+		return 1;
+	}
+
+	if (opt_pipeline && !opt_query) {
+		fprintf(stderr, "Error! Pipelined query options are only valid "
+			"with --query!\n");
+		return 1;
+	}
+
+	if (opt_pipeline && (pipe.window < 1 || pipe.window > PIPE_MAX_REQS ||
+	  pipe.timeout_ms < 1)) {
+		fprintf(stderr, "Error! --window must be between 1 and %d, and "
+			"--timeout non-zero!\n", PIPE_MAX_REQS);
+		return 1;
+	}
+
+	if (opt_daemon && (!opt_ecu || opt_threads || opt_uring)) {
+		fprintf(stderr, "Error! --daemon is only valid with --ecu, and "
+			"not with --threads or --uring!\n");
+		return 1;
+	}
+
+	/* Sockets passed to us stand in for --iface, when none are given */
+	if (opt_daemon) {
+		ninherited = daemon_listen_fds(nifaces ? inherited :
+					       opt_ifaces, MAX_IFACES);
+		if (ninherited < 0)
+			return 1;
+		if (nifaces == 0)
+			nifaces = ninherited;
+	}
+
+	if ((opt_ecu || opt_query) && nifaces == 0) {
 		fprintf(stderr, "Error! --iface must be specified with --ecu or "
 			"--query!\n");
 		return 1;
 	}
 
-	if (!(opt_ecu || opt_query))
-		opt_loopback = 1;
+	if (opt_link_setup && (nifaces == 0 || opt_backend)) {
+		fprintf(stderr, "Error! --link-setup needs --iface, and is not "
+			"valid with --backend!\n");
+		return 1;
+	}
 
-	/* Set up sockets */
-	if((query_recv_sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("Error opening send socket");
+	if (opt_link_setup && (bench.bitrate == 0 ||
+	  (opt_fd && bench.dbitrate == 0))) {
+		fprintf(stderr, "Error! --bitrate and --dbitrate must be "
+			"non-zero!\n");
 		return 1;
 	}
 
-	if((ecu_recv_sock = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
-		perror("Error opening recv socket");
-		close(query_recv_sock);
+	if (!opt_ecu && !opt_capture && !opt_replay && !opt_monitor &&
+	  !opt_bridge && nifaces > 1) {
+		fprintf(stderr, "Error! Only --ecu, --capture, --replay, "
+			"--monitor, and --bridge may be given more than one "
+			"--iface!\n");
+		return 1;
+	}
+
+	if (opt_vehicle && !opt_ecu) {
+		fprintf(stderr, "Error! --vehicle is only valid with --ecu!\n");
+		return 1;
+	}
+
+	if ((opt_threads || opt_spin || opt_busy_poll) && !opt_ecu) {
+		fprintf(stderr, "Error! --threads, --spin, and --busy-poll are "
+			"only valid with --ecu!\n");
 		return 1;
 	}
- 
-	if (opt_query) {
-		if (test_and_bind(query_recv_sock, &ifr, &query_recv_addr, opt_iface) < 0)
-			return 1;
-	} else if (opt_ecu) {
-		if (test_and_bind(ecu_recv_sock, &ifr, &ecu_recv_addr, opt_iface) < 0)
-			return 1;
-	/* Local loopback on can0 and can1 */
-	} else {
-		if (test_and_bind(query_recv_sock, &ifr, &query_recv_addr, "can0") < 0)
-			return 1;
 
-		if (test_and_bind(ecu_recv_sock, &ifr, &ecu_recv_addr, "can1") < 0)
+	if (opt_uring) {
+#ifndef HAVE_LIBURING
+		fprintf(stderr, "Error! --uring needs liburing, which this "
+			"was built without!\n");
+		return 1;
+#endif
+		if (!opt_ecu || opt_threads || opt_spin || opt_stats_ms) {
+			fprintf(stderr, "Error! --uring is only valid with "
+				"--ecu, and not with --threads, --spin, or "
+				"--stats!\n");
 			return 1;
+		}
 	}
 
-	/* Set up epoll FD handling */
-	fd_epoll = epoll_create1(0);
-	if (fd_epoll < 0) {
-		perror("Error creating epoll");
+	if (opt_batch < 1 || opt_batch > MAX_BATCH) {
+		fprintf(stderr, "Error! --batch must be between 1 and %d!\n",
+			MAX_BATCH);
 		return 1;
 	}
 
-	ecu_recv_event.data.fd = ecu_recv_sock;
-	if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, ecu_recv_sock, &ecu_recv_event) < 0) {
-		perror("Error adding ECU recv socket to epoll");
+	if (opt_burst < 1 || opt_burst > MAX_BATCH) {
+		fprintf(stderr, "Error! --burst must be between 1 and %d!\n",
+			MAX_BATCH);
 		return 1;
 	}
 
-	query_recv_event.data.fd = query_recv_sock;
-	if (epoll_ctl(fd_epoll, EPOLL_CTL_ADD, query_recv_sock, &query_recv_event) < 0) {
-		perror("Error adding query recv socket to epoll");
+	if (!(opt_ecu || opt_query || opt_capture || opt_replay || opt_monitor ||
+	  opt_bridge))
+		opt_loopback = 1;
+
+	if (opt_backend && !opt_loopback) {
+		fprintf(stderr, "Error! --backend is only valid with the "
+			"loopback test, --bench, and --isotp!\n");
 		return 1;
 	}
 
-	/* Set up message struct for receiving messages for parsing */
-	iov.iov_base = &frame;
-	msg.msg_iov = &iov;
-	msg.msg_iovlen = 1;
-	msg.msg_control = &ctrlmsg;
-	iov.iov_len = sizeof(frame);
-	msg.msg_namelen = sizeof(struct sockaddr_can);
-	msg.msg_controllen = sizeof(ctrlmsg);
-	msg.msg_flags = 0;
+	if (opt_bench) {
+		bench.window = opt_burst;
+		bench.fd = opt_fd;
+		if (!bench.duration_s && !bench.count)
+			bench.duration_s = BENCH_DURATION_S;
+		opt_latency = 1;
+	}
+
+	if (opt_isotp) {
+		isotp.duration_s = bench.duration_s;
+		isotp.count = bench.count;
+		if (!isotp.duration_s && !isotp.count)
+			isotp.duration_s = BENCH_DURATION_S;
+	}
 
-	/* Seed random RPM return value */
+	/* The loopback test is strictly one query and one response */
+	if (opt_loopback)
+		opt_burst = 1;
+
+	/* Seed random RPM return values, each ECU port seeds its own from this */
 	srandom(time(NULL));
 
-	while (1) {
-		ret = 1;
-		/* Send initial packet request if querying or in loopback mode */
-		if (opt_query || opt_loopback) {
-		 	/* For the ozen mOByDic 1610 this requests the RPM guage */
-			frame.can_id  = 0x7df;
-			frame.can_dlc = 3;
-			frame.data[0] = 3;
-			frame.data[1] = 1;
-			frame.data[2] = 0x0c;
- 
-			if (write(query_recv_sock, &frame, sizeof(struct can_frame)) < 0) {
-				perror("Error sending query");
-				break;
+	if (opt_vehicle) {
+		if (vehicle_load(&vehicle, opt_vehicle) < 0)
+			return 1;
+		vehicle_print(&vehicle);
+		ecu_set_vehicle(&vehicle);
+
+		/* Change and timeout notifications are printed from the event
+		 * loop, which the worker threads and io_uring do not have.
+		 */
+		if ((opt_threads || opt_uring) && vehicle.nwatches) {
+			fprintf(stderr, "Error! watch entries in --vehicle are "
+				"not supported with --threads or --uring!\n");
+			vehicle_close(&vehicle);
+			return 1;
+		}
+	}
+
+	/* Before any socket is opened, so the first frame sent goes out on a
+	 * controller that is already on the bus.
+	 */
+	if (opt_link_setup) {
+		link.bitrate = bench.bitrate;
+		link.dbitrate = bench.dbitrate;
+		link.fd = opt_fd;
+		for (i = 0; i < nifaces; i++) {
+			if (canlink_setup(opt_ifaces[i], &link) < 0)
+				return 1;
+		}
+	}
+
+	if (opt_backend && setup_backend(opt_backend, &query_iface,
+	  &ecu_iface) < 0) {
+		vehicle_close(&vehicle);
+		return 1;
+	}
+
+	/* Set up ports. Filters are set before binding, so that no unwanted
+	 * frames are queued in the short time between the two.
+	 */
+	if (opt_capture) {
+		/* Capture reads packet sockets, not CAN ports */
+		cap = &capture;
+		if (capture_open(cap, opt_ifaces, nifaces, opt_capture) < 0) {
+			close_ports(ports, nports, cap);
+			return 1;
+		}
+	} else if (opt_replay) {
+		if (canlog_open(&log, opt_replay) < 0) {
+			canlog_close(&log);
+			return 1;
+		}
+
+		/* Replay only sends, no filters lets nothing in */
+		for (i = 0; i < nifaces; i++, nports++) {
+			if (can_port_open(&ports[i], opt_ifaces[i], opt_batch,
+			  NULL, 0, NULL, 0, NULL, 0) < 0) {
+				close_ports(ports, nports, cap);
+				canlog_close(&log);
+				return 1;
 			}
 		}
+	} else if (opt_monitor) {
+		/* Everything on the bus, on top of any --filter */
+		static const struct can_filter all = { 0, 0 };
 
-		/* Wait to receive packet if ECU mode or loopback */
-		if (opt_ecu || opt_loopback) {
-			msg.msg_name = &ecu_recv_addr;
-
-			/* Error on timeout if opt_loopback, otherwise, if just
-			 * opt_ecu, a timeout will cause this to return 0.
-			 */
-			num_events = poll_sock_fd(fd_epoll, events_pending,
-						  ecu_recv_sock, opt_loopback);
-			if (num_events < 0)
-				break;
-
-			if (num_events == 0)
-				continue;
-
-			nbytes = recvmsg(ecu_recv_sock, &msg, 0);
-			if (nbytes < 0) {
-				perror("Error receving on ECU emulation");
-				break;
+		if (opt_dbc && dbc_load(&dbc, opt_dbc, opt_dbc_shm) < 0)
+			return 1;
+
+		for (i = 0; i < nifaces; i++, nports++) {
+			if (can_port_open(&ports[i], opt_ifaces[i], opt_batch,
+			  &all, 1, NULL, 0, opt_filters, nfilters) < 0) {
+				close_ports(ports, nports, cap);
+				dbc_close(&dbc);
+				return 1;
+			}
+			ports[i].ev.handler = stats_port_handler;
+			if (opt_dbc) {
+				ports[i].priv = &dbc;
+				ports[i].ev.handler = dbc_port_handler;
+			}
+		}
+	} else if (opt_bridge) {
+		if (nifaces == 0) {
+			strcpy(opt_ifaces[nifaces++], "can0");
+			strcpy(opt_ifaces[nifaces++], "can1");
+		}
+		if (bridge_load(&bridge, opt_bridge, opt_ifaces, nifaces) < 0 ||
+		  bridge_open(&bridge, ports, opt_batch, opt_latency,
+		  opt_fd) < 0) {
+			/* The bridge closes what ports it opened itself */
+			close_ports(ports, nports, cap);
+			bridge_close(&bridge);
+			return 1;
+		}
+		nports = nifaces;
+	} else if (opt_ecu) {
+		for (i = 0; i < nifaces; i++, nports++) {
+			if (ecu_port_open(&ports[i], opt_latency ?
+			  &ecu_states[i] : NULL, opt_ifaces[i], opt_batch,
+			  opt_filters, nfilters) < 0) {
+				close_ports(ports, nports, cap);
+				return 1;
 			}
 
-			if (nbytes < (int)sizeof(struct can_frame)) {
-				fprintf(stderr, "Incomplete CAN frame on ECU emulation\n");
+			if (opt_busy_poll &&
+			  enable_busy_poll(ports[i].sock, opt_busy_poll) < 0) {
+				close_ports(ports, nports + 1, cap);
+				return 1;
 			}
+		}
+	} else {
+		/* Local loopback, on can0 and can1 unless --backend says
+		 * otherwise.
+		 */
+		if (opt_query)
+			query_iface = opt_ifaces[0];
+		query = &ports[nports];
+		if (query_port_open(query, query_iface, opt_batch, opt_latency,
+		  opt_filters, nfilters) < 0)
+			return 1;
+		nports++;
 
-			if (frame.data[0] == 0x03) {
-				/* Set up response */
-				frame.can_id = 0x7e8;
-				frame.can_dlc = 5;
-				memset(frame.data, '\0', sizeof(frame.data));
-				frame.data[0] = 0x04;
-				frame.data[1] = 0x41;
-				frame.data[2] = 0x0c;
-				frame.data[3] = random() & 0xFF; // RPM value
-				frame.data[4] = 0x40;
-				if (write(ecu_recv_sock, &frame,
-				  sizeof(struct can_frame)) < 0) {
-					perror("Error sending ECU response");
-					break;
-				}
+		if (opt_loopback) {
+			ecu = &ports[nports];
+			if (ecu_port_open(ecu, NULL, ecu_iface, opt_batch,
+			  opt_filters, nfilters) < 0) {
+				close_ports(ports, nports, cap);
+				return 1;
 			}
+			nports++;
 		}
+	}
 
-		/* Finally, receive response from ECU if querying or loopback */
-		if (opt_query || opt_loopback) {
-			msg.msg_name = &query_recv_addr;
+	for (i = 0; opt_fd && i < nports; i++) {
+		if (can_port_enable_fd(&ports[i]) < 0) {
+			close_ports(ports, nports, cap);
+			return 1;
+		}
+	}
 
-			num_events = poll_sock_fd(fd_epoll, events_pending,
-						  query_recv_sock, 1);
-			if (num_events < 0)
-				break;
+	for (i = 0; i < nports; i++) {
+		if (can_port_set_buffers(&ports[i], opt_rcvbuf, opt_sndbuf,
+		  opt_rcvbuf_max) < 0) {
+			close_ports(ports, nports, cap);
+			return 1;
+		}
+	}
 
-			nbytes = recvmsg(query_recv_sock, &msg, 0);
-			if (nbytes < 0) {
-				perror("Error receving on query");
-				break;
-			}
-	
-			if (nbytes < (int)sizeof(struct can_frame)) {
-				fprintf(stderr, "Incomplete CAN frame on query\n");
+	/* Cyclic frames and watches are handed to the kernel on a BCM socket
+	 * per port, the ECU responses stay on the raw sockets.
+	 */
+	if (opt_vehicle && (vehicle.nperiodic || vehicle.nwatches)) {
+		if (open_bcm(bcm_ports, ports, nports, &vehicle) < 0) {
+			close_ports(ports, nports, cap);
+			vehicle_close(&vehicle);
+			return 1;
+		}
+		nbcm = nports;
+	}
+
+	/* The ECU emulation runs until interrupted, have that end the loop
+	 * cleanly so the receive statistics can be reported. Same for the
+	 * benchmark and pipelined query, which can be cut short.
+	 */
+	if (opt_ecu || opt_bench || opt_pipeline || opt_isotp || opt_capture ||
+	  opt_replay || opt_monitor || opt_bridge)
+		evloop_stop_on_signals();
+
+	/* Nothing, unless built with -Dtracing=true */
+	if (trace_init() < 0) {
+		close_ports(ports, nports, cap);
+		return 1;
+	}
+
+	/* Every buffer used from here on is already allocated, lock them all
+	 * in to RAM, along with the worker stacks to come, so that no page
+	 * fault ever lands in the middle of a response.
+	 */
+	if (opt_mlock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		perror("Unable to lock memory");
+		close_ports(ports, nports, cap);
+		return 1;
+	}
+
+	if (opt_replay) {
+		replay.duration_ns = bench.duration_s * 1000000000ULL;
+		replay.count = bench.count;
+		ret = run_replay(ports, nports, &log, &replay);
+		for (i = 0; i < nports; i++)
+			can_port_print_stats(&ports[i]);
+		close_ports(ports, nports, cap);
+		canlog_close(&log);
+
+		return ret < 0 ? 1 : 0;
+	}
+
+	if (opt_threads) {
+		ret = run_ecu_workers(ports, nports, opt_cpus, ncpus, opt_prio,
+				      opt_spin);
+		for (i = 0; i < nbcm; i++)
+			bcm_print_stats(&bcm_ports[i]);
+		close_bcm(bcm_ports, nbcm);
+		close_ports(ports, nports, cap);
+		vehicle_close(&vehicle);
+
+		return ret < 0 ? 1 : 0;
+	}
+
+	/* Otherwise every port is serviced from the one event loop, in this
+	 * thread.
+	 */
+	if (sched_setup("main thread", ncpus ? opt_cpus[0] : -1, opt_prio) < 0) {
+		close_ports(ports, nports, cap);
+		return 1;
+	}
+
+#ifdef HAVE_LIBURING
+	if (opt_uring) {
+		ret = uring_init(&uring, ports, nports);
+		if (ret == 0)
+			ret = uring_run_ecu(&uring);
+
+		for (i = 0; i < nports; i++) {
+			can_port_print_stats(&ports[i]);
+			ecu_print_latency(&ports[i]);
+		}
+		uring_print_stats(&uring);
+		for (i = 0; i < nbcm; i++)
+			bcm_print_stats(&bcm_ports[i]);
+
+		uring_close(&uring);
+		close_bcm(bcm_ports, nbcm);
+		close_ports(ports, nports, cap);
+		vehicle_close(&vehicle);
+
+		return ret < 0 ? 1 : 0;
+	}
+#endif
+
+	if (evloop_init(&loop) < 0) {
+		close_ports(ports, nports, cap);
+		return 1;
+	}
+
+	for (i = 0; i < nports; i++) {
+		if (evloop_add(&loop, &ports[i].ev, EPOLLIN) < 0) {
+			evloop_close(&loop);
+			close_ports(ports, nports, cap);
+			return 1;
+		}
+	}
+
+	for (i = 0; cap && i < (int)cap->nifaces; i++) {
+		if (evloop_add(&loop, &cap->ifaces[i].ev, EPOLLIN) < 0) {
+			evloop_close(&loop);
+			close_ports(ports, nports, cap);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < nbcm; i++) {
+		if (evloop_add(&loop, &bcm_ports[i].ev, EPOLLIN) < 0) {
+			evloop_close(&loop);
+			close_bcm(bcm_ports, nbcm);
+			close_ports(ports, nports, cap);
+			vehicle_close(&vehicle);
+			return 1;
+		}
+	}
+
+	if (opt_stats_ms) {
+		st = &stats;
+		if (stats_init(st, &loop, opt_stats_ms, opt_stats_shm,
+		  bench.bitrate, bench.dbitrate) < 0) {
+			stats_close(st, &loop);
+			evloop_close(&loop);
+			close_ports(ports, nports, cap);
+			return 1;
+		}
+
+		for (i = 0; i < nports; i++) {
+			if (stats_enable_port(st, &ports[i]) < 0) {
+				stats_close(st, &loop);
+				evloop_close(&loop);
+				close_ports(ports, nports, cap);
+				return 1;
 			}
+		}
+	}
 
-			if(frame.data[0] == 0x4)
-				printf("RPM at %d of 255\n", frame.data[3]);
+	if (opt_ecu) {
+		if (opt_daemon) {
+			ret = ecu_daemon_start(&ecud, ports, nports,
+					       opt_vehicle ? &vehicle : NULL,
+					       opt_vehicle, opt_filters,
+					       nfilters, opt_spin);
+			if (ret == 0)
+				ret = run_ecu_daemon(&loop, &ecud);
+			ecu_daemon_stop(&ecud);
+		} else {
+			while (keep_running) {
+				if ((opt_spin ? evloop_poll_all(&loop) :
+				  evloop_run_once(&loop, 1000)) < 0) {
+					ret = -1;
+					break;
+				}
+			}
 		}
 
-		/* Finally, if we're querying or loopback, break out of the loop */
-		ret = 0;
-		if (!opt_ecu)
-			break;
+		for (i = 0; i < nports; i++) {
+			can_port_print_stats(&ports[i]);
+			ecu_print_latency(&ports[i]);
+		}
+		for (i = 0; i < nbcm; i++)
+			bcm_print_stats(&bcm_ports[i]);
+		if (opt_daemon)
+			ecu_daemon_print_stats(&ecud);
+	} else if (opt_bench) {
+		ret = run_bench(&loop, query, ecu, &bench);
+		can_port_print_stats(query);
+		can_port_print_stats(ecu);
+	} else if (opt_isotp) {
+		ret = run_isotp_bench(&loop, query, ecu, &isotp);
+		can_port_print_stats(query);
+		can_port_print_stats(ecu);
+	} else if (opt_capture) {
+		ret = run_capture(&loop, cap, bench.duration_s);
+		capture_print_stats(cap);
+	} else if (opt_monitor) {
+		ret = run_monitor(&loop, bench.duration_s);
+		if (opt_dbc)
+			dbc_print(&dbc);
+	} else if (opt_bridge) {
+		ret = run_bridge(&loop, &bridge, bench.duration_s);
+		bridge_print_stats(&bridge);
+		for (i = 0; i < nports; i++)
+			can_port_print_stats(&ports[i]);
+		bridge_close(&bridge);
+	} else if (opt_pipeline) {
+		pipe.count = bench.count;
+		if (pipe.bus_load)
+			pipe_bitrates(&pipe, query, &bench);
+		ret = run_query_pipeline(&loop, query, &pipe, opt_latency);
+		can_port_print_stats(query);
+	} else {
+		ret = run_query_oneshot(&loop, query, opt_burst, opt_latency);
 	}
 
-	close(ecu_recv_sock);
-	close(query_recv_sock);
- 
-	return ret;
+	if (st)
+		stats_close(st, &loop);
+	evloop_close(&loop);
+	close_bcm(bcm_ports, nbcm);
+	close_ports(ports, nports, cap);
+	vehicle_close(&vehicle);
+	dbc_close(&dbc);
+
+	return ret < 0 ? 1 : 0;
 }
@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/can/raw.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "canio.h"
+#include "etscan.h"
+
+/* Open a raw CAN socket, not yet bound to any interface */
+signed int etscan_open(void)
+{
+	int sock;
+
+	sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (sock < 0)
+		perror("Error opening CAN socket");
+
+	return sock;
+}
+
+/* Replace the socket's filters, set before etscan_bind() so that nothing
+ * else is ever queued. With n of 0, the socket receives nothing.
+ */
+signed int etscan_filter(int sock, const struct can_filter *filters, int n)
+{
+	if (n > MAX_PORT_FILTERS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return set_filters(sock, filters, n, NULL, 0, NULL, 0);
+}
+
+signed int etscan_bind(int sock, const char *iface)
+{
+	struct sockaddr_can addr;
+	struct ifreq ifr;
+
+	return test_and_bind(sock, &ifr, &addr, iface);
+}
+
+/* Receive CAN FD frames as well as classic ones. Sending an FD frame still
+ * fails if the interface is not FD capable.
+ */
+signed int etscan_enable_fd(int sock)
+{
+	int on = 1;
+
+	if (setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &on,
+	  sizeof(on)) < 0) {
+		perror("Unable to enable CAN FD frames");
+		return -1;
+	}
+
+	return 0;
+}
+
+signed int etscan_enable_timestamps(int sock)
+{
+	return enable_timestamps(sock);
+}
+
+/* Wait up to timeout_ms, or forever if negative, for frames to be pending.
+ * Returns 1 if there are, 0 on timeout, or -1 on error.
+ */
+signed int etscan_wait(int sock, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = sock,
+		.events = POLLIN,
+	};
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, timeout_ms);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret;
+}
+
+/* Receive up to n frames in to frames, and if stamps is not NULL, their
+ * timestamps in to stamps. With ETSCAN_DONTWAIT, returns 0 if nothing is
+ * pending rather than blocking for the first frame. Frames after the first
+ * are only those already pending. FD frames have CANFD_FDF set in their
+ * flags, classic frames have flags of 0.
+ *
+ * Returns the number of frames received, or -1 on error.
+ */
+signed int etscan_recv(int sock, struct canfd_frame *frames,
+		       struct etscan_rx_stamp *stamps, unsigned int n,
+		       int flags)
+{
+	struct rx_stamp stamp;
+	struct mmsghdr msgs[ETSCAN_MAX_BATCH];
+	struct iovec iov[ETSCAN_MAX_BATCH];
+	char ctrlmsg[ETSCAN_MAX_BATCH][CTRLMSG_LEN];
+	unsigned int i;
+	int nframes;
+
+	if (n > ETSCAN_MAX_BATCH)
+		n = ETSCAN_MAX_BATCH;
+
+	memset(msgs, '\0', n * sizeof(msgs[0]));
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = CANFD_MTU;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (stamps) {
+			msgs[i].msg_hdr.msg_control = ctrlmsg[i];
+			msgs[i].msg_hdr.msg_controllen = CTRLMSG_LEN;
+		}
+	}
+
+	nframes = recvmmsg(sock, msgs, n, flags & ETSCAN_DONTWAIT ?
+			   MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+	if (nframes < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		return -1;
+	}
+
+	for (i = 0; i < (unsigned int)nframes; i++) {
+		if (msgs[i].msg_len == CANFD_MTU)
+			frames[i].flags |= CANFD_FDF;
+		else
+			frames[i].flags = 0;
+		if (!stamps)
+			continue;
+		parse_cmsgs(&msgs[i].msg_hdr, &stamp);
+		stamps[i].sw = stamp.sw;
+		stamps[i].hw = stamp.hw;
+	}
+
+	return nframes;
+}
+
+/* Send up to n frames, as FD frames if fd is set, or classic ones if not.
+ * This may send fewer than n when the interface queue fills, and returns -1
+ * with errno of ENOBUFS if it is full already. When that happens, back off
+ * and send the rest again later.
+ *
+ * Returns the number of frames sent, or -1 on error.
+ */
+signed int etscan_send(int sock, const struct canfd_frame *frames,
+		       unsigned int n, int fd)
+{
+	struct mmsghdr msgs[ETSCAN_MAX_BATCH];
+	struct iovec iov[ETSCAN_MAX_BATCH];
+	unsigned int i;
+	int nframes;
+
+	if (n > ETSCAN_MAX_BATCH)
+		n = ETSCAN_MAX_BATCH;
+
+	memset(msgs, '\0', n * sizeof(msgs[0]));
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = (void *)&frames[i];
+		iov[i].iov_len = fd ? CANFD_MTU : CAN_MTU;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		nframes = sendmmsg(sock, msgs, n, 0);
+	} while (nframes < 0 && errno == EINTR);
+
+	return nframes;
+}
+
+void etscan_close(int sock)
+{
+	if (sock >= 0)
+		close(sock);
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* libetscan, raw CAN sockets for applications
+ *
+ * The socket plumbing of ets_can_test, built as a library for use by other
+ * applications. A socket is opened, given its filters, then bound, in that
+ * order so that no unwanted frames are queued in between. Frames are then
+ * received and sent in batches, a single recvmmsg() or sendmmsg() each.
+ *
+ * Nothing here allocates. The caller owns every frame and timestamp array,
+ * and the message headers each batch needs are built on the stack, with
+ * room for up to ETSCAN_MAX_BATCH frames per call. Functions return -1 with
+ * errno set on error, the setup calls also print what failed to stderr.
+ *
+ * Only the etscan_ functions below are exported from the shared library,
+ * the rest of the plumbing it is built from stays internal to it.
+ */
+
+#ifndef __ETSCAN_H__
+#define __ETSCAN_H__
+
+#include <linux/can.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Most frames moved by one etscan_recv() or etscan_send() call */
+#define ETSCAN_MAX_BATCH	64
+
+/* Marks what the shared library exports, everything else is hidden */
+#define ETSCAN_API		__attribute__((visibility("default")))
+
+/* Flags to etscan_recv() */
+#define ETSCAN_DONTWAIT		0x1
+
+/* Timestamps pulled from the control messages of a received frame, either
+ * may be zero if not provided by the kernel or controller.
+ */
+struct etscan_rx_stamp {
+	struct timespec sw;
+	struct timespec hw;
+};
+
+ETSCAN_API signed int etscan_open(void);
+ETSCAN_API signed int etscan_filter(int sock, const struct can_filter *filters,
+				    int n);
+ETSCAN_API signed int etscan_bind(int sock, const char *iface);
+ETSCAN_API signed int etscan_enable_fd(int sock);
+ETSCAN_API signed int etscan_enable_timestamps(int sock);
+ETSCAN_API signed int etscan_wait(int sock, int timeout_ms);
+
+ETSCAN_API signed int etscan_recv(int sock, struct canfd_frame *frames,
+				  struct etscan_rx_stamp *stamps,
+				  unsigned int n, int flags);
+ETSCAN_API signed int etscan_send(int sock, const struct canfd_frame *frames,
+				  unsigned int n, int fd);
+
+ETSCAN_API void etscan_close(int sock);
+
+/* Frame i as received, classic frames and FD frames of up to 8 bytes are
+ * laid out the same.
+ */
+static inline struct can_frame *etscan_frame(struct canfd_frame *frames,
+					     unsigned int i)
+{
+	return (struct can_frame *)&frames[i];
+}
+
+#endif /* __ETSCAN_H__ */
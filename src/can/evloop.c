@@ -0,0 +1,241 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evloop.h"
+#include "trace.h"
+
+volatile sig_atomic_t keep_running = 1;
+
+static void stop_handler(int signum)
+{
+	(void)signum;
+	keep_running = 0;
+}
+
+/* Modes that run until interrupted have that end the loop cleanly, so that
+ * statistics can be reported.
+ */
+void evloop_stop_on_signals(void)
+{
+	struct sigaction sa = { .sa_handler = stop_handler };
+
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static uint64_t evloop_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+signed int evloop_init(struct evloop *loop)
+{
+	loop->nsources = 0;
+	loop->nretries = 0;
+	loop->wakeups = 0;
+	loop->events = 0;
+
+	loop->fd_epoll = epoll_create1(0);
+	if (loop->fd_epoll < 0) {
+		perror("Error creating epoll");
+		return -1;
+	}
+
+	return 0;
+}
+
+signed int evloop_add(struct evloop *loop, struct ev_source *src,
+		      uint32_t events)
+{
+	struct epoll_event event = {
+		.events = events,
+		.data.ptr = src,
+	};
+
+	if (loop->nsources >= EVLOOP_MAX_SOURCES) {
+		fprintf(stderr, "Too many event sources, limit is %d\n",
+			EVLOOP_MAX_SOURCES);
+		return -1;
+	}
+
+	if (epoll_ctl(loop->fd_epoll, EPOLL_CTL_ADD, src->fd, &event) < 0) {
+		fprintf(stderr, "Error adding %d to epoll: ", src->fd);
+		perror("");
+		return -1;
+	}
+	loop->sources[loop->nsources++] = src;
+	src->loop = loop;
+	src->retry_ns = 0;
+
+	return 0;
+}
+
+static void evloop_clear_retry(struct ev_source *src)
+{
+	if (!src->retry_ns)
+		return;
+
+	src->retry_ns = 0;
+	src->loop->nretries--;
+}
+
+void evloop_del(struct evloop *loop, struct ev_source *src)
+{
+	unsigned int i;
+
+	epoll_ctl(loop->fd_epoll, EPOLL_CTL_DEL, src->fd, NULL);
+	evloop_clear_retry(src);
+
+	for (i = 0; i < loop->nsources; i++) {
+		if (loop->sources[i] == src) {
+			loop->sources[i] = loop->sources[--loop->nsources];
+			break;
+		}
+	}
+}
+
+/* Have the source's handler run again once delay_us is up, whether or not
+ * its fd is ready by then. Does nothing for a source in no loop.
+ */
+void evloop_retry(struct ev_source *src, unsigned int delay_us)
+{
+	if (!src->loop)
+		return;
+
+	if (!src->retry_ns)
+		src->loop->nretries++;
+	src->retry_ns = evloop_now_ns() + delay_us * 1000ULL;
+}
+
+/* Whether a retry asked for is still to come, for a handler run before then
+ * because its fd was ready, or by evloop_poll_all(), to leave what it is
+ * retrying alone. A retry that is due is taken as done.
+ */
+int evloop_retry_pending(struct ev_source *src)
+{
+	if (!src->retry_ns)
+		return 0;
+	if (evloop_now_ns() < src->retry_ns)
+		return 1;
+
+	evloop_clear_retry(src);
+
+	return 0;
+}
+
+/* Wait no longer than until the first retry is due */
+static int evloop_retry_timeout(struct evloop *loop, int timeout_ms)
+{
+	uint64_t now_ns = evloop_now_ns();
+	uint64_t wait_ns;
+	unsigned int i;
+	int ms;
+
+	for (i = 0; i < loop->nsources; i++) {
+		if (!loop->sources[i]->retry_ns)
+			continue;
+		if (loop->sources[i]->retry_ns <= now_ns)
+			return 0;
+
+		wait_ns = loop->sources[i]->retry_ns - now_ns;
+		ms = (wait_ns + 999999) / 1000000;
+		if (timeout_ms < 0 || ms < timeout_ms)
+			timeout_ms = ms;
+	}
+
+	return timeout_ms;
+}
+
+static signed int evloop_run_retries(struct evloop *loop)
+{
+	uint64_t now_ns = evloop_now_ns();
+	struct ev_source *src;
+	unsigned int i;
+
+	for (i = 0; i < loop->nsources && loop->nretries; i++) {
+		src = loop->sources[i];
+		if (!src->retry_ns || src->retry_ns > now_ns)
+			continue;
+
+		evloop_clear_retry(src);
+		if (src->handler(src, EPOLLIN) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Wait up to timeout_ms for any source to become ready, then run the handler
+ * of every source that is, and of every source whose retry is due. Being
+ * interrupted by a signal counts as a timeout. Returns the number of events
+ * handled, or -1 on error.
+ */
+signed int evloop_run_once(struct evloop *loop, int timeout_ms)
+{
+	struct epoll_event events[EVLOOP_MAX_EVENTS];
+	struct ev_source *src;
+	int num_events;
+	int i;
+
+	if (loop->nretries)
+		timeout_ms = evloop_retry_timeout(loop, timeout_ms);
+
+	TRACE_BEGIN(t);
+	num_events = epoll_wait(loop->fd_epoll, events, EVLOOP_MAX_EVENTS,
+				timeout_ms);
+	TRACE_END(t, TRACE_WAIT, num_events);
+	if (num_events < 0) {
+		if (errno == EINTR)
+			return 0;
+		perror("epoll_wait error");
+		return -1;
+	}
+
+	loop->wakeups++;
+	loop->events += num_events;
+
+	for (i = 0; i < num_events; i++) {
+		src = events[i].data.ptr;
+		if (src->handler(src, events[i].events) < 0)
+			return -1;
+	}
+
+	if (loop->nretries && evloop_run_retries(loop) < 0)
+		return -1;
+
+	return num_events;
+}
+
+/* Run the handler of every source without waiting for any of them to be
+ * ready, for busy polling. This saves the epoll_wait() and the wakeup on
+ * every frame, at the cost of a CPU spinning in the handlers. Handlers must
+ * cope with there being nothing to receive.
+ */
+signed int evloop_poll_all(struct evloop *loop)
+{
+	unsigned int i;
+
+	for (i = 0; i < loop->nsources; i++) {
+		if (loop->sources[i]->handler(loop->sources[i], EPOLLIN) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void evloop_close(struct evloop *loop)
+{
+	if (loop->fd_epoll >= 0)
+		close(loop->fd_epoll);
+	loop->fd_epoll = -1;
+}
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* epoll based event loop
+ *
+ * Each file descriptor is registered along with the handler to call when it
+ * is ready. One wakeup collects up to EVLOOP_MAX_EVENTS ready descriptors,
+ * which are all dispatched before waiting again, so any number of sockets
+ * can share one loop without one being serviced at the expense of another.
+ *
+ * A handler that could not finish, a port whose transmit queue is full, say,
+ * must not wait in the handler for every other source not to be serviced
+ * meanwhile. It asks with evloop_retry() to be run again after a delay, as
+ * though its fd were ready, and returns to the loop. Should it be run before
+ * then, evloop_retry_pending() says to leave that for later.
+ */
+
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#include <signal.h>
+#include <stdint.h>
+
+#define EVLOOP_MAX_EVENTS	16
+#define EVLOOP_MAX_SOURCES	32
+
+struct ev_source;
+
+/* Returns < 0 to stop the loop on an unrecoverable error */
+typedef int (*ev_handler_fn)(struct ev_source *src, uint32_t events);
+
+struct ev_source {
+	int fd;
+	ev_handler_fn handler;
+	void *data;
+
+	/* The loop the source was added to, and when evloop_retry() has it be
+	 * run again, 0 if not.
+	 */
+	struct evloop *loop;
+	uint64_t retry_ns;
+};
+
+struct evloop {
+	int fd_epoll;
+	struct ev_source *sources[EVLOOP_MAX_SOURCES];
+	unsigned int nsources;
+	unsigned int nretries;
+
+	/* Statistics */
+	unsigned long long wakeups;
+	unsigned long long events;
+};
+
+/* Cleared by SIGINT or SIGTERM once evloop_stop_on_signals() is called */
+extern volatile sig_atomic_t keep_running;
+
+signed int evloop_init(struct evloop *loop);
+signed int evloop_add(struct evloop *loop, struct ev_source *src,
+		      uint32_t events);
+void evloop_del(struct evloop *loop, struct ev_source *src);
+void evloop_retry(struct ev_source *src, unsigned int delay_us);
+int evloop_retry_pending(struct ev_source *src);
+signed int evloop_run_once(struct evloop *loop, int timeout_ms);
+signed int evloop_poll_all(struct evloop *loop);
+void evloop_close(struct evloop *loop);
+void evloop_stop_on_signals(void);
+
+#endif /* __EVLOOP_H__ */
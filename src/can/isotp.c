@@ -0,0 +1,373 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+
+#include "isotp.h"
+#include "obd.h"
+
+void isotp_link_init(struct isotp_link *link, struct can_port *port,
+		     canid_t tx_id, canid_t rx_id, uint8_t *rx_buf,
+		     size_t rx_size)
+{
+	memset(link, '\0', sizeof(*link));
+	link->port = port;
+	link->tx_id = tx_id;
+	link->rx_id = rx_id;
+	link->rx_buf = rx_buf;
+	link->rx_size = rx_size;
+}
+
+/* Minimum gap between consecutive frames, 0-127 ms or 100-900 us. Reserved
+ * values are to be treated as the longest gap.
+ */
+uint64_t isotp_stmin_ns(uint8_t stmin)
+{
+	if (stmin <= 0x7f)
+		return stmin * 1000000ULL;
+	if (stmin >= 0xf1 && stmin <= 0xf9)
+		return (stmin - 0xf0) * 100000ULL;
+
+	return 0x7f * 1000000ULL;
+}
+
+/* Next frame to send on the link, padded out to 8 bytes as OBD requires */
+static struct can_frame *isotp_frame(struct isotp_link *link)
+{
+	struct can_frame *frame = tx_queue_next(&link->port->tx);
+
+	if (!frame)
+		return NULL;
+
+	frame->can_id = link->tx_id;
+	frame->can_dlc = CAN_MAX_DLEN;
+	memset(frame->data, OBD_PAD_BYTE, CAN_MAX_DLEN);
+
+	return frame;
+}
+
+static void isotp_send_fc(struct isotp_link *link, uint8_t status)
+{
+	struct can_frame *frame = isotp_frame(link);
+
+	if (!frame)
+		return;
+
+	frame->data[0] = ISOTP_FC | status;
+	frame->data[1] = link->bs;
+	frame->data[2] = link->stmin;
+	link->fc_sent++;
+}
+
+static void isotp_tx_finish(struct isotp_link *link, int err)
+{
+	link->tx_state = ISOTP_IDLE;
+	if (err)
+		link->errors++;
+	else
+		link->tx_msgs++;
+	if (link->tx_done)
+		link->tx_done(link, err);
+}
+
+static void isotp_rx_finish(struct isotp_link *link, int err)
+{
+	link->rx_state = ISOTP_IDLE;
+	if (err)
+		link->errors++;
+	else
+		link->rx_msgs++;
+	if (link->rx_done)
+		link->rx_done(link, err);
+}
+
+/* Start sending a message, queueing the single or first frame. Returns the
+ * number of frames queued, or -1 if the link is already sending, the message
+ * is too long, or the transmit queue is full.
+ */
+signed int isotp_send(struct isotp_link *link, const uint8_t *data,
+		      size_t len, uint64_t now_ns)
+{
+	struct can_frame *frame;
+
+	if (link->tx_state != ISOTP_IDLE || len == 0 || len > ISOTP_MAX_LEN)
+		return -1;
+
+	frame = isotp_frame(link);
+	if (!frame)
+		return -1;
+
+	link->tx_buf = data;
+	link->tx_len = len;
+
+	if (len <= 7) {
+		frame->data[0] = ISOTP_SF | len;
+		memcpy(&frame->data[1], data, len);
+		link->tx_off = len;
+		link->tx_state = ISOTP_TX_SENDING;
+		return 1;
+	}
+
+	if (len <= 4095) {
+		frame->data[0] = ISOTP_FF | (len >> 8);
+		frame->data[1] = len & 0xFF;
+		link->tx_off = 6;
+	} else {
+		frame->data[0] = ISOTP_FF;
+		frame->data[1] = 0;
+		frame->data[2] = len >> 24;
+		frame->data[3] = (len >> 16) & 0xFF;
+		frame->data[4] = (len >> 8) & 0xFF;
+		frame->data[5] = len & 0xFF;
+		link->tx_off = 2;
+	}
+	memcpy(&frame->data[CAN_MAX_DLEN - link->tx_off], data, link->tx_off);
+
+	link->tx_sn = 1;
+	link->tx_state = ISOTP_TX_WAIT_FC;
+	link->tx_deadline_ns = now_ns + ISOTP_TIMEOUT_MS * 1000000ULL;
+
+	return 1;
+}
+
+/* Of the frames the last isotp_send() or isotp_poll() queued, sent actually
+ * went out. A message is only done once its last frame is out, and a message
+ * that lost any frame can not be recovered.
+ */
+void isotp_tx_sent(struct isotp_link *link, unsigned int queued,
+		   unsigned int sent)
+{
+	if (!queued || link->tx_state == ISOTP_IDLE)
+		return;
+
+	if (sent < queued) {
+		isotp_tx_finish(link, -1);
+		return;
+	}
+
+	if (link->tx_state == ISOTP_TX_SENDING && link->tx_off == link->tx_len)
+		isotp_tx_finish(link, 0);
+}
+
+/* Flow control from the other side, for a message being sent */
+static void isotp_rx_fc(struct isotp_link *link, const struct can_frame *frame,
+			uint64_t now_ns)
+{
+	if (link->tx_state != ISOTP_TX_WAIT_FC)
+		return;
+
+	link->fc_received++;
+
+	switch (frame->data[0] & 0x0F) {
+	case ISOTP_FC_CTS:
+		link->tx_bs = frame->data[1];
+		link->tx_stmin_ns = isotp_stmin_ns(frame->data[2]);
+		link->tx_block = 0;
+		link->tx_next_ns = now_ns;
+		link->tx_state = ISOTP_TX_SENDING;
+		break;
+	case ISOTP_FC_WAIT:
+		link->tx_deadline_ns = now_ns + ISOTP_TIMEOUT_MS * 1000000ULL;
+		break;
+	default:
+		isotp_tx_finish(link, -1);
+		break;
+	}
+}
+
+static void isotp_rx_ff(struct isotp_link *link, const struct can_frame *frame,
+			uint64_t now_ns)
+{
+	size_t len = ((frame->data[0] & 0x0F) << 8) | frame->data[1];
+	size_t off = 2;
+
+	if (frame->can_dlc < CAN_MAX_DLEN)
+		return;
+
+	/* The escape to a 32 bit length is only for what 12 bits can not hold */
+	if (len == 0) {
+		len = ((size_t)frame->data[2] << 24) | (frame->data[3] << 16) |
+		  (frame->data[4] << 8) | frame->data[5];
+		off = 6;
+		if (len <= 4095)
+			return;
+	}
+
+	/* Anything that would fit in a single frame is not a valid FF */
+	if (len <= 7)
+		return;
+
+	/* A new message aborts whatever was being received */
+	if (link->rx_state == ISOTP_RX_RECEIVING)
+		isotp_rx_finish(link, -1);
+
+	if (len > link->rx_size) {
+		isotp_send_fc(link, ISOTP_FC_OVFLW);
+		return;
+	}
+
+	link->rx_len = len;
+	link->rx_off = CAN_MAX_DLEN - off;
+	memcpy(link->rx_buf, &frame->data[off], link->rx_off);
+	link->rx_sn = 1;
+	link->rx_block = 0;
+	link->rx_state = ISOTP_RX_RECEIVING;
+	link->rx_deadline_ns = now_ns + ISOTP_TIMEOUT_MS * 1000000ULL;
+
+	isotp_send_fc(link, ISOTP_FC_CTS);
+}
+
+static void isotp_rx_cf(struct isotp_link *link, const struct can_frame *frame,
+			uint64_t now_ns)
+{
+	size_t n;
+
+	if (link->rx_state != ISOTP_RX_RECEIVING)
+		return;
+
+	if ((frame->data[0] & 0x0F) != link->rx_sn) {
+		isotp_rx_finish(link, -1);
+		return;
+	}
+
+	n = link->rx_len - link->rx_off;
+	if (n > 7)
+		n = 7;
+	if (frame->can_dlc < n + 1) {
+		isotp_rx_finish(link, -1);
+		return;
+	}
+
+	memcpy(&link->rx_buf[link->rx_off], &frame->data[1], n);
+	link->rx_off += n;
+	link->rx_sn = (link->rx_sn + 1) & 0x0F;
+	link->cf_received++;
+
+	if (link->rx_off == link->rx_len) {
+		isotp_rx_finish(link, 0);
+		return;
+	}
+
+	link->rx_deadline_ns = now_ns + ISOTP_TIMEOUT_MS * 1000000ULL;
+	if (link->bs && ++link->rx_block >= link->bs) {
+		link->rx_block = 0;
+		isotp_send_fc(link, ISOTP_FC_CTS);
+	}
+}
+
+/* Handle a frame received on the link's port. Returns 1 if the frame was for
+ * this link, 0 otherwise. Any flow control to send in reply is queued on the
+ * port's transmit queue.
+ */
+int isotp_rx_frame(struct isotp_link *link, const struct can_frame *frame,
+		   uint64_t now_ns)
+{
+	size_t len;
+
+	if (frame->can_id != link->rx_id)
+		return 0;
+
+	if (frame->can_dlc < 1)
+		return 1;
+
+	switch (frame->data[0] & 0xF0) {
+	case ISOTP_SF:
+		len = frame->data[0] & 0x0F;
+		if (len == 0 || len > 7 || len + 1 > frame->can_dlc ||
+		  len > link->rx_size)
+			break;
+
+		if (link->rx_state == ISOTP_RX_RECEIVING)
+			isotp_rx_finish(link, -1);
+
+		memcpy(link->rx_buf, &frame->data[1], len);
+		link->rx_len = len;
+		isotp_rx_finish(link, 0);
+		break;
+	case ISOTP_FF:
+		isotp_rx_ff(link, frame, now_ns);
+		break;
+	case ISOTP_CF:
+		isotp_rx_cf(link, frame, now_ns);
+		break;
+	case ISOTP_FC:
+		isotp_rx_fc(link, frame, now_ns);
+		break;
+	default:
+		break;
+	}
+
+	return 1;
+}
+
+/* Queue every consecutive frame that is due, up to max, the end of the block,
+ * or as the transmit queue allows, and time out a link that has waited too
+ * long. Returns the number of frames queued, to be given to isotp_tx_sent()
+ * once the queue is flushed.
+ */
+unsigned int isotp_poll(struct isotp_link *link, uint64_t now_ns,
+			unsigned int max)
+{
+	struct can_frame *frame;
+	unsigned int queued = 0;
+	size_t n;
+
+	if (link->tx_state == ISOTP_TX_WAIT_FC && now_ns >= link->tx_deadline_ns) {
+		link->timeouts++;
+		isotp_tx_finish(link, -1);
+	}
+
+	if (link->rx_state == ISOTP_RX_RECEIVING &&
+	  now_ns >= link->rx_deadline_ns) {
+		link->timeouts++;
+		isotp_rx_finish(link, -1);
+	}
+
+	while (queued < max && link->tx_state == ISOTP_TX_SENDING &&
+	  link->tx_off < link->tx_len && now_ns >= link->tx_next_ns) {
+		frame = isotp_frame(link);
+		if (!frame)
+			break;
+
+		n = link->tx_len - link->tx_off;
+		if (n > 7)
+			n = 7;
+
+		frame->data[0] = ISOTP_CF | link->tx_sn;
+		memcpy(&frame->data[1], &link->tx_buf[link->tx_off], n);
+		link->tx_off += n;
+		link->tx_sn = (link->tx_sn + 1) & 0x0F;
+		link->cf_sent++;
+		queued++;
+
+		if (link->tx_stmin_ns)
+			link->tx_next_ns = now_ns + link->tx_stmin_ns;
+
+		if (link->tx_off < link->tx_len && link->tx_bs &&
+		  ++link->tx_block >= link->tx_bs) {
+			link->tx_state = ISOTP_TX_WAIT_FC;
+			link->tx_deadline_ns = now_ns +
+			  ISOTP_TIMEOUT_MS * 1000000ULL;
+		}
+	}
+
+	return queued;
+}
+
+/* Next time the link needs polling, or UINT64_MAX if it is idle */
+uint64_t isotp_next_ns(const struct isotp_link *link)
+{
+	uint64_t next = UINT64_MAX;
+
+	if (link->tx_state == ISOTP_TX_SENDING && link->tx_off < link->tx_len)
+		next = link->tx_next_ns;
+	else if (link->tx_state == ISOTP_TX_WAIT_FC)
+		next = link->tx_deadline_ns;
+
+	if (link->rx_state == ISOTP_RX_RECEIVING && link->rx_deadline_ns < next)
+		next = link->rx_deadline_ns;
+
+	return next;
+}
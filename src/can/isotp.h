@@ -0,0 +1,118 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* ISO-TP (ISO 15765-2) segmented transfer over classic CAN
+ *
+ * Messages of up to 7 bytes go out as a single frame. Longer ones start
+ * with a first frame, after which the receiver answers with flow control
+ * giving the block size, how many consecutive frames may be sent before
+ * waiting for the next flow control, and STmin, the minimum gap between
+ * consecutive frames. Messages over 4095 bytes use the 32 bit first frame
+ * length escape.
+ *
+ * A link is one pair of CAN IDs on a port, and can send and receive one
+ * message at a time in each direction. Frames are queued on the port's
+ * transmit queue, the caller flushes it and reports back how many of the
+ * frames queued by isotp_send() or isotp_poll() went out. A send completes
+ * once its last frame is out, and is aborted if any frame is dropped.
+ *
+ * The engine keeps no time of its own: the caller passes in the current
+ * time, and asks for the next time the link needs to be polled, either to
+ * send a consecutive frame once STmin has passed or to time out.
+ */
+
+#ifndef __ISOTP_H__
+#define __ISOTP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "canio.h"
+
+#define ISOTP_MAX_LEN		(1 << 20)
+
+/* N_Bs and N_Cr, how long to wait for flow control or the next frame */
+#define ISOTP_TIMEOUT_MS	1000
+
+/* Protocol control information, upper nibble of the first byte */
+#define ISOTP_SF		0x00
+#define ISOTP_FF		0x10
+#define ISOTP_CF		0x20
+#define ISOTP_FC		0x30
+
+#define ISOTP_FC_CTS		0x00
+#define ISOTP_FC_WAIT		0x01
+#define ISOTP_FC_OVFLW		0x02
+
+enum isotp_state {
+	ISOTP_IDLE = 0,
+	ISOTP_TX_WAIT_FC,
+	ISOTP_TX_SENDING,
+	ISOTP_RX_RECEIVING,
+};
+
+struct isotp_link;
+
+/* err is 0 on success, or -1 if the transfer was aborted */
+typedef void (*isotp_done_fn)(struct isotp_link *link, int err);
+
+struct isotp_link {
+	struct can_port *port;
+	canid_t tx_id;
+	canid_t rx_id;
+
+	/* Flow control sent to the other side when receiving */
+	uint8_t bs;
+	uint8_t stmin;
+
+	/* Sending */
+	int tx_state;
+	const uint8_t *tx_buf;
+	size_t tx_len;
+	size_t tx_off;
+	uint8_t tx_sn;
+	unsigned int tx_bs;
+	unsigned int tx_block;
+	uint64_t tx_stmin_ns;
+	uint64_t tx_next_ns;
+	uint64_t tx_deadline_ns;
+	isotp_done_fn tx_done;
+
+	/* Receiving */
+	int rx_state;
+	uint8_t *rx_buf;
+	size_t rx_size;
+	size_t rx_len;
+	size_t rx_off;
+	uint8_t rx_sn;
+	unsigned int rx_block;
+	uint64_t rx_deadline_ns;
+	isotp_done_fn rx_done;
+
+	void *priv;
+
+	/* Statistics */
+	unsigned long long tx_msgs;
+	unsigned long long rx_msgs;
+	unsigned long long cf_sent;
+	unsigned long long cf_received;
+	unsigned long long fc_sent;
+	unsigned long long fc_received;
+	unsigned long long timeouts;
+	unsigned long long errors;
+};
+
+void isotp_link_init(struct isotp_link *link, struct can_port *port,
+		     canid_t tx_id, canid_t rx_id, uint8_t *rx_buf,
+		     size_t rx_size);
+signed int isotp_send(struct isotp_link *link, const uint8_t *data,
+		      size_t len, uint64_t now_ns);
+int isotp_rx_frame(struct isotp_link *link, const struct can_frame *frame,
+		   uint64_t now_ns);
+unsigned int isotp_poll(struct isotp_link *link, uint64_t now_ns,
+			unsigned int max);
+void isotp_tx_sent(struct isotp_link *link, unsigned int queued,
+		   unsigned int sent);
+uint64_t isotp_next_ns(const struct isotp_link *link);
+uint64_t isotp_stmin_ns(uint8_t stmin);
+
+#endif /* __ISOTP_H__ */
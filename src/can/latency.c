@@ -0,0 +1,127 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <string.h>
+
+#include "latency.h"
+
+/* Values below LATENCY_SUB_BUCKETS map directly to a bucket. Above that,
+ * the top LATENCY_SUB_BITS bits below the most significant bit select the
+ * linear step within the power of two range.
+ */
+static unsigned int bucket_index(uint64_t ns)
+{
+	unsigned int msb;
+	unsigned int shift;
+
+	if (ns < LATENCY_SUB_BUCKETS)
+		return ns;
+
+	msb = 63 - __builtin_clzll(ns);
+	shift = msb - LATENCY_SUB_BITS;
+
+	return ((shift + 1) << LATENCY_SUB_BITS) +
+	  ((ns >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+/* Largest value that would be sorted in to the bucket */
+static uint64_t bucket_upper(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t base;
+
+	if (idx < LATENCY_SUB_BUCKETS)
+		return idx;
+
+	shift = (idx >> LATENCY_SUB_BITS) - 1;
+	base = (uint64_t)(LATENCY_SUB_BUCKETS +
+	  (idx & (LATENCY_SUB_BUCKETS - 1))) << shift;
+
+	return base + ((1ULL << shift) - 1);
+}
+
+void latency_hist_init(struct latency_hist *hist)
+{
+	memset(hist, '\0', sizeof(*hist));
+	hist->min_ns = UINT64_MAX;
+}
+
+void latency_hist_add(struct latency_hist *hist, uint64_t ns)
+{
+	hist->buckets[bucket_index(ns)]++;
+	hist->count++;
+	hist->sum_ns += ns;
+	if (ns < hist->min_ns)
+		hist->min_ns = ns;
+	if (ns > hist->max_ns)
+		hist->max_ns = ns;
+}
+
+/* Returns the value at or below which pct percent of all samples fall. This
+ * is the upper bound of the bucket the sample lands in, clamped to the
+ * largest sample actually seen.
+ */
+uint64_t latency_hist_percentile(const struct latency_hist *hist, double pct)
+{
+	uint64_t target;
+	uint64_t seen = 0;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	target = (uint64_t)((pct / 100.0) * hist->count + 0.5);
+	if (target < 1)
+		target = 1;
+	if (target > hist->count)
+		target = hist->count;
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+
+	if (i == LATENCY_BUCKETS || bucket_upper(i) > hist->max_ns)
+		return hist->max_ns;
+	if (bucket_upper(i) < hist->min_ns)
+		return hist->min_ns;
+
+	return bucket_upper(i);
+}
+
+void latency_hist_print(FILE *stream, const char *label,
+			const struct latency_hist *hist)
+{
+	uint64_t range[64] = {0};
+	unsigned int i;
+
+	if (hist->count == 0) {
+		fprintf(stream, "%s: no samples\n", label);
+		return;
+	}
+
+	fprintf(stream, "%s: %llu samples, min %.1f us, avg %.1f us, "
+		"p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+		label, (unsigned long long)hist->count,
+		hist->min_ns / 1000.0,
+		(double)hist->sum_ns / hist->count / 1000.0,
+		latency_hist_percentile(hist, 50.0) / 1000.0,
+		latency_hist_percentile(hist, 99.0) / 1000.0,
+		latency_hist_percentile(hist, 99.9) / 1000.0,
+		hist->max_ns / 1000.0);
+
+	/* Coarse distribution, one line per power of two of microseconds */
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		uint64_t us = bucket_upper(i) / 1000;
+
+		range[us ? 64 - __builtin_clzll(us) : 0] += hist->buckets[i];
+	}
+
+	for (i = 0; i < 64; i++) {
+		if (range[i] == 0)
+			continue;
+		fprintf(stream, "  %8llu - %8llu us: %llu\n",
+			i ? 1ULL << (i - 1) : 0ULL, (1ULL << i) - 1,
+			(unsigned long long)range[i]);
+	}
+}
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Fixed size latency histogram
+ *
+ * Samples are sorted in to log-linear buckets, each power of two range is
+ * split in to LATENCY_SUB_BUCKETS linear steps. This keeps the error on any
+ * reported percentile within a few percent while using a fixed amount of
+ * memory and no allocation, so samples can be recorded from the hot path.
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_SUB_BITS	4
+#define LATENCY_SUB_BUCKETS	(1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS		(64 * LATENCY_SUB_BUCKETS)
+
+struct latency_hist {
+	uint64_t buckets[LATENCY_BUCKETS];
+	uint64_t count;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t sum_ns;
+};
+
+static inline int64_t timespec_to_ns(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+static inline int64_t timespec_diff_ns(const struct timespec *end,
+				       const struct timespec *start)
+{
+	return timespec_to_ns(end) - timespec_to_ns(start);
+}
+
+void latency_hist_init(struct latency_hist *hist);
+void latency_hist_add(struct latency_hist *hist, uint64_t ns);
+uint64_t latency_hist_percentile(const struct latency_hist *hist, double pct);
+void latency_hist_print(FILE *stream, const char *label,
+			const struct latency_hist *hist);
+
+#endif /* __LATENCY_H__ */
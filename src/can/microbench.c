@@ -0,0 +1,653 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Microbenchmarks of the cost of the tool itself, rather than the bus
+ *
+ * Each benchmark prints one line of JSON to stdout, so that runs can be
+ * compared across kernel and toolchain upgrades:
+ *
+ *	write, sendmmsg		ns per frame sent, one frame per write() or a
+ *				batch per sendmmsg()
+ *	recvmsg, recvmmsg	ns per frame received, the same way
+ *	epoll_wakeup		time from a frame being written to a thread
+ *				sleeping in epoll_wait() on another socket
+ *				running again
+ *	cmsg_parse		ns to pull the timestamps out of the control
+ *				messages of a received frame
+ *	ecu_turnaround		time from an OBD request being written to the
+ *				ECU emulation's response being received
+ *
+ * The first line describes the system the numbers are from.
+ *
+ * Without --iface, can0 is used if it is up, and vcan0 if not, so this runs
+ * anywhere a vcan interface has been set up:
+ *
+ *	ip link add dev vcan0 type vcan && ip link set vcan0 up
+ *
+ * vcan does no more than hand each frame back to the other sockets, which
+ * leaves only the cost of the syscalls and the socket layer. On real
+ * hardware, another node must be on the bus to acknowledge frames, and the
+ * send benchmarks are paced by the bus. With neither interface up, exits
+ * with 77, which meson counts as skipped.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "canio.h"
+#include "ecu.h"
+#include "etscan.h"
+#include "latency.h"
+#include "obd.h"
+#include "worker.h"
+
+#define MICROBENCH_FRAMES	100000
+#define MICROBENCH_SAMPLES	10000
+#define MICROBENCH_PARSES	1000000
+#define MICROBENCH_ID		0x123
+
+/* Gap between epoll wakeup samples, so the waiting thread is asleep again */
+#define MICROBENCH_GAP_US	50
+
+/* Longest wait for any one frame before giving up on a benchmark */
+#define MICROBENCH_TIMEOUT_MS	1000
+
+#define SKIP_EXIT		77
+
+static volatile long sink;
+
+static void usage(char **argv)
+{
+	fprintf(stderr,
+		"Usage: %s [OPTIONS]\n"
+		"embeddedTS CAN microbenchmarks\n"
+		"\n"
+		"  -i, --iface <iface>        Interface to use, default can0 if\n"
+		"                             it is up, otherwise vcan0\n"
+		"  -n, --frames <n>           Frames per throughput benchmark,\n"
+		"                             default %d\n"
+		"  -s, --samples <n>          Samples per latency benchmark,\n"
+		"                             default %d\n"
+		"  -h, --help                 This message\n"
+		"\n",
+		argv[0], MICROBENCH_FRAMES, MICROBENCH_SAMPLES
+	);
+}
+
+static int iface_is_up(const char *iface)
+{
+	struct ifreq ifr;
+	int sock, up;
+
+	sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (sock < 0)
+		return 0;
+
+	memset(&ifr, '\0', sizeof(ifr));
+	strncpy(ifr.ifr_name, iface, IFNAMSIZ-1);
+	up = ioctl(sock, SIOCGIFFLAGS, &ifr) == 0 && (ifr.ifr_flags & IFF_UP);
+	close(sock);
+
+	return up;
+}
+
+/* A socket on iface that receives only frames matching id, or nothing at
+ * all if id is 0.
+ */
+static signed int open_sock(const char *iface, canid_t id)
+{
+	struct can_filter filter = {
+		.can_id = id,
+		.can_mask = CAN_SFF_MASK,
+	};
+	int sock;
+
+	sock = etscan_open();
+	if (sock < 0)
+		return -1;
+
+	if (etscan_filter(sock, &filter, id ? 1 : 0) < 0 ||
+	  etscan_bind(sock, iface) < 0) {
+		etscan_close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+static void fill_frames(struct canfd_frame *frames, unsigned int n,
+			canid_t id)
+{
+	unsigned int i;
+
+	memset(frames, '\0', n * sizeof(*frames));
+	for (i = 0; i < n; i++) {
+		frames[i].can_id = id;
+		frames[i].len = CAN_MAX_DLEN;
+		memcpy(frames[i].data, &i, sizeof(i));
+	}
+}
+
+/* Time spent sleeping, for the bus to drain, is not counted */
+static uint64_t backoff(unsigned long long *retries)
+{
+	struct timespec ts = { .tv_nsec = TX_BACKOFF_MIN_US * 1000 };
+	uint64_t start = monotonic_ns();
+
+	(*retries)++;
+	nanosleep(&ts, NULL);
+
+	return monotonic_ns() - start;
+}
+
+static void print_rate(const char *name, const char *iface,
+		       unsigned long long frames, uint64_t ns,
+		       unsigned long long calls, unsigned long long retries)
+{
+	printf("{\"bench\":\"%s\",\"iface\":\"%s\",\"frames\":%llu,"
+	       "\"calls\":%llu,\"retries\":%llu,\"ns_per_frame\":%.1f}\n",
+	       name, iface, frames, calls, retries,
+	       frames ? (double)ns / frames : 0.0);
+}
+
+static void print_latency(const char *name, const char *iface,
+			  const struct latency_hist *hist,
+			  unsigned long long timeouts)
+{
+	printf("{\"bench\":\"%s\",\"iface\":\"%s\",\"samples\":%llu,"
+	       "\"timeouts\":%llu,\"min_ns\":%llu,\"mean_ns\":%llu,"
+	       "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+	       "\"max_ns\":%llu}\n",
+	       name, iface, (unsigned long long)hist->count, timeouts,
+	       (unsigned long long)(hist->count ? hist->min_ns : 0),
+	       (unsigned long long)(hist->count ?
+				    hist->sum_ns / hist->count : 0),
+	       (unsigned long long)latency_hist_percentile(hist, 50.0),
+	       (unsigned long long)latency_hist_percentile(hist, 99.0),
+	       (unsigned long long)latency_hist_percentile(hist, 99.9),
+	       (unsigned long long)hist->max_ns);
+}
+
+static void print_info(const char *iface)
+{
+	struct utsname uts;
+
+	if (uname(&uts) < 0)
+		memset(&uts, '\0', sizeof(uts));
+
+	printf("{\"bench\":\"info\",\"iface\":\"%s\",\"version\":\"%s\","
+	       "\"kernel\":\"%s\",\"machine\":\"%s\",\"compiler\":\"%s\"}\n",
+	       iface, RELEASE, uts.release, uts.machine, __VERSION__);
+}
+
+/* One frame per write() */
+static signed int bench_write(int sock, const char *iface, unsigned int n)
+{
+	struct canfd_frame frames[MAX_BATCH];
+	unsigned long long retries = 0;
+	uint64_t start, slept = 0;
+	unsigned int i = 0;
+
+	fill_frames(frames, MAX_BATCH, MICROBENCH_ID);
+
+	start = monotonic_ns();
+	while (i < n) {
+		if (write(sock, &frames[i % MAX_BATCH], CAN_MTU) < 0) {
+			if (errno != ENOBUFS && errno != EAGAIN) {
+				perror("Error writing frame");
+				return -1;
+			}
+			slept += backoff(&retries);
+			continue;
+		}
+		i++;
+	}
+
+	print_rate("write", iface, n, monotonic_ns() - start - slept, n,
+		   retries);
+
+	return 0;
+}
+
+/* A batch of MAX_BATCH frames per sendmmsg() */
+static signed int bench_sendmmsg(int sock, const char *iface, unsigned int n)
+{
+	struct canfd_frame frames[MAX_BATCH];
+	unsigned long long calls = 0, retries = 0;
+	uint64_t start, slept = 0;
+	unsigned int sent = 0;
+	int ret;
+
+	fill_frames(frames, MAX_BATCH, MICROBENCH_ID);
+
+	start = monotonic_ns();
+	while (sent < n) {
+		ret = etscan_send(sock, frames, n - sent < MAX_BATCH ?
+				  n - sent : MAX_BATCH, 0);
+		if (ret < 0) {
+			if (errno != ENOBUFS && errno != EAGAIN) {
+				perror("Error sending frames");
+				return -1;
+			}
+			slept += backoff(&retries);
+			continue;
+		}
+		calls++;
+		sent += ret;
+	}
+
+	print_rate("sendmmsg", iface, n, monotonic_ns() - start - slept, calls,
+		   retries);
+
+	return 0;
+}
+
+/* Queue up a batch on rx_sock, outside of the timing */
+static signed int fill_rx(int tx_sock, unsigned int count)
+{
+	struct canfd_frame frames[MAX_BATCH];
+	unsigned long long retries = 0;
+	unsigned int sent = 0;
+	int ret;
+
+	fill_frames(frames, MAX_BATCH, MICROBENCH_ID);
+	while (sent < count) {
+		ret = etscan_send(tx_sock, frames, count - sent, 0);
+		if (ret < 0) {
+			if (errno != ENOBUFS && errno != EAGAIN) {
+				perror("Error sending frames");
+				return -1;
+			}
+			backoff(&retries);
+			continue;
+		}
+		sent += ret;
+	}
+
+	return 0;
+}
+
+/* Frames are sent a batch at a time, then only the syscalls that receive
+ * them are timed, one frame per recvmsg(), or as many as are pending per
+ * recvmmsg(). Waits for frames still on their way are not counted.
+ */
+static signed int bench_recv(int tx_sock, int rx_sock, const char *iface,
+			     unsigned int n, int batched)
+{
+	static struct rx_batch rx;
+	struct msghdr *msg = &rx.msgs[0].msg_hdr;
+	unsigned long long calls = 0, lost = 0;
+	unsigned int got = 0, pending;
+	uint64_t start, ns = 0;
+	int ret;
+
+	rx_batch_init(&rx);
+
+	while (got + lost < n) {
+		pending = n - got - lost < MAX_BATCH ?
+		  n - got - lost : MAX_BATCH;
+		if (fill_rx(tx_sock, pending) < 0)
+			return -1;
+
+		while (pending) {
+			start = monotonic_ns();
+			if (batched) {
+				ret = rx_batch_recv(rx_sock, &rx, pending);
+			} else {
+				msg->msg_namelen = sizeof(struct sockaddr_can);
+				msg->msg_controllen = CTRLMSG_LEN;
+				msg->msg_flags = 0;
+				ret = recvmsg(rx_sock, msg, MSG_DONTWAIT);
+				if (ret < 0 && (errno == EAGAIN ||
+				  errno == EWOULDBLOCK))
+					ret = 0;
+				else if (ret > 0)
+					ret = 1;
+			}
+			ns += monotonic_ns() - start;
+
+			if (ret < 0) {
+				perror("Error receiving frames");
+				return -1;
+			}
+			calls++;
+
+			if (!ret) {
+				ret = etscan_wait(rx_sock,
+						  MICROBENCH_TIMEOUT_MS);
+				if (ret < 0) {
+					perror("Error waiting for frames");
+					return -1;
+				}
+				if (!ret) {
+					lost += pending;
+					break;
+				}
+				continue;
+			}
+			pending -= ret;
+			got += ret;
+		}
+	}
+
+	if (lost)
+		fprintf(stderr, "%s: %llu frames never arrived\n",
+			batched ? "recvmmsg" : "recvmsg", lost);
+	print_rate(batched ? "recvmmsg" : "recvmsg", iface, got, ns, calls, 0);
+
+	return 0;
+}
+
+struct waiter {
+	int sock;
+	unsigned int samples;
+	struct latency_hist hist;
+	unsigned long long timeouts;
+	int ret;
+};
+
+/* Sleep in epoll_wait() on the socket, for each frame record how long ago
+ * the sender stamped it.
+ */
+static void *waiter_main(void *arg)
+{
+	struct waiter *w = arg;
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct can_frame frame;
+	uint64_t now, sent;
+	unsigned int i;
+	int epfd, ret;
+
+	w->ret = -1;
+	epfd = epoll_create1(0);
+	if (epfd < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, w->sock, &ev) < 0) {
+		perror("Unable to set up epoll");
+		if (epfd >= 0)
+			close(epfd);
+		return NULL;
+	}
+
+	for (i = 0; i < w->samples; i++) {
+		ret = epoll_wait(epfd, &ev, 1, MICROBENCH_TIMEOUT_MS);
+		now = monotonic_ns();
+		if (ret < 0 && errno == EINTR) {
+			i--;
+			continue;
+		}
+		if (ret < 0) {
+			perror("Error in epoll_wait");
+			close(epfd);
+			return NULL;
+		}
+		/* Whatever was still to come is not coming */
+		if (!ret) {
+			w->timeouts += w->samples - i;
+			break;
+		}
+
+		if (read(w->sock, &frame, sizeof(frame)) <
+		  (ssize_t)sizeof(frame))
+			continue;
+		memcpy(&sent, frame.data, sizeof(sent));
+		latency_hist_add(&w->hist, now - sent);
+	}
+
+	close(epfd);
+	w->ret = 0;
+
+	return NULL;
+}
+
+static signed int bench_wakeup(int tx_sock, int rx_sock, const char *iface,
+			       unsigned int samples)
+{
+	struct timespec gap = { .tv_nsec = MICROBENCH_GAP_US * 1000 };
+	static struct waiter w;
+	struct can_frame frame;
+	pthread_t thread;
+	unsigned int i;
+	uint64_t now;
+	int err;
+
+	memset(&w, '\0', sizeof(w));
+	w.sock = rx_sock;
+	w.samples = samples;
+	latency_hist_init(&w.hist);
+
+	err = pthread_create(&thread, NULL, waiter_main, &w);
+	if (err) {
+		fprintf(stderr, "Unable to start waiter: %s\n", strerror(err));
+		return -1;
+	}
+
+	memset(&frame, '\0', sizeof(frame));
+	frame.can_id = MICROBENCH_ID;
+	frame.can_dlc = CAN_MAX_DLEN;
+	for (i = 0; i < samples; i++) {
+		nanosleep(&gap, NULL);
+		now = monotonic_ns();
+		memcpy(frame.data, &now, sizeof(now));
+		if (write(tx_sock, &frame, CAN_MTU) < 0 && errno != ENOBUFS) {
+			perror("Error writing frame");
+			break;
+		}
+	}
+
+	pthread_join(thread, NULL);
+	if (w.ret < 0)
+		return -1;
+
+	print_latency("epoll_wakeup", iface, &w.hist, w.timeouts);
+
+	return 0;
+}
+
+/* Parse the control messages of one real received frame, over and over */
+static signed int bench_cmsg(int tx_sock, int rx_sock, const char *iface,
+			     unsigned int n)
+{
+	static struct rx_batch rx;
+	struct rx_stamp stamp;
+	struct msghdr *msg;
+	uint64_t start, ns;
+	unsigned int i;
+	int ret;
+
+	rx_batch_init(&rx);
+	if (enable_timestamps(rx_sock) < 0 || fill_rx(tx_sock, 1) < 0)
+		return -1;
+
+	ret = etscan_wait(rx_sock, MICROBENCH_TIMEOUT_MS);
+	if (ret > 0)
+		ret = rx_batch_recv(rx_sock, &rx, 1);
+	if (ret <= 0) {
+		fprintf(stderr, "No frame received for cmsg_parse\n");
+		return -1;
+	}
+	msg = &rx.msgs[0].msg_hdr;
+
+	start = monotonic_ns();
+	for (i = 0; i < n; i++) {
+		parse_cmsgs(msg, &stamp);
+		sink += stamp.sw.tv_nsec;
+	}
+	ns = monotonic_ns() - start;
+
+	printf("{\"bench\":\"cmsg_parse\",\"iface\":\"%s\",\"parses\":%u,"
+	       "\"ctrl_bytes\":%zu,\"ns_per_parse\":%.2f}\n",
+	       iface, n, (size_t)msg->msg_controllen, (double)ns / n);
+
+	return 0;
+}
+
+/* The ECU emulation runs in a worker thread, as it does with --threads, and
+ * is sent one functional RPM request at a time.
+ */
+static signed int bench_ecu(const char *iface, unsigned int samples)
+{
+	static struct can_port port;
+	static struct worker w;
+	struct latency_hist hist;
+	unsigned long long timeouts = 0;
+	struct canfd_frame req, rsp;
+	uint64_t start;
+	unsigned int i;
+	int sock, ret = 0;
+
+	sock = open_sock(iface, 0x7e8);
+	if (sock < 0)
+		return -1;
+
+	if (ecu_port_open(&port, NULL, iface, MAX_BATCH, NULL, 0) < 0) {
+		etscan_close(sock);
+		return -1;
+	}
+
+	keep_running = 1;
+	worker_init(&w, &port, -1, 0, 0);
+	if (worker_start(&w) < 0) {
+		can_port_close(&port);
+		etscan_close(sock);
+		return -1;
+	}
+
+	memset(&req, '\0', sizeof(req));
+	obd_build_request(etscan_frame(&req, 0), 0x7df, 0x0c);
+
+	latency_hist_init(&hist);
+	for (i = 0; i < samples && keep_running; i++) {
+		start = monotonic_ns();
+		if (write(sock, &req, CAN_MTU) < 0) {
+			perror("Error writing request");
+			ret = -1;
+			break;
+		}
+
+		ret = etscan_wait(sock, MICROBENCH_TIMEOUT_MS);
+		if (ret > 0)
+			ret = etscan_recv(sock, &rsp, NULL, 1, ETSCAN_DONTWAIT);
+		if (ret < 0) {
+			perror("Error receiving response");
+			break;
+		}
+		if (!ret) {
+			timeouts++;
+			continue;
+		}
+		latency_hist_add(&hist, monotonic_ns() - start);
+	}
+
+	keep_running = 0;
+	if (worker_join(&w) < 0)
+		ret = -1;
+	can_port_close(&port);
+	etscan_close(sock);
+
+	if (ret < 0)
+		return -1;
+
+	print_latency("ecu_turnaround", iface, &hist, timeouts);
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static struct option long_options[] = {
+		{ "iface", required_argument, 0, 'i' },
+		{ "frames", required_argument, 0, 'n' },
+		{ "samples", required_argument, 0, 's' },
+		{ "help", no_argument, 0, 'h' },
+		{ 0, 0, 0, 0 },
+	};
+	unsigned int frames = MICROBENCH_FRAMES;
+	unsigned int samples = MICROBENCH_SAMPLES;
+	const char *iface = NULL;
+	int tx_sock, rx_sock;
+	int ret = 0;
+	int c;
+
+	while ((c = getopt_long(argc, argv, "i:n:s:h", long_options,
+	  NULL)) != -1) {
+		switch (c) {
+		case 'i':
+			iface = optarg;
+			break;
+		case 'n':
+			frames = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			samples = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv);
+			return 1;
+		}
+	}
+
+	if (!frames || !samples) {
+		fprintf(stderr, "Error! --frames and --samples must be at "
+			"least 1!\n");
+		return 1;
+	}
+
+	if (!iface) {
+		if (iface_is_up("can0")) {
+			iface = "can0";
+		} else if (iface_is_up("vcan0")) {
+			iface = "vcan0";
+		} else {
+			fprintf(stderr, "Neither can0 nor vcan0 is up, "
+				"skipping\n");
+			return SKIP_EXIT;
+		}
+	}
+
+	print_info(iface);
+
+	/* The sender receives nothing, so only the receiving socket pays for
+	 * each frame being handed back.
+	 */
+	tx_sock = open_sock(iface, 0);
+	if (tx_sock < 0)
+		return 1;
+
+	if (bench_write(tx_sock, iface, frames) < 0 ||
+	  bench_sendmmsg(tx_sock, iface, frames) < 0) {
+		etscan_close(tx_sock);
+		return 1;
+	}
+
+	rx_sock = open_sock(iface, MICROBENCH_ID);
+	if (rx_sock < 0) {
+		etscan_close(tx_sock);
+		return 1;
+	}
+
+	if (bench_recv(tx_sock, rx_sock, iface, frames, 0) < 0 ||
+	  bench_recv(tx_sock, rx_sock, iface, frames, 1) < 0 ||
+	  bench_wakeup(tx_sock, rx_sock, iface, samples) < 0 ||
+	  bench_cmsg(tx_sock, rx_sock, iface, MICROBENCH_PARSES) < 0)
+		ret = -1;
+
+	etscan_close(rx_sock);
+	etscan_close(tx_sock);
+
+	if (!ret && bench_ecu(iface, samples) < 0)
+		ret = -1;
+
+	fflush(stdout);
+
+	return ret < 0 ? 1 : 0;
+}
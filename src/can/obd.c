@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <string.h>
+
+#include "obd.h"
+
+#define VALUE(l, s, o, n, u) \
+	{ .kind = OBD_VALUE, .len = l, .scale = s, .offset = o, \
+	  .name = n, .unit = u }
+#define SUPPORTED(n) \
+	{ .kind = OBD_SUPPORTED, .len = 4, .scale = 1, .offset = 0, \
+	  .name = n, .unit = "" }
+
+/* Formulas are from SAE J1979, written as raw * scale + offset */
+const struct obd_pid obd_pids[256] = {
+	[0x00] = SUPPORTED("PIDs supported 01-20"),
+	[0x04] = VALUE(1, 100.0 / 255, 0, "Calculated engine load", "%"),
+	[0x05] = VALUE(1, 1, -40, "Engine coolant temperature", "C"),
+	[0x06] = VALUE(1, 100.0 / 128, -100, "Short term fuel trim bank 1", "%"),
+	[0x07] = VALUE(1, 100.0 / 128, -100, "Long term fuel trim bank 1", "%"),
+	[0x0a] = VALUE(1, 3, 0, "Fuel pressure", "kPa"),
+	[0x0b] = VALUE(1, 1, 0, "Intake manifold absolute pressure", "kPa"),
+	[0x0c] = VALUE(2, 0.25, 0, "Engine speed", "rpm"),
+	[0x0d] = VALUE(1, 1, 0, "Vehicle speed", "km/h"),
+	[0x0e] = VALUE(1, 0.5, -64, "Timing advance", "deg"),
+	[0x0f] = VALUE(1, 1, -40, "Intake air temperature", "C"),
+	[0x10] = VALUE(2, 0.01, 0, "Mass air flow rate", "g/s"),
+	[0x11] = VALUE(1, 100.0 / 255, 0, "Throttle position", "%"),
+	[0x1f] = VALUE(2, 1, 0, "Run time since engine start", "s"),
+	[0x20] = SUPPORTED("PIDs supported 21-40"),
+	[0x21] = VALUE(2, 1, 0, "Distance traveled with MIL on", "km"),
+	[0x2f] = VALUE(1, 100.0 / 255, 0, "Fuel tank level", "%"),
+	[0x33] = VALUE(1, 1, 0, "Absolute barometric pressure", "kPa"),
+	[0x40] = SUPPORTED("PIDs supported 41-60"),
+	[0x42] = VALUE(2, 0.001, 0, "Control module voltage", "V"),
+	[0x46] = VALUE(1, 1, -40, "Ambient air temperature", "C"),
+	[0x5c] = VALUE(1, 1, -40, "Engine oil temperature", "C"),
+	[0x5e] = VALUE(2, 0.05, 0, "Engine fuel rate", "L/h"),
+};
+
+/* Only standard ID data frames match */
+#define SFF_DATA_MASK(m)	((m) | CAN_EFF_FLAG | CAN_RTR_FLAG)
+
+const struct can_filter obd_request_filters[2] = {
+	{ 0x7df, SFF_DATA_MASK(CAN_SFF_MASK) },
+	{ 0x7e0, SFF_DATA_MASK(0x7f8) },
+};
+
+const struct can_filter obd_response_filters[1] = {
+	{ 0x7e8, SFF_DATA_MASK(0x7f8) },
+};
+
+/* Turn a frame built as classic in to a CAN FD frame of len bytes, which must
+ * be a valid FD length, with the bit rate switched for the data phase. The
+ * message itself stays single frame, the rest of the frame is padding. This
+ * is for moving more payload on the bus, not conformant OBD on CAN FD.
+ */
+void obd_pad_fd(struct canfd_frame *frame, uint8_t len)
+{
+	if (len > frame->len)
+		memset(&frame->data[frame->len], OBD_PAD_BYTE, len - frame->len);
+	frame->len = len;
+	frame->flags = CANFD_BRS;
+}
+
+/* The request format used throughout, as expected by the mOByDic 1610 */
+void obd_build_request(struct can_frame *frame, canid_t id, uint8_t pid)
+{
+	memset(frame, '\0', sizeof(*frame));
+	frame->can_id = id;
+	frame->can_dlc = 3;
+	frame->data[0] = 3;
+	frame->data[1] = OBD_SERVICE_CURRENT;
+	frame->data[2] = pid;
+}
+
+/* Set up a positive response carrying the raw value for the PID. Returns -1
+ * if the PID is not one in the table.
+ */
+int obd_build_response(struct can_frame *frame, canid_t id, uint8_t pid,
+		       uint32_t raw)
+{
+	const struct obd_pid *info = obd_pid_info(pid);
+	int i;
+
+	if (!info)
+		return -1;
+
+	if (info->kind == OBD_SUPPORTED)
+		raw = obd_supported_mask(pid);
+
+	memset(frame, '\0', sizeof(*frame));
+	frame->can_id = id;
+	frame->can_dlc = 3 + info->len;
+	frame->data[0] = 2 + info->len;
+	frame->data[1] = OBD_SERVICE_CURRENT + OBD_RESPONSE_OFFSET;
+	frame->data[2] = pid;
+	for (i = info->len - 1; i >= 0; i--) {
+		frame->data[3 + i] = raw & 0xFF;
+		raw >>= 8;
+	}
+
+	return 0;
+}
+
+/* Inverse of the decode formula, rounded and clamped to what fits */
+uint32_t obd_encode(const struct obd_pid *info, double value)
+{
+	double raw = (value - info->offset) / info->scale + 0.5;
+
+	if (raw < 0)
+		return 0;
+	if (raw > obd_raw_max(info))
+		return obd_raw_max(info);
+
+	return (uint32_t)raw;
+}
+
+/* Decode a service 01 positive response. Returns the PID's table entry with
+ * the decoded value written to value, or NULL if the frame is not a response
+ * to a known PID.
+ */
+const struct obd_pid *obd_decode(const struct can_frame *frame, double *value)
+{
+	const struct obd_pid *info;
+	uint32_t raw = 0;
+	int i;
+
+	if (frame->data[1] != OBD_SERVICE_CURRENT + OBD_RESPONSE_OFFSET)
+		return NULL;
+
+	info = obd_pid_info(frame->data[2]);
+	if (!info || frame->data[0] < 2 + info->len ||
+	  frame->can_dlc < 3 + info->len)
+		return NULL;
+
+	for (i = 0; i < info->len; i++)
+		raw = (raw << 8) | frame->data[3 + i];
+	*value = raw * info->scale + info->offset;
+
+	return info;
+}
+
+/* Bitmap of supported PIDs base+1 through base+32, MSB first, with the last
+ * bit set if the next supported PIDs entry is also in the table.
+ */
+uint32_t obd_supported_mask(uint8_t base)
+{
+	uint32_t mask = 0;
+	int i;
+
+	for (i = 1; i <= 32 && base + i < 256; i++) {
+		if (obd_pids[base + i].kind != OBD_UNSUPPORTED)
+			mask |= 1UL << (32 - i);
+	}
+
+	return mask;
+}
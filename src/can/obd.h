@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* OBD-II service 01 PID definitions
+ *
+ * Each PID that is understood has an entry in obd_pids[], indexed directly
+ * by the PID number. The entry describes how many data bytes the response
+ * carries and how to turn those in to a value: the bytes are read as a big
+ * endian unsigned integer, then scaled and offset. Decoding a response is a
+ * single table lookup plus a multiply-add, with no searching or branching
+ * on the PID.
+ */
+
+#ifndef __OBD_H__
+#define __OBD_H__
+
+#include <linux/can.h>
+#include <stdint.h>
+
+/* Service 01 request and positive response */
+#define OBD_SERVICE_CURRENT	0x01
+#define OBD_RESPONSE_OFFSET	0x40
+
+/* Filler for unused bytes of a padded frame, per ISO 15765-2 */
+#define OBD_PAD_BYTE		0xCC
+
+/* Time an ECU has to respond to a request, P2 in ISO 15765-4 */
+#define OBD_P2_MS		50
+
+enum obd_kind {
+	OBD_UNSUPPORTED = 0,
+	OBD_VALUE,
+	/* Bitmap of which of the following 32 PIDs are supported */
+	OBD_SUPPORTED,
+};
+
+struct obd_pid {
+	enum obd_kind kind;
+	uint8_t len;
+	double scale;
+	double offset;
+	const char *name;
+	const char *unit;
+};
+
+extern const struct obd_pid obd_pids[256];
+
+/* CAN_RAW_FILTER sets for the functional and physical request addresses,
+ * 0x7df and 0x7e0-0x7e7, and the response addresses, 0x7e8-0x7ef.
+ */
+extern const struct can_filter obd_request_filters[2];
+extern const struct can_filter obd_response_filters[1];
+
+static inline const struct obd_pid *obd_pid_info(uint8_t pid)
+{
+	return obd_pids[pid].kind != OBD_UNSUPPORTED ? &obd_pids[pid] : NULL;
+}
+
+/* Largest raw value the PID's data bytes can hold */
+static inline uint32_t obd_raw_max(const struct obd_pid *info)
+{
+	return info->len >= 4 ? UINT32_MAX : (1UL << (8 * info->len)) - 1;
+}
+
+void obd_build_request(struct can_frame *frame, canid_t id, uint8_t pid);
+int obd_build_response(struct can_frame *frame, canid_t id, uint8_t pid,
+		       uint32_t raw);
+void obd_pad_fd(struct canfd_frame *frame, uint8_t len);
+uint32_t obd_encode(const struct obd_pid *info, double value);
+const struct obd_pid *obd_decode(const struct can_frame *frame,
+				 double *value);
+uint32_t obd_supported_mask(uint8_t base);
+
+#endif /* __OBD_H__ */
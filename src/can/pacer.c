@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "pacer.h"
+
+/* Limit our transmits to load_pct of a bus running at bitrate, and dbitrate
+ * for the data phase of FD frames.
+ */
+void pacer_init(struct pacer *p, unsigned int load_pct, unsigned int bitrate,
+		unsigned int dbitrate, uint64_t now_ns)
+{
+	memset(p, '\0', sizeof(*p));
+	p->bitrate = bitrate;
+	p->dbitrate = dbitrate;
+	p->max_permille = load_pct * 10;
+	p->permille = p->max_permille;
+	p->low_permille = p->max_permille;
+	p->tokens_ns = PACER_BURST_NS * p->permille / 1000;
+	p->last_ns = now_ns;
+	p->calm_ns = now_ns;
+	p->start_ns = now_ns;
+}
+
+/* Bus time of a frame. Classic frames are charged their exact stuff bits,
+ * FD frames the worst case, as their stuffing also depends on the CRC.
+ */
+uint64_t pacer_cost_ns(const struct pacer *p, const struct canfd_frame *frame,
+		       int fd)
+{
+	const struct can_frame *cf = (const struct can_frame *)frame;
+
+	if (fd)
+		return frame_time_ns(frame, fd, 1, p->bitrate, p->dbitrate);
+
+	return (frame_bits(cf, 0) + frame_stuff_bits(cf)) * 1000000000ULL /
+	  p->bitrate;
+}
+
+static void refill(struct pacer *p, uint64_t now_ns)
+{
+	int64_t cap = PACER_BURST_NS * p->permille / 1000;
+
+	if (now_ns <= p->last_ns)
+		return;
+
+	p->tokens_ns += (now_ns - p->last_ns) * p->permille / 1000;
+	if (p->tokens_ns > cap)
+		p->tokens_ns = cap;
+	p->last_ns = now_ns;
+}
+
+/* Returns 1 if a frame of cost_ns may be sent now, taking its bus time from
+ * the bucket. A frame may go out on credit whenever the bucket is not
+ * already in debt, so that frames longer than the whole bucket still go
+ * out, just less often.
+ */
+int pacer_admit(struct pacer *p, uint64_t now_ns, uint64_t cost_ns)
+{
+	refill(p, now_ns);
+	if (p->tokens_ns < 0) {
+		p->throttled++;
+		return 0;
+	}
+
+	p->tokens_ns -= cost_ns;
+	p->frames++;
+	p->bus_ns += cost_ns;
+
+	return 1;
+}
+
+/* Give back the bus time of a frame that was admitted but never sent */
+void pacer_refund(struct pacer *p, uint64_t cost_ns)
+{
+	p->tokens_ns += cost_ns;
+	p->frames--;
+	p->bus_ns -= cost_ns;
+}
+
+/* When the next frame may be sent */
+uint64_t pacer_next_ns(const struct pacer *p, uint64_t now_ns)
+{
+	if (p->tokens_ns >= 0)
+		return now_ns;
+
+	return p->last_ns + ((uint64_t)-p->tokens_ns * 1000 + p->permille - 1) /
+	  p->permille;
+}
+
+/* Check the port for anything that says we are sending too much, and back
+ * off if so, otherwise creep back up towards the limit. Call after each
+ * send and receive.
+ */
+void pacer_update(struct pacer *p, const struct can_port *port,
+		  uint64_t now_ns)
+{
+	int trouble;
+
+	trouble = port->rx.rxq_drops != p->rxq_seen ||
+	  port->tx.retries_total != p->retries_seen ||
+	  port->tx.dropped_total != p->dropped_seen;
+	p->rxq_seen = port->rx.rxq_drops;
+	p->retries_seen = port->tx.retries_total;
+	p->dropped_seen = port->tx.dropped_total;
+
+	/* Time passed so far counts at the rate in force while it passed */
+	refill(p, now_ns);
+
+	if (trouble) {
+		p->permille /= 2;
+		if (p->permille < PACER_MIN_PERMILLE)
+			p->permille = PACER_MIN_PERMILLE;
+		if (p->permille < p->low_permille)
+			p->low_permille = p->permille;
+		if (p->tokens_ns > 0)
+			p->tokens_ns = 0;
+		p->calm_ns = now_ns;
+		p->backoffs++;
+		return;
+	}
+
+	if (p->permille < p->max_permille &&
+	  now_ns - p->calm_ns >= PACER_RAISE_NS) {
+		p->permille += p->max_permille / PACER_RAISE_DIV ?
+		  p->max_permille / PACER_RAISE_DIV : 1;
+		if (p->permille > p->max_permille)
+			p->permille = p->max_permille;
+		p->calm_ns = now_ns;
+	}
+}
+
+void pacer_print(FILE *stream, const char *label, const struct pacer *p,
+		 uint64_t now_ns)
+{
+	uint64_t elapsed = now_ns - p->start_ns;
+
+	fprintf(stream, "%s: %llu frames, %.1f%% of the bus at %u bit/s, "
+		"limit %.1f%%, %llu times held back\n", label, p->frames,
+		elapsed ? 100.0 * p->bus_ns / elapsed : 0.0, p->bitrate,
+		p->max_permille / 10.0, p->throttled);
+	fprintf(stream, "  Backed off %llu times, down to %.1f%%, ended at "
+		"%.1f%%\n", p->backoffs, p->low_permille / 10.0,
+		p->permille / 10.0);
+}
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Bus load limiting for our own transmits
+ *
+ * A token bucket that holds bus time rather than frames. It fills at the
+ * allowed fraction of real time, so at a 20% limit every 1 ms that passes
+ * allows another 200 us of frames, and each frame sent takes the time it
+ * occupies the bus at the interface's bit rate, stuff bits included. The
+ * bucket holds at most PACER_BURST_NS of real time worth, so after a quiet
+ * spell we never send more than that in one go.
+ *
+ * The limit is a ceiling. When the socket shows signs of trouble, the
+ * receive queue overflowing or the interface having no room to send
+ * (ENOBUFS), the rate is halved, and it only climbs back up towards the
+ * ceiling a step at a time while things stay quiet, so a bus that is busier
+ * than expected settles at what it can actually take.
+ */
+
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "canio.h"
+
+/* Real time the bucket can save up */
+#define PACER_BURST_NS		10000000ULL
+
+/* Quiet time before each step back up, and the size of the step as a
+ * fraction of the ceiling
+ */
+#define PACER_RAISE_NS		100000000ULL
+#define PACER_RAISE_DIV		20
+
+/* Never backs off below this, in tenths of a percent */
+#define PACER_MIN_PERMILLE	5
+
+struct pacer {
+	unsigned int bitrate;
+	unsigned int dbitrate;
+	unsigned int max_permille;
+	unsigned int permille;
+
+	/* Bus time in ns that may still be used, negative once a frame has
+	 * gone out on credit.
+	 */
+	int64_t tokens_ns;
+	uint64_t last_ns;
+	uint64_t calm_ns;
+
+	/* Last seen counts from the port */
+	uint32_t rxq_seen;
+	unsigned long long retries_seen;
+	unsigned long long dropped_seen;
+
+	/* Statistics */
+	unsigned long long frames;
+	unsigned long long bus_ns;
+	unsigned long long throttled;
+	unsigned long long backoffs;
+	unsigned int low_permille;
+	uint64_t start_ns;
+};
+
+void pacer_init(struct pacer *p, unsigned int load_pct, unsigned int bitrate,
+		unsigned int dbitrate, uint64_t now_ns);
+uint64_t pacer_cost_ns(const struct pacer *p, const struct canfd_frame *frame,
+		       int fd);
+int pacer_admit(struct pacer *p, uint64_t now_ns, uint64_t cost_ns);
+void pacer_refund(struct pacer *p, uint64_t cost_ns);
+uint64_t pacer_next_ns(const struct pacer *p, uint64_t now_ns);
+void pacer_update(struct pacer *p, const struct can_port *port,
+		  uint64_t now_ns);
+void pacer_print(FILE *stream, const char *label, const struct pacer *p,
+		 uint64_t now_ns);
+
+#endif /* __PACER_H__ */
@@ -0,0 +1,475 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include "obd.h"
+#include "query.h"
+
+/* State of the one-shot query, responses come back in query order so the
+ * timestamps of our own queries going out are kept in a FIFO.
+ */
+struct oneshot_state {
+	int replies;
+	int latency;
+	struct rx_stamp stamps[MAX_BATCH];
+	unsigned int head;
+	unsigned int tail;
+	struct latency_hist rtt;
+	unsigned long long hw_samples;
+};
+
+/* Open iface for queries, receiving only responses plus any extra filters.
+ * When measuring latency, also timestamp frames and have our own queries
+ * come back once they are sent.
+ */
+signed int query_port_open(struct can_port *port, const char *iface,
+			   unsigned int batch, int latency,
+			   const struct can_filter *extra, int nextra)
+{
+	if (can_port_open(port, iface, batch, obd_response_filters,
+	  ARRAY_SIZE(obd_response_filters), obd_request_filters,
+	  latency ? ARRAY_SIZE(obd_request_filters) : 0, extra, nextra) < 0)
+		return -1;
+
+	/* Without echoes of our own frames, a local port has nothing to
+	 * measure latency from.
+	 */
+	if (latency && !port->local && (enable_timestamps(port->sock) < 0 ||
+	  enable_own_msgs(port->sock) < 0)) {
+		can_port_close(port);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Print a decoded response, or the raw bytes if the PID is not known */
+void print_response(const struct can_frame *frame)
+{
+	const struct obd_pid *info;
+	double value;
+	int i;
+
+	printf("ECU 0x%03x PID 0x%02x: ", frame->can_id, frame->data[2]);
+
+	info = obd_decode(frame, &value);
+	if (info && info->kind == OBD_VALUE) {
+		printf("%s %.2f %s\n", info->name, value, info->unit);
+		return;
+	}
+
+	for (i = 3; i <= frame->data[0] && i < CAN_MAX_DLEN; i++)
+		printf("%02x ", frame->data[i]);
+	printf("\n");
+}
+
+static signed int oneshot_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	struct oneshot_state *st = port->priv;
+	struct rx_stamp stamp;
+	struct msghdr *msg;
+	double value;
+	int nframes;
+	int i;
+
+	(void)events;
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		perror("Error receving on query");
+		return -1;
+	}
+
+	for (i = 0; i < nframes && st->replies > 0; i++) {
+		msg = &port->rx.msgs[i].msg_hdr;
+
+		if (port->rx.msgs[i].msg_len < sizeof(struct can_frame))
+			fprintf(stderr, "Incomplete CAN frame on query\n");
+
+		if (st->latency) {
+			parse_cmsgs(msg, &stamp);
+
+			/* One of our own queries, now on the bus */
+			if (msg->msg_flags & MSG_CONFIRM) {
+				st->stamps[st->head++ % MAX_BATCH] = stamp;
+				continue;
+			}
+		}
+
+		if (obd_decode(rx_batch_frame(&port->rx, i), &value)) {
+			printf("RPM at %.2f\n", value);
+
+			/* ECU responses come back in query order */
+			if (st->latency && st->tail != st->head) {
+				st->hw_samples += record_latency(&st->rtt,
+				  &st->stamps[st->tail++ % MAX_BATCH], &stamp);
+			}
+		}
+
+		st->replies--;
+	}
+
+	return 0;
+}
+
+/* Send burst RPM queries and wait for as many frames to come back. Anything
+ * else in the same event loop, such as the ECU emulation in the loopback
+ * test, is serviced while waiting.
+ */
+signed int run_query_oneshot(struct evloop *loop, struct can_port *port,
+			     int burst, int latency)
+{
+	static struct oneshot_state st;
+	struct canfd_frame *fdframe;
+	uint64_t now_ns, deadline_ns;
+	int nframes;
+	int i;
+
+	memset(&st, '\0', sizeof(st));
+	st.latency = latency;
+	latency_hist_init(&st.rtt);
+	port->priv = &st;
+	port->ev.handler = oneshot_handler;
+
+	/* For the ozen mOByDic 1610 this requests the RPM guage. With FD
+	 * enabled, the same request goes out as a full size FD frame.
+	 */
+	for (i = 0; i < burst; i++) {
+		if (port->fd) {
+			fdframe = tx_queue_next_fd(&port->tx);
+			obd_build_request((struct can_frame *)fdframe, 0x7df, 0x0c);
+			obd_pad_fd(fdframe, CANFD_MAX_DLEN);
+		} else {
+			obd_build_request(tx_queue_next(&port->tx), 0x7df, 0x0c);
+		}
+	}
+
+	nframes = tx_queue_flush(port->sock, &port->tx);
+	if (nframes < 0) {
+		perror("Error sending query");
+		return -1;
+	}
+
+	/* Only wait on replies to queries that actually went out */
+	if (nframes < burst) {
+		fprintf(stderr, "Only sent %d of %d queries, TX queue full\n",
+			nframes, burst);
+		if (nframes == 0)
+			return -1;
+	}
+	st.replies = nframes;
+
+	deadline_ns = monotonic_ns() + QUERY_TIMEOUT_MS * 1000000ULL;
+	while (st.replies > 0) {
+		now_ns = monotonic_ns();
+		if (now_ns >= deadline_ns) {
+			fprintf(stderr, "Timeout waiting for receive on %s!\n",
+				port->iface);
+			return -1;
+		}
+
+		if (evloop_run_once(loop, (deadline_ns - now_ns + 999999) /
+		  1000000) < 0)
+			return -1;
+	}
+
+	if (latency) {
+		latency_hist_print(stdout, "Round trip latency", &st.rtt);
+		printf("  %llu of %llu samples from hardware timestamps\n",
+			st.hw_samples, (unsigned long long)st.rtt.count);
+	}
+
+	return 0;
+}
+
+static void pipe_timeout(struct timer *timer, void *arg)
+{
+	struct pipe_req *req = timer->data;
+	struct pipe_state *st = arg;
+
+	req->outstanding = 0;
+	req->timeouts++;
+	st->outstanding--;
+	st->timeouts++;
+}
+
+/* Match a frame from the bus to the request it belongs to. Own queries are
+ * matched by the address they were sent to, responses by the ECU they came
+ * from, falling back to a functional request for the same PID.
+ */
+static struct pipe_req *pipe_match(struct pipe_state *st,
+				   const struct can_frame *frame, int own)
+{
+	struct pipe_req *req = NULL;
+	canid_t id = frame->can_id;
+	uint16_t idx;
+
+	if (own) {
+		if (id == 0x7df)
+			idx = st->index[PIPE_FUNCTIONAL][frame->data[2]];
+		else if (id >= 0x7e0 && id < 0x7e0 + PIPE_MAX_ECUS)
+			idx = st->index[id - 0x7e0][frame->data[2]];
+		else
+			return NULL;
+
+		return idx ? &st->reqs[idx - 1] : NULL;
+	}
+
+	if (id < 0x7e8 || id >= 0x7e8 + PIPE_MAX_ECUS ||
+	  frame->data[1] != OBD_SERVICE_CURRENT + OBD_RESPONSE_OFFSET)
+		return NULL;
+
+	idx = st->index[id - 0x7e8][frame->data[2]];
+	if (idx)
+		req = &st->reqs[idx - 1];
+
+	if (!req || !req->outstanding) {
+		idx = st->index[PIPE_FUNCTIONAL][frame->data[2]];
+		req = idx ? &st->reqs[idx - 1] : NULL;
+	}
+
+	return (req && req->outstanding) ? req : NULL;
+}
+
+static signed int pipe_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	struct pipe_state *st = port->priv;
+	struct can_frame *frame;
+	struct pipe_req *req;
+	struct rx_stamp stamp;
+	int nframes;
+	int own;
+	int i;
+
+	(void)events;
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		perror("Error receving on query");
+		return -1;
+	}
+
+	for (i = 0; i < nframes; i++) {
+		own = port->rx.msgs[i].msg_hdr.msg_flags & MSG_CONFIRM;
+		frame = rx_batch_frame(&port->rx, i);
+		if (st->latency)
+			parse_cmsgs(&port->rx.msgs[i].msg_hdr, &stamp);
+
+		req = pipe_match(st, frame, own);
+		if (own) {
+			if (req && req->outstanding) {
+				req->echo = stamp;
+				req->echoed = 1;
+			}
+			continue;
+		}
+
+		if (!req) {
+			if (frame->can_id >= 0x7e8 &&
+			  frame->can_id < 0x7e8 + PIPE_MAX_ECUS)
+				st->unmatched++;
+			continue;
+		}
+
+		timer_del(&st->wheel, &req->timer);
+		req->outstanding = 0;
+		req->answered++;
+		st->outstanding--;
+		st->answered++;
+		if (st->latency && req->echoed)
+			st->hw_samples += record_latency(&st->rtt, &req->echo,
+							 &stamp);
+
+		print_response(frame);
+	}
+
+	return 0;
+}
+
+/* Pipelined query, see the description at the top of query.h */
+signed int run_query_pipeline(struct evloop *loop, struct can_port *port,
+			      const struct pipe_cfg *cfg, int latency)
+{
+	static struct pipe_state st;
+	struct pipe_req *queued[MAX_BATCH];
+	struct can_frame frame;
+	struct pipe_req *req;
+	uint64_t now_ns, wake_ns;
+	uint64_t period_ns = cfg->period_ms * 1000000ULL;
+	unsigned long long sent = 0;
+	unsigned int rr = 0;
+	unsigned int nqueued;
+	unsigned int e, p, n, j;
+	int sending = 1;
+	int timeout_ms;
+	int nframes;
+
+	memset(&st, '\0', sizeof(st));
+	st.latency = latency;
+	latency_hist_init(&st.rtt);
+	now_ns = monotonic_ns();
+	timer_wheel_init(&st.wheel, now_ns, PIPE_TICK_NS);
+	port->priv = &st;
+	port->ev.handler = pipe_handler;
+	if (cfg->bus_load)
+		pacer_init(&st.pacer, cfg->bus_load, cfg->bitrate,
+			   cfg->dbitrate, now_ns);
+
+	for (e = 0; e < cfg->necus; e++) {
+		for (p = 0; p < cfg->npids; p++) {
+			int row = cfg->ecus[e] < 0 ? PIPE_FUNCTIONAL : cfg->ecus[e];
+
+			if (st.nreqs >= PIPE_MAX_REQS) {
+				fprintf(stderr, "Too many queries, limit is %d\n",
+					PIPE_MAX_REQS);
+				return -1;
+			}
+
+			/* Duplicates would never be told apart */
+			if (st.index[row][cfg->pids[p]])
+				continue;
+
+			req = &st.reqs[st.nreqs++];
+			req->req_id = cfg->ecus[e] < 0 ? 0x7df : 0x7e0 + cfg->ecus[e];
+			req->pid = cfg->pids[p];
+			req->next_ns = now_ns;
+			if (cfg->bus_load) {
+				obd_build_request(&frame, req->req_id,
+						  req->pid);
+				req->bus_ns = pacer_cost_ns(&st.pacer,
+				  (struct canfd_frame *)&frame, 0);
+			}
+			timer_init(&req->timer, req);
+			st.index[row][req->pid] = st.nreqs;
+		}
+	}
+
+	while (keep_running) {
+		now_ns = monotonic_ns();
+		timer_wheel_advance(&st.wheel, now_ns, pipe_timeout, &st);
+		if (cfg->bus_load)
+			pacer_update(&st.pacer, port, now_ns);
+
+		if (sending && cfg->count && sent >= cfg->count)
+			sending = 0;
+		if (sending && !period_ns) {
+			for (n = 0; n < st.nreqs && st.reqs[n].sent; n++);
+			if (n == st.nreqs)
+				sending = 0;
+		}
+		if (!sending && st.outstanding == 0)
+			break;
+
+		/* Queue up everything that is due, as the window allows. Start
+		 * where the last pass stopped so no request is starved.
+		 */
+		nqueued = 0;
+		for (n = 0; sending && n < st.nreqs; n++) {
+			if (st.outstanding >= cfg->window || nqueued >= MAX_BATCH)
+				break;
+			if (cfg->count && sent >= cfg->count)
+				break;
+
+			req = &st.reqs[(rr + n) % st.nreqs];
+			if (req->next_ns > now_ns || (!period_ns && req->sent))
+				continue;
+
+			/* Out of bus time, this one is first in line next pass */
+			if (cfg->bus_load && !req->outstanding &&
+			  !pacer_admit(&st.pacer, now_ns, req->bus_ns))
+				break;
+
+			req->next_ns += period_ns;
+			if (req->next_ns < now_ns)
+				req->next_ns = now_ns;
+
+			/* Still waiting on the last one, skip this period */
+			if (req->outstanding) {
+				req->overruns++;
+				continue;
+			}
+
+			obd_build_request(tx_queue_next(&port->tx), req->req_id,
+					  req->pid);
+
+			req->outstanding = 1;
+			req->echoed = 0;
+			req->sent++;
+			st.outstanding++;
+			sent++;
+			timer_add(&st.wheel, &req->timer,
+				  now_ns + cfg->timeout_ms * 1000000ULL);
+			queued[nqueued++] = req;
+		}
+		rr = (rr + n) % st.nreqs;
+
+		if (nqueued) {
+			nframes = tx_queue_flush(port->sock, &port->tx);
+			if (nframes < 0) {
+				perror("Error sending query");
+				return -1;
+			}
+
+			/* Anything the TX queue dropped is retried next pass */
+			for (j = nframes; j < nqueued; j++) {
+				req = queued[j];
+				timer_del(&st.wheel, &req->timer);
+				req->outstanding = 0;
+				req->sent--;
+				req->next_ns = now_ns;
+				st.outstanding--;
+				sent--;
+				if (cfg->bus_load)
+					pacer_refund(&st.pacer, req->bus_ns);
+			}
+		}
+
+		/* Sleep until the next query is due, the next timeout, or
+		 * frames arrive.
+		 */
+		wake_ns = now_ns + 1000000000ULL;
+		if (sending && st.outstanding < cfg->window) {
+			for (n = 0; n < st.nreqs; n++) {
+				req = &st.reqs[n];
+				if (!req->outstanding && (period_ns || !req->sent) &&
+				  req->next_ns < wake_ns)
+					wake_ns = req->next_ns;
+			}
+		}
+		if (cfg->bus_load && pacer_next_ns(&st.pacer, now_ns) > wake_ns)
+			wake_ns = pacer_next_ns(&st.pacer, now_ns);
+		if (st.wheel.pending &&
+		  timer_wheel_next_tick_ns(&st.wheel) < wake_ns)
+			wake_ns = timer_wheel_next_tick_ns(&st.wheel);
+		timeout_ms = wake_ns > now_ns ?
+		  (int)((wake_ns - now_ns + 999999) / 1000000) : 0;
+
+		if (evloop_run_once(loop, timeout_ms) < 0)
+			return -1;
+	}
+
+	printf("Sent %llu queries, %llu answered, %llu timed out, %llu "
+		"unmatched responses\n", sent, st.answered, st.timeouts,
+		st.unmatched);
+	for (n = 0; n < st.nreqs; n++) {
+		req = &st.reqs[n];
+		printf("  0x%03x PID 0x%02x: sent %llu, answered %llu, "
+			"timed out %llu, overruns %llu\n", req->req_id, req->pid,
+			req->sent, req->answered, req->timeouts, req->overruns);
+	}
+	if (cfg->bus_load)
+		pacer_print(stdout, "Bus load", &st.pacer, monotonic_ns());
+	if (latency) {
+		latency_hist_print(stdout, "Round trip latency", &st.rtt);
+		printf("  %llu of %llu samples from hardware timestamps\n",
+			st.hw_samples, (unsigned long long)st.rtt.count);
+	}
+
+	return 0;
+}
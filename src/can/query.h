@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* OBD queries
+ *
+ * The one-shot query sends a burst of RPM requests and waits for as many
+ * responses. The pipelined query sends a list of PIDs, optionally to a
+ * number of ECUs, keeping up to a window of requests in flight at once.
+ * Responses are matched back to their request by the CAN ID of the ECU and
+ * the PID, and each request's timeout is tracked in a timer wheel. With a
+ * bus load limit, requests are also held back to keep our share of the bus
+ * under it, see pacer.h.
+ */
+
+#ifndef __QUERY_H__
+#define __QUERY_H__
+
+#include "canio.h"
+#include "evloop.h"
+#include "pacer.h"
+#include "timerwheel.h"
+
+/* Time to wait for the responses to a one-shot query */
+#define QUERY_TIMEOUT_MS	1000
+
+/* Pipelined query related */
+#define PIPE_MAX_REQS		256
+#define PIPE_MAX_ECUS		8
+#define PIPE_FUNCTIONAL		PIPE_MAX_ECUS
+#define PIPE_TICK_NS		1000000ULL
+#define PIPE_TIMEOUT_MS		100
+#define PIPE_WINDOW		4
+
+struct pipe_cfg {
+	uint8_t pids[PIPE_MAX_REQS];
+	unsigned int npids;
+	int ecus[PIPE_MAX_ECUS];
+	unsigned int necus;
+	unsigned int window;
+	unsigned int period_ms;
+	unsigned int timeout_ms;
+	unsigned long long count;
+
+	/* Percent of the bus, 0 for no limit */
+	unsigned int bus_load;
+	unsigned int bitrate;
+	unsigned int dbitrate;
+};
+
+/* One PID on one ECU, or on all ECUs if sent to the functional address.
+ * Only one query for each is ever in flight.
+ */
+struct pipe_req {
+	canid_t req_id;
+	uint8_t pid;
+	int outstanding;
+	int echoed;
+	uint64_t next_ns;
+	uint64_t bus_ns;
+	struct rx_stamp echo;
+	struct timer timer;
+
+	unsigned long long sent;
+	unsigned long long answered;
+	unsigned long long timeouts;
+	unsigned long long overruns;
+};
+
+struct pipe_state {
+	struct pipe_req reqs[PIPE_MAX_REQS];
+	unsigned int nreqs;
+	unsigned int outstanding;
+	struct timer_wheel wheel;
+	struct pacer pacer;
+
+	/* Index+1 in to reqs, by responding ECU then PID. The last row is for
+	 * requests sent to the functional address, which any ECU may answer.
+	 */
+	uint16_t index[PIPE_MAX_ECUS + 1][256];
+
+	int latency;
+	struct latency_hist rtt;
+
+	/* Statistics */
+	unsigned long long timeouts;
+	unsigned long long answered;
+	unsigned long long unmatched;
+	unsigned long long hw_samples;
+};
+
+signed int query_port_open(struct can_port *port, const char *iface,
+			   unsigned int batch, int latency,
+			   const struct can_filter *extra, int nextra);
+void print_response(const struct can_frame *frame);
+signed int run_query_oneshot(struct evloop *loop, struct can_port *port,
+			     int burst, int latency);
+signed int run_query_pipeline(struct evloop *loop, struct can_port *port,
+			      const struct pipe_cfg *cfg, int latency);
+
+#endif /* __QUERY_H__ */
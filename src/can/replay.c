@@ -0,0 +1,187 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <endian.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "evloop.h"
+#include "replay.h"
+#include "txsched.h"
+
+struct replay_state {
+	unsigned long long queued;
+	unsigned long long sent;
+	unsigned long long dropped;
+	unsigned long long skipped;
+	struct txsched sched;
+};
+
+static signed int replay_flush(struct can_port *port, struct replay_state *st)
+{
+	unsigned int queued = port->tx.count;
+	int nframes;
+
+	if (!queued)
+		return 0;
+
+	nframes = tx_queue_flush(port->sock, &port->tx);
+	if (nframes < 0) {
+		fprintf(stderr, "Error sending on %s: ", port->iface);
+		perror("");
+		return -1;
+	}
+	st->sent += nframes;
+	st->dropped += queued - nframes;
+	txsched_check_errors(&st->sched, port->sock);
+
+	return 0;
+}
+
+static signed int replay_flush_all(struct can_port *ports, int nports,
+				   struct replay_state *st)
+{
+	int i;
+
+	for (i = 0; i < nports; i++) {
+		if (replay_flush(&ports[i], st) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Queue a record on its port, flushing once a batch is queued up. Timed
+ * frames are due at deadline_ns, and now_ns is when they were queued.
+ */
+static signed int replay_queue(struct can_port *port,
+			       const struct canlog_rec *rec,
+			       struct replay_state *st, int timed,
+			       uint64_t deadline_ns, uint64_t now_ns)
+{
+	struct canfd_frame *frame;
+
+	if (port->tx.count >= MAX_BATCH && replay_flush(port, st) < 0)
+		return -1;
+
+	if (rec->flags & CANLOG_REC_FD) {
+		frame = tx_queue_next_fd(&port->tx);
+		if (rec->flags & CANLOG_REC_BRS)
+			frame->flags |= CANFD_BRS;
+		if (rec->flags & CANLOG_REC_ESI)
+			frame->flags |= CANFD_ESI;
+	} else {
+		frame = (struct canfd_frame *)tx_queue_next(&port->tx);
+	}
+	frame->can_id = le32toh(rec->can_id);
+	frame->len = rec->len;
+	memcpy(frame->data, rec->data, rec->len);
+	st->queued++;
+
+	if (timed)
+		txsched_queued(&st->sched, &port->tx, deadline_ns, now_ns);
+
+	if (port->tx.count >= port->batch)
+		return replay_flush(port, st);
+
+	return 0;
+}
+
+/* Send the log, from cfg->seek_ns after the start of the capture, out on
+ * ports. With a single port every frame goes out on it, otherwise frames
+ * captured on the log's nth interface go out on the nth port. Error frames
+ * can not be sent, nor FD frames on a port without FD enabled, those are
+ * skipped.
+ */
+signed int run_replay(struct can_port *ports, int nports,
+		      const struct canlog *log, const struct replay_cfg *cfg)
+{
+	struct replay_state st;
+	const struct canlog_rec *rec;
+	struct can_port *port;
+	uint64_t start_ns, end_ns = UINT64_MAX, first_ts = 0, ts, base_ns;
+	uint64_t due_ns = 0, now_ns = 0;
+	double elapsed;
+	size_t pos;
+	int ret = 0;
+	int i;
+
+	memset(&st, '\0', sizeof(st));
+	txsched_init(&st.sched);
+	for (i = 0; cfg->txtime_lead_ns && i < nports; i++) {
+		if (txsched_enable_txtime(&st.sched, ports[i].sock,
+		  cfg->txtime_lead_ns) < 0)
+			return -1;
+	}
+
+	start_ns = le64toh(log->hdr->start_ns) + cfg->seek_ns;
+	if (cfg->duration_ns)
+		end_ns = start_ns + cfg->duration_ns;
+	pos = canlog_seek(log, start_ns);
+
+	base_ns = monotonic_ns();
+	while (keep_running && (!cfg->count || st.queued < cfg->count)) {
+		rec = canlog_next(log, &pos);
+		if (!rec)
+			break;
+
+		ts = le64toh(rec->ts_ns);
+		if (ts >= end_ns)
+			break;
+
+		if ((nports > 1 && rec->iface >= nports) ||
+		  (le32toh(rec->can_id) & CAN_ERR_FLAG) ||
+		  rec->len > ((rec->flags & CANLOG_REC_FD) ? CANFD_MAX_DLEN :
+		  CAN_MAX_DLEN)) {
+			st.skipped++;
+			continue;
+		}
+		port = &ports[nports > 1 ? rec->iface : 0];
+		if ((rec->flags & CANLOG_REC_FD) && !port->fd) {
+			st.skipped++;
+			continue;
+		}
+
+		/* At original timing, send everything queued so far and wait
+		 * until this frame is due. Frames within a batch that are
+		 * already due go out together.
+		 */
+		if (!cfg->fast) {
+			if (!first_ts)
+				first_ts = ts;
+			due_ns = base_ns + (ts > first_ts ? ts - first_ts : 0);
+			now_ns = monotonic_ns();
+			if (due_ns > now_ns + (st.sched.txtime ?
+			  st.sched.lead_ns : 0)) {
+				if (replay_flush_all(ports, nports, &st) < 0) {
+					ret = -1;
+					break;
+				}
+				now_ns = txsched_wait(&st.sched, due_ns);
+			}
+		}
+
+		if (replay_queue(port, rec, &st, !cfg->fast, due_ns,
+		  now_ns) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+
+	if (replay_flush_all(ports, nports, &st) < 0)
+		ret = -1;
+
+	elapsed = (monotonic_ns() - base_ns) / 1e9;
+	if (elapsed <= 0)
+		elapsed = 1e-9;
+
+	printf("Replayed %llu frames of %llu in the log in %.2f s (%.0f "
+		"frames/s), %llu dropped, %llu skipped\n", st.sent,
+		(unsigned long long)log->nrecs, elapsed, st.sent / elapsed,
+		st.dropped, st.skipped);
+	if (!cfg->fast)
+		txsched_print(stdout, "  Timed replay", &st.sched);
+
+	return ret;
+}
@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Replay of a binary CAN log
+ *
+ * Frames are read straight out of the memory mapped log and sent back out,
+ * either with the gaps between them as captured or as fast as the bus will
+ * take them. The log's time index lets replay start part way in to a log of
+ * any size without reading what comes before the start. Logged timing is
+ * kept with the transmit scheduler in txsched.c, optionally with SO_TXTIME.
+ */
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+
+#include "canio.h"
+#include "canlog.h"
+
+struct replay_cfg {
+	uint64_t seek_ns;
+	uint64_t duration_ns;
+	unsigned long long count;
+	int fast;
+	uint64_t txtime_lead_ns;
+};
+
+signed int run_replay(struct can_port *ports, int nports,
+		      const struct canlog *log, const struct replay_cfg *cfg);
+
+#endif /* __REPLAY_H__ */
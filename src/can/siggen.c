@@ -0,0 +1,221 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "siggen.h"
+
+#define SIGGEN_MAX_PARAMS	3
+#define SIGGEN_LINE_MAX		64
+
+/* One period of (1 + sin) / 2, scaled to 16 bits */
+uint16_t siggen_sine[SIGGEN_SINE_SIZE + 1];
+
+static void siggen_init_sine(void)
+{
+	static int ready;
+	int i;
+
+	if (ready)
+		return;
+
+	for (i = 0; i <= SIGGEN_SINE_SIZE; i++)
+		siggen_sine[i] = lround((1.0 + sin(2 * M_PI * i /
+					SIGGEN_SINE_SIZE)) / 2 * 65535);
+	ready = 1;
+}
+
+/* Service 01 values are in the units in obd.c, anything else is raw */
+static uint32_t to_raw(const struct obd_pid *info, unsigned int len,
+		       double value)
+{
+	double max = len >= 4 ? UINT32_MAX : (1UL << (8 * len)) - 1;
+
+	if (info)
+		return obd_encode(info, value);
+
+	value += 0.5;
+	if (value < 0)
+		return 0;
+	if (value > max)
+		return max;
+
+	return value;
+}
+
+static uint64_t period_step(double period_ns)
+{
+	return 18446744073709551616.0 / period_ns;
+}
+
+static void set_range(struct siggen *gen, uint32_t a, uint32_t b)
+{
+	gen->lo = a < b ? a : b;
+	gen->span = a < b ? b - a : a - b;
+}
+
+static const char *load_trace(struct siggen *gen, const char *path,
+			      const struct obd_pid *info, unsigned int len)
+{
+	char line[SIGGEN_LINE_MAX];
+	uint32_t *values = NULL, *tmp;
+	uint32_t n = 0, size = 0;
+	char *end;
+	double val;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return "unable to open trace file";
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#\r\n")] = '\0';
+		val = strtod(line, &end);
+		if (end == line)
+			continue;
+
+		if (n == size) {
+			size = size ? size * 2 : 1024;
+			tmp = size <= SIGGEN_TRACE_MAX ?
+			  realloc(values, size * sizeof(*values)) : NULL;
+			if (!tmp) {
+				fclose(f);
+				free(values);
+				return "trace file too long, or out of memory";
+			}
+			values = tmp;
+		}
+		values[n++] = to_raw(info, len, val);
+	}
+	fclose(f);
+
+	if (!n)
+		return "no values in trace file";
+
+	gen->trace = values;
+	gen->ntrace = n;
+
+	return NULL;
+}
+
+/* Set up a generator of the named kind, taking its parameters from the rest
+ * of the line. A service 01 PID in obd.c brings its own length, anything
+ * else needs the length in bytes after the parameters, in to *len. Returns
+ * NULL, or a description of what is wrong with the line.
+ *
+ *	const <value>
+ *	random
+ *	noise <lo> <hi>
+ *	ramp <from> <to> <period s>
+ *	triangle <lo> <hi> <period s>
+ *	sine <lo> <hi> <period s>
+ *	trace <file> <interval ms>
+ */
+const char *siggen_parse(struct siggen *gen, const char *kind, char **save,
+			 const struct obd_pid *info, unsigned int *len)
+{
+	double params[SIGGEN_MAX_PARAMS];
+	const char *trace = NULL;
+	unsigned int nparams, i;
+	const char *tok, *err;
+	char *end;
+
+	memset(gen, '\0', sizeof(*gen));
+	if (!strcmp(kind, "const")) {
+		gen->kind = SIGGEN_CONST;
+		nparams = 1;
+	} else if (!strcmp(kind, "random")) {
+		gen->kind = SIGGEN_RANDOM;
+		nparams = 0;
+	} else if (!strcmp(kind, "noise")) {
+		gen->kind = SIGGEN_RANDOM;
+		nparams = 2;
+	} else if (!strcmp(kind, "ramp")) {
+		gen->kind = SIGGEN_RAMP;
+		nparams = 3;
+	} else if (!strcmp(kind, "triangle")) {
+		gen->kind = SIGGEN_TRIANGLE;
+		nparams = 3;
+	} else if (!strcmp(kind, "sine")) {
+		gen->kind = SIGGEN_SINE;
+		nparams = 3;
+		siggen_init_sine();
+	} else if (!strcmp(kind, "trace")) {
+		gen->kind = SIGGEN_TRACE;
+		trace = strtok_r(NULL, " \t", save);
+		if (!trace)
+			return "expected a trace file";
+		nparams = 1;
+	} else {
+		return "unknown generator";
+	}
+
+	for (i = 0; i < nparams; i++) {
+		tok = strtok_r(NULL, " \t", save);
+		if (!tok)
+			return "too few generator parameters";
+		params[i] = strtod(tok, &end);
+		if (end == tok || *end != '\0')
+			return "expected a number";
+	}
+
+	tok = strtok_r(NULL, " \t", save);
+	if (info) {
+		if (tok)
+			return "unexpected length, the PID has one";
+		*len = info->len;
+	} else {
+		if (!tok)
+			return "expected a length in bytes for this PID";
+		*len = strtoul(tok, &end, 10);
+		if (end == tok || *end != '\0' || *len < 1 || *len > 4)
+			return "length must be 1-4 bytes";
+		if (strtok_r(NULL, " \t", save))
+			return "too many generator parameters";
+	}
+
+	switch (gen->kind) {
+	case SIGGEN_CONST:
+		gen->lo = to_raw(info, *len, params[0]);
+		break;
+	case SIGGEN_RANDOM:
+		if (nparams)
+			set_range(gen, to_raw(info, *len, params[0]),
+				  to_raw(info, *len, params[1]));
+		else
+			set_range(gen, 0, to_raw(NULL, *len, INFINITY));
+		break;
+	case SIGGEN_RAMP:
+	case SIGGEN_TRIANGLE:
+	case SIGGEN_SINE:
+		if (params[2] < 1e-6)
+			return "period must be at least 1 us";
+		set_range(gen, to_raw(info, *len, params[0]),
+			  to_raw(info, *len, params[1]));
+		gen->down = gen->kind == SIGGEN_RAMP &&
+		  to_raw(info, *len, params[0]) > to_raw(info, *len, params[1]);
+		gen->step = period_step(params[2] * 1e9);
+		break;
+	case SIGGEN_TRACE:
+		if (params[0] < 0.001)
+			return "interval must be at least 1 us";
+		err = load_trace(gen, trace, info, *len);
+		if (err)
+			return err;
+		gen->step = period_step(params[0] * 1e6 * gen->ntrace);
+		break;
+	}
+
+	return NULL;
+}
+
+void siggen_free(struct siggen *gen)
+{
+	free(gen->trace);
+	gen->trace = NULL;
+	gen->ntrace = 0;
+}
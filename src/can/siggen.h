@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Signal generators for emulated ECU values
+ *
+ * A generator gives the raw value of a PID as a function of time since the
+ * simulation started: constant, a ramp or triangle between two values, a
+ * sine, uniform noise, or a recorded trace played back on a loop. Whatever
+ * reads the values can then check them against what they should be, which
+ * noise alone does not allow.
+ *
+ * Everything that is slow is done once, when the generator is set up:
+ * values in engineering units are converted to raw ones, and the period is
+ * turned in to a 64 bit fixed point phase step per ns. Multiplying the time
+ * by the step wraps around once per period by itself, so working out a value
+ * takes a multiply and a shift, and for a sine a lookup in a table with
+ * linear interpolation. Nothing on the response path divides, calls in to
+ * libm, or takes the lock in random().
+ */
+
+#ifndef __SIGGEN_H__
+#define __SIGGEN_H__
+
+#include <stdint.h>
+
+#include "obd.h"
+
+/* Sine table entries, one period, plus one so interpolation can look one
+ * ahead of the last entry.
+ */
+#define SIGGEN_SINE_BITS	8
+#define SIGGEN_SINE_SIZE	(1 << SIGGEN_SINE_BITS)
+
+/* Most values in a trace file */
+#define SIGGEN_TRACE_MAX	(1 << 20)
+
+enum siggen_kind {
+	SIGGEN_CONST = 0,
+	SIGGEN_RANDOM,
+	SIGGEN_RAMP,
+	SIGGEN_TRIANGLE,
+	SIGGEN_SINE,
+	SIGGEN_TRACE,
+};
+
+struct siggen {
+	enum siggen_kind kind;
+
+	/* Raw values span from lo to lo + span, a ramp going down runs its
+	 * phase backwards.
+	 */
+	uint32_t lo;
+	uint32_t span;
+	int down;
+
+	/* Phase, in 1/2^64ths of the period, per ns */
+	uint64_t step;
+
+	uint32_t *trace;
+	uint32_t ntrace;
+};
+
+extern uint16_t siggen_sine[SIGGEN_SINE_SIZE + 1];
+
+const char *siggen_parse(struct siggen *gen, const char *kind, char **save,
+			 const struct obd_pid *info, unsigned int *len);
+void siggen_free(struct siggen *gen);
+
+static inline uint32_t siggen_xorshift(uint32_t *state)
+{
+	uint32_t x = *state ? *state : 0x9e3779b9;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+/* Raw value at t_ns in to the simulation. seed is only used for noise. */
+static inline uint32_t siggen_value(const struct siggen *gen, uint64_t t_ns,
+				    uint32_t *seed)
+{
+	uint32_t phase = (t_ns * gen->step) >> 32;
+	uint32_t idx, frac, a, b, x;
+
+	if (gen->down)
+		phase = ~phase;
+
+	switch (gen->kind) {
+	case SIGGEN_RANDOM:
+		x = siggen_xorshift(seed);
+		return gen->lo + (((uint64_t)gen->span + 1) * x >> 32);
+	case SIGGEN_RAMP:
+		return gen->lo + ((uint64_t)gen->span * phase >> 32);
+	case SIGGEN_TRIANGLE:
+		x = phase & 0x80000000 ? ~phase << 1 : phase << 1;
+		return gen->lo + ((uint64_t)gen->span * x >> 32);
+	case SIGGEN_SINE:
+		idx = phase >> (32 - SIGGEN_SINE_BITS);
+		frac = (phase >> (16 - SIGGEN_SINE_BITS)) & 0xffff;
+		a = siggen_sine[idx];
+		b = siggen_sine[idx + 1];
+		x = (a << 16) + (b - a) * frac;
+		return gen->lo + ((uint64_t)gen->span * x >> 32);
+	case SIGGEN_TRACE:
+		return gen->trace[(uint64_t)phase * gen->ntrace >> 32];
+	case SIGGEN_CONST:
+	default:
+		return gen->lo;
+	}
+}
+
+#endif /* __SIGGEN_H__ */
@@ -0,0 +1,385 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/can/error.h>
+#include <linux/can/raw.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+/* By bit of the error class in the can_id of an error frame */
+static const char *const err_class_names[STATS_ERR_CLASSES] = {
+	"tx_timeout",
+	"lost_arbitration",
+	"controller",
+	"protocol",
+	"transceiver",
+	"no_ack",
+	"bus_off",
+	"bus_error",
+	"restarted",
+	"counters",
+};
+
+static struct stats_id *stats_lookup(struct stats *st, canid_t id)
+{
+	unsigned int h = (id * 2654435761U) & (STATS_MAX_IDS - 1);
+	struct stats_id *ent;
+
+	for (;;) {
+		ent = &st->ids[h];
+		if (!ent->used) {
+			if (st->nids >= STATS_MAX_IDS / 4 * 3)
+				return NULL;
+			ent->used = 1;
+			ent->id = id;
+			st->nids++;
+			return ent;
+		}
+		if (ent->id == id)
+			return ent;
+		h = (h + 1) & (STATS_MAX_IDS - 1);
+	}
+}
+
+/* Count frames received in the port's last batch */
+void stats_add_batch(struct stats *st, struct can_port *port, int nframes)
+{
+	struct rx_batch *rx = &port->rx;
+	struct canfd_frame *frame;
+	struct stats_id *ent;
+	unsigned int bit;
+	int fd;
+	int i;
+
+	for (i = 0; i < nframes; i++) {
+		frame = &rx->frames[i];
+		if (frame->can_id & CAN_ERR_FLAG) {
+			st->err_frames++;
+			for (bit = 0; bit < STATS_ERR_CLASSES; bit++) {
+				if (frame->can_id & (1U << bit))
+					st->err_class[bit]++;
+			}
+			continue;
+		}
+
+		fd = rx_batch_is_fd(rx, i);
+		st->frames++;
+		st->bytes += frame->len;
+		st->bus_ns += frame_time_ns(frame, fd, 0, st->bitrate,
+					    st->dbitrate);
+
+		ent = stats_lookup(st, frame->can_id);
+		if (!ent) {
+			st->untracked++;
+			continue;
+		}
+		ent->frames++;
+		ent->bytes += frame->len;
+	}
+}
+
+/* Rate of a counter over the window, from its value STATS_WINDOW snapshots
+ * ago, or since the start for the first ones.
+ */
+static double window_rate(uint64_t now_val, uint64_t old_val, uint64_t dt_ns)
+{
+	return dt_ns ? (now_val - old_val) * 1e9 / dt_ns : 0.0;
+}
+
+static void stats_write_json(struct stats *st, uint64_t now_ns,
+			     unsigned int old, uint64_t dt_ns)
+{
+	struct timespec wall;
+	struct stats_id *ent;
+	unsigned int i;
+	int first = 1;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+	printf("{\"time\":%lld.%03ld,\"uptime\":%.3f,\"frames\":%llu,"
+		"\"rate\":%.1f,\"bus_load\":%.4f,\"err_frames\":%llu,"
+		"\"errors\":{", (long long)wall.tv_sec, wall.tv_nsec / 1000000,
+		(now_ns - st->start_ns) / 1e9, (unsigned long long)st->frames,
+		window_rate(st->frames, st->tick_frames[old], dt_ns),
+		window_rate(st->bus_ns, st->tick_bus_ns[old], dt_ns) / 1e9,
+		(unsigned long long)st->err_frames);
+	for (i = 0; i < STATS_ERR_CLASSES; i++)
+		printf("%s\"%s\":%llu", i ? "," : "", err_class_names[i],
+			(unsigned long long)st->err_class[i]);
+	printf("},\"rxq_drops\":%llu,\"iface_drops\":%llu,\"untracked\":%llu,"
+		"\"ids\":{", (unsigned long long)st->rxq_drops,
+		(unsigned long long)st->iface_drops,
+		(unsigned long long)st->untracked);
+
+	for (i = 0; i < STATS_MAX_IDS; i++) {
+		ent = &st->ids[i];
+		if (!ent->used)
+			continue;
+		printf("%s\"0x%x\":{\"frames\":%llu,\"rate\":%.1f}",
+			first ? "" : ",", ent->id & ~CAN_ERR_FLAG,
+			(unsigned long long)ent->frames,
+			window_rate(ent->frames, ent->window[old], dt_ns));
+		first = 0;
+	}
+	printf("}}\n");
+	fflush(stdout);
+}
+
+static void stats_write_shm(struct stats *st, uint64_t now_ns,
+			    unsigned int old, uint64_t dt_ns)
+{
+	struct stats_shm *shm = st->shm;
+	struct stats_id *ent;
+	uint32_t seq = shm->seq;
+	unsigned int i, n = 0;
+
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shm->time_ns = now_ns;
+	shm->frames = st->frames;
+	shm->rate = window_rate(st->frames, st->tick_frames[old], dt_ns);
+	shm->bus_load = window_rate(st->bus_ns, st->tick_bus_ns[old],
+				    dt_ns) / 1e9;
+	shm->err_frames = st->err_frames;
+	memcpy(shm->err_class, st->err_class, sizeof(shm->err_class));
+	shm->rxq_drops = st->rxq_drops;
+	shm->iface_drops = st->iface_drops;
+	shm->untracked = st->untracked;
+	for (i = 0; i < STATS_MAX_IDS; i++) {
+		ent = &st->ids[i];
+		if (!ent->used)
+			continue;
+		shm->ids[n].id = ent->id;
+		shm->ids[n].frames = ent->frames;
+		shm->ids[n].rate = window_rate(ent->frames, ent->window[old],
+					       dt_ns);
+		n++;
+	}
+	shm->nids = n;
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Export everything, then take a snapshot in place of the oldest one */
+static void stats_tick(struct stats *st)
+{
+	uint64_t now_ns = monotonic_ns();
+	unsigned int old = st->ticks % STATS_WINDOW;
+	uint64_t dt_ns = now_ns - st->tick_ns[old];
+	struct can_port *port;
+	unsigned int i;
+
+	/* Socket drops are from not keeping up, interface drops happened
+	 * before any socket saw the frames.
+	 */
+	st->rxq_drops = 0;
+	st->iface_drops = 0;
+	for (i = 0; i < st->nports; i++) {
+		port = st->ports[i];
+		st->rxq_drops += port->rx.rxq_drops;
+		st->iface_drops += iface_rx_drops(port->iface) -
+		  port->iface_drops_start;
+	}
+
+	if (st->shm)
+		stats_write_shm(st, now_ns, old, dt_ns);
+	else
+		stats_write_json(st, now_ns, old, dt_ns);
+
+	st->tick_ns[old] = now_ns;
+	st->tick_frames[old] = st->frames;
+	st->tick_bus_ns[old] = st->bus_ns;
+	for (i = 0; i < STATS_MAX_IDS; i++) {
+		if (st->ids[i].used)
+			st->ids[i].window[old] = st->ids[i].frames;
+	}
+	st->ticks++;
+}
+
+static signed int stats_timer_handler(struct ev_source *src, uint32_t events)
+{
+	struct stats *st = src->data;
+	uint64_t expirations;
+
+	(void)events;
+
+	/* Also called on every pass of a spinning loop, not only when due */
+	if (read(src->fd, &expirations, sizeof(expirations)) < 0) {
+		if (errno == EAGAIN)
+			return 0;
+		perror("Error reading statistics timer");
+		return -1;
+	}
+
+	stats_tick(st);
+
+	return 0;
+}
+
+static signed int stats_open_shm(struct stats *st, const char *name)
+{
+	int fd;
+
+	fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to open shared memory %s: ", name);
+		perror("");
+		return -1;
+	}
+
+	if (ftruncate(fd, sizeof(*st->shm)) < 0) {
+		perror("Unable to size shared memory");
+		close(fd);
+		return -1;
+	}
+
+	st->shm = mmap(NULL, sizeof(*st->shm), PROT_READ | PROT_WRITE,
+		       MAP_SHARED, fd, 0);
+	close(fd);
+	if (st->shm == MAP_FAILED) {
+		st->shm = NULL;
+		perror("Unable to map shared memory");
+		return -1;
+	}
+
+	memset(st->shm, '\0', sizeof(*st->shm));
+	st->shm->magic = STATS_SHM_MAGIC;
+	st->shm_name = name;
+
+	return 0;
+}
+
+/* Set up statistics exported every interval_ms, to the shared memory
+ * segment shm_name if it is not NULL or as JSON on stdout otherwise. The
+ * bit rates are used for the bus load.
+ */
+signed int stats_init(struct stats *st, struct evloop *loop,
+		      unsigned int interval_ms, const char *shm_name,
+		      unsigned int bitrate, unsigned int dbitrate)
+{
+	struct itimerspec its;
+	unsigned int i;
+
+	memset(st, '\0', sizeof(*st));
+	st->timer.fd = -1;
+	st->bitrate = bitrate;
+	st->dbitrate = dbitrate;
+	st->start_ns = monotonic_ns();
+	for (i = 0; i < STATS_WINDOW; i++)
+		st->tick_ns[i] = st->start_ns;
+
+	if (shm_name && stats_open_shm(st, shm_name) < 0)
+		return -1;
+
+	st->timer.fd = timerfd_create(CLOCK_MONOTONIC,
+				      TFD_NONBLOCK | TFD_CLOEXEC);
+	if (st->timer.fd < 0) {
+		perror("Error creating statistics timer");
+		return -1;
+	}
+	st->timer.handler = stats_timer_handler;
+	st->timer.data = st;
+
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	its.it_value = its.it_interval;
+	if (timerfd_settime(st->timer.fd, 0, &its, NULL) < 0) {
+		perror("Error setting statistics timer");
+		close(st->timer.fd);
+		st->timer.fd = -1;
+		return -1;
+	}
+
+	if (evloop_add(loop, &st->timer, EPOLLIN) < 0) {
+		close(st->timer.fd);
+		st->timer.fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Count the port's frames in st, and have it receive error frames as well */
+signed int stats_enable_port(struct stats *st, struct can_port *port)
+{
+	can_err_mask_t err_mask = CAN_ERR_MASK;
+
+	if (st->nports >= ARRAY_SIZE(st->ports)) {
+		fprintf(stderr, "Too many ports for statistics\n");
+		return -1;
+	}
+
+	if (!port->local && setsockopt(port->sock, SOL_CAN_RAW,
+	  CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask)) < 0) {
+		perror("Unable to receive error frames");
+		return -1;
+	}
+
+	port->stats = st;
+	st->ports[st->nports++] = port;
+
+	return 0;
+}
+
+/* Event handler for a port that is only monitored */
+signed int stats_port_handler(struct ev_source *src, uint32_t events)
+{
+	struct can_port *port = src->data;
+	int nframes;
+
+	(void)events;
+
+	nframes = rx_batch_recv(port->sock, &port->rx, port->batch);
+	if (nframes < 0) {
+		fprintf(stderr, "Error receiving on %s: ", port->iface);
+		perror("");
+		return -1;
+	}
+
+	stats_add_batch(port->stats, port, nframes);
+
+	return 0;
+}
+
+/* Monitor every port in the loop until interrupted, or for duration_s */
+signed int run_monitor(struct evloop *loop, unsigned int duration_s)
+{
+	uint64_t end_ns = 0;
+
+	if (duration_s)
+		end_ns = monotonic_ns() + duration_s * 1000000000ULL;
+
+	while (keep_running && (!end_ns || monotonic_ns() < end_ns)) {
+		if (evloop_run_once(loop, 100) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Export one last time, and stop */
+void stats_close(struct stats *st, struct evloop *loop)
+{
+	if (st->timer.fd >= 0) {
+		stats_tick(st);
+		evloop_del(loop, &st->timer);
+		close(st->timer.fd);
+		st->timer.fd = -1;
+	}
+
+	if (st->shm) {
+		munmap(st->shm, sizeof(*st->shm));
+		shm_unlink(st->shm_name);
+		st->shm = NULL;
+	}
+}
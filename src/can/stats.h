@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Live bus statistics
+ *
+ * Every frame received on a port with statistics attached is counted in
+ * memory, per CAN ID in an open addressed table, along with the time it
+ * took on the bus. Error frames, enabled with CAN_RAW_ERR_FILTER, are
+ * counted by class, and the SO_RXQ_OVFL count canio.c keeps for each port
+ * gives how many the socket has dropped. Nothing here makes a syscall
+ * per frame.
+ *
+ * A timer in the event loop takes a snapshot every interval, rates and bus
+ * load are over the last STATS_WINDOW snapshots. Each snapshot is written
+ * out either as a line of JSON on stdout, or in to a shared memory segment
+ * that other processes can map and read at any time, see struct stats_shm.
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <linux/can.h>
+#include <stdint.h>
+
+#include "canio.h"
+#include "evloop.h"
+
+/* Power of two, at most three quarters used before new IDs are not tracked */
+#define STATS_MAX_IDS		2048
+#define STATS_WINDOW		10
+#define STATS_INTERVAL_MS	1000
+#define STATS_ERR_CLASSES	10
+
+struct stats_id {
+	canid_t id;
+	int used;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t window[STATS_WINDOW];
+};
+
+struct stats {
+	struct ev_source timer;
+	unsigned int bitrate;
+	unsigned int dbitrate;
+
+	struct stats_id ids[STATS_MAX_IDS];
+	unsigned int nids;
+
+	/* Totals */
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t bus_ns;
+	uint64_t err_frames;
+	uint64_t err_class[STATS_ERR_CLASSES];
+	uint64_t untracked;
+
+	/* Ports counted in to these statistics */
+	struct can_port *ports[EVLOOP_MAX_SOURCES];
+	unsigned int nports;
+	uint64_t rxq_drops;
+	uint64_t iface_drops;
+
+	/* Snapshots for the sliding window */
+	uint64_t start_ns;
+	unsigned int ticks;
+	uint64_t tick_ns[STATS_WINDOW];
+	uint64_t tick_frames[STATS_WINDOW];
+	uint64_t tick_bus_ns[STATS_WINDOW];
+
+	struct stats_shm *shm;
+	const char *shm_name;
+};
+
+/* Shared memory layout. seq is odd while a snapshot is being written, a
+ * reader copies what it needs and retries if seq changed or was odd.
+ */
+#define STATS_SHM_MAGIC		0x45545353
+
+struct stats_shm_id {
+	uint32_t id;
+	uint32_t rsvd;
+	uint64_t frames;
+	double rate;
+};
+
+struct stats_shm {
+	uint32_t magic;
+	uint32_t seq;
+	uint64_t time_ns;
+	uint64_t frames;
+	double rate;
+	double bus_load;
+	uint64_t err_frames;
+	uint64_t err_class[STATS_ERR_CLASSES];
+	uint64_t rxq_drops;
+	uint64_t iface_drops;
+	uint64_t untracked;
+	uint32_t nids;
+	uint32_t rsvd;
+	struct stats_shm_id ids[STATS_MAX_IDS];
+};
+
+signed int stats_init(struct stats *st, struct evloop *loop,
+		      unsigned int interval_ms, const char *shm_name,
+		      unsigned int bitrate, unsigned int dbitrate);
+signed int stats_enable_port(struct stats *st, struct can_port *port);
+void stats_add_batch(struct stats *st, struct can_port *port, int nframes);
+signed int stats_port_handler(struct ev_source *src, uint32_t events);
+signed int run_monitor(struct evloop *loop, unsigned int duration_s);
+void stats_close(struct stats *st, struct evloop *loop);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,114 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#include <stddef.h>
+
+#include "timerwheel.h"
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ns,
+		      uint64_t tick_ns)
+{
+	int i;
+
+	for (i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		wheel->slots[i].next = &wheel->slots[i];
+		wheel->slots[i].prev = &wheel->slots[i];
+	}
+	wheel->tick_ns = tick_ns;
+	wheel->base_ns = now_ns;
+	wheel->current_tick = 0;
+	wheel->pending = 0;
+}
+
+void timer_init(struct timer *timer, void *data)
+{
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->expires_tick = 0;
+	timer->data = data;
+}
+
+/* Arm the timer to expire at expires_ns. It always expires on a later tick
+ * than the current one, so a timer is never run before its time.
+ */
+void timer_add(struct timer_wheel *wheel, struct timer *timer,
+	       uint64_t expires_ns)
+{
+	struct timer *head;
+	uint64_t tick;
+
+	if (timer_pending(timer))
+		timer_del(wheel, timer);
+
+	if (expires_ns < wheel->base_ns)
+		expires_ns = wheel->base_ns;
+	tick = (expires_ns - wheel->base_ns + wheel->tick_ns - 1) /
+	  wheel->tick_ns;
+	if (tick <= wheel->current_tick)
+		tick = wheel->current_tick + 1;
+
+	timer->expires_tick = tick;
+	head = &wheel->slots[tick % TIMER_WHEEL_SLOTS];
+	timer->next = head;
+	timer->prev = head->prev;
+	head->prev->next = timer;
+	head->prev = timer;
+	wheel->pending++;
+}
+
+void timer_del(struct timer_wheel *wheel, struct timer *timer)
+{
+	if (!timer_pending(timer))
+		return;
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+	wheel->pending--;
+}
+
+/* Move the wheel forward to now_ns, calling expire for every timer that came
+ * due along the way. The callback may re-arm the timer it is passed. Returns
+ * the number of timers that expired.
+ */
+unsigned int timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ns,
+				 timer_expire_fn expire, void *arg)
+{
+	struct timer *head;
+	struct timer *timer;
+	struct timer *next;
+	uint64_t target;
+	unsigned int expired = 0;
+
+	if (now_ns < wheel->base_ns)
+		return 0;
+	target = (now_ns - wheel->base_ns) / wheel->tick_ns;
+
+	while (wheel->current_tick < target) {
+		/* Once nothing is pending, there is nothing to walk */
+		if (wheel->pending == 0) {
+			wheel->current_tick = target;
+			break;
+		}
+
+		wheel->current_tick++;
+		head = &wheel->slots[wheel->current_tick % TIMER_WHEEL_SLOTS];
+		for (timer = head->next; timer != head; timer = next) {
+			next = timer->next;
+			if (timer->expires_tick > wheel->current_tick)
+				continue;
+
+			timer_del(wheel, timer);
+			expired++;
+			expire(timer, arg);
+		}
+	}
+
+	return expired;
+}
+
+/* Time of the next tick, which is when the soonest timer could expire */
+uint64_t timer_wheel_next_tick_ns(const struct timer_wheel *wheel)
+{
+	return wheel->base_ns + (wheel->current_tick + 1) * wheel->tick_ns;
+}
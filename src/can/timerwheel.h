@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Hashed timer wheel
+ *
+ * Timers are kept on intrusive lists in one of TIMER_WHEEL_SLOTS slots,
+ * selected by their expiry tick. Adding and removing a timer is O(1), and
+ * advancing the wheel only looks at the slots for the ticks that passed.
+ * Timers further out than a full turn of the wheel stay in their slot until
+ * the turn they expire on.
+ */
+
+#ifndef __TIMERWHEEL_H__
+#define __TIMERWHEEL_H__
+
+#include <stdint.h>
+
+#define TIMER_WHEEL_SLOTS	256
+
+struct timer {
+	struct timer *next;
+	struct timer *prev;
+	uint64_t expires_tick;
+	void *data;
+};
+
+struct timer_wheel {
+	struct timer slots[TIMER_WHEEL_SLOTS];
+	uint64_t tick_ns;
+	uint64_t base_ns;
+	uint64_t current_tick;
+	unsigned int pending;
+};
+
+typedef void (*timer_expire_fn)(struct timer *timer, void *arg);
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now_ns,
+		      uint64_t tick_ns);
+void timer_init(struct timer *timer, void *data);
+void timer_add(struct timer_wheel *wheel, struct timer *timer,
+	       uint64_t expires_ns);
+void timer_del(struct timer_wheel *wheel, struct timer *timer);
+unsigned int timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ns,
+				 timer_expire_fn expire, void *arg);
+uint64_t timer_wheel_next_tick_ns(const struct timer_wheel *wheel);
+
+static inline int timer_pending(const struct timer *timer)
+{
+	return timer->next != NULL;
+}
+
+#endif /* __TIMERWHEEL_H__ */
@@ -0,0 +1,211 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "canio.h"
+#include "trace.h"
+
+struct trace_event {
+	uint64_t start_ns;
+	uint32_t dur_ns;
+	uint32_t arg;
+	uint8_t stage;
+};
+
+/* Only ever written by its own thread. The dump thread reads behind it, and
+ * checks head again afterwards for any events that were overwritten while
+ * it was reading.
+ */
+struct trace_ring {
+	struct trace_event ev[TRACE_RING_LEN];
+	_Atomic uint64_t head;
+	pid_t tid;
+} __attribute__((aligned(CACHE_LINE)));
+
+static const char *stage_names[TRACE_NUM_STAGES] = {
+	[TRACE_WAIT] = "wait",
+	[TRACE_RECV] = "recv",
+	[TRACE_DECODE] = "decode",
+	[TRACE_SEND] = "send",
+	[TRACE_URING_ENTER] = "io_uring_enter",
+};
+
+static struct trace_ring rings[TRACE_MAX_THREADS];
+static _Atomic unsigned int nrings;
+static __thread struct trace_ring *my_ring;
+static __thread int untraced;
+
+/* Copy of one ring at a time, for the dump thread */
+static struct trace_event snapshot[TRACE_RING_LEN];
+
+static sem_t dump_sem;
+static pthread_t dump_thread;
+
+static struct trace_ring *ring_register(void)
+{
+	unsigned int i;
+
+	i = atomic_fetch_add(&nrings, 1);
+	if (i >= TRACE_MAX_THREADS) {
+		untraced = 1;
+		return NULL;
+	}
+
+	my_ring = &rings[i];
+	my_ring->tid = syscall(SYS_gettid);
+
+	return my_ring;
+}
+
+void trace_record(enum trace_stage stage, uint64_t start_ns, uint32_t arg)
+{
+	struct trace_ring *ring = my_ring;
+	struct trace_event *ev;
+	uint64_t head;
+
+	if (!ring) {
+		if (untraced)
+			return;
+		ring = ring_register();
+		if (!ring)
+			return;
+	}
+
+	head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	ev = &ring->ev[head & (TRACE_RING_LEN - 1)];
+	ev->start_ns = start_ns;
+	ev->dur_ns = trace_now() - start_ns;
+	ev->stage = stage;
+	ev->arg = arg;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Write out what is still in a ring, oldest first */
+static void dump_ring(FILE *f, struct trace_ring *ring, int *first)
+{
+	uint64_t head, tail, now_head, i;
+	struct trace_event *ev;
+
+	head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	tail = head > TRACE_RING_LEN ? head - TRACE_RING_LEN : 0;
+	for (i = tail; i < head; i++)
+		snapshot[i & (TRACE_RING_LEN - 1)] =
+		  ring->ev[i & (TRACE_RING_LEN - 1)];
+
+	/* Anything the thread wrote over while it was copied is lost, as is
+	 * the slot of the event at now_head it may be part way through
+	 */
+	now_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (now_head >= TRACE_RING_LEN && now_head - TRACE_RING_LEN + 1 > tail)
+		tail = now_head - TRACE_RING_LEN + 1;
+
+	for (i = tail; i < head; i++) {
+		ev = &snapshot[i & (TRACE_RING_LEN - 1)];
+		fprintf(f, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+			"\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64 ",\"dur\":"
+			"%" PRIu32 ".%03" PRIu32 ",\"args\":{\"n\":%u}}",
+			*first ? "" : ",", stage_names[ev->stage], getpid(),
+			ring->tid, ev->start_ns / 1000, ev->start_ns % 1000,
+			ev->dur_ns / 1000, ev->dur_ns % 1000, ev->arg);
+		*first = 0;
+	}
+}
+
+static signed int trace_dump(unsigned int seq)
+{
+	unsigned int i, n;
+	char path[64];
+	int first = 1;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "ets_can_trace-%d-%u.json", getpid(), seq);
+	f = fopen(path, "w");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s: ", path);
+		perror("");
+		return -1;
+	}
+
+	n = atomic_load(&nrings);
+	if (n > TRACE_MAX_THREADS)
+		n = TRACE_MAX_THREADS;
+
+	/* ts and dur are in microseconds */
+	fprintf(f, "{\"traceEvents\":[");
+	for (i = 0; i < n; i++)
+		dump_ring(f, &rings[i], &first);
+	fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+	if (fclose(f)) {
+		fprintf(stderr, "Error writing %s: ", path);
+		perror("");
+		return -1;
+	}
+	fprintf(stderr, "Wrote trace of %u threads to %s\n", n, path);
+
+	return 0;
+}
+
+static void *dump_main(void *arg)
+{
+	unsigned int seq = 0;
+
+	(void)arg;
+
+	for (;;) {
+		if (sem_wait(&dump_sem) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		trace_dump(seq++);
+	}
+
+	return NULL;
+}
+
+/* sem_post() is one of the few things a signal handler may safely call */
+static void dump_handler(int signum)
+{
+	(void)signum;
+	sem_post(&dump_sem);
+}
+
+signed int trace_init(void)
+{
+	struct sigaction sa = { .sa_handler = dump_handler };
+	int err;
+
+	if (sem_init(&dump_sem, 0, 0) < 0) {
+		perror("Unable to create trace semaphore");
+		return -1;
+	}
+
+	err = pthread_create(&dump_thread, NULL, dump_main, NULL);
+	if (err) {
+		fprintf(stderr, "Unable to start trace thread: %s\n",
+			strerror(err));
+		return -1;
+	}
+	pthread_detach(dump_thread);
+
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	fprintf(stderr, "Tracing, send SIGUSR1 to %d to write out a trace\n",
+		getpid());
+
+	return 0;
+}
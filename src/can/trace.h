@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Tracepoints around each stage of the event loop
+ *
+ * For finding where the time goes in a latency spike. Each stage, the wait
+ * for the next wakeup, the receive, the decode of each frame, and the send
+ * of the responses, is recorded with its start and duration in to a ring
+ * that belongs to the thread doing the work, so recording takes no lock and
+ * shares no cache line with any other thread. Each ring holds the last
+ * TRACE_RING_LEN stages of its thread, older ones are overwritten.
+ *
+ * On SIGUSR1, every ring is written out as ets_can_trace-<pid>-<n>.json in
+ * the current directory, in the Chrome trace event format that
+ * chrome://tracing and ui.perfetto.dev both open. The signal handler only
+ * wakes a thread that writes the file, so the loops are never held up by
+ * the disk.
+ *
+ * Stamps are CLOCK_MONOTONIC_RAW, which the vDSO reads from the counter
+ * directly on both x86 and ARM, without a syscall.
+ *
+ * Only built with -Dtracing=true. Otherwise ETS_TRACE is not set, the macros
+ * below expand to nothing, and the loops are exactly as they would be
+ * without them.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#ifdef ETS_TRACE
+
+#include <stdint.h>
+#include <time.h>
+
+/* Stages per thread, a power of two */
+#define TRACE_RING_LEN		8192
+
+/* Threads past this many are not traced */
+#define TRACE_MAX_THREADS	16
+
+enum trace_stage {
+	TRACE_WAIT,
+	TRACE_RECV,
+	TRACE_DECODE,
+	TRACE_SEND,
+	TRACE_URING_ENTER,
+	TRACE_NUM_STAGES,
+};
+
+static inline uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+signed int trace_init(void);
+void trace_record(enum trace_stage stage, uint64_t start_ns, uint32_t arg);
+
+/* TRACE_BEGIN() declares t as the start of a stage, TRACE_END() records the
+ * stage as running from then until now, along with arg, a count of frames
+ * or a CAN ID.
+ */
+#define TRACE_BEGIN(t)		uint64_t t = trace_now()
+#define TRACE_END(t, stage, arg) trace_record(stage, t, arg)
+
+#else
+
+static inline signed int trace_init(void)
+{
+	return 0;
+}
+
+#define TRACE_BEGIN(t)		(void)0
+#define TRACE_END(t, stage, arg) (void)0
+
+#endif /* ETS_TRACE */
+
+#endif /* __TRACE_H__ */
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/net_tstamp.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "txsched.h"
+
+/* Once a frame is this late, it is counted as late */
+#define TXSCHED_LATE_NS		100000ULL
+
+void txsched_init(struct txsched *ts)
+{
+	memset(ts, '\0', sizeof(*ts));
+	latency_hist_init(&ts->err);
+}
+
+/* Launch times are on CLOCK_TAI, which is what the ETF qdisc runs on, the
+ * offset from CLOCK_MONOTONIC is taken once here.
+ */
+signed int txsched_enable_txtime(struct txsched *ts, int sock,
+				 uint64_t lead_ns)
+{
+	struct sock_txtime cfg = {
+		.clockid = CLOCK_TAI,
+		.flags = SOF_TXTIME_REPORT_ERRORS,
+	};
+	struct timespec tai;
+	uint64_t mono_ns;
+
+	if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0) {
+		perror("Unable to set SO_TXTIME");
+		return -1;
+	}
+
+	mono_ns = monotonic_ns();
+	clock_gettime(CLOCK_TAI, &tai);
+	ts->tai_offset_ns = timespec_to_ns(&tai) - (int64_t)mono_ns;
+	ts->lead_ns = lead_ns;
+	ts->txtime = 1;
+
+	return 0;
+}
+
+/* Wait until a frame due at deadline_ns should be queued, returns the time
+ * it was woken. Without SO_TXTIME that is the deadline itself, with it the
+ * deadline less the lead time.
+ */
+uint64_t txsched_wait(const struct txsched *ts, uint64_t deadline_ns)
+{
+	struct timespec wake;
+	uint64_t now_ns, wake_ns;
+
+	if (ts->txtime)
+		deadline_ns = deadline_ns > ts->lead_ns ?
+		  deadline_ns - ts->lead_ns : 0;
+
+	now_ns = monotonic_ns();
+	if (now_ns >= deadline_ns)
+		return now_ns;
+
+	if (deadline_ns - now_ns > TXSCHED_SPIN_NS) {
+		wake_ns = deadline_ns - TXSCHED_SPIN_NS;
+		wake.tv_sec = wake_ns / 1000000000ULL;
+		wake.tv_nsec = wake_ns % 1000000000ULL;
+		if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+		  NULL) == EINTR)
+			return monotonic_ns();
+	}
+
+	/* The timer is only so precise, spin out what is left of the wait.
+	 * With SO_TXTIME the qdisc takes it from here.
+	 */
+	do {
+		now_ns = monotonic_ns();
+	} while (!ts->txtime && now_ns < deadline_ns);
+
+	return now_ns;
+}
+
+/* Account for a frame due at deadline_ns that was just queued on tx, and
+ * with SO_TXTIME give it its launch time.
+ */
+void txsched_queued(struct txsched *ts, struct tx_queue *tx,
+		    uint64_t deadline_ns, uint64_t now_ns)
+{
+	uint64_t err_ns;
+
+	ts->frames++;
+
+	if (ts->txtime) {
+		tx_queue_set_txtime(tx, deadline_ns + ts->tai_offset_ns);
+		return;
+	}
+
+	err_ns = now_ns > deadline_ns ? now_ns - deadline_ns : 0;
+	latency_hist_add(&ts->err, err_ns);
+	if (err_ns >= TXSCHED_LATE_NS)
+		ts->late++;
+}
+
+/* Count frames the qdisc dropped, reported on the error queue */
+void txsched_check_errors(struct txsched *ts, int sock)
+{
+	char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+	struct sock_extended_err *ee;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct canfd_frame frame;
+	struct iovec iov = { .iov_base = &frame, .iov_len = sizeof(frame) };
+
+	if (!ts->txtime)
+		return;
+
+	for (;;) {
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl;
+		msg.msg_controllen = sizeof(ctrl);
+		if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+			break;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		  cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+			if (ee->ee_origin != SO_EE_ORIGIN_TXTIME)
+				continue;
+			if (ee->ee_code == SO_EE_CODE_TXTIME_MISSED)
+				ts->missed++;
+			else
+				ts->invalid++;
+		}
+	}
+}
+
+void txsched_print(FILE *stream, const char *label, const struct txsched *ts)
+{
+	if (ts->txtime) {
+		fprintf(stream, "%s: %llu frames scheduled with SO_TXTIME %llu "
+			"us early, %llu missed their launch time, %llu "
+			"rejected\n", label, ts->frames,
+			(unsigned long long)ts->lead_ns / 1000,
+			ts->missed, ts->invalid);
+		return;
+	}
+
+	fprintf(stream, "%s: %llu frames, %llu more than %llu us late\n", label,
+		ts->frames, ts->late, TXSCHED_LATE_NS / 1000);
+	latency_hist_print(stream, "  Scheduling error", &ts->err);
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Transmit scheduling at absolute deadlines
+ *
+ * Each frame has a deadline on CLOCK_MONOTONIC. The scheduler sleeps with
+ * clock_nanosleep() on TIMER_ABSTIME, so that time spent building and
+ * sending frames never accumulates in to drift, until TXSCHED_SPIN_NS
+ * before the deadline, and spins out the rest to avoid the wakeup latency
+ * of the timer. The difference between each deadline and the moment the
+ * frame is handed to the kernel is the scheduling error, kept in a
+ * histogram.
+ *
+ * With SO_TXTIME, the frame is instead handed to the kernel lead_ns early
+ * with its deadline as the launch time, and an ETF qdisc on the interface
+ * holds it until then, e.g.:
+ *
+ *   tc qdisc replace dev can0 root etf clockid CLOCK_TAI delta 200000
+ *
+ * Frames the qdisc could not send in time are dropped and reported back on
+ * the socket error queue, those are counted as missed.
+ */
+
+#ifndef __TXSCHED_H__
+#define __TXSCHED_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "canio.h"
+#include "latency.h"
+
+#define TXSCHED_SPIN_NS		50000ULL
+
+struct txsched {
+	int txtime;
+	uint64_t lead_ns;
+	int64_t tai_offset_ns;
+
+	/* Statistics */
+	struct latency_hist err;
+	unsigned long long frames;
+	unsigned long long late;
+	unsigned long long missed;
+	unsigned long long invalid;
+};
+
+void txsched_init(struct txsched *ts);
+signed int txsched_enable_txtime(struct txsched *ts, int sock,
+				 uint64_t lead_ns);
+uint64_t txsched_wait(const struct txsched *ts, uint64_t deadline_ns);
+void txsched_queued(struct txsched *ts, struct tx_queue *tx,
+		    uint64_t deadline_ns, uint64_t now_ns);
+void txsched_check_errors(struct txsched *ts, int sock);
+void txsched_print(FILE *stream, const char *label, const struct txsched *ts);
+
+#endif /* __TXSCHED_H__ */
@@ -0,0 +1,403 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ecu.h"
+#include "evloop.h"
+#include "trace.h"
+#include "uring.h"
+
+/* What a completion is for, with the port and transmit slot, packed in to
+ * its user data.
+ */
+#define URING_OP_RECV		1ULL
+#define URING_OP_SEND		2ULL
+
+static uint64_t pack_data(uint64_t op, unsigned int port, unsigned int slot)
+{
+	return op << 32 | port << 16 | slot;
+}
+
+/* An SQE, submitting what is already queued first if the ring is full */
+static struct io_uring_sqe *get_sqe(struct uring_loop *ul)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(&ul->ring);
+	if (!sqe) {
+		ul->sqe_full++;
+		ul->enters++;
+		io_uring_submit(&ul->ring);
+		sqe = io_uring_get_sqe(&ul->ring);
+	}
+
+	return sqe;
+}
+
+/* Post the port's multishot receive. Each frame completes it once, in to a
+ * buffer from the port's buffer group, until the kernel runs out of buffers
+ * or hits an error.
+ */
+static signed int arm_recv(struct uring_loop *ul, unsigned int i)
+{
+	struct uring_port *up = &ul->ports[i];
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ul);
+	if (!sqe) {
+		fprintf(stderr, "io_uring submission queue full\n");
+		return -1;
+	}
+
+	io_uring_prep_recvmsg_multishot(sqe, i, &up->rx_msg, 0);
+	sqe->flags |= IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+	sqe->buf_group = i;
+	io_uring_sqe_set_data64(sqe, pack_data(URING_OP_RECV, i, 0));
+
+	return 0;
+}
+
+static signed int submit_send(struct uring_loop *ul, unsigned int i,
+			      unsigned int slot)
+{
+	struct uring_tx *tx = &ul->ports[i].tx[slot];
+	struct io_uring_sqe *sqe;
+
+	sqe = get_sqe(ul);
+	if (!sqe) {
+		fprintf(stderr, "io_uring submission queue full\n");
+		return -1;
+	}
+
+	io_uring_prep_send(sqe, i, &tx->frame, tx->len, 0);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	io_uring_sqe_set_data64(sqe, pack_data(URING_OP_SEND, i, slot));
+
+	return 0;
+}
+
+/* Move the responses queued on the port in to transmit slots of their own,
+ * that stay put until the kernel is done sending them, and queue a send for
+ * each. They go to the kernel with the next wait for completions.
+ */
+static signed int queue_sends(struct uring_loop *ul, unsigned int i)
+{
+	struct uring_port *up = &ul->ports[i];
+	struct tx_queue *q = &up->port->tx;
+	struct uring_tx *tx;
+	unsigned int j, slot;
+
+	for (j = 0; j < q->count; j++) {
+		if (!up->ntx_free) {
+			q->dropped_total++;
+			ecu_responses_lost(up->port, 1);
+			continue;
+		}
+
+		slot = up->tx_free[--up->ntx_free];
+		tx = &up->tx[slot];
+		tx->len = q->iov[j].iov_len;
+		tx->retries = 0;
+		memcpy(&tx->frame, &q->frames[j], tx->len);
+		if (submit_send(ul, i, slot) < 0)
+			return -1;
+	}
+	q->count = 0;
+
+	return 0;
+}
+
+static signed int complete_send(struct uring_loop *ul, unsigned int i,
+				unsigned int slot, int res)
+{
+	struct uring_port *up = &ul->ports[i];
+	struct tx_queue *q = &up->port->tx;
+	struct uring_tx *tx = &up->tx[slot];
+
+	if (res == -ENOBUFS || res == -EAGAIN) {
+		if (++tx->retries <= TX_RETRY_MAX) {
+			q->retries_total++;
+			return submit_send(ul, i, slot);
+		}
+		q->dropped_total++;
+		ecu_responses_lost(up->port, 1);
+	} else if (res < 0) {
+		fprintf(stderr, "Error sending ECU response on %s: %s\n",
+			up->port->iface, strerror(-res));
+		return -1;
+	} else {
+		q->frames_total++;
+	}
+
+	up->tx_free[up->ntx_free++] = slot;
+
+	return 0;
+}
+
+/* Hand one received frame to the ECU emulation, then put its buffer back to
+ * be added to the ring again once this round of completions is done.
+ */
+static signed int complete_recv(struct uring_loop *ul, unsigned int i,
+				const struct io_uring_cqe *cqe, int *rearm)
+{
+	struct uring_port *up = &ul->ports[i];
+	struct can_port *port = up->port;
+	struct io_uring_recvmsg_out *out;
+	struct canfd_frame *frame;
+	struct msghdr msg;
+	unsigned int bid, len;
+	uint8_t *buf;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		*rearm = 1;
+
+	/* Out of buffers ends the multishot receive, it is posted again once
+	 * buffers are back in the ring.
+	 */
+	if (cqe->res == -ENOBUFS)
+		return 0;
+	if (cqe->res < 0) {
+		fprintf(stderr, "Error receiving on ECU emulation on %s: %s\n",
+			port->iface, strerror(-cqe->res));
+		return -1;
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER))
+		return 0;
+
+	bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	buf = up->bufs[bid];
+	out = io_uring_recvmsg_validate(buf, cqe->res, &up->rx_msg);
+	if (out) {
+		len = io_uring_recvmsg_payload_length(out, cqe->res,
+						      &up->rx_msg);
+		frame = io_uring_recvmsg_payload(out, &up->rx_msg);
+
+		memset(&msg, '\0', sizeof(msg));
+		msg.msg_control = (uint8_t *)io_uring_recvmsg_name(out) +
+		  up->rx_msg.msg_namelen;
+		msg.msg_controllen = out->controllen;
+		msg.msg_flags = out->flags;
+
+		if (out->flags & (MSG_TRUNC | MSG_CTRUNC))
+			up->truncated++;
+
+		if (len >= sizeof(struct can_frame)) {
+			port->rx.frames_total++;
+			if (out->flags & MSG_CONFIRM)
+				port->rx.echo_total++;
+			if (ecu_handle_frame(port, &msg,
+			  (struct can_frame *)frame, len == CANFD_MTU) < 0)
+				return -1;
+		}
+	}
+
+	io_uring_buf_ring_add(up->br, buf, URING_RX_BUF_LEN, bid,
+			      io_uring_buf_ring_mask(URING_RX_BUFS),
+			      up->recycled++);
+
+	return 0;
+}
+
+static signed int handle_cqe(struct uring_loop *ul,
+			     const struct io_uring_cqe *cqe, int *rearm)
+{
+	uint64_t data = io_uring_cqe_get_data64(cqe);
+	unsigned int i = (data >> 16) & 0xffff;
+
+	if (i >= ul->nports)
+		return 0;
+
+	switch (data >> 32) {
+	case URING_OP_RECV:
+		return complete_recv(ul, i, cqe, &rearm[i]);
+	case URING_OP_SEND:
+		return complete_send(ul, i, data & 0xffff, cqe->res);
+	default:
+		return 0;
+	}
+}
+
+signed int uring_init(struct uring_loop *ul, struct can_port *ports,
+		      int nports)
+{
+	struct io_uring_params params;
+	int fds[URING_MAX_PORTS];
+	struct uring_port *up;
+	int i, j, ret;
+
+	memset(ul, '\0', sizeof(*ul));
+	if (nports > URING_MAX_PORTS) {
+		fprintf(stderr, "Too many ports for io_uring\n");
+		return -1;
+	}
+
+	/* Completions only ever come in to this thread, when it asks for
+	 * them. Older kernels without these flags get a plain ring.
+	 */
+	memset(&params, '\0', sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+	  IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER |
+	  IORING_SETUP_DEFER_TASKRUN;
+	params.cq_entries = URING_CQ_ENTRIES;
+	ret = io_uring_queue_init_params(URING_ENTRIES, &ul->ring, &params);
+	if (ret == -EINVAL) {
+		memset(&params, '\0', sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = URING_CQ_ENTRIES;
+		ret = io_uring_queue_init_params(URING_ENTRIES, &ul->ring,
+						 &params);
+	}
+	if (ret < 0) {
+		fprintf(stderr, "Unable to set up io_uring: %s\n",
+			strerror(-ret));
+		return -1;
+	}
+	ul->ready = 1;
+
+	for (i = 0; i < nports; i++)
+		fds[i] = ports[i].sock;
+	ret = io_uring_register_files(&ul->ring, fds, nports);
+	if (ret < 0) {
+		fprintf(stderr, "Unable to register sockets with io_uring: "
+			"%s\n", strerror(-ret));
+		uring_close(ul);
+		return -1;
+	}
+
+	for (i = 0; i < nports; i++, ul->nports++) {
+		up = &ul->ports[i];
+		up->port = &ports[i];
+
+		up->br = io_uring_setup_buf_ring(&ul->ring, URING_RX_BUFS, i, 0,
+						 &ret);
+		if (!up->br) {
+			fprintf(stderr, "Unable to register io_uring buffers "
+				"for %s: %s\n", ports[i].iface, strerror(-ret));
+			uring_close(ul);
+			return -1;
+		}
+		for (j = 0; j < URING_RX_BUFS; j++)
+			io_uring_buf_ring_add(up->br, up->bufs[j],
+					      URING_RX_BUF_LEN, j,
+					      io_uring_buf_ring_mask(URING_RX_BUFS),
+					      j);
+		io_uring_buf_ring_advance(up->br, URING_RX_BUFS);
+
+		up->rx_msg.msg_namelen = sizeof(struct sockaddr_can);
+		up->rx_msg.msg_controllen = CTRLMSG_LEN;
+
+		for (j = 0; j < URING_TX_SLOTS; j++)
+			up->tx_free[j] = URING_TX_SLOTS - 1 - j;
+		up->ntx_free = URING_TX_SLOTS;
+	}
+
+	for (i = 0; i < nports; i++) {
+		if (arm_recv(ul, i) < 0) {
+			uring_close(ul);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Run the ECU emulation until interrupted. Each round submits everything
+ * queued since the last, and waits for at least one completion, in a single
+ * io_uring_enter().
+ */
+signed int uring_run_ecu(struct uring_loop *ul)
+{
+	struct __kernel_timespec ts = { .tv_sec = 1 };
+	int rearm[URING_MAX_PORTS];
+	struct io_uring_cqe *cqe;
+	struct uring_port *up;
+	unsigned int head, count, i;
+	int ret = 0;
+
+	while (keep_running) {
+		TRACE_BEGIN(t);
+		ret = io_uring_submit_and_wait_timeout(&ul->ring, &cqe, 1, &ts,
+						       NULL);
+		TRACE_END(t, TRACE_URING_ENTER, ret);
+		ul->enters++;
+		if (ret < 0 && ret != -ETIME && ret != -EINTR) {
+			fprintf(stderr, "Error waiting on io_uring: %s\n",
+				strerror(-ret));
+			return -1;
+		}
+
+		memset(rearm, '\0', sizeof(rearm));
+		count = 0;
+		ret = 0;
+		io_uring_for_each_cqe(&ul->ring, head, cqe) {
+			count++;
+			if (handle_cqe(ul, cqe, rearm) < 0) {
+				ret = -1;
+				break;
+			}
+		}
+		io_uring_cq_advance(&ul->ring, count);
+		ul->cqes += count;
+		if (ret < 0)
+			return -1;
+
+		for (i = 0; i < ul->nports; i++) {
+			up = &ul->ports[i];
+			if (up->recycled) {
+				io_uring_buf_ring_advance(up->br, up->recycled);
+				up->recycled = 0;
+			}
+			if (rearm[i]) {
+				up->rearms++;
+				if (arm_recv(ul, i) < 0)
+					return -1;
+			}
+			if (up->port->tx.count && queue_sends(ul, i) < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+void uring_print_stats(const struct uring_loop *ul)
+{
+	unsigned long long rx = 0, tx = 0, rearms = 0, truncated = 0;
+	unsigned int i;
+
+	for (i = 0; i < ul->nports; i++) {
+		rx += ul->ports[i].port->rx.frames_total;
+		tx += ul->ports[i].port->tx.frames_total;
+		rearms += ul->ports[i].rearms;
+		truncated += ul->ports[i].truncated;
+	}
+
+	fprintf(stderr, "io_uring: %llu frames received and %llu sent with "
+		"%llu io_uring_enter() calls (%.2f frames per call), %llu "
+		"completions\n", rx, tx, ul->enters, ul->enters ?
+		(double)(rx + tx) / ul->enters : 0.0, ul->cqes);
+	fprintf(stderr, "io_uring: %llu receives posted again, %llu frames "
+		"truncated, %llu times the submission queue filled\n", rearms,
+		truncated, ul->sqe_full);
+}
+
+void uring_close(struct uring_loop *ul)
+{
+	unsigned int i;
+
+	if (!ul->ready)
+		return;
+
+	for (i = 0; i < URING_MAX_PORTS; i++) {
+		if (ul->ports[i].br)
+			io_uring_free_buf_ring(&ul->ring, ul->ports[i].br,
+					       URING_RX_BUFS, i);
+		ul->ports[i].br = NULL;
+	}
+	io_uring_queue_exit(&ul->ring);
+	ul->ready = 0;
+}
@@ -0,0 +1,102 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* io_uring based ECU emulation loop
+ *
+ * An alternative to servicing the ECU ports from the epoll loop, selected
+ * with --uring. Each port keeps one multishot receive posted, which the
+ * kernel completes once for every frame that arrives, in to a buffer taken
+ * from a ring of buffers registered for that port. The sockets are
+ * registered as well, so the kernel does not look them up for each
+ * operation.
+ *
+ * Responses are queued as sends and only handed to the kernel when waiting
+ * for the next completions, so all of the responses to everything received
+ * in one wakeup, and the wait for the next, take one io_uring_enter(). Under
+ * load that comes to a small fraction of a syscall per frame, where the
+ * epoll loop needs an epoll_wait(), a recvmmsg(), and a sendmmsg() per
+ * wakeup.
+ *
+ * A send the interface has no room for, ENOBUFS, is retried up to
+ * TX_RETRY_MAX times before the response is dropped.
+ *
+ * Only built with liburing, HAVE_LIBURING is set by meson when it is found.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#ifdef HAVE_LIBURING
+
+#include <liburing.h>
+
+#include "canio.h"
+
+#define URING_MAX_PORTS		8
+#define URING_ENTRIES		512
+
+/* Receive buffers per port, a power of two */
+#define URING_RX_BUFS		256
+
+/* Each receive buffer holds the io_uring_recvmsg_out header, the address,
+ * the control messages, then the frame.
+ */
+#define URING_RX_BUF_LEN	(sizeof(struct io_uring_recvmsg_out) + \
+				 sizeof(struct sockaddr_can) + CTRLMSG_LEN + \
+				 CANFD_MTU)
+
+/* Responses in flight per port */
+#define URING_TX_SLOTS		256
+
+struct uring_tx {
+	struct canfd_frame frame;
+	unsigned int len;
+	unsigned int retries;
+};
+
+/* Completion queue entries, room for every receive buffer of every port
+ * to complete at once, along with the sends.
+ */
+#define URING_CQ_ENTRIES	(URING_MAX_PORTS * (URING_RX_BUFS + \
+				 URING_TX_SLOTS))
+
+struct uring_port {
+	uint8_t bufs[URING_RX_BUFS][URING_RX_BUF_LEN];
+	struct can_port *port;
+	struct io_uring_buf_ring *br;
+
+	/* Tells the kernel how much of each buffer is for the address and the
+	 * control messages, for every frame the multishot receive completes.
+	 */
+	struct msghdr rx_msg;
+	unsigned int recycled;
+
+	struct uring_tx tx[URING_TX_SLOTS];
+	uint16_t tx_free[URING_TX_SLOTS];
+	unsigned int ntx_free;
+
+	/* Statistics */
+	unsigned long long rearms;
+	unsigned long long truncated;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct uring_loop {
+	struct io_uring ring;
+	struct uring_port ports[URING_MAX_PORTS];
+	unsigned int nports;
+	int ready;
+
+	/* Statistics */
+	unsigned long long enters;
+	unsigned long long cqes;
+	unsigned long long sqe_full;
+};
+
+signed int uring_init(struct uring_loop *ul, struct can_port *ports,
+		      int nports);
+signed int uring_run_ecu(struct uring_loop *ul);
+void uring_print_stats(const struct uring_loop *ul);
+void uring_close(struct uring_loop *ul);
+
+#endif /* HAVE_LIBURING */
+
+#endif /* __URING_H__ */
@@ -0,0 +1,385 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "obd.h"
+#include "vehicle.h"
+
+#define VEHICLE_LINE_MAX	256
+
+static inline uint64_t vehicle_key(canid_t id, uint8_t service, uint16_t pid)
+{
+	return ((uint64_t)id << 24) | ((uint64_t)service << 16) | pid;
+}
+
+static inline unsigned int vehicle_hash(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> (64 - VEHICLE_HASH_BITS);
+}
+
+/* Slot holding key, or the empty one it would go in */
+static struct vehicle_slot *vehicle_slot(struct vehicle *v, uint64_t key)
+{
+	unsigned int h = vehicle_hash(key);
+	unsigned int probe = 0;
+
+	while (v->slots[h].used && v->slots[h].key != key) {
+		h = (h + 1) & (VEHICLE_HASH_SIZE - 1);
+		probe++;
+	}
+	if (probe > v->max_probe)
+		v->max_probe = probe;
+
+	return &v->slots[h];
+}
+
+/* Response to a request for service and PID on id, or NULL if there is
+ * none. For a request to the functional address, vehicle_next() gives the
+ * responses from the rest of the ECUs.
+ */
+const struct vehicle_rsp *vehicle_lookup(const struct vehicle *v,
+					 canid_t id, uint8_t service,
+					 uint16_t pid)
+{
+	uint64_t key = vehicle_key(id, service, pid);
+	unsigned int h = vehicle_hash(key);
+
+	while (v->slots[h].used) {
+		if (v->slots[h].key == key)
+			return &v->rsps[v->slots[h].rsp];
+		h = (h + 1) & (VEHICLE_HASH_SIZE - 1);
+	}
+
+	return NULL;
+}
+
+static signed int parse_id(const char *str, canid_t *id)
+{
+	char *end;
+	unsigned long val;
+
+	if (!str)
+		return -1;
+
+	val = strtoul(str, &end, 0);
+	if (end == str || *end != '\0' || val > CAN_EFF_MASK)
+		return -1;
+
+	*id = val > CAN_SFF_MASK ? val | CAN_EFF_FLAG : val;
+
+	return 0;
+}
+
+static signed int parse_hex(const char *str, unsigned long max,
+			    unsigned long *val)
+{
+	char *end;
+
+	if (!str)
+		return -1;
+
+	*val = strtoul(str, &end, 16);
+	if (end == str || *end != '\0' || *val > max)
+		return -1;
+
+	return 0;
+}
+
+static void add_filter(struct can_filter *filter, canid_t id)
+{
+	filter->can_id = id;
+	filter->can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+	  ((id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+}
+
+/* ecu <name> <request id> <response id> */
+static const char *parse_ecu(struct vehicle *v, char **save)
+{
+	const char *name = strtok_r(NULL, " \t", save);
+	struct vehicle_ecu *ecu;
+	unsigned int i;
+
+	if (v->necus >= VEHICLE_MAX_ECUS)
+		return "too many ECUs";
+
+	ecu = &v->ecus[v->necus];
+	if (!name || strlen(name) >= VEHICLE_NAME_LEN)
+		return "missing or too long ECU name";
+	if (parse_id(strtok_r(NULL, " \t", save), &ecu->req_id) < 0 ||
+	  parse_id(strtok_r(NULL, " \t", save), &ecu->rsp_id) < 0)
+		return "expected request and response CAN IDs";
+	if (ecu->req_id == v->functional_id)
+		return "request ID is the functional address";
+
+	for (i = 0; i < v->necus; i++) {
+		if (v->ecus[i].req_id == ecu->req_id)
+			return "request ID already used by another ECU";
+	}
+
+	strcpy(ecu->name, name);
+	ecu->npids = 0;
+	add_filter(&v->filters[v->nfilters++], ecu->req_id);
+	add_filter(&v->rsp_filters[v->nrsp_filters++], ecu->rsp_id);
+	v->necus++;
+
+	return NULL;
+}
+
+/* pid <service> <pid> (<byte> ... | <generator> ...) */
+static const char *parse_pid(struct vehicle *v, char **save)
+{
+	struct vehicle_ecu *ecu;
+	const struct obd_pid *info;
+	struct vehicle_rsp *rsp, *last;
+	const char *err;
+	struct vehicle_slot *slot;
+	unsigned long service, pid, val;
+	unsigned int pid_len, len = 0;
+	const char *tok;
+	int idx;
+
+	if (!v->necus)
+		return "pid before any ecu";
+	ecu = &v->ecus[v->necus - 1];
+	if (v->nrsps >= VEHICLE_MAX_RSPS)
+		return "too many PIDs";
+
+	if (parse_hex(strtok_r(NULL, " \t", save), 0x3f, &service) < 0)
+		return "expected a service, 00-3f";
+	pid_len = vehicle_pid_len(service);
+	if (parse_hex(strtok_r(NULL, " \t", save),
+	  pid_len == 2 ? 0xffff : 0xff, &pid) < 0)
+		return "expected a PID";
+
+	idx = v->nrsps;
+	rsp = &v->rsps[idx];
+	memset(rsp, '\0', sizeof(*rsp));
+	rsp->id = ecu->rsp_id;
+	rsp->next = -1;
+
+	/* Length, positive response, then the PID as in the request */
+	rsp->data[1] = service + OBD_RESPONSE_OFFSET;
+	if (pid_len == 2) {
+		rsp->data[2] = pid >> 8;
+		rsp->data[3] = pid & 0xff;
+	} else {
+		rsp->data[2] = pid;
+	}
+	rsp->val_off = 2 + pid_len;
+
+	/* Generator names are never hex */
+	tok = strtok_r(NULL, " \t", save);
+	if (tok && parse_hex(tok, 0xff, &val) < 0) {
+		info = service == OBD_SERVICE_CURRENT ? obd_pid_info(pid) : NULL;
+		err = siggen_parse(&rsp->gen, tok, save, info, &len);
+		if (err)
+			return err;
+		rsp->val_len = len;
+	} else {
+		for (; tok; tok = strtok_r(NULL, " \t", save)) {
+			if (rsp->val_off + len >= CAN_MAX_DLEN)
+				return "too much data for a single frame";
+			if (parse_hex(tok, 0xff, &val) < 0)
+				return "expected hex data bytes";
+			rsp->data[rsp->val_off + len++] = val;
+		}
+	}
+	if (!len)
+		return "no response data";
+	if (rsp->val_off + len > CAN_MAX_DLEN) {
+		siggen_free(&rsp->gen);
+		return "too much data for a single frame";
+	}
+
+	rsp->data[0] = 1 + pid_len + len;
+	rsp->dlc = rsp->val_off + len;
+
+	slot = vehicle_slot(v, vehicle_key(ecu->req_id, service, pid));
+	if (slot->used) {
+		siggen_free(&rsp->gen);
+		return "PID already given for this ECU";
+	}
+	slot->used = 1;
+	slot->key = vehicle_key(ecu->req_id, service, pid);
+	slot->rsp = idx;
+
+	/* Functional requests are answered by every ECU in the file's order */
+	slot = vehicle_slot(v, vehicle_key(v->functional_id, service, pid));
+	if (slot->used) {
+		for (last = &v->rsps[slot->rsp]; last->next >= 0;
+		  last = &v->rsps[last->next]);
+		last->next = idx;
+	} else {
+		slot->used = 1;
+		slot->key = vehicle_key(v->functional_id, service, pid);
+		slot->rsp = idx;
+	}
+
+	ecu->npids++;
+	v->nrsps++;
+
+	return NULL;
+}
+
+/* periodic <id> <ms> <byte> ... */
+static const char *parse_periodic(struct vehicle *v, char **save)
+{
+	struct bcm_tx *tx;
+	unsigned long val;
+	const char *tok;
+
+	if (v->nperiodic >= BCM_MAX_MSGS)
+		return "too many periodic frames";
+
+	tx = &v->periodic[v->nperiodic];
+	memset(tx, '\0', sizeof(*tx));
+	if (parse_id(strtok_r(NULL, " \t", save), &tx->frame.can_id) < 0)
+		return "expected a CAN ID";
+
+	tok = strtok_r(NULL, " \t", save);
+	val = tok ? strtoul(tok, NULL, 10) : 0;
+	if (val < 1 || val > 3600000)
+		return "expected an interval of 1 ms to 1 hour";
+	tx->ival_ms = val;
+
+	while ((tok = strtok_r(NULL, " \t", save))) {
+		if (tx->frame.can_dlc >= CAN_MAX_DLEN)
+			return "too much data for a frame";
+		if (parse_hex(tok, 0xff, &val) < 0)
+			return "expected hex data bytes";
+		tx->frame.data[tx->frame.can_dlc++] = val;
+	}
+
+	v->nperiodic++;
+
+	return NULL;
+}
+
+/* watch <id> <timeout ms> [<mask byte> ...] */
+static const char *parse_watch(struct vehicle *v, char **save)
+{
+	struct bcm_rx *rx;
+	unsigned long val;
+	unsigned int n = 0;
+	const char *tok;
+
+	if (v->nwatches >= BCM_MAX_MSGS)
+		return "too many watched frames";
+
+	rx = &v->watches[v->nwatches];
+	memset(rx, '\0', sizeof(*rx));
+	if (parse_id(strtok_r(NULL, " \t", save), &rx->id) < 0)
+		return "expected a CAN ID";
+
+	tok = strtok_r(NULL, " \t", save);
+	if (!tok)
+		return "expected a timeout in ms, or 0";
+	rx->timeout_ms = strtoul(tok, NULL, 10);
+
+	while ((tok = strtok_r(NULL, " \t", save))) {
+		if (n >= CAN_MAX_DLEN)
+			return "mask longer than a frame";
+		if (parse_hex(tok, 0xff, &val) < 0)
+			return "expected a hex mask";
+		rx->mask[n++] = val;
+	}
+	if (!n)
+		memset(rx->mask, 0xff, sizeof(rx->mask));
+
+	v->nwatches++;
+
+	return NULL;
+}
+
+signed int vehicle_load(struct vehicle *v, const char *path)
+{
+	char line[VEHICLE_LINE_MAX];
+	const char *err = NULL;
+	char *save, *tok;
+	unsigned int lineno = 0;
+	FILE *f;
+
+	memset(v, '\0', sizeof(*v));
+	v->functional_id = VEHICLE_FUNCTIONAL_ID;
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Unable to open %s: ", path);
+		perror("");
+		return -1;
+	}
+
+	while (!err && fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "#\r\n")] = '\0';
+
+		tok = strtok_r(line, " \t", &save);
+		if (!tok)
+			continue;
+
+		if (!strcmp(tok, "ecu")) {
+			err = parse_ecu(v, &save);
+		} else if (!strcmp(tok, "pid")) {
+			err = parse_pid(v, &save);
+		} else if (!strcmp(tok, "periodic")) {
+			err = parse_periodic(v, &save);
+		} else if (!strcmp(tok, "watch")) {
+			err = parse_watch(v, &save);
+		} else if (!strcmp(tok, "functional")) {
+			if (v->necus)
+				err = "functional must come before any ecu";
+			else if (parse_id(strtok_r(NULL, " \t", &save),
+			  &v->functional_id) < 0)
+				err = "expected a CAN ID";
+		} else {
+			err = "unknown keyword";
+		}
+	}
+	fclose(f);
+
+	if (err) {
+		fprintf(stderr, "%s:%u: %s\n", path, lineno, err);
+		vehicle_close(v);
+		return -1;
+	}
+
+	if (!v->nrsps && !v->nperiodic && !v->nwatches) {
+		fprintf(stderr, "%s: no PIDs, periodic, or watched frames\n",
+			path);
+		return -1;
+	}
+
+	add_filter(&v->filters[v->nfilters++], v->functional_id);
+
+	return 0;
+}
+
+void vehicle_close(struct vehicle *v)
+{
+	unsigned int i;
+
+	for (i = 0; i < v->nrsps; i++)
+		siggen_free(&v->rsps[i].gen);
+	v->nrsps = 0;
+}
+
+void vehicle_print(const struct vehicle *v)
+{
+	unsigned int i;
+
+	for (i = 0; i < v->necus; i++)
+		fprintf(stderr, "ECU %s: requests on 0x%x, responses from 0x%x, "
+			"%u PIDs\n", v->ecus[i].name,
+			v->ecus[i].req_id & CAN_EFF_MASK,
+			v->ecus[i].rsp_id & CAN_EFF_MASK, v->ecus[i].npids);
+	fprintf(stderr, "Vehicle: %u ECUs, %u responses, functional address "
+		"0x%x, longest hash probe %u\n", v->necus, v->nrsps,
+		v->functional_id & CAN_EFF_MASK, v->max_probe);
+	if (v->nperiodic || v->nwatches)
+		fprintf(stderr, "Vehicle: %u periodic frames, %u watched\n",
+			v->nperiodic, v->nwatches);
+}
@@ -0,0 +1,141 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Simulated vehicle
+ *
+ * A vehicle is a set of ECUs, each with its own request and response CAN
+ * IDs and its own set of PIDs it answers, loaded from a text file:
+ *
+ *	# Answers physical requests to 0x7e0, and functional ones to 0x7df
+ *	ecu engine 0x7e0 0x7e8
+ *	pid 01 0c sine 800 3000 10
+ *	pid 01 05 7b
+ *	pid 22 f190 45 54 53
+ *
+ *	ecu transmission 0x7e1 0x7e9
+ *	pid 01 0d ramp 0 120 30
+ *	pid 01 a4 random 4
+ *	pid 22 0101 trace gear.txt 100 1
+ *
+ * Each pid line belongs to the ecu above it, and gives the service, the PID
+ * in hex, and then the response data. That is either the data bytes in hex,
+ * or a signal generator, see siggen.c, whose value goes out big endian with
+ * as many bytes as obd.c says the PID has for service 01, or as many as are
+ * given after the generator otherwise. Service 01 values are in the units
+ * in obd.c, any others are raw. Services 22 and 2e take a 16 bit data
+ * identifier rather than an 8 bit PID. Responses are single frames, so the
+ * data has to fit in what is left of 7 bytes after the service and PID.
+ *
+ * Every ECU also answers the PIDs it has when requested on the functional
+ * address, 0x7df unless a "functional <id>" line says otherwise, as real
+ * ECUs do. IDs that do not fit in 11 bits are taken as extended IDs.
+ *
+ * The vehicle can also send frames of its own on a cycle, and watch frames
+ * from elsewhere for changes, both done by the kernel, see bcm.h:
+ *
+ *	periodic 0x3e8 10 00 11 22 33
+ *	watch 0x120 100 ff 00 0f
+ *
+ * A periodic line gives the CAN ID, the interval in ms, and the data in hex.
+ * A watch line gives the CAN ID, a timeout in ms to report the frame going
+ * missing after, or 0 for none, and optionally a mask in hex of the data
+ * bits whose changes are reported, all of them if none is given.
+ *
+ * Each response is built in full when the file is loaded, and is found from
+ * the request's CAN ID, service, and PID with an open addressed hash table,
+ * so answering costs the same with a few entries as with thousands. A
+ * functional request finds the first ECU's response, which links to the
+ * next ECU answering the same PID, and so on.
+ */
+
+#ifndef __VEHICLE_H__
+#define __VEHICLE_H__
+
+#include <linux/can.h>
+#include <stdint.h>
+
+#include "bcm.h"
+#include "siggen.h"
+
+#define VEHICLE_MAX_ECUS	32
+#define VEHICLE_MAX_RSPS	4096
+#define VEHICLE_NAME_LEN	32
+
+/* Power of two, twice the most keys there can be so probes stay short */
+#define VEHICLE_HASH_BITS	14
+#define VEHICLE_HASH_SIZE	(1 << VEHICLE_HASH_BITS)
+
+#define VEHICLE_FUNCTIONAL_ID	0x7df
+
+struct vehicle_rsp {
+	canid_t id;
+	uint8_t dlc;
+	uint8_t data[CAN_MAX_DLEN];
+
+	/* Bytes of data to fill with the generator's value on each response,
+	 * none if the data is fixed.
+	 */
+	uint8_t val_off;
+	uint8_t val_len;
+	struct siggen gen;
+
+	/* Next ECU's response to the same functional request, or -1. Only
+	 * followed for functional requests.
+	 */
+	int next;
+};
+
+struct vehicle_slot {
+	uint64_t key;
+	int used;
+	int rsp;
+};
+
+struct vehicle_ecu {
+	char name[VEHICLE_NAME_LEN];
+	canid_t req_id;
+	canid_t rsp_id;
+	unsigned int npids;
+};
+
+struct vehicle {
+	struct vehicle_ecu ecus[VEHICLE_MAX_ECUS];
+	unsigned int necus;
+	canid_t functional_id;
+
+	struct vehicle_rsp rsps[VEHICLE_MAX_RSPS];
+	unsigned int nrsps;
+	struct vehicle_slot slots[VEHICLE_HASH_SIZE];
+	unsigned int max_probe;
+
+	struct bcm_tx periodic[BCM_MAX_MSGS];
+	unsigned int nperiodic;
+	struct bcm_rx watches[BCM_MAX_MSGS];
+	unsigned int nwatches;
+
+	/* Requests to every ECU and the functional address, and responses */
+	struct can_filter filters[VEHICLE_MAX_ECUS + 1];
+	unsigned int nfilters;
+	struct can_filter rsp_filters[VEHICLE_MAX_ECUS];
+	unsigned int nrsp_filters;
+};
+
+/* Bytes of PID a request for the service carries */
+static inline unsigned int vehicle_pid_len(uint8_t service)
+{
+	return (service == 0x22 || service == 0x2e) ? 2 : 1;
+}
+
+signed int vehicle_load(struct vehicle *v, const char *path);
+void vehicle_close(struct vehicle *v);
+const struct vehicle_rsp *vehicle_lookup(const struct vehicle *v,
+					 canid_t id, uint8_t service,
+					 uint16_t pid);
+void vehicle_print(const struct vehicle *v);
+
+static inline const struct vehicle_rsp *
+vehicle_next(const struct vehicle *v, const struct vehicle_rsp *rsp)
+{
+	return rsp->next < 0 ? NULL : &v->rsps[rsp->next];
+}
+
+#endif /* __VEHICLE_H__ */
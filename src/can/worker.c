@@ -0,0 +1,147 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include "worker.h"
+
+/* Pin the calling thread to cpu, if it is not negative, and run it under
+ * SCHED_FIFO at prio, if it is not zero. RT priority normally needs root or
+ * CAP_SYS_NICE.
+ */
+signed int sched_setup(const char *name, int cpu, int prio)
+{
+	struct sched_param param = { .sched_priority = prio };
+	cpu_set_t cpus;
+	int err;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		err = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (err) {
+			fprintf(stderr, "Unable to pin %s to CPU %d: %s\n", name,
+				cpu, strerror(err));
+			return -1;
+		}
+	}
+
+	if (prio) {
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err) {
+			fprintf(stderr, "Unable to set SCHED_FIFO priority %d "
+				"for %s: %s\n", prio, name, strerror(err));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	w->ret = -1;
+
+	if (sched_setup(w->port->iface, w->cpu, w->prio) < 0 ||
+	  evloop_init(&w->loop) < 0) {
+		keep_running = 0;
+		return NULL;
+	}
+
+	if (evloop_add(&w->loop, &w->port->ev, EPOLLIN) < 0) {
+		evloop_close(&w->loop);
+		keep_running = 0;
+		return NULL;
+	}
+
+	w->ret = 0;
+	while (keep_running) {
+		if ((w->spin ? evloop_poll_all(&w->loop) :
+		  evloop_run_once(&w->loop, 1000)) < 0) {
+			w->ret = -1;
+			break;
+		}
+	}
+
+	/* One worker failing stops all of them */
+	keep_running = 0;
+	evloop_close(&w->loop);
+
+	return NULL;
+}
+
+void worker_init(struct worker *w, struct can_port *port, int cpu, int prio,
+		 int spin)
+{
+	memset(w, '\0', sizeof(*w));
+	w->port = port;
+	w->cpu = cpu;
+	w->prio = prio;
+	w->spin = spin;
+	w->loop.fd_epoll = -1;
+}
+
+/* Signals are blocked while the thread is created so that only the main
+ * thread ever handles them. Workers notice keep_running being cleared the
+ * next time their event loop times out.
+ */
+signed int worker_start(struct worker *w)
+{
+	sigset_t mask, oldmask;
+	int err;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, &oldmask);
+
+	err = pthread_create(&w->thread, NULL, worker_main, w);
+
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	if (err) {
+		fprintf(stderr, "Unable to start worker for %s: %s\n",
+			w->port->iface, strerror(err));
+		return -1;
+	}
+	w->started = 1;
+
+	return 0;
+}
+
+signed int worker_join(struct worker *w)
+{
+	if (!w->started)
+		return 0;
+
+	pthread_join(w->thread, NULL);
+	w->started = 0;
+
+	return w->ret;
+}
+
+/* Sum of the per worker counters, only valid once every worker is joined */
+void workers_print_stats(const struct worker *workers, int nworkers)
+{
+	unsigned long long rx = 0, tx = 0, wakeups = 0, events = 0;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		rx += workers[i].port->rx.frames_total;
+		tx += workers[i].port->tx.frames_total;
+		wakeups += workers[i].loop.wakeups;
+		events += workers[i].loop.events;
+	}
+
+	fprintf(stderr, "%d workers: received %llu frames, sent %llu frames, "
+		"%llu wakeups (%.2f events per wakeup)\n", nworkers, rx, tx,
+		wakeups, wakeups ? (double)events / wakeups : 0.0);
+}
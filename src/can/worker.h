@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+
+/* Per-interface worker threads
+ *
+ * Each worker services one port from its own thread and event loop, so
+ * nothing is shared between workers on the receive and transmit paths. A
+ * worker may be pinned to a CPU and run under SCHED_FIFO. Every counter is
+ * written only by the worker that owns it, and is read once the worker has
+ * been joined, so statistics need neither locks nor atomics.
+ */
+
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include <pthread.h>
+
+#include "canio.h"
+#include "evloop.h"
+
+struct worker {
+	pthread_t thread;
+	struct evloop loop;
+	struct can_port *port;
+	int cpu;
+	int prio;
+	int spin;
+	int started;
+	int ret;
+} __attribute__((aligned(CACHE_LINE)));
+
+signed int sched_setup(const char *name, int cpu, int prio);
+void worker_init(struct worker *w, struct can_port *port, int cpu, int prio,
+		 int spin);
+signed int worker_start(struct worker *w);
+signed int worker_join(struct worker *w);
+void workers_print_stats(const struct worker *workers, int nworkers);
+
+#endif /* __WORKER_H__ */